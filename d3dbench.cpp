@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include <d3d9.h>
+
+typedef IDirect3D9*(WINAPI *LPDIRECT3DCREATE9)(UINT);
+
+static HMODULE d3d9_handle = nullptr;
+static LPDIRECT3DCREATE9 pDirect3DCreate9 = nullptr;
+
+
+namespace
+{
+
+// vs_2_0: dcl_position v0; def c0, x, 0, 0, 0; add oPos, v0, c0
+const DWORD VertexShaderCode[] = {
+    0xfffe0200,
+    0x0200001f, 0x80000000, 0x900f0000,
+    0x05000051, 0xa00f0000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x03000002, 0xc00f0000, 0x90e40000, 0xa0e40000,
+    0x0000ffff
+};
+const size_t VertexShaderConstIdx = 6;
+
+// ps_2_0: def c0, r, g, b, 1; mov oC0, c0
+const DWORD PixelShaderCode[] = {
+    0xffff0200,
+    0x05000051, 0xa00f0000, 0x00000000, 0x00000000, 0x00000000, 0x3f800000,
+    0x02000001, 0x800f0800, 0xa0e40000,
+    0x0000ffff
+};
+const size_t PixelShaderConstIdx = 3;
+
+const float Triangle[] = {
+    -0.5f, -0.5f, 0.5f,
+     0.0f,  0.5f, 0.5f,
+     0.5f, -0.5f, 0.5f,
+};
+const WORD TriangleIndices[] = { 0, 1, 2 };
+
+
+// Scales the iteration counts, for a quick sanity run.
+unsigned int Scale = 1;
+
+LARGE_INTEGER Frequency;
+
+double now()
+{
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) / double(Frequency.QuadPart);
+}
+
+void setConstant(std::vector<DWORD> &code, size_t idx, float value)
+{ memcpy(&code[idx], &value, sizeof(value)); }
+
+
+class Bench {
+    IDirect3DDevice9 *mDevice;
+    IDirect3DQuery9 *mQuery;
+
+    IDirect3DVertexBuffer9 *mVtxBuffer;
+    IDirect3DIndexBuffer9 *mIdxBuffer;
+    IDirect3DVertexShader9 *mVtxShader;
+    IDirect3DPixelShader9 *mPixShaders[2];
+    IDirect3DTexture9 *mTextures[2];
+
+    std::string mDraws;
+    std::string mLocks;
+    std::string mUploads;
+    std::string mShaders;
+
+    static void append(std::string &list, const char *fmt, ...)
+    {
+        char str[512];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(str, sizeof(str), fmt, ap);
+        va_end(ap);
+
+        if(!list.empty()) list += ",\n";
+        list += "    ";
+        list += str;
+    }
+
+    // Waits for the device to finish everything sent so far.
+    void finish()
+    {
+        if(!mQuery)
+        {
+            // No query support, so fall back to a blocking read of the
+            // triangle's vertex buffer.
+            void *ptr;
+            if(SUCCEEDED(mVtxBuffer->Lock(0, 0, &ptr, D3DLOCK_READONLY)))
+                mVtxBuffer->Unlock();
+            return;
+        }
+        DWORD samples;
+        mQuery->Issue(D3DISSUE_END);
+        while(mQuery->GetData(&samples, sizeof(samples), D3DGETDATA_FLUSH) == S_FALSE)
+            Sleep(0);
+    }
+
+    void setupDraws()
+    {
+        mDevice->SetFVF(D3DFVF_XYZ);
+        mDevice->SetVertexShader(mVtxShader);
+        mDevice->SetPixelShader(mPixShaders[0]);
+        mDevice->SetStreamSource(0, mVtxBuffer, 0, sizeof(float)*3);
+        mDevice->SetIndices(mIdxBuffer);
+        mDevice->SetTexture(0, mTextures[0]);
+        mDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+        mDevice->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
+    }
+
+    bool createShader(float value, IDirect3DVertexShader9 **shader)
+    {
+        std::vector<DWORD> code(std::begin(VertexShaderCode), std::end(VertexShaderCode));
+        setConstant(code, VertexShaderConstIdx, value);
+        return SUCCEEDED(mDevice->CreateVertexShader(code.data(), shader));
+    }
+    bool createShader(float value, IDirect3DPixelShader9 **shader)
+    {
+        std::vector<DWORD> code(std::begin(PixelShaderCode), std::end(PixelShaderCode));
+        setConstant(code, PixelShaderConstIdx, value);
+        return SUCCEEDED(mDevice->CreatePixelShader(code.data(), shader));
+    }
+
+    // Sets the given shader, or the default one of its type if null.
+    void setShader(IDirect3DVertexShader9 *shader)
+    { mDevice->SetVertexShader(shader ? shader : mVtxShader); }
+    void setShader(IDirect3DPixelShader9 *shader)
+    { mDevice->SetPixelShader(shader ? shader : mPixShaders[0]); }
+
+public:
+    Bench(IDirect3DDevice9 *device)
+      : mDevice(device), mQuery(nullptr), mVtxBuffer(nullptr), mIdxBuffer(nullptr)
+      , mVtxShader(nullptr), mPixShaders{nullptr, nullptr}, mTextures{nullptr, nullptr}
+    { }
+    ~Bench()
+    {
+        if(mQuery) mQuery->Release();
+        if(mVtxBuffer) mVtxBuffer->Release();
+        if(mIdxBuffer) mIdxBuffer->Release();
+        if(mVtxShader) mVtxShader->Release();
+        for(IDirect3DPixelShader9 *shader : mPixShaders)
+            if(shader) shader->Release();
+        for(IDirect3DTexture9 *tex : mTextures)
+            if(tex) tex->Release();
+    }
+
+    bool init()
+    {
+        HRESULT hr;
+        void *ptr;
+
+        if(FAILED(mDevice->CreateQuery(D3DQUERYTYPE_OCCLUSION, &mQuery)))
+        {
+            fprintf(stderr, "Occlusion queries unavailable, syncing with buffer locks\n");
+            mQuery = nullptr;
+        }
+
+        hr = mDevice->CreateVertexBuffer(sizeof(Triangle), 0, D3DFVF_XYZ, D3DPOOL_MANAGED, &mVtxBuffer, nullptr);
+        if(SUCCEEDED(hr) && SUCCEEDED(hr=mVtxBuffer->Lock(0, 0, &ptr, 0)))
+        {
+            memcpy(ptr, Triangle, sizeof(Triangle));
+            mVtxBuffer->Unlock();
+        }
+        if(FAILED(hr))
+        {
+            fprintf(stderr, "Failed to create vertex buffer: 0x%lx\n", hr);
+            return false;
+        }
+
+        hr = mDevice->CreateIndexBuffer(sizeof(TriangleIndices), 0, D3DFMT_INDEX16, D3DPOOL_MANAGED, &mIdxBuffer, nullptr);
+        if(SUCCEEDED(hr) && SUCCEEDED(hr=mIdxBuffer->Lock(0, 0, &ptr, 0)))
+        {
+            memcpy(ptr, TriangleIndices, sizeof(TriangleIndices));
+            mIdxBuffer->Unlock();
+        }
+        if(FAILED(hr))
+        {
+            fprintf(stderr, "Failed to create index buffer: 0x%lx\n", hr);
+            return false;
+        }
+
+        if(!createShader(0.0f, &mVtxShader) || !createShader(0.25f, &mPixShaders[0]) ||
+           !createShader(0.75f, &mPixShaders[1]))
+        {
+            fprintf(stderr, "Failed to create shaders\n");
+            return false;
+        }
+
+        for(IDirect3DTexture9 *&tex : mTextures)
+        {
+            hr = mDevice->CreateTexture(64, 64, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &tex, nullptr);
+            if(FAILED(hr))
+            {
+                fprintf(stderr, "Failed to create texture: 0x%lx\n", hr);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Draw calls per second, with one or no state change between draws.
+    void runDraws(bool indexed, const char *churn)
+    {
+        const UINT count = 20000 / Scale;
+        const char *call = indexed ? "DrawIndexedPrimitive" : "DrawPrimitive";
+
+        setupDraws();
+        mDevice->BeginScene();
+        finish();
+
+        double start = now();
+        for(UINT i = 0;i < count;++i)
+        {
+            if(strcmp(churn, "renderstate") == 0)
+                mDevice->SetRenderState(D3DRS_ZFUNC, (i&1) ? D3DCMP_LESSEQUAL : D3DCMP_ALWAYS);
+            else if(strcmp(churn, "texture") == 0)
+                mDevice->SetTexture(0, mTextures[i&1]);
+            else if(strcmp(churn, "shader") == 0)
+                mDevice->SetPixelShader(mPixShaders[i&1]);
+            else if(strcmp(churn, "constants") == 0)
+            {
+                float values[4] = { float(i&255)/255.0f, 0.0f, 0.0f, 0.0f };
+                mDevice->SetVertexShaderConstantF(1, values, 1);
+            }
+
+            if(indexed)
+                mDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, 3, 0, 1);
+            else
+                mDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 0, 1);
+        }
+        double submitted = now();
+        mDevice->EndScene();
+        finish();
+        double end = now();
+
+        append(mDraws, "{ \"call\": \"%s\", \"churn\": \"%s\", \"draws\": %u, \"submit_seconds\": %.6f, "
+                       "\"seconds\": %.6f, \"draws_per_sec\": %.1f }",
+               call, churn, count, submitted-start, end-start, count/(end-start));
+        fprintf(stderr, "%s (%s churn): %.1f draws/sec\n", call, churn, count/(end-start));
+    }
+
+    // Lock/fill/Unlock/draw of a dynamic vertex buffer. DISCARD replaces the
+    // whole buffer each time, NOOVERWRITE appends chunks and discards when it
+    // wraps around, as a typical streaming renderer would. Lock sizes should
+    // be a multiple of the vertex size.
+    void runLocks(DWORD flags, UINT locksize)
+    {
+        const UINT buflen = 1<<20;
+        const UINT count = 20000 / Scale;
+        const char *name = (flags == D3DLOCK_DISCARD) ? "DISCARD" : "NOOVERWRITE";
+
+        IDirect3DVertexBuffer9 *vbuffer;
+        HRESULT hr = mDevice->CreateVertexBuffer(buflen, D3DUSAGE_DYNAMIC|D3DUSAGE_WRITEONLY,
+                                                 D3DFVF_XYZ, D3DPOOL_DEFAULT, &vbuffer, nullptr);
+        if(FAILED(hr))
+        {
+            fprintf(stderr, "Failed to create dynamic vertex buffer: 0x%lx\n", hr);
+            return;
+        }
+
+        setupDraws();
+        mDevice->SetStreamSource(0, vbuffer, 0, sizeof(float)*3);
+        mDevice->BeginScene();
+        finish();
+
+        const UINT vtxsize = sizeof(float)*3;
+        const UINT size = (flags == D3DLOCK_DISCARD) ? buflen : locksize;
+        UINT offset = 0;
+        UINT failed = 0;
+        double start = now();
+        for(UINT i = 0;i < count;++i)
+        {
+            DWORD lockflags = flags;
+            if(flags != D3DLOCK_DISCARD && (i == 0 || offset+size > buflen))
+            {
+                lockflags = D3DLOCK_DISCARD;
+                offset = 0;
+            }
+
+            void *ptr;
+            if(FAILED(vbuffer->Lock(offset, size, &ptr, lockflags)))
+            {
+                ++failed;
+                continue;
+            }
+            float *verts = static_cast<float*>(ptr);
+            for(UINT j = 0;j+9 <= size/sizeof(float);j += 9)
+                memcpy(verts+j, Triangle, sizeof(Triangle));
+            vbuffer->Unlock();
+
+            mDevice->DrawPrimitive(D3DPT_TRIANGLELIST, offset/vtxsize, 1);
+            offset += size;
+        }
+        mDevice->EndScene();
+        finish();
+        double end = now();
+
+        mDevice->SetStreamSource(0, mVtxBuffer, 0, vtxsize);
+        vbuffer->Release();
+
+        double mb = double(size) * (count-failed) / (1024.0*1024.0);
+        append(mLocks, "{ \"flags\": \"%s\", \"buffer_size\": %u, \"lock_size\": %u, \"locks\": %u, "
+                       "\"failed\": %u, \"seconds\": %.6f, \"locks_per_sec\": %.1f, \"mb_per_sec\": %.2f }",
+               name, buflen, size, count, failed, end-start, (count-failed)/(end-start), mb/(end-start));
+        fprintf(stderr, "Lock %s (%u bytes): %.1f locks/sec, %.2f MB/s\n", name, size,
+                (count-failed)/(end-start), mb/(end-start));
+    }
+
+    // Fills level 0 of a managed texture through LockRect and uses it for a
+    // draw, so the upload has to happen before the draw completes.
+    void runUploads(UINT size)
+    {
+        const UINT count = std::max(1u, (size >= 1024) ? 100/Scale : 1000/Scale);
+
+        IDirect3DTexture9 *tex;
+        HRESULT hr = mDevice->CreateTexture(size, size, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &tex, nullptr);
+        if(FAILED(hr))
+        {
+            fprintf(stderr, "Failed to create %ux%u texture: 0x%lx\n", size, size, hr);
+            return;
+        }
+
+        setupDraws();
+        mDevice->SetTexture(0, tex);
+        mDevice->BeginScene();
+        finish();
+
+        UINT failed = 0;
+        double start = now();
+        for(UINT i = 0;i < count;++i)
+        {
+            D3DLOCKED_RECT lockrect;
+            if(FAILED(tex->LockRect(0, &lockrect, nullptr, 0)))
+            {
+                ++failed;
+                continue;
+            }
+            BYTE *row = static_cast<BYTE*>(lockrect.pBits);
+            for(UINT y = 0;y < size;++y)
+            {
+                memset(row, (i+y)&0xff, size*4);
+                row += lockrect.Pitch;
+            }
+            tex->UnlockRect(0);
+
+            mDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 0, 1);
+        }
+        mDevice->EndScene();
+        finish();
+        double end = now();
+
+        mDevice->SetTexture(0, mTextures[0]);
+        tex->Release();
+
+        double mb = double(size) * size * 4 * (count-failed) / (1024.0*1024.0);
+        append(mUploads, "{ \"width\": %u, \"height\": %u, \"format\": \"A8R8G8B8\", \"uploads\": %u, "
+                         "\"failed\": %u, \"seconds\": %.6f, \"mb_per_sec\": %.2f }",
+               size, size, count, failed, end-start, mb/(end-start));
+        fprintf(stderr, "Texture upload %ux%u: %.2f MB/s\n", size, size, mb/(end-start));
+    }
+
+    // Time to create a never-before-seen shader, and until the first draw
+    // using it completes, which includes building the GL program.
+    template<typename T>
+    void runShaders(const char *type)
+    {
+        const UINT count = std::max(1u, 200/Scale);
+
+        setupDraws();
+        mDevice->BeginScene();
+        finish();
+
+        double create = 0.0, total = 0.0, worst = 0.0;
+        UINT failed = 0;
+        for(UINT i = 0;i < count;++i)
+        {
+            // Distinct constants keep every shader's bytecode unique.
+            float value = (i+1) / float(count*16);
+            T *shader;
+
+            double start = now();
+            if(!createShader(value, &shader))
+            {
+                ++failed;
+                continue;
+            }
+            double created = now();
+            setShader(shader);
+            mDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 0, 1);
+            finish();
+            double end = now();
+
+            setShader(static_cast<T*>(nullptr));
+            shader->Release();
+
+            create += created - start;
+            total += end - start;
+            worst = std::max(worst, end - start);
+        }
+        mDevice->EndScene();
+
+        UINT made = std::max(1u, count-failed);
+        append(mShaders, "{ \"type\": \"%s\", \"shaders\": %u, \"failed\": %u, \"create_us\": %.2f, "
+                         "\"first_draw_us\": %.2f, \"max_first_draw_us\": %.2f }",
+               type, count, failed, create*1000000.0/made, total*1000000.0/made, worst*1000000.0);
+        fprintf(stderr, "%s shader: %.2fus create, %.2fus to first draw\n", type,
+                create*1000000.0/made, total*1000000.0/made);
+    }
+
+    void present()
+    { mDevice->Present(nullptr, nullptr, nullptr, nullptr); }
+
+    void write(FILE *file, const D3DADAPTER_IDENTIFIER9 &ident)
+    {
+        fprintf(file, "{\n  \"adapter\": \"");
+        for(const char *c = ident.Description;*c;++c)
+        {
+            if(*c == '"' || *c == '\\')
+                fputc('\\', file);
+            fputc(*c, file);
+        }
+        fprintf(file, "\",\n  \"scale\": %u,\n", Scale);
+        fprintf(file, "  \"draws\": [\n%s\n  ],\n", mDraws.c_str());
+        fprintf(file, "  \"buffer_locks\": [\n%s\n  ],\n", mLocks.c_str());
+        fprintf(file, "  \"texture_uploads\": [\n%s\n  ],\n", mUploads.c_str());
+        fprintf(file, "  \"shader_creation\": [\n%s\n  ]\n}\n", mShaders.c_str());
+    }
+};
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+    const char *outname = nullptr;
+    for(int i = 1;i < argc;++i)
+    {
+        if(strcmp(argv[i], "--quick") == 0)
+            Scale = 10;
+        else if(strcmp(argv[i], "-o") == 0 && i+1 < argc)
+            outname = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--quick] [-o <output.json>]\n\n"
+                            "Results are written to stdout as JSON, unless -o is given.\n", argv[0]);
+            return 1;
+        }
+    }
+    QueryPerformanceFrequency(&Frequency);
+
+    d3d9_handle = LoadLibraryA("d3d9.dll");
+    pDirect3DCreate9 = reinterpret_cast<LPDIRECT3DCREATE9>(GetProcAddress(d3d9_handle, "Direct3DCreate9"));
+    IDirect3D9 *d3d = pDirect3DCreate9 ? pDirect3DCreate9(D3D_SDK_VERSION) : nullptr;
+    if(!d3d)
+    {
+        fprintf(stderr, "Could not create IDirect3D9 from d3d9!\n");
+        return 1;
+    }
+
+    D3DADAPTER_IDENTIFIER9 ident;
+    if(FAILED(d3d->GetAdapterIdentifier(D3DADAPTER_DEFAULT, 0, &ident)))
+        memset(&ident, 0, sizeof(ident));
+
+    WNDCLASSA wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.lpfnWndProc = DefWindowProcA;
+    wc.hInstance = GetModuleHandleA(nullptr);
+    wc.lpszClassName = "D3DGLBenchWndClass";
+    RegisterClassA(&wc);
+    HWND hWnd = CreateWindowExA(0, wc.lpszClassName, "D3DGL Bench", WS_OVERLAPPEDWINDOW,
+                                CW_USEDEFAULT, CW_USEDEFAULT, 640, 480, nullptr, nullptr,
+                                wc.hInstance, nullptr);
+    if(!hWnd)
+    {
+        fprintf(stderr, "Could not create window: %lu\n", GetLastError());
+        d3d->Release();
+        return 1;
+    }
+    ShowWindow(hWnd, SW_SHOW);
+
+    D3DPRESENT_PARAMETERS params;
+    memset(&params, 0, sizeof(params));
+    params.BackBufferWidth = 640;
+    params.BackBufferHeight = 480;
+    params.BackBufferFormat = D3DFMT_X8R8G8B8;
+    params.BackBufferCount = 1;
+    params.SwapEffect = D3DSWAPEFFECT_DISCARD;
+    params.hDeviceWindow = hWnd;
+    params.Windowed = TRUE;
+    params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+
+    IDirect3DDevice9 *device = nullptr;
+    HRESULT hr = d3d->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, hWnd,
+                                   D3DCREATE_HARDWARE_VERTEXPROCESSING, &params, &device);
+    if(FAILED(hr))
+    {
+        fprintf(stderr, "CreateDevice failed: 0x%lx\n", hr);
+        DestroyWindow(hWnd);
+        d3d->Release();
+        return 1;
+    }
+
+    int ret = 1;
+    {
+        Bench bench(device);
+        if(bench.init())
+        {
+            static const char *const churns[] = { "none", "renderstate", "texture", "shader", "constants" };
+            for(const char *churn : churns)
+            {
+                bench.runDraws(false, churn);
+                bench.runDraws(true, churn);
+                bench.present();
+            }
+
+            bench.runLocks(D3DLOCK_DISCARD, 0);
+            bench.runLocks(D3DLOCK_NOOVERWRITE, 3*1024);
+            bench.runLocks(D3DLOCK_NOOVERWRITE, 48*1024);
+            bench.present();
+
+            bench.runUploads(256);
+            bench.runUploads(1024);
+            bench.present();
+
+            bench.runShaders<IDirect3DVertexShader9>("vertex");
+            bench.runShaders<IDirect3DPixelShader9>("pixel");
+            bench.present();
+
+            FILE *out = outname ? fopen(outname, "w") : stdout;
+            if(!out)
+                fprintf(stderr, "Could not open %s for writing\n", outname);
+            else
+            {
+                bench.write(out, ident);
+                if(out != stdout) fclose(out);
+                ret = 0;
+            }
+        }
+    }
+
+    device->Release();
+    DestroyWindow(hWnd);
+    d3d->Release();
+    return ret;
+}
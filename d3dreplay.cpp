@@ -0,0 +1,196 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+
+#include "glew.h"
+#include "trace.hpp"
+#include "commandqueue.hpp"
+#include "commandstream.hpp"
+
+
+eLogLevel LogLevel = ERR_;
+FILE *LogFile = stderr;
+eLogLevel GLDebugLevel = NONE_;
+GLErrorCheck GLErrorCheckMode = GLErrorCheck::Frame;
+unsigned int GLErrorCheckInterval = 256;
+
+void log_printf(FILE *file, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(file, fmt, ap);
+    va_end(ap);
+}
+
+void log_printf_sync(FILE *file, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(file, fmt, ap);
+    va_end(ap);
+}
+
+
+static const wchar_t WndClassName[] = L"D3DGLReplayWndClass";
+
+class MakeCurrentCmd : public Command {
+    HDC mDc;
+    HGLRC mGLContext;
+
+public:
+    MakeCurrentCmd(HDC dc, HGLRC glcontext) : mDc(dc), mGLContext(glcontext) { }
+
+    virtual ULONG execute()
+    {
+        if(!wglMakeCurrent(mDc, mGLContext))
+            ERR("Failed to make context current! Error: %lu\n", GetLastError());
+        return sizeof(*this);
+    }
+};
+
+static void pumpMessages()
+{
+    MSG msg;
+    while(PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *fname = nullptr;
+    bool timed = false;
+    unsigned long loops = 1;
+
+    for(int i = 1;i < argc;++i)
+    {
+        if(strcmp(argv[i], "--timed") == 0)
+            timed = true;
+        else if(strcmp(argv[i], "--loops") == 0 && i+1 < argc)
+            loops = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if(strcmp(argv[i], "--verbose") == 0)
+            LogLevel = FIXME_;
+        else if(!fname && argv[i][0] != '-')
+            fname = argv[i];
+        else
+        {
+            fname = nullptr;
+            break;
+        }
+    }
+    if(!fname)
+    {
+        fprintf(stderr, "Usage: %s [--timed] [--loops <count>] [--verbose] <stream file>\n\n"
+                        "  --timed    Send each command at the time it was originally recorded,\n"
+                        "             instead of as fast as possible\n", argv[0]);
+        return 1;
+    }
+
+    HINSTANCE hInstance = GetModuleHandleW(nullptr);
+    WNDCLASSW wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.lpfnWndProc = DefWindowProcW;
+    wc.hInstance = hInstance;
+    wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+    wc.lpszClassName = WndClassName;
+    if(!RegisterClassW(&wc))
+    {
+        fprintf(stderr, "Failed to register window class, error %lu\n", GetLastError());
+        return 1;
+    }
+
+    HWND hWnd = CreateWindowExW(0, WndClassName, L"D3DGL Replay", WS_OVERLAPPEDWINDOW,
+                                CW_USEDEFAULT, CW_USEDEFAULT, 640, 480, nullptr, nullptr,
+                                hInstance, nullptr);
+    if(!hWnd)
+    {
+        fprintf(stderr, "Failed to create window, error %lu\n", GetLastError());
+        return 1;
+    }
+    HDC dc = GetDC(hWnd);
+
+    CommandQueue queue;
+    CommandStreamPlayer player(queue, dc);
+    if(!player.load(fname))
+        return 1;
+
+    // Size the window to fit what gets presented.
+    GLsizei width, height;
+    if(player.getWindowSize(width, height))
+    {
+        RECT rect = { 0, 0, width, height };
+        AdjustWindowRect(&rect, WS_OVERLAPPEDWINDOW, FALSE);
+        SetWindowPos(hWnd, nullptr, 0, 0, rect.right-rect.left, rect.bottom-rect.top,
+                     SWP_NOMOVE | SWP_NOZORDER);
+    }
+    ShowWindow(hWnd, SW_SHOW);
+
+    PIXELFORMATDESCRIPTOR pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.nSize = sizeof(pfd);
+    pfd.nVersion = 1;
+    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+    pfd.iPixelType = PFD_TYPE_RGBA;
+    pfd.cColorBits = 32;
+    pfd.iLayerType = PFD_MAIN_PLANE;
+    int pfid = ChoosePixelFormat(dc, &pfd);
+    if(!pfid || !SetPixelFormat(dc, pfid, &pfd))
+    {
+        fprintf(stderr, "Failed to set pixel format, error %lu\n", GetLastError());
+        return 1;
+    }
+
+    HGLRC glcontext = wglCreateContext(dc);
+    if(!glcontext || !wglMakeCurrent(dc, glcontext))
+    {
+        fprintf(stderr, "Failed to create GL context, error %lu\n", GetLastError());
+        return 1;
+    }
+    GLenum err = glewInit();
+    if(err != GLEW_OK)
+    {
+        fprintf(stderr, "Failed to initialize GLEW: %s\n", glewGetErrorString(err));
+        return 1;
+    }
+    printf("GL renderer: %s\nGL version: %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+    wglMakeCurrent(nullptr, nullptr);
+
+    if(!queue.init(CommandQueueSize, CommandPayloadSize))
+        return 1;
+    queue.sendSync<MakeCurrentCmd>(dc, glcontext);
+
+    printf("Replaying %u records from %s (%s)\n", (unsigned int)player.getNumRecords(), fname,
+           timed ? "original timing" : "unthrottled");
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for(unsigned long i = 0;i < loops;++i)
+    {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        player.play(timed);
+        QueryPerformanceCounter(&end);
+        pumpMessages();
+
+        double secs = double(end.QuadPart-start.QuadPart) / freq.QuadPart;
+        ULONG frames = player.getNumFrames();
+        printf("Run %lu: %lu frames in %.3fms, %.3fms/frame, %.1f fps\n", i+1, frames, secs*1000.0,
+               frames ? secs*1000.0/frames : 0.0, frames ? frames/secs : 0.0);
+    }
+
+    queue.sendSync<MakeCurrentCmd>(nullptr, nullptr);
+    queue.deinit();
+
+    wglDeleteContext(glcontext);
+    ReleaseDC(hWnd, dc);
+    DestroyWindow(hWnd);
+    return 0;
+}
@@ -7,6 +7,15 @@
 #include <d3d9.h>
 
 
+// File to keep probed adapter info in, "0" to disable the cache, or null to
+// use one in the user's local app data.
+extern const char *AdapterCacheFile;
+
+
+// The caps, limits, and format support come from probing a GL context, which
+// is slow enough to matter for apps that make a few IDirect3D9 objects at
+// startup. So probing waits until something needs them, and the results are
+// cached on disk for the display driver.
 class D3DAdapter {
 public:
     struct Limits {
@@ -48,8 +57,13 @@ public:
 private:
     UINT mOrdinal;
     bool mInited;
+    bool mProbed;
+    bool mUsable;
 
     std::wstring mDeviceName;
+    // Identifies the display device and driver version, or empty if the
+    // driver version is unknown and the results can't be cached.
+    std::wstring mCacheKey;
 
     WORD mVendorId;
     WORD mDeviceId;
@@ -66,10 +80,16 @@ private:
     void init_ids();
     void init_usage();
 
+    bool load_cache();
+    void store_cache(const std::string &glvendor, const std::string &glrenderer, const std::string &glversion);
+
 public:
     D3DAdapter(UINT adapter_num);
 
     bool init();
+    // Gets the GL info, from the cache or a temporary context, if it hasn't
+    // been already. Caller is responsible for serializing calls.
+    bool probe();
     UINT getOrdinal() const { return mOrdinal; }
     const Limits& getLimits() const { return mLimits; }
     const std::wstring &getDeviceName() const { return mDeviceName; }
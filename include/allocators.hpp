@@ -3,6 +3,7 @@
 
 #include <new>
 #include <limits>
+#include <atomic>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -151,4 +152,76 @@ public:
     { AlignedAllocator<T>().deallocate(ptr, 0); }
 };
 
+
+struct DataPoolStats {
+    ULONG64 mAllocs;
+    // Allocations that reused a cached block.
+    ULONG64 mHits;
+    size_t mInUseBytes;
+    size_t mCachedBytes;
+    // Highest total of in-use and cached bytes.
+    size_t mPeakBytes;
+};
+
+// A thread-safe cache of aligned data blocks, for storage that gets renamed a
+// lot, like buffers locked with DISCARD while an update is pending. Sizes are
+// rounded up to a power of 2, and freed blocks are kept in per-size lists for
+// reuse, up to sMaxCachedBytes total. Larger blocks aren't cached.
+class DataPool {
+    static const size_t sMinBucketBits = 8;
+    static const size_t sNumBuckets = 17;
+    static const size_t sMaxCachedBytes = 64<<20;
+    // Each block starts with a header giving its (rounded up) size. The
+    // header size keeps the data aligned for AVX.
+    static const size_t sHeaderSize = 32;
+
+    struct Block {
+        Block *mNext;
+        size_t mSize;
+    };
+    static_assert(sizeof(Block) <= sHeaderSize, "Block header is too large!");
+
+    struct Bucket {
+        SRWLOCK mLock;
+        Block *mFree;
+    };
+    Bucket mBuckets[sNumBuckets];
+
+    std::atomic<ULONG64> mAllocs;
+    std::atomic<ULONG64> mHits;
+    std::atomic<size_t> mInUseBytes;
+    std::atomic<size_t> mCachedBytes;
+    std::atomic<size_t> mPeakBytes;
+
+    DataPool();
+    ~DataPool();
+
+    void updatePeak();
+
+public:
+    static DataPool &get()
+    {
+        static DataPool pool;
+        return pool;
+    }
+
+    void *alloc(size_t size);
+    void free(void *ptr);
+
+    void getStats(DataPoolStats &stats) const;
+};
+
+template<typename T>
+class PooledDataAllocator {
+public:
+    T *operator()(size_t len)
+    { return reinterpret_cast<T*>(DataPool::get().alloc(len * sizeof(T))); }
+};
+template<typename T>
+class PooledDataDeallocator {
+public:
+    void operator()(T *ptr)
+    { DataPool::get().free(ptr); }
+};
+
 #endif /* ALLOCATORS_HPP */
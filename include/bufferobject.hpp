@@ -12,6 +12,21 @@
 
 class D3DGLDevice;
 
+#define MAX_STREAM_REGIONS 64
+
+// Number of copies of its contents a new dynamic buffer gets in persistently
+// mapped storage, or 0 to have dynamic buffers use a shadow copy.
+extern UINT StreamBufferRegions;
+
+// When false, write-only default pool buffers don't keep a shadow copy of
+// their contents.
+extern bool ShadowWriteOnlyBuffers;
+
+struct BufferRange {
+    UINT mOffset;
+    UINT mEnd;
+};
+
 class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBuffer9 {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
@@ -38,8 +53,43 @@ class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBu
     UINT mLockedFlags;
 
     std::atomic<ULONG> mUpdateInProgress;
+    std::atomic<ULONG> mUpdateFence;
+
+    // Ranges of the shadow copy written since the last upload, sorted and
+    // with touching ranges merged. They're sent together the next time the
+    // buffer is drawn with. Protected by the queue lock.
+    static const size_t sMaxDirtyRanges = 32;
+    std::vector<BufferRange> mDirtyRanges;
+    bool mDirtyDiscard;
+    bool mDirtySync;
+    // Set when the GPU wrote the buffer since it was last locked, so the
+    // shadow copy or stream region is stale until it's read back or synced.
+    bool mGPUWritten;
+
+    // Staged buffers have no shadow copy. Each lock gets its own staging
+    // memory, which is uploaded and let go of on unlock.
+    bool mStaged;
+    std::shared_ptr<GLubyte> mStagingData;
+
+    // Streaming buffers are written directly through a persistent mapping,
+    // which holds mStreamRegions copies of the contents. A DISCARD lock moves
+    // on to the next region, and a region isn't written again until the GPU
+    // is done with it: the command thread fences a region when it's left, and
+    // clears its mRegionBusy flag once the fence has passed. mRegionFences is
+    // only touched by the command thread.
+    bool mStreaming;
+    GLubyte *mStreamData;
+    UINT mRegionStride;
+    UINT mStreamRegions;
+    UINT mStreamRegion;
+    std::unique_ptr<std::atomic<bool>[]> mRegionBusy;
+    std::vector<GLsync> mRegionFences;
 
     bool init_common(UINT length, DWORD usage, D3DPOOL pool);
+    GLubyte *discardRegion();
+    void syncRegion();
+    void addDirtyRange(UINT offset, UINT length);
+    void sendDirtyRanges();
 
 public:
     D3DGLBufferObject(D3DGLDevice *parent);
@@ -49,12 +99,27 @@ public:
     bool init_ibo(UINT length, DWORD usage, D3DFORMAT format, D3DPOOL pool);
 
     GLuint getBufferId() const { return mBufferId; }
+    // Offset of the current contents in the GL buffer.
+    UINT getDataOffset() const { return mStreamRegion*mRegionStride; }
 
     void resetBufferData(const GLubyte *data, GLuint length);
+    // Uploads any changes made since the buffer was last drawn with. Caller is
+    // responsible for holding the queue lock.
+    void flushUpdates() { if(!mDirtyRanges.empty()) sendDirtyRanges(); }
+    // Marks the contents as written on the GPU, to be read back if the app
+    // locks the buffer before discarding them. Caller is responsible for
+    // holding the queue lock.
+    void setGPUWritten() { mGPUWritten = true; }
 
     void initGL(const GLubyte *data);
     void loadBufferDataGL(UINT offset, UINT length, const GLubyte *data, GLbitfield flags);
+    void loadBufferRangesGL(const BufferRange *ranges, UINT count, const GLubyte *data, GLbitfield flags);
+    void readBufferDataGL();
     void resizeBufferGL(UINT length);
+    void initStreamGL(UINT regions);
+    void retireRegionGL(UINT region);
+    void waitRegionGL(UINT region);
+    void deinitStreamGL();
 
     D3DFORMAT getFormat() const { return mFormat; }
 
@@ -5,12 +5,37 @@
 #include <windows.h>
 
 #include <atomic>
+#include <memory>
 #include <new>
+#include <typeinfo>
 
 #include "trace.hpp"
+#include "allocators.hpp"
 
 
 class CommandQueue;
+class CommandStreamWriter;
+
+// Command ring and payload arena sizes, in bytes, for new devices.
+extern size_t CommandQueueSize;
+extern size_t CommandPayloadSize;
+// Frames between queue statistics dumps to the log, or 0 to not collect them.
+extern unsigned int CommandQueueStatsInterval;
+
+// How the command thread waits for commands, and producers wait for space,
+// when there's nothing to do. Spin never sleeps, Block sleeps right away, and
+// Hybrid spins for a fixed time before sleeping. Adaptive is like Hybrid, but
+// the command thread's spin time follows the typical gap between commands.
+enum class QueueWaitMode {
+    Spin,
+    Block,
+    Hybrid,
+    Adaptive
+};
+extern QueueWaitMode CommandQueueWaitMode;
+// Keeps queues locking for devices made without D3DCREATE_MULTITHREADED, for
+// apps that call them from more than one thread anyway.
+extern bool CommandQueueForceLocking;
 
 
 template<typename T>
@@ -38,11 +63,17 @@ protected:
 
 public:
     virtual ULONG execute() = 0;
+
+    // Called after execute() while the queue is recording the command stream,
+    // to write out what it did. Commands whose GL methods record themselves
+    // override this to do nothing.
+    virtual void record(CommandStreamWriter &stream) const;
 };
 
 class CommandNoOp : public Command {
 public:
     virtual ULONG execute() { return sizeof(*this); }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 class CommandSkip : public Command {
@@ -52,6 +83,7 @@ public:
     CommandSkip(ULONG amt) : mSkipAmt(amt) { }
 
     virtual ULONG execute() { return mSkipAmt; }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 template<typename T>
@@ -71,6 +103,57 @@ public:
     { }
 
     virtual ULONG execute();
+    virtual void record(CommandStreamWriter &stream) const { mCommand.record(stream); }
+};
+
+// Base for commands that keep their data in the queue's payload arena rather
+// than inline in the ring. The payload is released once the command has
+// executed. Caller must hold the queue lock while sending these, so payloads
+// are released in the order they were allocated.
+class PayloadCommand : public Command {
+    CommandQueue &mQueue;
+    ULONG mPayloadEnd;
+
+protected:
+    void *mPayload;
+
+    PayloadCommand(CommandQueue &queue, size_t size);
+    virtual ~PayloadCommand();
+};
+
+// Execute times of a single command type, in performance counter ticks. The
+// histogram buckets are powers of 2 microseconds, with bucket 0 holding
+// anything under 1us.
+struct CommandTypeStats {
+    static const size_t sNumBuckets = 16;
+
+    const std::type_info *mType;
+    ULONG64 mCount;
+    ULONG64 mTotalTime;
+    ULONG64 mMaxTime;
+    ULONG64 mHistogram[sNumBuckets];
+};
+
+struct CommandQueueStats {
+    static const size_t sMaxTypes = 256;
+
+    ULONG64 mFrequency;
+    ULONG mFrames;
+
+    // Highest ring occupancy seen by the command thread, in bytes.
+    ULONG mHighWater;
+    // Time producers spent waiting for ring or payload space, and the time
+    // the command thread spent waiting for commands.
+    ULONG mProducerStalls;
+    ULONG64 mProducerStallTime;
+    ULONG64 mConsumerIdleTime;
+
+    // Process-wide, copied when the stats are read.
+    DataPoolStats mDataPool;
+
+    // Open-addressed on the type_info pointer, so unused slots are spread
+    // throughout.
+    CommandTypeStats mTypes[sMaxTypes];
 };
 
 class FlushGLCmd : public Command {
@@ -82,75 +165,218 @@ public:
 
 
 class CommandQueue {
-    static const size_t sQueueBits = 21;
-    static const size_t sQueueSize = 1<<sQueueBits;
-    static const size_t sQueueMask = sQueueSize-1;
-
+    static const size_t sMinQueueSize = 1<<16;
+    static const size_t sMinPayloadSize = 1<<16;
+    static const int sFenceSpinCount = 4000;
+    static const ULONG sHybridSpinUs = 50;
+    static const ULONG sMaxSpinUs = 200;
+
+    size_t mQueueSize;
+    size_t mQueueMask;
+
+    // mHead is the reservation point producers claim space from, and mTail is
+    // where the command thread reads. Both count up freely and are masked on
+    // use. A command becomes visible to the command thread once the commit
+    // flag for its first slot is set, so producers never wait on each other.
     std::atomic<ULONG> mHead, mTail;
-    char mQueueData[sQueueSize];
+    char *mQueueData;
+    std::atomic<bool> *mCommitted;
+
+    // Where a held command was placed, or sNoHeld. It's claimed by exchanging
+    // it for sNoHeld, both to commit it and to add to it. mHeldPos and
+    // mHeldEnd are only used by the thread holding it.
+    static const ULONG sNoHeld = ~0ul;
+    std::atomic<ULONG> mHeld;
+    ULONG mHeldPos, mHeldEnd;
+
+    // Bump-allocated storage for PayloadCommand data. mPayloadHead is only
+    // touched with the queue lock held, and mPayloadTail is advanced by the
+    // command thread as payload commands are destroyed.
+    size_t mPayloadSize;
+    size_t mPayloadMask;
+    ULONG mPayloadHead;
+    std::atomic<ULONG> mPayloadTail;
+    char *mPayloadData;
+
     CRITICAL_SECTION mLock;
     CONDITION_VARIABLE mCondVar;
     std::atomic<ULONG> mSpinLock;
 
+    // Set when only one thread ever sends, so the lock does nothing, and
+    // claiming ring space or the held command needs no read-modify-writes.
+    bool mSingleProducer;
+
     HANDLE mThreadHdl;
     DWORD mThreadId;
 
+    // Only allocated when statistics are enabled. The per-type stats, high
+    // water mark and idle time belong to the command thread, while the stall
+    // times are updated with mLock held.
+    std::unique_ptr<CommandQueueStats> mStats;
+    ULONG mStatsFrames;
+
+    // Only allocated while recording the command stream.
+    std::unique_ptr<CommandStreamWriter> mRecorder;
+
+    // Set by the command thread while it sleeps on mCondVar, so producers only
+    // need to signal it when it's actually asleep. mSpinTicks is how long to
+    // spin before sleeping, and mMaxSpinTicks caps it (and producer spins).
+    QueueWaitMode mWaitMode;
+    std::atomic<bool> mParked;
+    // Threads between beginWait and endWait, which may be about to sleep on
+    // mCondVar for the tail to move. The command thread only signals after a
+    // command when there are any.
+    std::atomic<ULONG> mWaiters;
+    ULONG64 mSpinTicks;
+    ULONG64 mMaxSpinTicks;
+
+    ULONG64 consumerSpinTicks() const
+    {
+        if(mWaitMode == QueueWaitMode::Spin) return ~ULONG64(0);
+        if(mWaitMode == QueueWaitMode::Block) return 0;
+        return mSpinTicks;
+    }
+    ULONG64 producerSpinTicks() const
+    {
+        if(mWaitMode == QueueWaitMode::Spin) return ~ULONG64(0);
+        if(mWaitMode == QueueWaitMode::Block) return 0;
+        return mMaxSpinTicks;
+    }
+    template<typename F>
+    bool spinUntil(F done, ULONG64 budget) const;
+    void waitForSpace(ULONG head, size_t size);
+    void stallWait();
+    void recordCommand(const std::type_info &type, ULONG64 ticks);
+
     DWORD CALLBACK run(void);
     static DWORD CALLBACK thread_func(void *arg)
     { return reinterpret_cast<CommandQueue*>(arg)->run(); }
 
-    template<typename T, typename ...Args>
-    void doSizedSend(size_t size, Args...args)
+    // How producers claim ring space and the held command.
+    struct MultiProducer {
+        static bool claim(std::atomic<ULONG> &head, ULONG &expected, ULONG desired)
+        { return head.compare_exchange_weak(expected, desired, std::memory_order_relaxed); }
+        static ULONG take(std::atomic<ULONG> &held)
+        { return held.exchange(sNoHeld); }
+    };
+    struct SingleProducer {
+        static bool claim(std::atomic<ULONG> &head, ULONG&, ULONG desired)
+        {
+            head.store(desired, std::memory_order_release);
+            return true;
+        }
+        static ULONG take(std::atomic<ULONG> &held)
+        {
+            ULONG ret = held.load(std::memory_order_relaxed);
+            held.store(sNoHeld, std::memory_order_relaxed);
+            return ret;
+        }
+    };
+
+    void commit(ULONG pos)
+    { mCommitted[(pos&mQueueMask)/sizeof(Command)].store(true, std::memory_order_release); }
+
+    ULONG takeHeld()
+    { return mSingleProducer ? SingleProducer::take(mHeld) : MultiProducer::take(mHeld); }
+    void commitHeld()
     {
-        ULONG head = mHead.load();
+        ULONG held = takeHeld();
+        if(held != sNoHeld) commit(held);
+    }
+
+    template<typename Policy>
+    ULONG reserveAs(size_t size)
+    {
+        // The held command can't be added to once something follows it.
+        if(mHeld.load(std::memory_order_relaxed) != sNoHeld)
+            commitHeld();
+
+        ULONG head = mHead.load(std::memory_order_relaxed);
+        ULONG pad;
         while(1)
         {
-            ULONG rem_size = sQueueSize - head;
-            if(rem_size < size)
+            // If the command doesn't fit before the end of the ring, claim
+            // the remainder as padding too and place it at the start.
+            pad = mQueueSize - (head&mQueueMask);
+            if(pad >= size) pad = 0;
+
+            if(head-mTail.load(std::memory_order_acquire) + pad+size <= mQueueSize)
             {
-                if(rem_size >= sizeof(CommandSkip))
-                {
-                    doSizedSend<CommandSkip>(rem_size, rem_size);
-                    head = mHead.load();
-                    rem_size = sQueueSize - head;
-                }
-                else do {
-                    doSizedSend<CommandNoOp>(sizeof(CommandNoOp));
-                    head = mHead.load();
-                    rem_size = sQueueSize - head;
-                } while(rem_size < size);
+                if(Policy::claim(mHead, head, head+pad+size))
+                    break;
+                continue;
             }
-            if(((mTail-head-1)&sQueueMask) >= size)
-                break;
 
-            EnterCriticalSection(&mLock);
-            WakeAllConditionVariable(&mCondVar);
-            SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
-            LeaveCriticalSection(&mLock);
-            head = mHead.load();
+            waitForSpace(head, pad+size);
+            head = mHead.load(std::memory_order_relaxed);
         }
 
-        Command *cmd = new(&mQueueData[head]) T(args...);
+        if(pad >= sizeof(CommandSkip))
+        {
+            new(&mQueueData[head&mQueueMask]) CommandSkip(pad);
+            commit(head);
+        }
+        else for(ULONG i = 0;i < pad;i += sizeof(CommandNoOp))
+        {
+            new(&mQueueData[(head+i)&mQueueMask]) CommandNoOp();
+            commit(head+i);
+        }
+        return head + pad;
+    }
+    ULONG reserve(size_t size)
+    { return mSingleProducer ? reserveAs<SingleProducer>(size) : reserveAs<MultiProducer>(size); }
+
+    template<typename T, typename ...Args>
+    ULONG doSizedSend(size_t size, Args...args)
+    {
+        ULONG head = reserve(size);
+
+        Command *cmd = new(&mQueueData[head&mQueueMask]) T(args...);
         TRACE("Sending %p\n", cmd);
 
-        head += size;
-        mHead.store(head&sQueueMask);
+        commit(head);
+        return head + size;
     }
 
+    void *allocPayload(size_t size, ULONG &end);
+    void freePayload(ULONG end) { mPayloadTail.store(end, std::memory_order_release); }
+
+    friend class PayloadCommand;
+    friend class DumpQueueStatsCmd;
+    friend class GetQueueStatsCmd;
+
     CommandQueue(const CommandQueue&) = delete;
     CommandQueue& operator=(const CommandQueue&) = delete;
 
 public:
+    // Largest payload that is always guaranteed to fit, including padding
+    // when it wraps around the end of the arena.
+    static const size_t sMaxPayloadSize = sMinPayloadSize/2;
+
     CommandQueue();
     ~CommandQueue();
 
-    bool init();
+    // Sizes are in bytes, and are rounded up to a power of 2. A single
+    // producer queue must only ever be sent to from one thread.
+    bool init(size_t queuesize, size_t payloadsize, bool singleproducer=false);
     void deinit();
     bool isActive() const { return mThreadHdl != nullptr; }
 
+    // Non-null while recording the command stream. Only for use by the command
+    // thread.
+    CommandStreamWriter *getRecorder() const { return mRecorder.get(); }
+
 
-    void beginWait() { EnterCriticalSection(&mLock); }
-    void endWait() { LeaveCriticalSection(&mLock); }
+    void beginWait()
+    {
+        EnterCriticalSection(&mLock);
+        mWaiters.fetch_add(1);
+    }
+    void endWait()
+    {
+        mWaiters.fetch_sub(1, std::memory_order_relaxed);
+        LeaveCriticalSection(&mLock);
+    }
     void wait(DWORD time_ms=INFINITE)
     {
         wake();
@@ -160,34 +386,109 @@ public:
 
     void lock()
     {
+        if(mSingleProducer) return;
         while(mSpinLock.exchange(true) == true)
             SwitchToThread();
     }
-    void unlock() { mSpinLock = false; }
-    void wake() { WakeAllConditionVariable(&mCondVar); }
+    void unlock()
+    {
+        if(!mSingleProducer)
+            mSpinLock = false;
+    }
+    void wake()
+    {
+        if(mHeld.load(std::memory_order_relaxed) != sNoHeld)
+            commitHeld();
+
+        // Make sure the command thread sees anything sent before this if it
+        // isn't parked yet. If it is, the critical section ensures it's
+        // actually sleeping before it's signaled.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mParked.load(std::memory_order_relaxed))
+        {
+            EnterCriticalSection(&mLock);
+            LeaveCriticalSection(&mLock);
+            WakeAllConditionVariable(&mCondVar);
+        }
+    }
 
-    void wakeAndSleep()
+    // A fence is a position in the command stream, as returned by send() and
+    // doSend() for the command just sent, or by getFence() for everything
+    // sent so far. It has passed once the command thread has executed all
+    // commands before it. Comparing distances from the head keeps stale
+    // fences working after the counters wrap.
+    ULONG getFence() const { return mHead.load(); }
+    bool isFencePassed(ULONG fence) const
     {
-        wake();
-        Sleep(1);
+        ULONG tail = mTail.load(std::memory_order_acquire);
+        ULONG head = mHead.load();
+        return ULONG(head-fence) >= ULONG(head-tail);
     }
+    void waitFence(ULONG fence);
 
     template<typename T, typename ...Args>
-    void doSend(Args...args)
+    ULONG doSend(Args...args)
     {
         static_assert(sizeof(T) >= sizeof(Command), "Type is too small!");
         static_assert((sizeof(T)%sizeof(Command)) == 0, "Type is not a multiple of Command!");
-        static_assert(sizeof(T) < sQueueSize, "Type size is way too large!");
+        static_assert(sizeof(T) < sMinQueueSize, "Type size is way too large!");
 
-        doSizedSend<T,Args...>(sizeof(T), args...);
+        return doSizedSend<T,Args...>(sizeof(T), args...);
     }
 
+    // lock() is only needed to keep a sequence of commands together along
+    // with the state that goes with them; single commands can be sent from
+    // multiple threads without it.
     template<typename T, typename ...Args>
-    void send(Args...args)
+    ULONG send(Args...args)
+    { return doSend<T,Args...>(args...); }
+
+    // Like doSend, but the command is held back from the command thread, so
+    // it can still be added to with reclaimHeld() while it's the last one
+    // sent. It's committed as soon as anything else is sent, the queue is
+    // woken, or a fence is waited on. Caller must hold the queue lock.
+    template<typename T, typename ...Args>
+    void doSendHeld(Args...args)
     {
-        lock();
-        doSend<T,Args...>(args...);
-        unlock();
+        static_assert(sizeof(T) >= sizeof(Command), "Type is too small!");
+        static_assert((sizeof(T)%sizeof(Command)) == 0, "Type is not a multiple of Command!");
+        static_assert(sizeof(T) < sMinQueueSize, "Type size is way too large!");
+
+        ULONG head = reserve(sizeof(T));
+        new(&mQueueData[head&mQueueMask]) T(args...);
+        mHeldPos = head;
+        mHeldEnd = head + sizeof(T);
+        rehold();
+    }
+
+    // True if the held command is still the last one sent.
+    bool isHeldLast() const
+    { return mHeld.load() != sNoHeld && mHead.load() == mHeldEnd; }
+
+    // Takes the held command back if it's of type T and still the last one
+    // sent, for the caller to add to before it's put back with rehold().
+    // Otherwise the held command is committed and this returns null.
+    template<typename T>
+    T *reclaimHeld()
+    {
+        ULONG held = takeHeld();
+        if(held == sNoHeld)
+            return nullptr;
+        Command *cmd = reinterpret_cast<Command*>(&mQueueData[held&mQueueMask]);
+        if(mHead.load() != mHeldEnd || typeid(*cmd) != typeid(T))
+        {
+            commit(held);
+            return nullptr;
+        }
+        return static_cast<T*>(cmd);
+    }
+    void rehold()
+    {
+        mHeld.store(mHeldPos);
+        // Another thread may have sent something without seeing it held, and
+        // be waiting on it behind this.
+        if(mHead.load() != mHeldEnd)
+            commitHeld();
     }
 
     template<typename T, typename ...Args>
@@ -204,13 +505,20 @@ public:
     template<typename T, typename ...Args>
     void sendFlush(Args...args)
     {
-        EnterCriticalSection(&mLock);
         send<T,Args...>(args...);
-        LeaveCriticalSection(&mLock);
         wake();
     }
 
 
+    // Called once per presented frame. Every CommandQueueStatsInterval frames,
+    // has the command thread dump and reset the statistics.
+    void endFrame();
+
+    // Copies the statistics gathered since the last dump. Returns false if
+    // statistics aren't enabled.
+    bool getStats(CommandQueueStats &stats);
+
+
     void flush()
     {
         // FIXME: On Wine, a glFlush may cause a repaint of the window from the
@@ -218,13 +526,19 @@ public:
         // don't want. However, it would be nice to ensure OpenGL is processing
         // all the commands that got sent to it up to this point.
         //sendFlush<FlushGLCmd>();
-        EnterCriticalSection(&mLock);
-        LeaveCriticalSection(&mLock);
         wake();
     }
 };
 
 
+inline PayloadCommand::PayloadCommand(CommandQueue &queue, size_t size)
+  : mQueue(queue)
+{ mPayload = mQueue.allocPayload(size, mPayloadEnd); }
+
+inline PayloadCommand::~PayloadCommand()
+{ mQueue.freePayload(mPayloadEnd); }
+
+
 template<typename T>
 inline ULONG CommandSync<T>::execute()
 {
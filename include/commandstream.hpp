@@ -0,0 +1,349 @@
+#ifndef COMMANDSTREAM_HPP
+#define COMMANDSTREAM_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <map>
+#include <vector>
+#include <typeinfo>
+
+#include "glew.h"
+#include "samplercache.hpp"
+
+
+class CommandQueue;
+
+// File to record the GL command stream of new devices to, or null to not
+// record. Devices after the first get a numbered suffix.
+extern const char *CommandStreamFile;
+
+
+// A recorded stream is a StreamFileHeader, followed by records. Each record
+// is a StreamRecord, the op's body struct, and any trailing data, padded out
+// to 8 bytes. Everything is in terms of GL calls, so the stream doesn't
+// depend on the D3D objects that made it, and GL object names are the ones
+// the recording context used (the player maps them to its own).
+enum class StreamOp : uint16_t {
+    DeviceInit,       // StreamDeviceInit
+    Enable,           // StreamEnable
+    Material,         // StreamMaterial
+    Viewport,         // StreamViewport
+    Scissor,          // StreamRect
+    PolygonMode,      // StreamValue
+    CullFace,         // StreamValue, 0 to disable culling
+    ColorMask,        // StreamColorMask
+    DepthMask,        // StreamValue
+    DepthFunc,        // StreamValue
+    AlphaFunc,        // StreamAlphaFunc
+    BlendFunc,        // StreamBlendFunc
+    StencilFunc,      // StreamStencilFunc
+    BlendOp,          // StreamBlendFunc
+    StencilOp,        // StreamStencilOp
+    StencilMask,      // StreamValue
+    DepthBias,        // StreamDepthBias
+    Fog,              // StreamFog
+    SamplerParami,    // StreamSamplerParam
+    SamplerParamf,    // StreamSamplerParam
+    ClipPlanes,       // StreamValue, mask of enabled planes
+    AttribArrays,     // StreamValue, mask of enabled arrays
+    BindTexture,      // StreamBindTexture
+    BindElements,     // StreamValue, buffer name
+    BindUniformBuffer,// StreamBindBuffer
+    VertexStreams,    // StreamValue, count; data is StreamVertexAttrib[count]
+    FBAttachment,     // StreamFBAttachment
+    Clear,            // StreamClear
+    DrawArrays,       // StreamDraw
+    DrawElements,     // StreamDraw
+    Blit,             // StreamBlit
+    Swap,             // StreamValue, unused
+    SwapInterval,     // StreamValue
+    BufferData,       // StreamBufferData; data is the contents, if any
+    BufferSubData,    // StreamBufferSubData; data is the contents
+    BufferDelete,     // StreamValue, buffer name
+    TextureImage,     // StreamTexImage
+    TextureSubImage,  // StreamTexSubImage; data is the pixels
+    TextureGenMip,    // StreamBindTexture, stage unused
+    TextureDelete,    // StreamValue, texture name
+    RenderbufferStorage, // StreamRenderbuffer
+    RenderbufferDelete,  // StreamValue, renderbuffer name
+    ProgramCreate,    // StreamProgram; data is the NUL-terminated source
+    ProgramBlock,     // StreamProgram, mType is the binding; data is the block name
+    ProgramSampler,   // StreamProgram, mType is the unit; data is the sampler name
+    ProgramDelete,    // StreamValue, program name
+    UseProgramStages, // StreamProgramStages
+    BindSampler,      // StreamBindSampler
+    CopyImage,        // StreamCopyImage
+
+    Count
+};
+
+struct StreamFileHeader {
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mReserved;
+};
+
+struct StreamRecord {
+    StreamOp mOp;
+    uint16_t mSize;
+    uint32_t mDataSize;
+    // Microseconds since recording started, as seen by the command thread.
+    uint64_t mTime;
+};
+
+struct StreamValue {
+    GLuint mValue;
+};
+struct StreamEnable {
+    GLenum mState;
+    GLuint mEnable;
+};
+struct StreamMaterial {
+    GLfloat mShininess;
+    GLfloat mDiffuse[4];
+    GLfloat mAmbient[4];
+    GLfloat mSpecular[4];
+    GLfloat mEmission[4];
+};
+struct StreamViewport {
+    GLint mX, mY;
+    GLsizei mWidth, mHeight;
+    GLfloat mMinZ, mMaxZ;
+};
+struct StreamRect {
+    GLint mLeft, mTop, mRight, mBottom;
+};
+struct StreamColorMask {
+    GLuint mIndex;
+    GLuint mMask; // D3DCOLORWRITEENABLE bits
+};
+struct StreamAlphaFunc {
+    GLenum mFunc;
+    GLfloat mRef;
+};
+struct StreamBlendFunc {
+    GLenum mSrc, mDst;
+};
+struct StreamStencilFunc {
+    GLenum mFace, mFunc;
+    GLuint mRef, mMask;
+};
+struct StreamStencilOp {
+    GLenum mFace, mFail, mZFail, mZPass;
+};
+struct StreamDepthBias {
+    GLfloat mScale, mBias;
+};
+struct StreamFog {
+    GLenum mParam;
+    GLfloat mValues[4];
+};
+struct StreamSamplerParam {
+    GLuint mSampler;
+    GLenum mParam;
+    GLint mValue;
+    GLfloat mValues[4];
+};
+struct StreamBindSampler {
+    GLuint mUnit;
+    GLSamplerDesc mDesc;
+};
+struct StreamBindTexture {
+    GLuint mStage;
+    GLenum mTarget;
+    GLuint mTexture;
+};
+struct StreamBindBuffer {
+    GLuint mIndex;
+    GLuint mBuffer;
+};
+struct StreamVertexAttrib {
+    GLuint mBuffer;
+    GLuint mOffset;
+    GLenum mType;
+    GLint mCount;
+    GLuint mNormalize;
+    GLsizei mStride;
+    GLint mTarget;
+    GLuint mDivisor;
+};
+struct StreamFBAttachment {
+    GLenum mAttachment;
+    GLenum mTarget;
+    GLuint mName;
+    GLint mLevel;
+};
+struct StreamClear {
+    GLbitfield mMask;
+    GLuint mColor;
+    GLfloat mDepth;
+    GLuint mStencil;
+    StreamRect mRect;
+};
+struct StreamDraw {
+    GLenum mMode;
+    GLint mCount;
+    GLenum mType;
+    GLuint mOffset;
+    GLsizei mNumInstances;
+    GLint mBaseVtx; // The first vertex for DrawArrays
+};
+struct StreamBlit {
+    GLenum mSrcTarget;
+    GLuint mSrcName;
+    GLint mSrcLevel;
+    StreamRect mSrcRect;
+    GLenum mDstTarget;  // GL_NONE for the window
+    GLuint mDstName;
+    GLint mDstLevel;
+    StreamRect mDstRect;
+    GLenum mFilter;
+};
+struct StreamCopyImage {
+    GLenum mSrcTarget;  // GL_RENDERBUFFER, GL_TEXTURE_2D, or GL_TEXTURE_CUBE_MAP
+    GLuint mSrcName;
+    GLint mSrcLevel;
+    GLint mSrcX, mSrcY, mSrcZ;
+    GLenum mDstTarget;
+    GLuint mDstName;
+    GLint mDstLevel;
+    GLint mDstX, mDstY, mDstZ;
+    GLsizei mWidth, mHeight, mDepth;
+};
+struct StreamBufferData {
+    GLuint mBuffer;
+    GLuint mSize;
+    GLenum mUsage;
+};
+struct StreamBufferSubData {
+    GLuint mBuffer;
+    GLuint mOffset;
+};
+struct StreamTexImage {
+    GLuint mTexture;
+    GLenum mTarget;   // GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP or GL_TEXTURE_3D
+    GLint mLevels;
+    GLenum mInternalFormat;
+    GLsizei mWidth, mHeight, mDepth;
+    GLenum mFormat, mType;
+};
+struct StreamTexSubImage {
+    GLuint mTexture;
+    GLenum mTarget;   // GL_TEXTURE_2D, a cube face, or GL_TEXTURE_3D
+    GLint mLevel;
+    GLint mX, mY, mZ;
+    GLsizei mWidth, mHeight, mDepth;
+    GLenum mFormat;   // The internal format for compressed data
+    GLenum mType;     // GL_NONE for compressed data
+    GLint mRowLength, mImageHeight;
+};
+struct StreamRenderbuffer {
+    GLuint mRenderbuffer;
+    GLenum mInternalFormat;
+    GLsizei mWidth, mHeight;
+    GLsizei mSamples;
+};
+struct StreamProgram {
+    GLuint mProgram;
+    GLenum mType;
+};
+struct StreamProgramStages {
+    GLuint mPipeline;
+    GLbitfield mStages;
+    GLuint mProgram;
+};
+struct StreamDeviceInit {
+    static const size_t sMaxSamplers = 32;
+
+    GLuint mNumSamplers;
+    GLuint mSamplers[sMaxSamplers];
+    GLuint mPipeline;
+    GLuint mMainFramebuffer;
+    GLuint mCopyFramebuffers[2];
+};
+
+
+// Writes records for the command thread of a CommandQueue. Only the command
+// thread may use it once the queue is running.
+class CommandStreamWriter {
+    FILE *mFile;
+    LONGLONG mStart;
+    LONGLONG mFrequency;
+    ULONG64 mRecords;
+    ULONG64 mBytes;
+
+    // Command types executed without anything recorded for them.
+    std::map<const std::type_info*,ULONG64> mUnsupported;
+
+    void writeRecord(StreamOp op, const void *body, size_t size, const void *data, size_t datalen);
+
+public:
+    CommandStreamWriter();
+    ~CommandStreamWriter();
+
+    bool open(const char *fname);
+    void close();
+
+    template<typename T>
+    void write(StreamOp op, const T &body, const void *data=nullptr, size_t datalen=0)
+    { writeRecord(op, &body, sizeof(body), data, datalen); }
+
+    void unsupported(const std::type_info &type) { ++mUnsupported[&type]; }
+};
+
+
+// Plays a recorded stream back through a CommandQueue, whose command thread
+// must have a GL context current. Only the command thread touches the GL
+// state and name maps.
+class CommandStreamPlayer {
+    CommandQueue &mQueue;
+    HDC mDevCtx;
+
+    std::vector<uint64_t> mData;
+    std::vector<const StreamRecord*> mRecords;
+
+    std::map<GLuint,GLuint> mBuffers;
+    std::map<GLuint,GLuint> mTextures;
+    std::map<GLuint,GLuint> mRenderbuffers;
+    std::map<GLuint,GLuint> mPrograms;
+    std::map<GLuint,GLuint> mSamplers;
+    std::map<GLuint,GLuint> mPipelines;
+    std::map<GLuint,GLuint> mFramebuffers;
+    SamplerCache mSamplerCache;
+
+    GLuint mMainFramebuffer;
+    GLuint mCopyFramebuffers[2];
+    GLuint mCurrentFramebuffer[2];
+    GLuint mActiveStage;
+    GLuint mClipPlanes;
+    GLuint mAttribArrays;
+
+    std::atomic<ULONG> mFrames;
+
+    GLuint getName(std::map<GLuint,GLuint> &names, GLuint name) const;
+    void bindMainFramebuffer();
+    void attachCopyGL(GLenum fbtarget, GLenum target, GLuint name, GLint level);
+
+public:
+    CommandStreamPlayer(CommandQueue &queue, HDC dc);
+
+    bool load(const char *fname);
+    size_t getNumRecords() const { return mRecords.size(); }
+    // Gets the size of the first image the stream blits to the window.
+    bool getWindowSize(GLsizei &width, GLsizei &height) const;
+    ULONG getNumFrames() const { return mFrames.load(); }
+
+    // Sends every record to the queue, waiting until each one's original
+    // time when timed is set, and returns once they've all executed.
+    void play(bool timed);
+
+    void executeGL(const StreamRecord *record);
+    // Deletes everything the stream created and left alive.
+    void resetGL();
+};
+
+#endif /* COMMANDSTREAM_HPP */
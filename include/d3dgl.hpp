@@ -17,6 +17,7 @@
 
 
 bool CreateFakeWindow(HINSTANCE hInstance, HWND &hWnd, HDC &dc);
+bool InitGLEW();
 
 
 class D3DAdapter;
@@ -5,9 +5,25 @@
 
 #include <atomic>
 #include <array>
+#include <bitset>
+#include <memory>
+#include <vector>
 
 #include "d3dgl.hpp"
 #include "commandqueue.hpp"
+#include "uploadring.hpp"
+#include "workerpool.hpp"
+#include "residency.hpp"
+#include "readbackring.hpp"
+#include "vertexarraycache.hpp"
+#include "samplercache.hpp"
+#include "framebuffercache.hpp"
+#include "querypool.hpp"
+#include "gputimer.hpp"
+#include "ffshader.hpp"
+#include "shadercompiler.hpp"
+#include "shadercodemap.hpp"
+#include "flatmap.hpp"
 
 
 class D3DGLSwapChain;
@@ -15,7 +31,13 @@ class D3DGLRenderTarget;
 class D3DGLBufferObject;
 class D3DGLVertexShader;
 class D3DGLPixelShader;
+class VertexShaderCode;
+class PixelShaderCode;
 class D3DGLVertexDeclaration;
+class D3DGLTexture;
+class D3DGLCubeTexture;
+class D3DGLPlainSurface;
+class D3DGLStateBlock;
 
 #define VSF_BINDING_IDX 0
 #define VSI_BINDING_IDX 1
@@ -25,6 +47,13 @@ class D3DGLVertexDeclaration;
 #define PSB_BINDING_IDX 5
 #define VTXSTATE_BINDING_IDX 6
 #define POSFIXUP_BINDING_IDX 7
+#define FFVS_BINDING_IDX 8
+#define FFPS_BINDING_IDX 9
+
+#define MAX_FRAME_LATENCY 3
+
+// Default maximum frame latency for new devices.
+extern UINT MaxFrameLatency;
 
 union Vector4f {
     float value[4];
@@ -35,33 +64,23 @@ union Vector4f {
 };
 static_assert(sizeof(Vector4f)==sizeof(float[4]), "Bad Vector4f size");
 
-struct GLStreamData {
-    GLuint mBufferId;
-    GLubyte *mPointer;
-    GLenum mGLType;
-    GLint mGLCount;
-    GLenum mNormalize;
-    GLsizei mStride;
-    GLint mTarget;
-    GLuint mDivisor;
-};
-
 struct GLState {
     /* Non-copyable */
     GLState(const GLState&) = delete;
     GLState& operator=(const GLState&) = delete;
 
     GLState()
-      : samplers{0}, pipeline(0)
+      : pipeline(0)
       , main_framebuffer(0), copy_framebuffers{0,0} , current_framebuffer{0,0}
       , vs_uniform_bufferf(0), ps_uniform_bufferf(0)
+      , vs_uniform_bufferi(0), ps_uniform_bufferi(0)
+      , vs_uniform_bufferb(0), ps_uniform_bufferb(0)
       , vtx_state_uniform_buffer(0), pos_fixup_uniform_buffer(0)
+      , ffvs_uniform_buffer(0), ffps_uniform_buffer(0)
       , active_texture_stage(0)
-      , attrib_array_enabled(0)
       , clip_plane_enabled(0)
     { }
 
-    std::array<GLuint,MAX_COMBINED_SAMPLERS> samplers;
     GLuint pipeline;
 
     GLuint main_framebuffer;     // Used for offscreen rendering
@@ -72,13 +91,17 @@ struct GLState {
 
     GLuint vs_uniform_bufferf;
     GLuint ps_uniform_bufferf;
+    GLuint vs_uniform_bufferi;
+    GLuint ps_uniform_bufferi;
+    GLuint vs_uniform_bufferb;
+    GLuint ps_uniform_bufferb;
     GLuint vtx_state_uniform_buffer;
     GLuint pos_fixup_uniform_buffer;
+    GLuint ffvs_uniform_buffer;
+    GLuint ffps_uniform_buffer;
 
     GLenum active_texture_stage;
 
-    UINT attrib_array_enabled; // Bitmask, 1<<attrib
-
     UINT clip_plane_enabled; // Bitmask, 1<<plane_index
 };
 
@@ -105,6 +128,23 @@ class D3DGLDevice : public IDirect3DDevice9 {
     GLState mGLState;
 
     CommandQueue mQueue;
+    UploadRing mUploadRing;
+    // Slices of float constants, so draws don't write over the constants of
+    // the ones still in flight. Not used when recording a command stream.
+    UploadRing mUniformRing;
+    UINT mUniformAlign;
+    WorkerPool mWorkers;
+    ResidencyManager mResidency;
+    ReadbackRing mReadback;
+    VertexArrayCache mVertexArrays;
+    SamplerCache mSamplerCache;
+    FramebufferCache mFramebuffers;
+    QueryPool mQueries;
+    GPUTimer mGPUTimer;
+    FFShaderCache mFFShaders;
+    ShaderCompiler mCompiler;
+    ShaderCodeMap<VertexShaderCode> mVertexShaderCodes;
+    ShaderCodeMap<PixelShaderCode> mPixelShaderCodes;
 
     const HWND mWindow;
     const DWORD mFlags;
@@ -120,6 +160,9 @@ class D3DGLDevice : public IDirect3DDevice9 {
     typedef std::array<std::atomic<DWORD>,33> TexStageStates;
     typedef std::array<std::atomic<DWORD>,14> SamplerStates;
 
+    // Each value stands alone and setters are serialized by the queue lock
+    // (or by there being one caller), so they're stored relaxed, which is a
+    // plain store.
     std::array<TexStageStates,MAX_TEXTURES> mTexStageState;
     std::array<SamplerStates,MAX_COMBINED_SAMPLERS> mSamplerState;
     std::array<std::atomic<DWORD>,210> mRenderState;
@@ -128,15 +171,32 @@ class D3DGLDevice : public IDirect3DDevice9 {
     D3DMATERIAL9 mMaterial;
     std::array<Vector4f,8> mClipPlane;
     std::atomic<bool> mInScene;
+    std::atomic<UINT> mMaxFrameLatency;
 
     std::array<Vector4f,256> mVSConstantsF;
     std::array<Vector4f,224> mPSConstantsF;
+    // Registers set since they were last uploaded, and the registers holding
+    // current values in the bound uniform ring slices, as [start, end), with
+    // the ring's region serial when the slices were taken. Only touched with
+    // the mQueue lock held.
+    UINT mVSConstFDirtyStart, mVSConstFDirtyEnd;
+    UINT mPSConstFDirtyStart, mPSConstFDirtyEnd;
+    UINT mVSConstFSliceStart, mVSConstFSliceEnd;
+    UINT mPSConstFSliceStart, mPSConstFSliceEnd;
+    ULONG mVSConstFSliceSerial, mPSConstFSliceSerial;
+    // Bool constants are kept as bitmasks. These are uploaded as they're set,
+    // for programs that don't have them folded in.
+    ShaderConstantsI mVSConstantsI;
+    ShaderConstantsI mPSConstantsI;
+    UINT mVSConstantsB;
+    UINT mPSConstantsB;
 
     std::atomic<D3DGLVertexShader*> mVertexShader;
     std::atomic<D3DGLPixelShader*> mPixelShader;
 
     std::atomic<D3DGLVertexDeclaration*> mVertexDecl;
 
+    // A null mBuffer means the data is in the upload ring, at mOffset.
     struct StreamSource {
         D3DGLBufferObject *mBuffer;
         UINT mOffset;
@@ -148,18 +208,73 @@ class D3DGLDevice : public IDirect3DDevice9 {
     std::atomic<D3DGLBufferObject*> mIndexBuffer;
 
     // FVF to VertexDeclaration map
-    std::map<DWORD,D3DGLVertexDeclaration*> mVtxDeclMap;
+    FlatMap<D3DGLVertexDeclaration*> mVtxDeclMap;
+
+    // Textures with locked rects that haven't been uploaded yet. Protected by
+    // the mQueue lock.
+    std::vector<D3DGLTexture*> mPendingTextures;
+    std::vector<D3DGLCubeTexture*> mPendingCubeTextures;
 
-    D3DGLBufferObject *mPrimitiveUserData;
+    // The managed textures set on each stage, kept resident while bound.
+    // Protected by the mQueue lock.
+    std::array<ManagedResource*,MAX_COMBINED_SAMPLERS> mBoundResources;
 
     /* Bit-depth of the current depth-stencil buffer */
     UINT mDepthBits;
+    /* Current render target attachments, for the framebuffer cache */
+    GLFramebufferDesc mFBDesc;
 
     /* Bitmask of sampler stages that have a shadow texture format */
     UINT mShadowSamplers;
-
-    /* Specifies if the pixel shader is newly set for this draw. */
-    std::atomic<bool> mNewPixelShader;
+    /* Bitmask of sampler stages that have a cube texture */
+    UINT mCubeSamplers;
+
+    /* Fixed-function state for draws without shaders, which only gets turned
+     * into uniforms when such a draw needs it. mFFDirty has FFDirty_* bits for
+     * the uniforms changed since they were last sent. Protected by the mQueue
+     * lock. */
+    struct LightState {
+        D3DLIGHT9 mLight;
+        bool mEnabled;
+    };
+    enum {
+        FFDirty_Vertex = 1<<0,
+        FFDirty_Pixel = 1<<1
+    };
+    std::array<D3DMATRIX,D3DTS_TEXTURE7+1> mTransforms;
+    std::array<D3DMATRIX,256> mWorldMatrices;
+    FlatMap<LightState> mLights;
+    std::array<DWORD,8> mActiveLights;
+    UINT mNumActiveLights;
+    UINT mFFDirty;
+    // The uniform ring's region serial when the uniforms' slices were taken.
+    ULONG mFFVertexSliceSerial, mFFPixelSliceSerial;
+
+    /* Programs last set on the pipeline's vertex and fragment stages.
+     * Protected by the mQueue lock. */
+    GLuint mVertexProgram;
+    GLuint mFragmentProgram;
+
+    /* Render state values and samplers last sent to GL, and which render
+     * states and sampler stages the app has changed since. Changes are only
+     * sent when the next draw is issued. Protected by the mQueue lock. */
+    std::array<DWORD,210> mGLRenderState;
+    std::bitset<210> mDirtyRenderStates;
+    std::array<GLSamplerDesc,MAX_COMBINED_SAMPLERS> mGLSamplerDescs;
+    UINT mDirtySamplers;
+
+    /* The state block being recorded between BeginStateBlock and
+     * EndStateBlock, which gets the states set instead of the device. */
+    D3DGLStateBlock *mRecordingBlock;
+
+    /* The vertex setup last sent, which a draw right after an indexed one
+     * with nothing in between doesn't need to send again. Protected by the
+     * mQueue lock. */
+    UINT mVtxAttribs;
+    std::array<GLVertexFormat,16> mVtxFormats;
+    GLuint mNumVtxFormats;
+    std::array<GLVertexBinding,MAX_STREAMS> mVtxBindings;
+    GLuint mNumVtxBindings;
 
     // Sends buffer values to update proj_fixup_uniform_buffer. Caller is
     // responsible for holding the mQueue lock.
@@ -175,7 +290,40 @@ class D3DGLDevice : public IDirect3DDevice9 {
     void GLAPIENTRY debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity,
                                 GLsizei length, const GLchar *message) const;
 
-    HRESULT sendVtxData(INT startvtx, const StreamSource *srcstreams, UINT num_sources);
+    // Returns S_FALSE if the draw should be skipped, because its shaders are
+    // still building. The draw's start vertex isn't part of the offsets, and
+    // is given to the draw call instead.
+    HRESULT sendVtxData(const StreamSource *srcstreams, UINT num_sources);
+
+    // Uploads the dirty constants within [usedstart, usedend) to buffer,
+    // leaving the rest dirty for a shader that reads them. Caller is
+    // responsible for holding the mQueue lock.
+    void flushConstantsF(GLuint buffer, const Vector4f *constants, UINT &dirtystart, UINT &dirtyend,
+                         UINT usedstart, UINT usedend);
+    // Makes the float constants read by the shaders, or the fixed-function
+    // uniforms for stages without one, current. New uniform ring slices for
+    // them are bound as needed. Caller is responsible for holding the mQueue
+    // lock.
+    void flushUniforms(const VertexShaderCode *vcode, const PixelShaderCode *pcode);
+    // Uploads bool constants [start, start+count) to buffer, laid out as
+    // std140 bools. Caller is responsible for holding the mQueue lock.
+    void sendConstantsB(GLuint buffer, UINT bools, UINT start, UINT count);
+
+    // Makes the keys for the fixed-function programs of the current state,
+    // and the uniforms they read. Caller is responsible for holding the
+    // mQueue lock.
+    FFVertexKey getFFVertexKey(const D3DGLVertexDeclaration *vtxdecl) const;
+    FFPixelKey getFFPixelKey(bool ffvertex, const D3DGLVertexDeclaration *vtxdecl) const;
+    void fillFFVertexUniforms(FFVertexUniforms &uniforms) const;
+    void fillFFPixelUniforms(FFPixelUniforms &uniforms) const;
+    // The matrix for a transform state, or null if there's no such state.
+    D3DMATRIX *getTransform(D3DTRANSFORMSTATETYPE state);
+
+    // Sends GL commands for render and sampler states that changed since the
+    // last draw. Caller is responsible for holding the mQueue lock.
+    void applyRenderState(D3DRENDERSTATETYPE state, DWORD value);
+    GLSamplerDesc getSamplerDesc(DWORD sampler) const;
+    void flushStateChanges();
 
 public:
     D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND window, DWORD flags);
@@ -185,14 +333,56 @@ public:
 
     const D3DAdapter &getAdapter() const { return mAdapter; }
     CommandQueue &getQueue() { return mQueue; }
+    UploadRing &getUploadRing() { return mUploadRing; }
+    WorkerPool &getWorkerPool() { return mWorkers; }
+    ResidencyManager &getResidency() { return mResidency; }
+    VertexArrayCache &getVertexArrays() { return mVertexArrays; }
+    FramebufferCache &getFramebuffers() { return mFramebuffers; }
+    QueryPool &getQueryPool() { return mQueries; }
+    GPUTimer &getGPUTimer() { return mGPUTimer; }
+    ShaderCompiler &getShaderCompiler() { return mCompiler; }
+    ShaderCodeMap<VertexShaderCode> &getVertexShaderCodes() { return mVertexShaderCodes; }
+    ShaderCodeMap<PixelShaderCode> &getPixelShaderCodes() { return mPixelShaderCodes; }
+
+    // Tracks textures with uploads waiting for flushPendingUploads, which
+    // sends them before the next draw or present. Caller is responsible for
+    // holding the mQueue lock.
+    void addPendingUpload(D3DGLTexture *texture) { mPendingTextures.push_back(texture); }
+    void addPendingUpload(D3DGLCubeTexture *texture) { mPendingCubeTextures.push_back(texture); }
+    void removePendingUpload(D3DGLTexture *texture);
+    void removePendingUpload(D3DGLCubeTexture *texture);
+    void flushPendingUploads();
 
     GLuint getShaderPipeline() const { return mGLState.pipeline; }
 
+    // Sets the render, sampler, and texture stage states of a state block in
+    // one go. Like with Set*, they're sent with the next draw, skipping the
+    // ones GL already has.
+    void applyStates(const D3DGLStateBlock &block);
+    // Fills in the render, sampler, and texture stage states of a state
+    // block.
+    void captureStates(D3DGLStateBlock &block);
+    // The lights that have been set or enabled, for state blocks that hold
+    // all of them.
+    void getLightIndices(std::vector<DWORD> &indices);
+
+    // Like IDirect3DDevice9Ex's, sets how many presented frames may be queued
+    // up before Present blocks. 0 resets it to the default.
+    HRESULT SetMaximumFrameLatency(UINT maxlatency);
+    HRESULT GetMaximumFrameLatency(UINT *maxlatency);
+
     void initGL(HDC dc, HGLRC glcontext);
     void deinitGL();
+    // Reads rect into surface's system memory, through the readback ring.
+    // Rows are rowlength pixels apart, or the rect's width if 0. The data is
+    // there once the fence resolveReadback returns has passed.
+    void queueReadback(D3DGLPlainSurface *surface, GLenum src_target, GLuint src_binding, GLint src_level,
+                       const RECT &rect, GLint rowlength);
+    ULONG resolveReadback(ULONG serial);
+
     void readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
-                           GLenum format, GLenum type, GLubyte *data,
-                           std::atomic<ULONG> &pendingupdates);
+                           GLenum format, GLenum type, const std::shared_ptr<GLubyte> &data, GLint rowlength,
+                           UINT pitch, ULONG serial, ULONG replaced);
     void blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
                            GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect,
                            GLenum filter);
@@ -0,0 +1,79 @@
+#ifndef DIRTYRECTS_HPP
+#define DIRTYRECTS_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <algorithm>
+#include <array>
+
+
+// A short list of rects waiting to be uploaded. Rects that overlap or touch
+// get merged, and once the list is full a new rect is merged into the one it
+// grows the least.
+class DirtyRects {
+    static const size_t sMaxRects = 4;
+
+    std::array<RECT,sMaxRects> mRects;
+    size_t mCount;
+
+    static RECT merge(const RECT &a, const RECT &b)
+    {
+        return RECT{ std::min(a.left, b.left), std::min(a.top, b.top),
+                     std::max(a.right, b.right), std::max(a.bottom, b.bottom) };
+    }
+    static LONGLONG area(const RECT &rect)
+    { return LONGLONG(rect.right-rect.left) * (rect.bottom-rect.top); }
+    static bool touches(const RECT &a, const RECT &b)
+    {
+        return a.left <= b.right && b.left <= a.right &&
+               a.top <= b.bottom && b.top <= a.bottom;
+    }
+
+public:
+    DirtyRects() : mCount(0) { }
+
+    void add(RECT rect)
+    {
+        // Merging can make the rect touch ones it didn't before, so keep
+        // going until nothing else merges.
+        for(size_t i = 0;i < mCount;)
+        {
+            if(!touches(mRects[i], rect))
+            {
+                ++i;
+                continue;
+            }
+            rect = merge(mRects[i], rect);
+            mRects[i] = mRects[--mCount];
+            i = 0;
+        }
+
+        if(mCount < sMaxRects)
+        {
+            mRects[mCount++] = rect;
+            return;
+        }
+
+        size_t best = 0;
+        LONGLONG bestgrowth = area(merge(mRects[0], rect)) - area(mRects[0]);
+        for(size_t i = 1;i < mCount;++i)
+        {
+            LONGLONG growth = area(merge(mRects[i], rect)) - area(mRects[i]);
+            if(growth < bestgrowth)
+            {
+                best = i;
+                bestgrowth = growth;
+            }
+        }
+        mRects[best] = merge(mRects[best], rect);
+    }
+
+    bool empty() const { return mCount == 0; }
+    void clear() { mCount = 0; }
+
+    const RECT *begin() const { return mRects.data(); }
+    const RECT *end() const { return mRects.data() + mCount; }
+};
+
+#endif /* DIRTYRECTS_HPP */
@@ -0,0 +1,183 @@
+#ifndef FFSHADER_HPP
+#define FFSHADER_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <map>
+#include <cstring>
+#include <d3d9.h>
+
+#include "glew.h"
+
+
+class CommandQueue;
+
+// Attribute locations the fixed-function vertex programs read their inputs
+// from, with texcoord n at FFATTRIB_TEXCOORD0+n.
+enum FFAttribLocation {
+    FFATTRIB_POSITION = 0,
+    FFATTRIB_NORMAL,
+    FFATTRIB_PSIZE,
+    FFATTRIB_DIFFUSE,
+    FFATTRIB_SPECULAR,
+    FFATTRIB_TEXCOORD0
+};
+// Gets the location for a vertex element, or -1 if the programs don't read
+// it.
+GLint GetFFAttribLocation(BYTE usage, BYTE index);
+
+// The fixed-function vertex state a generated program depends on. Values
+// that only change uniforms, like matrices and light colors, aren't part of
+// it. The fields are packed into DWORDs with nothing left over, so keys can
+// be compared as bytes and stored in the shader cache like bytecode, as long
+// as unused fields are left 0.
+struct FFVertexKey {
+    DWORD mTransformed : 1;   // POSITIONT, already in screen space
+    DWORD mLighting : 1;
+    DWORD mLocalViewer : 1;
+    DWORD mNormalize : 1;
+    DWORD mSpecular : 1;
+    DWORD mRangeFog : 1;
+    DWORD mPointScale : 1;
+    DWORD mHasNormal : 1;
+    DWORD mHasDiffuse : 1;
+    DWORD mHasSpecular : 1;
+    DWORD mHasPSize : 1;
+    DWORD mFogMode : 2;       // D3DFOG_*, when fog is computed per vertex
+    DWORD mNumLights : 4;
+    DWORD : 15;
+    // D3DLIGHTTYPE of each active light, 2 bits each.
+    DWORD mLightTypes : 16;
+    // D3DMCS_* source of the diffuse, ambient, specular, and emissive colors.
+    DWORD mDiffuseSource : 2;
+    DWORD mAmbientSource : 2;
+    DWORD mSpecularSource : 2;
+    DWORD mEmissiveSource : 2;
+    DWORD : 8;
+    // Component count of each texcoord input, 3 bits each, 0 for none.
+    DWORD mTexCoordSizes;
+    struct {
+        DWORD mIndex : 3;     // Texcoord input
+        DWORD mGen : 3;       // D3DTSS_TCI_* >> 16
+        DWORD mTransform : 3; // D3DTTFF_COUNT*, 0 for none
+        DWORD : 23;
+    } mStages[8];
+
+    bool operator<(const FFVertexKey &rhs) const
+    { return memcmp(this, &rhs, sizeof(*this)) < 0; }
+};
+static_assert(sizeof(FFVertexKey) == 11*sizeof(DWORD), "Unexpected FFVertexKey size");
+
+// The texture stage setup a generated fixed-function pixel program depends
+// on, packed like FFVertexKey. Stages from the first disabled one on are left
+// 0.
+struct FFPixelKey {
+    struct {
+        DWORD mColorOp : 5;
+        DWORD mColorArg1 : 6;  // D3DTA_* with the selector and modifier bits
+        DWORD mColorArg2 : 6;
+        DWORD mColorArg0 : 6;
+        DWORD mResultTemp : 1;
+        DWORD mTexType : 2;    // FFTEX_*
+        DWORD mProjected : 3;  // Coord component to divide by, 0 for none
+        DWORD : 3;
+        DWORD mAlphaOp : 5;
+        DWORD mAlphaArg1 : 6;
+        DWORD mAlphaArg2 : 6;
+        DWORD mAlphaArg0 : 6;
+        DWORD mTexCoord : 3;   // Texcoord input the stage samples with
+        DWORD : 6;
+    } mStages[8];
+    DWORD mFogMode : 3;        // FFFOG_*
+    DWORD mWFog : 1;           // Table fog by eye distance instead of depth
+    DWORD mSpecular : 1;
+    DWORD : 27;
+
+    bool operator<(const FFPixelKey &rhs) const
+    { return memcmp(this, &rhs, sizeof(*this)) < 0; }
+};
+static_assert(sizeof(FFPixelKey) == 17*sizeof(DWORD), "Unexpected FFPixelKey size");
+
+enum FFTexType {
+    FFTEX_NONE = 0,
+    FFTEX_2D,
+    FFTEX_CUBE,
+    FFTEX_SHADOW
+};
+enum FFFogMode {
+    FFFOG_NONE = 0,
+    FFFOG_VERTEX,  // Factor computed or given per vertex, in specular alpha
+    FFFOG_EXP,
+    FFFOG_EXP2,
+    FFFOG_LINEAR
+};
+
+// NOTE: These MUST match the uniform blocks in the generated GLSL. Matrices
+// are as D3D has them, which GLSL reads as the transpose for multiplying
+// column vectors.
+struct FFLightUniforms {
+    float Diffuse[4];
+    float Specular[4];
+    float Ambient[4];
+    float Position[4];    // Eye space
+    float Direction[4];   // Eye space, normalized
+    float Attenuation[4]; // Attenuation0-2, range
+    float Spot[4];        // cos(phi/2), 1/(cos(theta/2)-cos(phi/2)), falloff
+};
+struct FFVertexUniforms {
+    D3DMATRIX World;
+    D3DMATRIX WorldView;
+    D3DMATRIX WorldViewProj;
+    D3DMATRIX Normal;
+    D3DMATRIX TexMatrix[8];
+    float MaterialDiffuse[4];
+    float MaterialAmbient[4];
+    float MaterialSpecular[4];
+    float MaterialEmissive[4];
+    float GlobalAmbient[4];
+    float MaterialPower[4];
+    float FogParams[4];   // Start, end, density, 1/(end-start)
+    float PointParams[4]; // Size, min, max, viewport height
+    float PointScale[4];  // A, B, C
+    float ScreenScale[4]; // Screen space to clip space, for POSITIONT
+    float ScreenOffset[4];
+    FFLightUniforms Lights[8];
+};
+struct FFPixelUniforms {
+    float TextureFactor[4];
+    float FogColor[4];
+    float FogParams[4];
+    float StageConstant[8][4];
+};
+
+// GL programs generated for the fixed-function state of draws without a
+// shader, by key. Each key's program is made once, or loaded from the shader
+// cache, on the command thread, and kept for the device's lifetime.
+class FFShaderCache {
+    CommandQueue &mQueue;
+
+    // Only the app thread adds to these, with the queue lock held. The
+    // command thread fills in the new entry's program while the app thread
+    // waits.
+    std::map<FFVertexKey,GLuint> mVertexPrograms;
+    std::map<FFPixelKey,GLuint> mPixelPrograms;
+
+    FFShaderCache(const FFShaderCache&) = delete;
+    FFShaderCache& operator=(const FFShaderCache&) = delete;
+
+public:
+    FFShaderCache(CommandQueue &queue) : mQueue(queue) { }
+
+    // Gets the program for the key, waiting for it to be made if it's new. 0
+    // if it failed to build. Caller is responsible for holding the queue
+    // lock.
+    GLuint getVertexProgram(const FFVertexKey &key);
+    GLuint getPixelProgram(const FFPixelKey &key);
+
+    GLuint buildVertexProgramGL(const FFVertexKey &key);
+    GLuint buildPixelProgramGL(const FFPixelKey &key);
+    void deinitGL();
+};
+
+#endif /* FFSHADER_HPP */
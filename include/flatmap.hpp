@@ -0,0 +1,104 @@
+#ifndef FLATMAP_HPP
+#define FLATMAP_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <cstddef>
+#include <vector>
+
+
+// A small open-addressing hash table keyed by DWORD, for lookups on hot paths
+// that would otherwise chase std::map nodes. Entries live in one array probed
+// linearly, which is kept at most half full. There's no removal.
+template<typename T>
+class FlatMap {
+    struct Entry {
+        DWORD mKey;
+        bool mUsed;
+        T mValue;
+    };
+    std::vector<Entry> mEntries;
+    size_t mCount;
+
+    static size_t hash(DWORD key)
+    {
+        key ^= key >> 16;
+        key *= 0x7feb352d;
+        key ^= key >> 15;
+        key *= 0x846ca68b;
+        key ^= key >> 16;
+        return key;
+    }
+
+    void rehash(size_t size)
+    {
+        std::vector<Entry> old(size, Entry{0, false, T()});
+        old.swap(mEntries);
+        mCount = 0;
+        for(Entry &entry : old)
+        {
+            if(entry.mUsed)
+                insert(entry.mKey, entry.mValue);
+        }
+    }
+
+public:
+    FlatMap() : mCount(0) { }
+    template<typename U>
+    FlatMap(const U &list) : mCount(0)
+    {
+        for(const auto &item : list)
+            insert(item.first, item.second);
+    }
+
+    T *find(DWORD key)
+    {
+        if(mEntries.empty()) return nullptr;
+
+        size_t mask = mEntries.size() - 1;
+        for(size_t idx = hash(key)&mask;mEntries[idx].mUsed;idx = (idx+1)&mask)
+        {
+            if(mEntries[idx].mKey == key)
+                return &mEntries[idx].mValue;
+        }
+        return nullptr;
+    }
+    const T *find(DWORD key) const
+    { return const_cast<FlatMap*>(this)->find(key); }
+
+    // Replaces the value if the key already exists.
+    void insert(DWORD key, const T &value)
+    {
+        if((mCount+1)*2 > mEntries.size())
+            rehash(mEntries.empty() ? 16 : mEntries.size()*2);
+
+        size_t mask = mEntries.size() - 1;
+        size_t idx = hash(key)&mask;
+        for(;mEntries[idx].mUsed;idx = (idx+1)&mask)
+        {
+            if(mEntries[idx].mKey == key)
+            {
+                mEntries[idx].mValue = value;
+                return;
+            }
+        }
+        mEntries[idx] = Entry{key, true, value};
+        ++mCount;
+    }
+
+    template<typename F>
+    void forEach(F func)
+    {
+        for(Entry &entry : mEntries)
+        {
+            if(entry.mUsed)
+                func(entry.mKey, entry.mValue);
+        }
+    }
+
+    size_t size() const { return mCount; }
+    void clear() { mEntries.clear(); mCount = 0; }
+};
+
+#endif /* FLATMAP_HPP */
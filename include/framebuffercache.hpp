@@ -0,0 +1,66 @@
+#ifndef FRAMEBUFFERCACHE_HPP
+#define FRAMEBUFFERCACHE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <unordered_map>
+
+#include "glew.h"
+
+
+// A renderbuffer or texture image attached to a framebuffer. An mId of 0 is
+// nothing attached.
+struct GLFBAttachment {
+    GLenum mTarget;
+    GLuint mId;
+    GLint mLevel;
+};
+
+// The attachments of the device's render framebuffer, as set by
+// SetRenderTarget and SetDepthStencilSurface. All fields are 32-bit, so
+// there's no padding to compare or hash.
+struct GLFramebufferDesc {
+    GLFBAttachment mColor[4];
+    // GL_DEPTH_ATTACHMENT or GL_DEPTH_STENCIL_ATTACHMENT.
+    GLenum mDepthAttachment;
+    GLFBAttachment mDepth;
+
+    bool operator==(const GLFramebufferDesc &rhs) const;
+    bool operator!=(const GLFramebufferDesc &rhs) const { return !(*this == rhs); }
+};
+
+// Framebuffer objects for the render target setups the device has used, so
+// switching render targets is a lookup and a glBindFramebuffer instead of
+// reattaching images and having the driver revalidate the framebuffer. Only
+// touched by the command thread.
+class FramebufferCache {
+    static const size_t sMaxFramebuffers = 64;
+
+    struct Hasher {
+        size_t operator()(const GLFramebufferDesc &desc) const;
+    };
+
+    std::unordered_map<GLFramebufferDesc,GLuint,Hasher> mFramebuffers;
+
+    GLuint createGL(const GLFramebufferDesc &desc);
+
+    FramebufferCache(const FramebufferCache&) = delete;
+    FramebufferCache& operator=(const FramebufferCache&) = delete;
+
+public:
+    FramebufferCache() { }
+
+    void deinitGL();
+
+    // Gets the framebuffer for the given attachments, making it if needed.
+    // Evicting can delete the currently bound framebuffer, so the caller must
+    // bind what's returned.
+    GLuint getGL(const GLFramebufferDesc &desc);
+
+    // Deletes the framebuffers with the named renderbuffer or texture
+    // attached, before it's deleted.
+    void forgetGL(bool renderbuffer, GLuint id);
+};
+
+#endif /* FRAMEBUFFERCACHE_HPP */
@@ -7,6 +7,8 @@
 #include "glew.h"
 
 
+struct PixelConverter;
+
 #ifndef D3DFMT4CC
 #define D3DFMT4CC(a,b,c,d)  (a | ((b<<8)&0xff00) | ((c<<16)&0xff0000) | ((d<<24)&0xff000000))
 #endif
@@ -23,13 +25,20 @@ struct GLFormatInfo {
     int bytesperblock; /* Same as bytesperpixel for uncompressed formats */
     GLbitfield buffermask;
     GLbitfield flags;
+    /* Converts the D3D pixels for upload, if format and type can't take them as-is */
+    const PixelConverter *converter;
 
     enum FlagBits {
         Normal = 0,
         ShadowTexture = 1<<0, /* Expects depth comparison enabled on the sampler */
-        BadPitch = 1<<1 /* Calculate normal pitch/offset despite being compressed */
+        BadPitch = 1<<1, /* Calculate normal pitch/offset despite being compressed */
+        NoStorage = 1<<2 /* Not allowed for immutable texture storage */
     };
 
+    // Whether textures of this format can be made with ARB_texture_storage.
+    bool canUseStorage() const
+    { return GLEW_ARB_texture_storage && !(flags&NoStorage); }
+
     GLenum getDepthStencilAttachment() const;
     GLuint getDepthBits() const;
 
@@ -46,4 +55,8 @@ struct GLFormatInfo {
 };
 extern const std::map<DWORD,GLFormatInfo> gFormatList;
 
+// Finds the info for a format through a flat table built from gFormatList.
+// Returns null for unknown formats.
+const GLFormatInfo *FindGLFormat(DWORD format);
+
 #endif /* GLFORMAT_HPP */
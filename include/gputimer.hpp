@@ -0,0 +1,67 @@
+#ifndef GPUTIMER_HPP
+#define GPUTIMER_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <deque>
+#include <vector>
+
+#include "glew.h"
+
+
+// Frames between GPU timing reports, or 0 to not time frames.
+extern unsigned int GPUTimingInterval;
+
+// Brackets each frame, and each render target change in it, with GL timestamp
+// queries, and logs the GPU time of frames and of the passes between render
+// target changes. Passes are reported by their order in the frame, next to
+// the time between swaps on the command thread, so a GPU-bound frame shows up
+// as a GPU time close to the swap interval. Results are read a few frames
+// later, once the GPU has them, so timing doesn't stall the GL. Only touched
+// by the command thread.
+class GPUTimer {
+    static const size_t sMaxPasses = 64;
+    static const size_t sMaxPending = 16;
+
+    struct Frame {
+        std::vector<GLuint> mStamps;
+        double mInterval;
+    };
+
+    std::vector<GLuint> mFreeNames;
+    Frame mCurrent;
+    std::deque<Frame> mPending;
+    LONGLONG mFrequency;
+    LONGLONG mLastSwap;
+    std::vector<GLuint64> mScratch;
+
+    // Totals since the last report, in milliseconds.
+    ULONG mFrames;
+    ULONG mPasses;
+    double mGPUTime;
+    double mGPUMax;
+    double mInterval;
+    std::vector<double> mPassTime;
+    std::vector<ULONG> mPassCount;
+
+    void counterGL();
+    void stampGL();
+    void resolveGL(bool wait);
+    void report();
+
+    GPUTimer(const GPUTimer&) = delete;
+    GPUTimer& operator=(const GPUTimer&) = delete;
+
+public:
+    GPUTimer();
+
+    // Ends the current pass and starts a new one.
+    void markGL() { if(GPUTimingInterval) stampGL(); }
+    // Called around SwapBuffers.
+    void endFrameGL();
+    void beginFrameGL();
+    void deinitGL();
+};
+
+#endif /* GPUTIMER_HPP */
@@ -0,0 +1,34 @@
+#ifndef PIXELCONV_HPP
+#define PIXELCONV_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <cstddef>
+
+#include "glew.h"
+
+
+// Converts pixels of a D3D format GL has no matching upload format for, into
+// what the GLFormatInfo's format and type describe, so the driver never has
+// to convert them itself. Kernels use SSE2 when the compiler targets it, and
+// plain C++ otherwise.
+struct PixelConverter {
+    // Size of a converted pixel.
+    int dstbpp;
+    void (*convert)(GLubyte *dst, const GLubyte *src, size_t count);
+
+    // Converts a width x height x depth block of pixels, with src and dst
+    // rows and slices being the given number of bytes apart.
+    void convertBox(GLubyte *dst, UINT dstpitch, UINT dstslice, const GLubyte *src, UINT srcpitch,
+                    UINT srcslice, UINT width, UINT height, UINT depth) const;
+};
+
+// 24-bit B,G,R to 32-bit B,G,R,A with opaque alpha.
+extern const PixelConverter ConvertR8G8B8;
+// 16-bit A8R3G3B2 to 32-bit B,G,R,A.
+extern const PixelConverter ConvertA8R3G3B2;
+// 8-bit A4L4 to 16-bit L,A.
+extern const PixelConverter ConvertA4L4;
+
+#endif /* PIXELCONV_HPP */
@@ -3,26 +3,97 @@
 
 #include <atomic>
 #include <vector>
+#include <string>
 #include <map>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "commandqueue.hpp"
+#include "commandstream.hpp"
+#include "shadercache.hpp"
+#include "shadercodemap.hpp"
 
 
 class D3DGLDevice;
 
-class D3DGLPixelShader : public IDirect3DPixelShader9 {
-    std::atomic<ULONG> mRefCount;
+// The bytecode and GL programs of a pixel shader, shared by the shader objects
+// created from the same bytecode.
+class PixelShaderCode {
+    ULONG mRefCount;
 
     D3DGLDevice *mParent;
 
     std::atomic<ULONG> mPendingUpdates;
-    std::map<UINT,GLuint> mPrograms;
+    std::atomic<ULONG> mUpdateFence;
+    std::map<ShaderVariant,GLuint> mPrograms;
+    // Variants that programs were started for, so mPrograms only needs to be
+    // looked at once they're built.
+    std::vector<ShaderVariant> mBuilds;
     UINT mSamplerMask; // Bitmask of used samplers
-    UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
+    UINT mConstFStart;
+    UINT mConstFEnd;
+    UINT mConstIMask;
+    UINT mConstBMask;
+    // Number of programs built with constants folded in.
+    UINT mSpecializations;
+    // The variant selected for the last checked state, and what was asked
+    // for, which differs when it fell back to reading constants from
+    // uniforms.
+    ShaderVariant mSelected;
+    ShaderVariant mRequested;
+
+    // Sampler names, the same for every program.
+    const ShaderReflection mReflection;
+    // GLSL for no shadow samplers or folded constants, from parsing the
+    // shader when it was created. Only touched by the build for that variant.
+    std::string mSource;
+
+    const std::vector<DWORD> mCode;
+
+    // Translates and links the shader, without the cache. The source is
+    // parsed for again if it's empty.
+    GLuint buildProgramGL(const ShaderVariant &key, std::string&& source, CommandStreamWriter *stream);
+
+    void startCompile(const ShaderVariant &key);
+
+    friend class ShaderCodeMap<PixelShaderCode>;
+
+public:
+    PixelShaderCode(D3DGLDevice *parent, std::vector<DWORD>&& code, ShaderCodeInfo&& info);
+    ~PixelShaderCode();
+
+    const std::vector<DWORD> &getCode() const { return mCode; }
+    // The float constant registers read by the shader, as [start, end).
+    UINT getConstFStart() const { return mConstFStart; }
+    UINT getConstFEnd() const { return mConstFEnd; }
+
+    // Called on a compile thread when async is set, which leaves decrementing
+    // the pending count to the compiler. The program is written to slot, the
+    // variant's entry in mPrograms.
+    GLuint compileShaderGL(const ShaderVariant &key, GLuint &slot, bool async);
+
+    bool isBuilding() const { return mPendingUpdates > 0; }
+    void waitBuilt();
+
+    // Selects the program for the shadow samplers and bool and integer
+    // constants, and starts building it if it hasn't been yet. Caller is
+    // responsible for holding the queue lock.
+    void selectVariant(UINT shadowmask, const ShaderConstantsI &ints, UINT bools);
+    // Gets the selected program. Caller is responsible for waiting for it to
+    // be built.
+    GLuint getProgram() const
+    {
+        auto iter = mPrograms.find(mSelected);
+        return (iter != mPrograms.end()) ? iter->second : 0;
+    }
+};
 
-    std::vector<DWORD> mCode;
+class D3DGLPixelShader : public IDirect3DPixelShader9 {
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    PixelShaderCode *mCode;
 
 public:
     D3DGLPixelShader(D3DGLDevice *parent);
@@ -30,11 +101,7 @@ public:
 
     bool init(const DWORD *data);
 
-    GLuint compileShaderGL(UINT shadowsamplers);
-
-    ULONG getPendingUpdates() const { return mPendingUpdates; }
-
-    void setProgram(GLuint pipeline, UINT shadowmask, bool force);
+    PixelShaderCode *getCode() const { return mCode; }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -46,24 +113,6 @@ public:
 };
 
 
-class CompileAndSetPShaderCmd : public Command {
-    D3DGLPixelShader *mTarget;
-    GLuint mPipeline;
-    UINT mShadowSamplers;
-
-public:
-    CompileAndSetPShaderCmd(D3DGLPixelShader *target, GLuint pipeline, UINT shadowsamplers=0)
-      : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
-
-    virtual ULONG execute()
-    {
-        GLuint program = mTarget->compileShaderGL(mShadowSamplers);
-        glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, program);
-        checkGLError();
-        return sizeof(*this);
-    }
-};
-
 class SetPShaderCmd : public Command {
     GLuint mPipeline;
     GLuint mProgram;
@@ -78,6 +127,10 @@ public:
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::UseProgramStages, StreamProgramStages{mPipeline, GL_FRAGMENT_SHADER_BIT, mProgram});
+    }
 };
 
 #endif /* PIXELSHADER_HPP */
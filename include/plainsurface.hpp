@@ -21,7 +21,9 @@ class D3DGLPlainSurface : public IDirect3DSurface9 {
     bool mIsCompressed;
 
     std::shared_ptr<GLubyte> mBufData;
-    std::atomic<ULONG> mPendingUpdates;
+    std::atomic<ULONG> mUpdateFence;
+    // Serial of a readback that hasn't been copied to mBufData yet.
+    std::atomic<ULONG> mReadbackSerial;
 
     enum LockType {
         LT_Unlocked,
@@ -40,8 +42,12 @@ public:
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
 
-    std::atomic<ULONG> &getPendingUpdates() { return mPendingUpdates; };
+    void setUpdateFence(ULONG fence) { mUpdateFence = fence; }
     std::shared_ptr<GLubyte> getBufData() const { return mBufData; }
+    // Sets the pending readback, returning the one it replaces.
+    ULONG setReadback(ULONG serial) { return mReadbackSerial.exchange(serial); }
+    // Makes sure a pending readback is in mBufData.
+    void resolveReadback();
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
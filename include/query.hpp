@@ -9,6 +9,9 @@
 
 class D3DGLDevice;
 
+// Queries use a slot in the device's query pool, and read their results from
+// it once published, so GetData never waits on the command thread. Timestamps
+// are GL_TIMESTAMP counters, in nanoseconds.
 class D3DGLQuery : public IDirect3DQuery9 {
     std::atomic<ULONG> mRefCount;
 
@@ -17,9 +20,9 @@ class D3DGLQuery : public IDirect3DQuery9 {
     D3DQUERYTYPE mType;
 
     GLenum mQueryType;
-    GLuint mQueryId;
-    GLuint mQueryResult;
-    std::atomic<ULONG> mPendingQueries;
+    UINT mQuerySlot;
+    ULONG mQuerySerial;
+    UINT64 mQueryResult;
 
     enum State {
         Signaled,
@@ -34,12 +37,7 @@ public:
 
     bool init(D3DQUERYTYPE type);
 
-    GLuint getQueryId() const { return mQueryId; }
-
-    void initGL();
-    void beginQueryGL();
-    void endQueryGL();
-    void queryDataGL();
+    static bool isSupported(D3DQUERYTYPE type);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -0,0 +1,95 @@
+#ifndef QUERYPOOL_HPP
+#define QUERYPOOL_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "glew.h"
+
+
+// GL query names and results for the device's queries. Queries get a slot
+// when they're made, without waiting on the command thread, which makes the
+// GL names as slots are used. Ended queries have their results written to a
+// query buffer (with ARB_query_buffer_object) and are fenced in batches, and
+// once a batch's fence signals, its results are published to the slots for
+// any thread to read. Event queries are published when their fence signals.
+// Results are 64-bit, for timestamps.
+class QueryPool {
+public:
+    static const UINT sMaxQueries = 4096;
+
+private:
+    static const UINT sNameBlock = 64;
+
+    struct Result {
+        std::atomic<ULONG> mSerial;
+        std::atomic<UINT64> mValue;
+    };
+    struct Pending {
+        UINT mSlot;
+        ULONG mSerial;
+        GLenum mTarget; // GL_NONE for events, GL_TIMESTAMP for counters
+    };
+    struct Batch {
+        GLsync mFence;
+        std::vector<Pending> mQueries;
+    };
+
+    std::unique_ptr<Result[]> mResults;
+
+    // Protected by the queue lock.
+    std::vector<UINT> mFreeSlots;
+    UINT mNumSlots;
+    ULONG mNextSerial;
+
+    std::atomic<bool> mCollectQueued;
+
+    // Only touched by the command thread.
+    std::vector<GLuint> mNames;
+    std::vector<ULONG> mIssued;
+    GLuint mResultBuffer;
+    std::vector<Pending> mUnfenced;
+    std::deque<Batch> mBatches;
+    std::vector<GLuint64> mScratch;
+
+    GLuint getNameGL(UINT slot);
+    void resultGL(UINT slot, GLenum target, ULONG serial);
+    void fenceGL();
+    void publishGL(const Batch &batch);
+
+    QueryPool(const QueryPool&) = delete;
+    QueryPool& operator=(const QueryPool&) = delete;
+
+public:
+    QueryPool();
+
+    // Caller is responsible for holding the queue lock.
+    bool alloc(UINT &slot);
+    void free(UINT slot);
+    // Gets a serial for a query's next result.
+    ULONG next();
+
+    // Gets a slot's result if it's the one for serial.
+    bool getResult(UINT slot, ULONG serial, UINT64 &value) const;
+    // Returns true if a collect isn't queued yet, and marks one as queued.
+    bool queueCollect() { return !mCollectQueued.exchange(true); }
+
+    void initGL();
+    void deinitGL();
+    void beginGL(UINT slot, GLenum target);
+    void endGL(UINT slot, GLenum target, ULONG serial);
+    // Records the GPU time (in nanoseconds) once it gets through the commands
+    // sent before this.
+    void counterGL(UINT slot, ULONG serial);
+    void eventGL(UINT slot, ULONG serial);
+    // Fences what's been ended since the last collect, and publishes the
+    // results of batches whose fence has signaled.
+    void collectGL();
+};
+
+#endif /* QUERYPOOL_HPP */
@@ -0,0 +1,62 @@
+#ifndef READBACKRING_HPP
+#define READBACKRING_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <array>
+#include <memory>
+
+#include "glew.h"
+
+
+// A few pixel pack buffers for reading back render targets, so glReadPixels
+// doesn't drain the pipeline when it's issued. Each readback is fenced and
+// given a serial, and the data is only copied out to system memory when it's
+// resolved, which happens when the destination is locked or the buffer is
+// needed for another readback.
+class ReadbackRing {
+    static const UINT sNumBuffers = 4;
+
+    struct Slot {
+        GLuint mBufferId;
+        UINT mSize;
+        GLsync mFence;
+
+        // The pending readback, if mSerial is non-0.
+        ULONG mSerial;
+        std::shared_ptr<GLubyte> mDest;
+        UINT mPitch;
+        UINT mRows;
+        bool mFlip;
+    };
+
+    // Only touched by the command thread.
+    std::array<Slot,sNumBuffers> mSlots;
+
+    // Protected by the queue lock.
+    ULONG mNextSerial;
+
+    Slot &getSlot(ULONG serial) { return mSlots[serial % sNumBuffers]; }
+    void finishGL(Slot &slot);
+
+public:
+    ReadbackRing();
+
+    // Gets a serial for a new readback. Caller is responsible for holding the
+    // queue lock.
+    ULONG next();
+
+    // Binds a pack buffer for rows of pitch bytes to be read into, which get
+    // copied to dest in reverse order if flip is set. endGL fences it once
+    // the reads are sent.
+    void beginGL(ULONG serial, const std::shared_ptr<GLubyte> &dest, UINT pitch, UINT rows, bool flip);
+    void endGL(ULONG serial);
+    // Copies a readback out to its destination, if it's still pending.
+    void resolveGL(ULONG serial);
+    // Drops a readback without copying it, if it's still pending.
+    void cancelGL(ULONG serial);
+    void deinitGL();
+};
+
+#endif /* READBACKRING_HPP */
@@ -0,0 +1,93 @@
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <vector>
+
+#include "glew.h"
+
+
+class CommandQueue;
+
+// VRAM budget in MB for managed resources, or 0 to pick one from what the
+// driver reports.
+extern UINT VRAMBudget;
+
+// A D3DPOOL_MANAGED resource whose GL storage can be dropped, and rebuilt
+// from its system memory copy when it's needed again.
+class ManagedResource {
+    UINT64 mSize;
+    DWORD mPriority;
+    DWORD mLastUsed;
+    UINT mBindCount;
+    bool mResident;
+
+    friend class ResidencyManager;
+
+protected:
+    ManagedResource() : mSize(0), mPriority(0), mLastUsed(0), mBindCount(0), mResident(true) { }
+    virtual ~ManagedResource() { }
+
+    // Called with the queue lock held. evict() deletes the GL storage, and
+    // restore() recreates it and queues a full reupload.
+    virtual void evict() = 0;
+    virtual void restore() = 0;
+
+public:
+    bool isResident() const { return mResident; }
+};
+
+// Tracks the GL allocation size of managed resources, and keeps the resident
+// total under a budget by evicting the lowest priority, least recently used
+// ones at the end of each frame. Resources bound to the device or used during
+// the current frame are never evicted. Everything is protected by the queue
+// lock.
+class ResidencyManager {
+    static const UINT64 sDefaultMemory = UINT64(256)<<20;
+
+    CommandQueue &mQueue;
+
+    std::vector<ManagedResource*> mResources;
+    UINT64 mBudget;
+    UINT64 mResidentSize;
+    DWORD mFrame;
+
+    // Set by the command thread, while the app thread waits for it.
+    bool mHasMemInfo;
+    UINT64 mQueriedMem;
+
+    void doEvict(ManagedResource *res);
+
+public:
+    ResidencyManager(CommandQueue &queue);
+
+    // Picks the budget, unless VRAMBudget sets one. Caller is responsible
+    // for not holding the queue lock.
+    void init();
+
+    void queryDedicatedMemGL();
+    void queryFreeMemGL();
+
+    void add(ManagedResource *res, UINT64 size);
+    void remove(ManagedResource *res);
+
+    // Restores res if it was evicted, and marks it used this frame.
+    void use(ManagedResource *res);
+    void bind(ManagedResource *res) { ++res->mBindCount; use(res); }
+    void unbind(ManagedResource *res) { --res->mBindCount; res->mLastUsed = mFrame; }
+    DWORD setPriority(ManagedResource *res, DWORD priority);
+    DWORD getPriority(const ManagedResource *res) const { return res->mPriority; }
+
+    // Evicts what's needed to get under budget, and starts a new frame.
+    void endFrame();
+    // Evicts everything that isn't bound.
+    void evictAll();
+
+    // Gets an estimate of how much more texture memory is available, in
+    // bytes. Caller is responsible for not holding the queue lock.
+    UINT64 getAvailableMem();
+};
+
+#endif /* RESIDENCY_HPP */
@@ -0,0 +1,61 @@
+#ifndef SAMPLERCACHE_HPP
+#define SAMPLERCACHE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "glew.h"
+
+
+// The GL parameters of a sampler, as made from a stage's D3D sampler states.
+// All fields are 32-bit, so there's no padding to compare or hash.
+struct GLSamplerDesc {
+    GLenum mWrapS;
+    GLenum mWrapT;
+    GLenum mWrapR;
+    GLenum mMinFilter;
+    GLenum mMagFilter;
+    GLuint mMaxAnisotropy;
+    GLfloat mLodBias;
+    GLfloat mMinLod;
+    GLfloat mBorderColor[4];
+    GLenum mCompareMode;
+    GLenum mSRGBDecode;
+
+    bool operator==(const GLSamplerDesc &rhs) const;
+    bool operator!=(const GLSamplerDesc &rhs) const { return !(*this == rhs); }
+};
+
+// Sampler objects for the sampler setups stages have used. Samplers are never
+// changed after they're made, so a stage's sampler state changing is a lookup
+// and a glBindSampler, and stages with the same setup share one sampler. Only
+// touched by the command thread.
+class SamplerCache {
+    static const size_t sMaxSamplers = 1024;
+
+    struct Hasher {
+        size_t operator()(const GLSamplerDesc &desc) const;
+    };
+
+    std::unordered_map<GLSamplerDesc,GLuint,Hasher> mSamplers;
+    // What each unit was last bound with, to rebind after a purge.
+    std::vector<GLSamplerDesc> mBound;
+
+    GLuint createGL(const GLSamplerDesc &desc);
+    void purgeGL();
+
+    SamplerCache(const SamplerCache&) = delete;
+    SamplerCache& operator=(const SamplerCache&) = delete;
+
+public:
+    SamplerCache() { }
+
+    void deinitGL();
+
+    void bindGL(GLuint unit, const GLSamplerDesc &desc);
+};
+
+#endif /* SAMPLERCACHE_HPP */
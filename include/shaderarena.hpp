@@ -0,0 +1,42 @@
+#ifndef SHADERARENA_HPP
+#define SHADERARENA_HPP
+
+#include <cstddef>
+#include <vector>
+
+
+// A bump allocator for MojoShader, so a parse doesn't make lots of small heap
+// allocations that are all freed again right after. Frees are ignored, and
+// the memory is only given back by reset(). Each thread has its own.
+class ShaderArena {
+    static const size_t sBlockSize = 256<<10;
+    // Allocations bigger than this get their own block.
+    static const size_t sMaxBlockAlloc = sBlockSize / 4;
+
+    std::vector<char*> mBlocks;
+    std::vector<char*> mLargeBlocks;
+    size_t mCurrent;
+    size_t mUsed;
+
+    ShaderArena(const ShaderArena&) = delete;
+    ShaderArena& operator=(const ShaderArena&) = delete;
+
+public:
+    ShaderArena();
+    ~ShaderArena();
+
+    // The calling thread's arena.
+    static ShaderArena &get();
+
+    void *alloc(size_t len);
+    // Releases everything allocated since the last reset, keeping the blocks
+    // for the next parse.
+    void reset();
+
+    // For passing to MOJOSHADER_parse, with the arena as the data.
+    static void *allocate(int bytes, void *arena)
+    { return static_cast<ShaderArena*>(arena)->alloc(bytes); }
+    static void deallocate(void*, void*) { }
+};
+
+#endif /* SHADERARENA_HPP */
@@ -0,0 +1,69 @@
+#ifndef SHADERCACHE_HPP
+#define SHADERCACHE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "glew.h"
+
+
+// File to keep compiled shader programs in, "0" to disable the cache, or
+// null to use one in the user's local app data.
+extern const char *ShaderCacheFile;
+
+
+// What a program needs set up after it's created, which would otherwise
+// take parsing the shader again to find.
+struct ShaderVariable {
+    UINT mUsage;
+    UINT mIndex;
+    std::string mName;
+};
+struct ShaderReflection {
+    std::vector<ShaderVariable> mAttributes;
+    std::vector<ShaderVariable> mSamplers;
+};
+
+// What a program was built for, besides the bytecode. Only made of 32-bit
+// fields, so it can be compared and hashed as bytes.
+struct ShaderVariant {
+    UINT mShadowSamplers;
+    // Non-zero when the bool and integer constants below are folded into the
+    // program, instead of being read from uniforms.
+    UINT mFolded;
+    UINT mBools;
+    INT mInts[16][4];
+
+    bool operator<(const ShaderVariant &rhs) const
+    { return memcmp(this, &rhs, sizeof(*this)) < 0; }
+    bool operator==(const ShaderVariant &rhs) const
+    { return memcmp(this, &rhs, sizeof(*this)) == 0; }
+};
+
+// Keeps program binaries of translated shaders on disk, keyed by the D3D
+// bytecode, the variant (shadow samplers and folded constants), and the GL driver,
+// so later runs can skip translating and compiling them. Records are
+// appended to the file as programs get compiled, so they're kept even if
+// the process doesn't exit cleanly. Only to be used from threads with a GL
+// context current.
+class ShaderCache {
+public:
+    // Like glCreateShaderProgramv, but hints that the binary will be
+    // retrieved. prelink is given the program before it's linked, to set what
+    // has to be set then.
+    static GLuint createProgramGL(GLenum type, const char *source,
+                                  const std::function<void(GLuint)> &prelink=nullptr);
+
+    // Creates a program from the cache, or returns 0 if there isn't one.
+    static GLuint loadProgramGL(GLenum type, const std::vector<DWORD> &code, const ShaderVariant &variant,
+                                ShaderReflection &refl);
+    static void storeProgramGL(GLenum type, const std::vector<DWORD> &code, const ShaderVariant &variant,
+                               GLuint program, const ShaderReflection &refl);
+};
+
+#endif /* SHADERCACHE_HPP */
@@ -0,0 +1,138 @@
+#ifndef SHADERCODEMAP_HPP
+#define SHADERCODEMAP_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <array>
+#include <algorithm>
+#include <cstring>
+
+#include "shadercache.hpp"
+
+
+class D3DGLDevice;
+
+typedef std::array<std::array<INT,4>,16> ShaderConstantsI;
+
+// What parsing the bytecode found, for setting up new shader code.
+struct ShaderCodeInfo {
+    UINT mSamplerMask; // Bitmask of used samplers
+    // Range of float constant registers the shader reads, empty if none.
+    UINT mConstFStart;
+    UINT mConstFEnd;
+    // Bitmasks of the integer and bool constant registers the shader reads.
+    UINT mConstIMask;
+    UINT mConstBMask;
+    ShaderReflection mReflection;
+    // The GLSL output, without shadow samplers or folded constants.
+    std::string mSource;
+};
+
+// Shaders get a program built for each set of bool and integer constants
+// they're drawn with, so branches and loops on them are resolved when
+// compiling. Past this many sets, new ones use a program that reads them
+// from uniforms instead.
+const UINT MaxShaderSpecializations = 8;
+
+// Makes the variant for the shadow samplers and constants, keeping only the
+// constant registers in the masks so changing other ones doesn't need a new
+// program. Without any, it's the variant reading them from uniforms.
+inline ShaderVariant makeShaderVariant(UINT shadowsamplers, UINT intmask, const ShaderConstantsI &ints,
+                                       UINT boolmask, UINT bools)
+{
+    ShaderVariant variant;
+    memset(&variant, 0, sizeof(variant));
+    variant.mShadowSamplers = shadowsamplers;
+    if(intmask || boolmask)
+    {
+        variant.mFolded = 1;
+        variant.mBools = bools & boolmask;
+        for(UINT i = 0;i < ints.size();++i)
+        {
+            if((intmask&(1<<i)))
+                std::copy(ints[i].begin(), ints[i].end(), variant.mInts[i]);
+        }
+    }
+    return variant;
+}
+
+// Shared shader code by bytecode, so shader objects created from the same
+// bytecode use one set of GL programs. T is constructed from the device, the
+// bytecode, and its ShaderCodeInfo, and has an mRefCount that's only touched
+// with the map's lock held.
+template<typename T>
+class ShaderCodeMap {
+    SRWLOCK mLock;
+    std::unordered_multimap<UINT64,T*> mCodes;
+
+    static UINT64 hash(const std::vector<DWORD> &code)
+    {
+        UINT64 hash = 0xcbf29ce484222325ull;
+        for(DWORD token : code)
+        {
+            hash ^= token;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    ShaderCodeMap(const ShaderCodeMap&) = delete;
+    ShaderCodeMap& operator=(const ShaderCodeMap&) = delete;
+
+public:
+    ShaderCodeMap() { InitializeSRWLock(&mLock); }
+
+    // Gets the code for the bytecode, with a reference added, creating it if
+    // there isn't one.
+    T *get(D3DGLDevice *parent, std::vector<DWORD>&& code, ShaderCodeInfo&& info)
+    {
+        UINT64 key = hash(code);
+
+        AcquireSRWLockExclusive(&mLock);
+        auto range = mCodes.equal_range(key);
+        for(auto iter = range.first;iter != range.second;++iter)
+        {
+            T *match = iter->second;
+            if(match->getCode() == code)
+            {
+                ++match->mRefCount;
+                ReleaseSRWLockExclusive(&mLock);
+                return match;
+            }
+        }
+
+        T *ret = new T(parent, std::move(code), std::move(info));
+        ret->mRefCount = 1;
+        mCodes.insert(std::make_pair(key, ret));
+        ReleaseSRWLockExclusive(&mLock);
+        return ret;
+    }
+
+    void release(T *code)
+    {
+        AcquireSRWLockExclusive(&mLock);
+        if(--code->mRefCount > 0)
+        {
+            ReleaseSRWLockExclusive(&mLock);
+            return;
+        }
+        auto range = mCodes.equal_range(hash(code->getCode()));
+        for(auto iter = range.first;iter != range.second;++iter)
+        {
+            if(iter->second == code)
+            {
+                mCodes.erase(iter);
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&mLock);
+
+        delete code;
+    }
+};
+
+#endif /* SHADERCODEMAP_HPP */
@@ -0,0 +1,77 @@
+#ifndef SHADERCOMPILER_HPP
+#define SHADERCOMPILER_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+
+
+// Number of threads for building shaders, or 0 to build them on the command
+// thread.
+extern UINT ShaderCompileThreads;
+// Skip draws whose shaders are still being built, instead of waiting for
+// them.
+extern bool SkipPendingShaders;
+
+
+// Threads with their own GL contexts, sharing objects with the device's, for
+// translating and linking shaders while the command thread keeps rendering.
+// Jobs run in the order they're queued, but may finish out of order when
+// there's more than one thread.
+class ShaderCompiler {
+    static const UINT sMaxThreads = 4;
+
+    struct Job {
+        std::function<void()> mFunc;
+        std::atomic<ULONG> *mPending;
+    };
+
+    struct Thread {
+        ShaderCompiler *mSelf;
+        HANDLE mHandle;
+        HGLRC mContext;
+    };
+
+    HDC mDeviceCtx;
+    std::vector<Thread> mThreads;
+    UINT mStarted;
+    UINT mFailed;
+
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mWakeCond;
+    CONDITION_VARIABLE mDoneCond;
+    std::deque<Job> mJobs;
+    bool mQuit;
+
+    void workerLoop(Thread &thread);
+    static DWORD CALLBACK thread_func(void *arg);
+
+    ShaderCompiler(const ShaderCompiler&) = delete;
+    ShaderCompiler& operator=(const ShaderCompiler&) = delete;
+
+public:
+    ShaderCompiler();
+    ~ShaderCompiler();
+
+    // Creates contexts sharing with glcontext, which must not be current on
+    // any thread yet. Returns false if no threads could be started, in which
+    // case shaders should be built on the command thread.
+    bool init(HDC dc, HGLRC glcontext, const int *attribs);
+    // Finishes the queued jobs and stops the threads.
+    void deinit();
+
+    bool isActive() const { return !mThreads.empty(); }
+
+    // Runs job on one of the threads, then decrements pending once its GL work
+    // has finished, so the objects it made can be used right away on other
+    // contexts.
+    void queue(std::function<void()>&& job, std::atomic<ULONG> &pending);
+    // Waits for pending to reach 0.
+    void wait(const std::atomic<ULONG> &pending);
+};
+
+#endif /* SHADERCOMPILER_HPP */
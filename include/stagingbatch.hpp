@@ -0,0 +1,61 @@
+#ifndef STAGINGBATCH_HPP
+#define STAGINGBATCH_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <vector>
+
+#include "glew.h"
+
+
+class UploadRing;
+class WorkerPool;
+struct PixelConverter;
+
+// Copies and conversions for a group of texture updates, staged into one
+// upload ring allocation. They're split into parts that run across the
+// worker pool, so all that's left for the command thread are the GL calls
+// sent after stage(). Caller is responsible for holding the queue lock.
+class StagingBatch {
+    // Keeps within an upload ring region, so batches don't grow the ring.
+    static const UINT sMaxSize = 1<<20;
+    static const UINT sPartSize = 64<<10;
+    // Below this, waking the workers costs more than it saves.
+    static const UINT sMinParallelSize = 256<<10;
+
+    struct Part {
+        UINT mOffset;
+        const GLubyte *mSrc;
+        // Null for a plain copy of mWidth bytes.
+        const PixelConverter *mConverter;
+        UINT mDstPitch, mSrcPitch;
+        UINT mWidth, mHeight;
+    };
+
+    UploadRing &mRing;
+    WorkerPool &mPool;
+    std::vector<Part> mParts;
+    UINT mSize;
+
+public:
+    StagingBatch(UploadRing &ring, WorkerPool &pool) : mRing(ring), mPool(pool), mSize(0) { }
+
+    bool empty() const { return mSize == 0; }
+    // Checks if len more bytes fit in the batch. An empty batch takes
+    // anything the ring can stage.
+    bool fits(UINT len) const { return empty() || mSize + ((len+15)&~15) <= sMaxSize; }
+
+    // Makes room for len bytes, and returns their offset from the start of
+    // the batch.
+    UINT add(UINT len);
+    void copy(UINT offset, const GLubyte *src, UINT len);
+    void convert(UINT offset, const PixelConverter &conv, UINT dstpitch, UINT dstslice, const GLubyte *src,
+                 UINT srcpitch, UINT srcslice, UINT width, UINT height, UINT depth);
+
+    // Reserves the ring space, fills it, and returns the ring offset the
+    // batch starts at. The batch is empty again afterward.
+    UINT stage();
+};
+
+#endif /* STAGINGBATCH_HPP */
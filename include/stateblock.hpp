@@ -0,0 +1,175 @@
+#ifndef STATEBLOCK_HPP
+#define STATEBLOCK_HPP
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <d3d9.h>
+
+
+class D3DGLDevice;
+
+// The states a state block holds are kept as packed lists of what was
+// recorded or captured, so applying one only walks the states it has. The
+// render, sampler, and texture stage states go to the device in one go, and
+// the rest through the device's Set* methods. Sampler and texture stages are
+// the device's internal indices, with the vertex samplers following the
+// fragment samplers.
+class D3DGLStateBlock : public IDirect3DStateBlock9 {
+public:
+    struct RenderState {
+        D3DRENDERSTATETYPE mState;
+        DWORD mValue;
+    };
+    struct SamplerState {
+        DWORD mSampler;
+        D3DSAMPLERSTATETYPE mType;
+        DWORD mValue;
+    };
+    struct TexStageState {
+        DWORD mStage;
+        D3DTEXTURESTAGESTATETYPE mType;
+        DWORD mValue;
+    };
+
+private:
+    struct Texture {
+        DWORD mStage;
+        IDirect3DBaseTexture9 *mTexture;
+    };
+    struct StreamSource {
+        UINT mIndex;
+        IDirect3DVertexBuffer9 *mBuffer;
+        UINT mOffset;
+        UINT mStride;
+    };
+    struct StreamFreq {
+        UINT mIndex;
+        UINT mDivisor;
+    };
+    struct ClipPlane {
+        DWORD mIndex;
+        std::array<float,4> mPlane;
+    };
+    struct Transform {
+        D3DTRANSFORMSTATETYPE mState;
+        D3DMATRIX mMatrix;
+    };
+    // A recorded light may have just its parameters or its enable.
+    struct Light {
+        DWORD mIndex;
+        bool mHasLight;
+        D3DLIGHT9 mLight;
+        bool mHasEnable;
+        WINBOOL mEnable;
+    };
+
+    // Runs of constant registers, with N values each, stored back to back.
+    template<typename T, size_t N>
+    struct Constants {
+        struct Range {
+            UINT mStart;
+            UINT mCount;
+        };
+        std::vector<Range> mRanges;
+        std::vector<T> mValues;
+
+        // Includes registers [0, count).
+        void setAll(UINT count);
+        void set(UINT start, const T *values, UINT count);
+        template<typename F>
+        void capture(D3DGLDevice *device, F get);
+        template<typename F>
+        void apply(D3DGLDevice *device, F set) const;
+    };
+
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    std::vector<RenderState> mRenderStates;
+    std::vector<SamplerState> mSamplerStates;
+    std::vector<TexStageState> mTexStageStates;
+    std::vector<Texture> mTextures;
+    std::vector<StreamSource> mStreams;
+    std::vector<StreamFreq> mStreamFreqs;
+    std::vector<ClipPlane> mClipPlanes;
+    std::vector<Transform> mTransforms;
+    std::vector<Light> mLights;
+
+    bool mHasIndices;
+    IDirect3DIndexBuffer9 *mIndices;
+    bool mHasVertexDecl;
+    IDirect3DVertexDeclaration9 *mVertexDecl;
+    bool mHasVertexShader;
+    IDirect3DVertexShader9 *mVertexShader;
+    bool mHasPixelShader;
+    IDirect3DPixelShader9 *mPixelShader;
+    bool mHasViewport;
+    D3DVIEWPORT9 mViewport;
+    bool mHasScissorRect;
+    RECT mScissorRect;
+    bool mHasMaterial;
+    D3DMATERIAL9 mMaterial;
+
+    Constants<float,4> mVSConstantsF;
+    Constants<int,4> mVSConstantsI;
+    Constants<WINBOOL,1> mVSConstantsB;
+    Constants<float,4> mPSConstantsF;
+    Constants<int,4> mPSConstantsI;
+    Constants<WINBOOL,1> mPSConstantsB;
+
+public:
+    D3DGLStateBlock(D3DGLDevice *parent);
+    virtual ~D3DGLStateBlock();
+
+    // Sets up the states for the block type, then captures them.
+    HRESULT init(D3DSTATEBLOCKTYPE type);
+
+    const std::vector<RenderState> &getRenderStates() const { return mRenderStates; }
+    const std::vector<SamplerState> &getSamplerStates() const { return mSamplerStates; }
+    const std::vector<TexStageState> &getTexStageStates() const { return mTexStageStates; }
+    std::vector<RenderState> &getRenderStates() { return mRenderStates; }
+    std::vector<SamplerState> &getSamplerStates() { return mSamplerStates; }
+    std::vector<TexStageState> &getTexStageStates() { return mTexStageStates; }
+
+    // For the device's Set* methods between BeginStateBlock and
+    // EndStateBlock, with already checked parameters.
+    void recordRenderState(D3DRENDERSTATETYPE state, DWORD value);
+    void recordSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type, DWORD value);
+    void recordTexStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE type, DWORD value);
+    void recordTexture(DWORD stage, IDirect3DBaseTexture9 *texture);
+    void recordStreamSource(UINT index, IDirect3DVertexBuffer9 *buffer, UINT offset, UINT stride);
+    void recordStreamFreq(UINT index, UINT divisor);
+    void recordIndices(IDirect3DIndexBuffer9 *indices);
+    void recordVertexDecl(IDirect3DVertexDeclaration9 *decl);
+    void recordVertexShader(IDirect3DVertexShader9 *shader);
+    void recordPixelShader(IDirect3DPixelShader9 *shader);
+    void recordViewport(const D3DVIEWPORT9 &viewport);
+    void recordScissorRect(const RECT &rect);
+    void recordMaterial(const D3DMATERIAL9 &material);
+    void recordClipPlane(DWORD index, const float *plane);
+    void recordTransform(D3DTRANSFORMSTATETYPE state, const D3DMATRIX &matrix);
+    void recordLight(DWORD index, const D3DLIGHT9 &light);
+    void recordLightEnable(DWORD index, WINBOOL enable);
+    // The transform recorded so far, for MultiplyTransform, or null if there
+    // isn't one.
+    const D3DMATRIX *findTransform(D3DTRANSFORMSTATETYPE state) const;
+    void recordVSConstantsF(UINT start, const float *values, UINT count);
+    void recordVSConstantsI(UINT start, const int *values, UINT count);
+    void recordVSConstantsB(UINT start, const WINBOOL *values, UINT count);
+    void recordPSConstantsF(UINT start, const float *values, UINT count);
+    void recordPSConstantsI(UINT start, const int *values, UINT count);
+    void recordPSConstantsB(UINT start, const WINBOOL *values, UINT count);
+
+    /*** IUnknown methods ***/
+    virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
+    virtual ULONG WINAPI AddRef() final;
+    virtual ULONG WINAPI Release() final;
+    /*** IDirect3DStateBlock9 methods ***/
+    virtual HRESULT WINAPI GetDevice(IDirect3DDevice9 **device) final;
+    virtual HRESULT WINAPI Capture() final;
+    virtual HRESULT WINAPI Apply() final;
+};
+
+#endif /* STATEBLOCK_HPP */
@@ -3,8 +3,11 @@
 
 #include <atomic>
 #include <vector>
+#include <array>
 #include <d3d9.h>
 
+#include "glew.h"
+
 
 class D3DGLDevice;
 class D3DGLRenderTarget;
@@ -23,6 +26,11 @@ class D3DGLSwapChain : public IDirect3DSwapChain9 {
 
     std::atomic<ULONG> mPendingSwaps;
 
+    // Fences placed after each of the last few swaps, indexed by swap count.
+    // Only touched by the command thread.
+    std::array<GLsync,3> mSwapFences;
+    ULONG mSwapCount;
+
     void addIface();
     void releaseIface();
 
@@ -30,7 +38,8 @@ public:
     D3DGLSwapChain(D3DGLDevice *parent);
     virtual ~D3DGLSwapChain();
 
-    void swapBuffersGL(size_t backbuffer);
+    void swapBuffersGL(size_t backbuffer, UINT maxlatency);
+    void deinitGL();
 
     bool init(const D3DPRESENT_PARAMETERS *params, HWND window, bool isauto=false);
 
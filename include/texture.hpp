@@ -7,13 +7,15 @@
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "dirtyrects.hpp"
+#include "residency.hpp"
 
 
 struct GLFormatInfo;
 class D3DGLDevice;
 class D3DGLTextureSurface;
 
-class D3DGLTexture : public IDirect3DTexture9 {
+class D3DGLTexture : public IDirect3DTexture9, public ManagedResource {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
 
@@ -26,6 +28,12 @@ class D3DGLTexture : public IDirect3DTexture9 {
 
     RECT mDirtyRect;
     std::atomic<ULONG> mUpdateInProgress;
+    std::atomic<ULONG> mUpdateFence;
+
+    // Rects of each level written since the last upload, and whether any
+    // level has some. Protected by the device's queue lock.
+    std::vector<DirtyRects> mPendingRects;
+    bool mHasPendingRects;
 
     D3DSURFACE_DESC mDesc;
     std::vector<D3DGLTextureSurface*> mSurfaces;
@@ -34,6 +42,16 @@ class D3DGLTexture : public IDirect3DTexture9 {
     void addIface();
     void releaseIface();
 
+    // Gets the offset of rect's data within the level, and how much an upload
+    // reads from there.
+    UINT calcUpdateRange(DWORD level, const RECT &rect, UINT &length) const;
+    // Caller is responsible for holding the device's queue lock.
+    void sendUpdate(DWORD level, const RECT &rect);
+
+    bool isManaged() const { return mDesc.Pool == D3DPOOL_MANAGED && mDesc.Format != D3DFMT_NULL; }
+    virtual void evict() final;
+    virtual void restore() final;
+
     friend class D3DGLTextureSurface;
 
 public:
@@ -41,16 +59,41 @@ public:
     virtual ~D3DGLTexture();
 
     bool init(const D3DSURFACE_DESC *desc, UINT levels);
-    void updateTexture(DWORD level, const RECT &rect, const GLubyte *dataPtr);
+    // Marks rect of the level as needing an upload from system memory, which
+    // is deferred until flushUpdates.
+    void queueUpdate(DWORD level, const RECT &rect);
+    // Sends uploads for everything queued. Caller is responsible for holding
+    // the device's queue lock.
+    void flushUpdates();
+    // Uploads the dirty region of src, a system memory texture of the same
+    // format, for UpdateTexture. Caller is responsible for holding the
+    // device's queue lock.
+    void updateFrom(D3DGLTexture *src);
+    // Uploads rect of the level from dataPtr, which has srcpitch bytes per row
+    // (block row, for compressed formats). Returns a fence to wait on before
+    // dataPtr can be written, or 0 if it was copied. Caller is responsible for
+    // holding the device's queue lock.
+    ULONG sendUpload(DWORD level, const RECT &rect, const GLubyte *dataPtr, UINT srcpitch);
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
+    // The system memory copy of a level, for non-default pool textures, and
+    // its pitch (of block rows, for compressed formats).
+    const GLubyte *getLevelData(DWORD level) const;
+    UINT getLevelPitch(DWORD level) const;
+    bool isCompressed() const { return mIsCompressed; }
+    void setUpdateFence(ULONG fence) { mUpdateFence = fence; }
 
     void initGL();
     void deinitGL();
+    // Creates the GL texture and its storage, and deletes it again.
+    void allocGL();
+    void evictGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr);
+    // Loads length bytes from dataPtr, or from that offset into pbo if it's
+    // non-0.
+    void loadTexLevelGL(DWORD level, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -104,6 +147,7 @@ public:
     D3DGLTexture *getParent() { return mParent; }
     const GLFormatInfo &getFormat() const { return mParent->getFormat(); }
     UINT getLevel() const { return mLevel; }
+    UINT getDataOffset() const { return mDataOffset; }
     UINT getDataLength() const { return mDataLength; }
 
     /*** IUnknown methods ***/
@@ -26,6 +26,7 @@ class D3DGLTexture3D : public IDirect3DVolumeTexture9 {
 
     D3DBOX mDirtyBox;
     std::atomic<ULONG> mUpdateInProgress;
+    std::atomic<ULONG> mUpdateFence;
 
     D3DVOLUME_DESC mDesc;
     std::vector<D3DGLTextureVolume*> mVolumes;
@@ -34,6 +35,10 @@ class D3DGLTexture3D : public IDirect3DVolumeTexture9 {
     void addIface();
     void releaseIface();
 
+    // Gets the offset of box's data within the level, and how much an upload
+    // reads from there.
+    UINT calcUpdateRange(DWORD level, const D3DBOX &box, UINT &length) const;
+
     friend class D3DGLTextureVolume;
 
 public:
@@ -50,7 +55,9 @@ public:
     void initGL();
     void deinitGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr);
+    // Loads length bytes from dataPtr, or from that offset into pbo if it's
+    // non-0.
+    void loadTexLevelGL(DWORD level, const D3DBOX &box, GLuint pbo, const GLubyte *dataPtr, UINT length);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -8,13 +8,16 @@
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "dirtyrects.hpp"
+#include "residency.hpp"
 
 
 struct GLFormatInfo;
 class D3DGLDevice;
 class D3DGLCubeSurface;
+class StagingBatch;
 
-class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
+class D3DGLCubeTexture : public IDirect3DCubeTexture9, public ManagedResource {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
 
@@ -27,6 +30,12 @@ class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
 
     std::array<RECT,6> mDirtyRect;
     std::atomic<ULONG> mUpdateInProgress;
+    std::atomic<ULONG> mUpdateFence;
+
+    // Rects of each level's faces written since the last upload, and whether
+    // any face has some. Protected by the device's queue lock.
+    std::vector<std::array<DirtyRects,6>> mPendingRects;
+    bool mHasPendingRects;
 
     D3DSURFACE_DESC mDesc;
     std::vector<std::array<D3DGLCubeSurface*,6>> mSurfaces;
@@ -35,6 +44,27 @@ class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
     void addIface();
     void releaseIface();
 
+    // Gets the offset of rect's data within the face's level, and how much an
+    // upload reads from there.
+    UINT calcUpdateRange(DWORD level, GLint facenum, const RECT &rect, UINT &length) const;
+    struct StagedUpload {
+        DWORD mLevel;
+        GLint mFaceNum;
+        RECT mRect;
+        UINT mOffset;
+        UINT mLength;
+    };
+    // Adds an update's data to batch, or sends it right away if it's too
+    // large to stage. sendStaged then sends the uploads batched so far.
+    // Caller is responsible for holding the device's queue lock.
+    void stageUpdate(StagingBatch &batch, std::vector<StagedUpload> &staged, DWORD level, GLint facenum,
+                     const RECT &rect);
+    void sendStaged(StagingBatch &batch, std::vector<StagedUpload> &staged);
+
+    bool isManaged() const { return mDesc.Pool == D3DPOOL_MANAGED && mDesc.Format != D3DFMT_NULL; }
+    virtual void evict() final;
+    virtual void restore() final;
+
     friend class D3DGLCubeSurface;
 
 public:
@@ -42,7 +72,12 @@ public:
     virtual ~D3DGLCubeTexture();
 
     bool init(const D3DSURFACE_DESC *desc, UINT levels);
-    void updateTexture(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr);
+    // Marks rect of the face's level as needing an upload from system memory,
+    // which is deferred until flushUpdates.
+    void queueUpdate(DWORD level, GLint facenum, const RECT &rect);
+    // Sends uploads for everything queued. Caller is responsible for holding
+    // the device's queue lock.
+    void flushUpdates();
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
@@ -50,8 +85,13 @@ public:
 
     void initGL();
     void deinitGL();
+    // Creates the GL texture and its storage, and deletes it again.
+    void allocGL();
+    void evictGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr);
+    // Loads length bytes from dataPtr, or from that offset into pbo if it's
+    // non-0.
+    void loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -107,6 +147,7 @@ public:
     const GLFormatInfo &getFormat() const { return mParent->getFormat(); }
     UINT getLevel() const { return mLevel; }
     GLenum getTarget() const;
+    UINT getDataOffset() const { return mDataOffset; }
     UINT getDataLength() const { return mDataLength; }
 
     /*** IUnknown methods ***/
@@ -0,0 +1,74 @@
+#ifndef TIMELINE_HPP
+#define TIMELINE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <typeinfo>
+
+
+class CommandQueue;
+class StartTimelineCmd;
+class WriteTimelineCmd;
+
+// Number of frames a timeline capture records, or 0 to disable captures. A
+// capture is started with Ctrl+F12, or at TimelineStartFrame if non-0.
+extern unsigned int TimelineFrames;
+extern unsigned int TimelineStartFrame;
+
+
+// Records begin/end events from the app and command threads into per-thread
+// buffers while a capture is running, then writes them out as a Chrome trace
+// (about:tracing) JSON file. Each thread only ever appends to its own buffer,
+// so recording needs no locks. The command thread starts and stops recording
+// when it reaches the start and end of the captured frames in the queue, so
+// its events are for the same frames as the app's.
+class Timeline {
+    static std::atomic<bool> sActive;
+    static std::atomic<bool> sActiveGL;
+
+    friend class StartTimelineCmd;
+    friend class WriteTimelineCmd;
+
+public:
+    static bool isActive() { return sActive.load(std::memory_order_relaxed); }
+    // For the command thread, and the shader threads it starts builds on.
+    static bool isActiveGL() { return sActiveGL.load(std::memory_order_relaxed); }
+
+    static LONGLONG now()
+    {
+        LARGE_INTEGER count;
+        QueryPerformanceCounter(&count);
+        return count.QuadPart;
+    }
+
+    static void addEvent(const char *name, LONGLONG start, LONGLONG end);
+    static void addEvent(const std::type_info &type, LONGLONG start, LONGLONG end);
+    static void setThreadName(const char *name);
+
+    // Called by Present for each frame sent to the queue. Starts and stops
+    // captures, sending markers for the command thread to do the same, and
+    // has the command thread write the trace out once all the captured
+    // frames' commands have executed.
+    static void endFrame(CommandQueue &queue);
+};
+
+class TimelineScope {
+    const char *mName;
+    LONGLONG mStart;
+
+public:
+    TimelineScope(const char *name, bool active)
+      : mName(name), mStart(active ? Timeline::now() : 0)
+    { }
+    ~TimelineScope()
+    {
+        if(mStart)
+            Timeline::addEvent(mName, mStart, Timeline::now());
+    }
+};
+#define TIMELINE_SCOPE(name) TimelineScope timeline_scope(name, Timeline::isActive())
+#define TIMELINE_SCOPE_GL(name) TimelineScope timeline_scope(name, Timeline::isActiveGL())
+
+#endif /* TIMELINE_HPP */
@@ -17,46 +17,96 @@ extern eLogLevel LogLevel;
 extern FILE *LogFile;
 extern eLogLevel GLDebugLevel;
 
+// The most verbose level compiled in. Messages above it aren't built at all,
+// arguments included, whatever LogLevel is set to at run time.
+#ifndef D3DGL_MAX_LOGLEVEL
+#define D3DGL_MAX_LOGLEVEL TRACE_
+#endif
+
+// How often checkGLError() asks the GL for errors. glGetError can make the
+// driver sync up with its own threads, so by default it's only done once a
+// frame, on top of the GL_KHR_debug callback when D3DGL_DEBUGGL is set.
+enum class GLErrorCheck {
+    Off,
+    Frame,    // Only before each swap
+    Sampled,  // Every GLErrorCheckInterval'th check, and before each swap
+    Always
+};
+extern GLErrorCheck GLErrorCheckMode;
+extern unsigned int GLErrorCheckInterval;
+
+inline bool sampleGLErrorCheck()
+{
+    static thread_local unsigned int count = 0;
+    if(++count < GLErrorCheckInterval)
+        return false;
+    count = 0;
+    return true;
+}
+
 void log_printf(FILE *file, const char *fmt, ...) __attribute__((format(printf,2,3)));
+// Writes the message out before returning, after what the thread logged
+// before it, so errors aren't lost if the process dies right after.
+void log_printf_sync(FILE *file, const char *fmt, ...) __attribute__((format(printf,2,3)));
 
 
 #define D3DGL_PRINT(TYPE, MSG, ...) \
     log_printf(LogFile, "%04lx:" TYPE ":d3dgl:%s " MSG, GetCurrentThreadId(), __PRETTY_FUNCTION__ , ## __VA_ARGS__)
+#define D3DGL_PRINT_SYNC(TYPE, MSG, ...) \
+    log_printf_sync(LogFile, "%04lx:" TYPE ":d3dgl:%s " MSG, GetCurrentThreadId(), __PRETTY_FUNCTION__ , ## __VA_ARGS__)
+
+#define D3DGL_LOG_ENABLED(LEVEL) \
+    (D3DGL_MAX_LOGLEVEL >= LEVEL && __builtin_expect(LogLevel >= LEVEL, 0))
 
 #define TRACE(...) do {                                                       \
-    if(LogLevel >= TRACE_)                                                    \
+    if(D3DGL_LOG_ENABLED(TRACE_))                                             \
         D3DGL_PRINT("trace", __VA_ARGS__);                                    \
 } while(0)
 
 #define WARN(...) do {                                                        \
-    if(LogLevel >= WARN_)                                                     \
+    if(D3DGL_LOG_ENABLED(WARN_))                                              \
         D3DGL_PRINT("warn", __VA_ARGS__);                                     \
 } while(0)
 
 #define FIXME(...) do {                                                       \
-    if(LogLevel >= FIXME_)                                                    \
-        D3DGL_PRINT("fixme", __VA_ARGS__);                                    \
+    if(D3DGL_LOG_ENABLED(FIXME_))                                             \
+        D3DGL_PRINT_SYNC("fixme", __VA_ARGS__);                                    \
 } while(0)
 
 #define ERR(...) do {                                                         \
-    if(LogLevel >= ERR_)                                                      \
-        D3DGL_PRINT("err", __VA_ARGS__);                                      \
+    if(D3DGL_LOG_ENABLED(ERR_))                                               \
+        D3DGL_PRINT_SYNC("err", __VA_ARGS__);                                      \
 } while(0)
 
 
-//#define checkGLError()
-#ifndef checkGLError
-#define checkGLError() do {          \
+#define reportGLErrors(WHERE) do {   \
     GLenum err = glGetError();       \
     if(err != GL_NO_ERROR)           \
     {                                \
-        ERR("<<<<<<<<< GL error detected @ %s:%u: 0x%04x\n", __FILE__, __LINE__, err);\
+        ERR("<<<<<<<<< GL error detected @ %s: 0x%04x\n", WHERE, err);\
         while((err=glGetError()) != GL_NO_ERROR) \
            ERR("<<<<<<< GL error detected: 0x%04x\n", err);\
     }                                \
 } while(0)
+
+#define D3DGL_STRINGIFY2(x) #x
+#define D3DGL_STRINGIFY(x) D3DGL_STRINGIFY2(x)
+
+//#define checkGLError()
+#ifndef checkGLError
+#define checkGLError() do {                                                   \
+    if(GLErrorCheckMode == GLErrorCheck::Always ||                            \
+       (GLErrorCheckMode == GLErrorCheck::Sampled && sampleGLErrorCheck()))   \
+        reportGLErrors(__FILE__ ":" D3DGL_STRINGIFY(__LINE__));               \
+} while(0)
 #endif
 
+// Catches what the less frequent modes missed over the frame.
+#define checkGLFrameErrors() do {                                             \
+    if(GLErrorCheckMode != GLErrorCheck::Off)                                 \
+        reportGLErrors("end of frame");                                       \
+} while(0)
+
 
 class debugstr_guid {
     char mStr[64];
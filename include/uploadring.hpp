@@ -0,0 +1,86 @@
+#ifndef UPLOADRING_HPP
+#define UPLOADRING_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <array>
+
+#include "glew.h"
+
+
+class CommandQueue;
+class VertexArrayCache;
+
+// An append-only GL buffer for data only used by the command sent with it,
+// like the user pointers given to DrawPrimitiveUP or staged texture updates.
+// The buffer is split into regions. The command thread fences each region as
+// allocations move past it, and clears the region's busy flag once the fence
+// has passed, so a region is only written again after the GPU is done with
+// it. With GL_ARB_buffer_storage the data is written directly through a
+// persistent mapping, otherwise the command thread copies it in. The ring
+// grows for allocations larger than a region.
+class UploadRing {
+    static const UINT sNumRegions = 4;
+    static const UINT sInitialSize = 4<<20;
+
+    CommandQueue &mQueue;
+    VertexArrayCache &mVertexArrays;
+    const UINT mInitialSize;
+
+    // Set by the command thread, while the app thread waits for it.
+    GLuint mBufferId;
+    GLubyte *mData;
+    UINT mSize;
+
+    // Protected by the queue lock.
+    bool mMapped;
+    UINT mHead;
+    UINT mRegion;
+    ULONG mRegionSerial;
+    std::array<std::atomic<bool>,sNumRegions> mRegionBusy;
+
+    // Only touched by the command thread.
+    std::array<GLsync,sNumRegions> mFences;
+
+    UINT getRegionSize() const { return mSize / sNumRegions; }
+    void resetRegions();
+
+public:
+    UploadRing(CommandQueue &queue, VertexArrayCache &vertexarrays, UINT size=sInitialSize);
+    ~UploadRing();
+
+    bool init();
+    void deinit();
+
+    void initGL(UINT size, bool mapped);
+    void deinitGL();
+    void retireRegionGL(UINT region);
+    void waitRegionGL(UINT region);
+
+    GLuint getBufferId() const { return mBufferId; }
+    // Changes whenever reserve() leaves a region or grows the ring, after
+    // which nothing reserved before can be used by new commands. Caller is
+    // responsible for holding the queue lock.
+    ULONG getRegionSerial() const { return mRegionSerial; }
+
+    // Reserves len bytes and returns the offset, aligned to align (a power of
+    // two), for filling with copy(). The space is only valid for the commands
+    // sent before the next reserve() that changes the region serial, so
+    // everything a draw needs has to be reserved at once. Caller is
+    // responsible for holding the queue lock.
+    UINT reserve(UINT len, UINT align=16);
+    void copy(UINT offset, const void *data, UINT len);
+    // For filling reserved space in place instead of copying to it. The
+    // pointer map() gives must be filled and passed to commit().
+    GLubyte *map(UINT offset, UINT len);
+    void commit(UINT offset, UINT len, GLubyte *ptr);
+
+    // Checks if len bytes of pixel data can be staged in the ring, to be
+    // unpacked from it as a PBO. Updates larger than a region aren't worth
+    // growing the ring for, and recorded streams need the pixel data itself.
+    bool canStage(UINT len) const;
+};
+
+#endif /* UPLOADRING_HPP */
@@ -0,0 +1,99 @@
+#ifndef VERTEXARRAYCACHE_HPP
+#define VERTEXARRAYCACHE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "glew.h"
+
+
+// An attribute's format, read from mOffset bytes into each vertex of the
+// stream at mBinding.
+struct GLVertexFormat {
+    GLint mTarget;
+    GLuint mBinding;
+    GLenum mGLType;
+    GLint mGLCount;
+    GLenum mNormalize;
+    GLuint mOffset;
+};
+
+// Where a stream's vertices come from.
+struct GLVertexBinding {
+    GLuint mBufferId;
+    GLuint mOffset;
+    GLsizei mStride;
+    GLuint mDivisor;
+};
+
+// Vertex array objects for the attribute setups draws have used. A draw with
+// the same setup as the last one needs no GL calls, and one seen before only
+// needs the array bound.
+// With ARB_vertex_attrib_binding, arrays are keyed by the attribute formats
+// alone, which come from the vertex declaration and the vertex shader's
+// attribute locations, and the stream bindings are updated on whichever array
+// gets bound, for just the streams that changed. Otherwise the formats and
+// bindings are specified together, so both make up the key, and streams from
+// the upload ring, which land at a new offset each time, get set on a scratch
+// array instead of being cached.
+// The element array binding is part of the array too, so it's tracked here
+// and rebound on arrays that have an old one. Only touched by the command
+// thread.
+class VertexArrayCache {
+    static const size_t sMaxArrays = 256;
+
+    struct Entry {
+        GLuint mArray;
+        GLuint mElements;
+        UINT mAttribs;
+        std::vector<GLVertexFormat> mFormats;
+        std::vector<GLVertexBinding> mBindings;
+        ULONG mLastUse;
+    };
+
+    bool mSeparateFormat;
+
+    std::unordered_multimap<UINT64,Entry> mArrays;
+    Entry *mCurrent;
+    Entry mScratch;
+    GLuint mElements;
+    ULONG mClock;
+
+    UINT64 hash(UINT attribs, const GLVertexFormat *formats, UINT count,
+                const GLVertexBinding *bindings, UINT numbindings) const;
+    bool matches(const Entry &entry, UINT attribs, const GLVertexFormat *formats, UINT count,
+                 const GLVertexBinding *bindings, UINT numbindings) const;
+
+    void setupGL(Entry &entry, UINT attribs, const GLVertexFormat *formats, UINT count,
+                 const GLVertexBinding *bindings, UINT numbindings);
+    void setBindingsGL(Entry &entry, const GLVertexBinding *bindings, UINT numbindings);
+    void bindEntryGL(Entry &entry);
+    void evictGL();
+
+    VertexArrayCache(const VertexArrayCache&) = delete;
+    VertexArrayCache& operator=(const VertexArrayCache&) = delete;
+
+public:
+    VertexArrayCache();
+
+    void initGL();
+    void deinitGL();
+
+    // Binds an array with the attributes in the attribs mask enabled, and set
+    // up from formats reading from bindings. Streams from scratchbuffer aren't
+    // cached.
+    void bindGL(UINT attribs, const GLVertexFormat *formats, UINT count,
+                const GLVertexBinding *bindings, UINT numbindings, GLuint scratchbuffer);
+
+    void setElementsGL(GLuint buffer);
+    GLuint getElementsGL() const { return mElements; }
+
+    // Stops using buffer for any array, for when it's about to be deleted. The
+    // name may be reused for a new buffer, which the arrays wouldn't see.
+    void forgetBufferGL(GLuint buffer);
+};
+
+#endif /* VERTEXARRAYCACHE_HPP */
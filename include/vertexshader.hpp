@@ -3,49 +3,158 @@
 
 #include <atomic>
 #include <vector>
+#include <string>
+#include <array>
 #include <map>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "commandqueue.hpp"
+#include "commandstream.hpp"
+#include "shadercache.hpp"
+#include "shadercodemap.hpp"
 
 
 class D3DGLDevice;
+class D3DGLVertexDeclaration;
 
-class D3DGLVertexShader : public IDirect3DVertexShader9 {
-    std::atomic<ULONG> mRefCount;
+// What ProcessVertices writes for each vertex of an output declaration: a
+// main() wrapping the shader's that writes the outputs, and the varyings to
+// capture in buffer order, with skips for what isn't written.
+struct FeedbackLayout {
+    std::string mSource;
+    std::vector<std::string> mVaryings;
+    UINT mStride;
 
-    D3DGLDevice *mParent;
+    HRESULT init(const D3DGLVertexDeclaration *decl);
 
-    std::atomic<ULONG> mPendingUpdates;
-    std::atomic<GLuint> mProgram;
-    UINT mSamplerMask; // Bitmask of used samplers
-    UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
+    bool operator<(const FeedbackLayout &rhs) const
+    {
+        if(mSource != rhs.mSource) return mSource < rhs.mSource;
+        return mVaryings < rhs.mVaryings;
+    }
+};
 
-    std::vector<DWORD> mCode;
+// The bytecode and GL programs of a vertex shader, shared by the shader objects
+// created from the same bytecode.
+class VertexShaderCode {
+public:
+    // A program built for one set of shadow samplers and constants.
+    struct Variant {
+        std::atomic<ULONG> mPending;
+        ULONG mUpdateFence;
+        GLuint mProgram;
+        ShaderVariant mKey;
 
-    std::map<USHORT,GLint> mUsageMap;
+        // Attribute locations by [usage][usage index], -1 where unused.
+        std::array<std::array<GLint,16>,MAXD3DDECLUSAGE+1> mUsageMap;
 
-public:
-    D3DGLVertexShader(D3DGLDevice *parent);
-    virtual ~D3DGLVertexShader();
+        Variant();
+    };
 
-    bool init(const DWORD *data);
+private:
+    // Up to this many vertex samplers get every shadow variant built once
+    // the mask changes.
+    static const size_t sMaxSpeculativeBits = 3;
 
-    GLuint compileShaderGL(UINT shadowsamplers);
+    ULONG mRefCount;
 
-    void addPendingUpdate() { ++mPendingUpdates; }
-    ULONG getPendingUpdates() { return mPendingUpdates; }
+    D3DGLDevice *mParent;
 
-    GLuint getProgram() const { return mProgram; }
+    // Only the app thread adds to this, and the builds only touch their own
+    // variant.
+    std::map<ShaderVariant,Variant> mVariants;
+    UINT mSamplerMask; // Bitmask of used samplers
+    UINT mConstFStart;
+    UINT mConstFEnd;
+    UINT mConstIMask;
+    UINT mConstBMask;
+    // Number of variants built with constants folded in.
+    UINT mSpecializations;
+    // The variant selected for the last checked state, and what was asked
+    // for, which differs when it fell back to reading constants from
+    // uniforms.
+    Variant *mCurrent;
+    ShaderVariant mCurrentKey;
+
+    // Attribute and sampler names, the same for every variant.
+    const ShaderReflection mReflection;
+    // GLSL for no shadow samplers or folded constants, from parsing the
+    // shader when it was created. Only touched by the build for that variant.
+    std::string mSource;
+
+    const std::vector<DWORD> mCode;
+
+    // Programs for ProcessVertices, by variant and layout. Only touched by
+    // the command thread, once the app thread has set mFeedbackUsed.
+    std::map<std::pair<const Variant*,FeedbackLayout>,GLuint> mFeedbackPrograms;
+    bool mFeedbackUsed;
+
+    // Gets the GLSL for a variant from the bytecode.
+    std::string translate(const ShaderVariant &key) const;
+    void setupProgramGL(GLuint program, CommandStreamWriter *stream) const;
+    // Translates and links the shader, without the cache. The source is
+    // parsed for again if it's empty.
+    GLuint buildProgramGL(const ShaderVariant &key, std::string&& source, CommandStreamWriter *stream);
+
+    Variant &startCompile(const ShaderVariant &key);
+    void waitBuilt(Variant &variant);
+
+    friend class ShaderCodeMap<VertexShaderCode>;
+
+public:
+    VertexShaderCode(D3DGLDevice *parent, std::vector<DWORD>&& code, ShaderCodeInfo&& info);
+    ~VertexShaderCode();
+
+    const std::vector<DWORD> &getCode() const { return mCode; }
+    // The float constant registers read by the shader, as [start, end).
+    UINT getConstFStart() const { return mConstFStart; }
+    UINT getConstFEnd() const { return mConstFEnd; }
+
+    // Called on a compile thread when async is set, which leaves decrementing
+    // the pending count to the compiler.
+    GLuint compileShaderGL(const ShaderVariant &key, Variant &variant, bool async);
+
+    // Selects the variant for the shadow samplers and bool and integer
+    // constants, and starts building it if it hasn't been yet. Caller is
+    // responsible for holding the queue lock.
+    void selectVariant(UINT shadowmask, const ShaderConstantsI &ints, UINT bools);
+
+    bool isBuilding() const { return mCurrent && mCurrent->mPending > 0; }
+    // Waits for the selected variant to finish building. Its attribute
+    // locations aren't known before then.
+    void waitBuilt() { if(mCurrent) waitBuilt(*mCurrent); }
+
+    GLuint getProgram() const { return mCurrent ? mCurrent->mProgram : 0; }
+    // The selected variant, to make a ProcessVertices program from once
+    // built. Caller is responsible for holding the queue lock.
+    const Variant *getFeedbackVariant() { mFeedbackUsed = true; return mCurrent; }
+    // Gets the program that runs the variant and captures the layout,
+    // making it if needed.
+    GLuint getFeedbackProgramGL(const Variant &variant, const FeedbackLayout &layout);
+    void deinitFeedbackGL();
     GLint getLocation(BYTE usage, BYTE index) const
     {
-        auto idx = mUsageMap.find((usage<<8) | index);
-        if(idx == mUsageMap.end()) return -1;
-        return idx->second;
+        if(!mCurrent || usage >= mCurrent->mUsageMap.size() || index >= mCurrent->mUsageMap[0].size())
+            return -1;
+        return mCurrent->mUsageMap[usage][index];
     }
+};
+
+class D3DGLVertexShader : public IDirect3DVertexShader9 {
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    VertexShaderCode *mCode;
 
-    void checkShadowSamplers(UINT mask);
+public:
+    D3DGLVertexShader(D3DGLDevice *parent);
+    virtual ~D3DGLVertexShader();
+
+    bool init(const DWORD *data);
+
+    VertexShaderCode *getCode() const { return mCode; }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -57,24 +166,6 @@ public:
 };
 
 
-class CompileAndSetVShaderCmd : public Command {
-    D3DGLVertexShader *mTarget;
-    GLuint mPipeline;
-    UINT mShadowSamplers;
-
-public:
-    CompileAndSetVShaderCmd(D3DGLVertexShader *target, GLuint pipeline, UINT shadowsamplers=0)
-      : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
-
-    virtual ULONG execute()
-    {
-        GLuint program = mTarget->compileShaderGL(mShadowSamplers);
-        glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, program);
-        checkGLError();
-        return sizeof(*this);
-    }
-};
-
 class SetVShaderCmd : public Command {
     GLuint mPipeline;
     GLuint mProgram;
@@ -89,6 +180,10 @@ public:
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::UseProgramStages, StreamProgramStages{mPipeline, GL_VERTEX_SHADER_BIT, mProgram});
+    }
 };
 
 #endif /* VERTEXSHADER_HPP */
@@ -0,0 +1,54 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+
+// A few threads for splitting CPU-side work, like preparing texture data,
+// into parallel parts. The thread calling run() works on the parts too, and
+// each thread grabs the next unclaimed part as soon as it's done with one, so
+// uneven parts still balance out.
+class WorkerPool {
+    static const UINT sMaxThreads = 4;
+
+    std::vector<HANDLE> mThreads;
+
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mWakeCond;
+    CONDITION_VARIABLE mDoneCond;
+    ULONG mGeneration;
+    // Workers in doParts. A job's counters are only reset once this is 0, so
+    // a worker late for the last job can't claim parts of the next one.
+    ULONG mBusy;
+    bool mQuit;
+
+    const std::function<void(size_t)> *mJob;
+    std::atomic<size_t> mJobCount;
+    std::atomic<size_t> mNextPart;
+    std::atomic<size_t> mPartsDone;
+
+    void doParts();
+    void workerLoop();
+    static DWORD CALLBACK thread_func(void *arg);
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    void init();
+    void deinit();
+
+    // Calls func for each part in [0, count), and returns once they're all
+    // done. Only one thread may run a job at a time.
+    void run(size_t count, const std::function<void(size_t)> &func);
+};
+
+#endif /* WORKERPOOL_HPP */
@@ -5,14 +5,28 @@
 #include <process.h>
 #include <d3d9.h>
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <sstream>
 #include <cstdio>
+#include <cstdarg>
+#include <exception>
 
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
 #include "d3dgl.hpp"
+#include "device.hpp"
+#include "bufferobject.hpp"
+#include "adapter.hpp"
+#include "commandqueue.hpp"
+#include "gputimer.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
+#include "residency.hpp"
+#include "shadercache.hpp"
+#include "shadercompiler.hpp"
 #include "private_iids.hpp"
 
 
@@ -23,21 +37,236 @@
 eLogLevel LogLevel = FIXME_;
 FILE *LogFile = stderr;
 eLogLevel GLDebugLevel = NONE_;
+GLErrorCheck GLErrorCheckMode = GLErrorCheck::Frame;
+unsigned int GLErrorCheckInterval = 256;
 
 
-static CRITICAL_SECTION LogLock;
+namespace
+{
+
+// Each thread formats its messages into its own buffer, which a writer
+// thread drains to the log file. Logging threads don't wait on the file, or
+// on each other, unless their buffer fills up. Messages from one thread stay
+// in order, but may be interleaved differently with other threads'.
+struct LogBuffer {
+    static const ULONG sSize = 1<<16;
+
+    LogBuffer *mNext;
+    std::atomic<ULONG> mWritePos;
+    std::atomic<ULONG> mReadPos;
+    // Set when the owning thread exits. The drain frees the buffer once it
+    // has written out the rest.
+    std::atomic<bool> mDead;
+    char mData[sSize];
+};
+
+std::atomic<LogBuffer*> LogBufferList(nullptr);
+
+struct ThreadLogBuffer {
+    LogBuffer *mBuffer;
+
+    ~ThreadLogBuffer()
+    {
+        if(mBuffer)
+            mBuffer->mDead.store(true, std::memory_order_release);
+        mBuffer = nullptr;
+    }
+};
+thread_local ThreadLogBuffer ThreadLog{nullptr};
+
+// Writes synchronously instead, for logs that need to be complete when the
+// process crashes. Also used before the writer thread is started.
+bool LogSync = false;
+CRITICAL_SECTION LogLock;
+
+HANDLE LogThread = nullptr;
+HANDLE LogEvent = nullptr;
+std::atomic<bool> LogWriterWaiting(false);
+// Held while draining, by the writer thread or by the final flush.
+std::atomic_flag LogDrainLock = ATOMIC_FLAG_INIT;
+
+
+LogBuffer *getLogBuffer()
+{
+    LogBuffer *buffer = ThreadLog.mBuffer;
+    if(!buffer)
+    {
+        buffer = new LogBuffer;
+        buffer->mWritePos.store(0, std::memory_order_relaxed);
+        buffer->mReadPos.store(0, std::memory_order_relaxed);
+        buffer->mDead.store(false, std::memory_order_relaxed);
+
+        buffer->mNext = LogBufferList.load();
+        while(!LogBufferList.compare_exchange_weak(buffer->mNext, buffer))
+        { }
+        ThreadLog.mBuffer = buffer;
+    }
+    return buffer;
+}
+
+// Returns false if someone else is already draining and wait is false.
+bool drainLogBuffers(bool wait)
+{
+    while(LogDrainLock.test_and_set(std::memory_order_acquire))
+    {
+        if(!wait) return false;
+        Sleep(0);
+    }
+
+    // New buffers only go on the front of the list, so a buffer behind
+    // another can be unlinked here without racing with them.
+    bool wrote = false;
+    LogBuffer *prev = nullptr;
+    LogBuffer *buffer = LogBufferList.load();
+    while(buffer)
+    {
+        const bool dead = buffer->mDead.load(std::memory_order_acquire);
+        ULONG readpos = buffer->mReadPos.load(std::memory_order_relaxed);
+        const ULONG writepos = buffer->mWritePos.load();
+        if(readpos != writepos)
+        {
+            while(readpos != writepos)
+            {
+                ULONG start = readpos % LogBuffer::sSize;
+                ULONG len = std::min(writepos-readpos, LogBuffer::sSize-start);
+                fwrite(buffer->mData+start, 1, len, LogFile);
+                readpos += len;
+            }
+            buffer->mReadPos.store(readpos, std::memory_order_release);
+            wrote = true;
+        }
+
+        LogBuffer *next = buffer->mNext;
+        if(dead && prev)
+        {
+            prev->mNext = next;
+            delete buffer;
+        }
+        else
+            prev = buffer;
+        buffer = next;
+    }
+    if(wrote)
+        fflush(LogFile);
+
+    LogDrainLock.clear(std::memory_order_release);
+    return true;
+}
+
+unsigned int __stdcall logWriterProc(void*)
+{
+    while(1)
+    {
+        // Anything sent after the flag is set but missed by the drain wakes
+        // the event. The timeout is just a backstop.
+        LogWriterWaiting.store(true);
+        drainLogBuffers(true);
+        WaitForSingleObject(LogEvent, 100);
+    }
+    return 0;
+}
+
+// Writes out what's buffered when the process is going down. The writer
+// thread may have crashed while draining, so it doesn't wait on itself.
+void flushLogBuffers()
+{
+    if(LogThread)
+        drainLogBuffers(GetThreadId(LogThread) != GetCurrentThreadId());
+}
+
+std::terminate_handler PrevTerminateHandler = nullptr;
+LPTOP_LEVEL_EXCEPTION_FILTER PrevExceptionFilter = nullptr;
+
+void logTerminateHandler()
+{
+    flushLogBuffers();
+    if(PrevTerminateHandler)
+        PrevTerminateHandler();
+    abort();
+}
+
+LONG WINAPI logExceptionFilter(EXCEPTION_POINTERS *info)
+{
+    flushLogBuffers();
+    if(PrevExceptionFilter)
+        return PrevExceptionFilter(info);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+void startLogWriter()
+{
+    LogEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if(LogEvent)
+        LogThread = (HANDLE)_beginthreadex(nullptr, 0, logWriterProc, nullptr, 0, nullptr);
+    if(!LogThread)
+    {
+        ERR("Failed to start log writer thread, logging synchronously\n");
+        return;
+    }
+
+    PrevTerminateHandler = std::set_terminate(logTerminateHandler);
+    PrevExceptionFilter = SetUnhandledExceptionFilter(logExceptionFilter);
+}
+
+void wakeLogWriter()
+{
+    if(LogWriterWaiting.exchange(false))
+        SetEvent(LogEvent);
+}
+
+void vlog_printf(FILE *file, bool sync, const char *fmt, va_list ap)
+{
+    char msg[4096];
+    int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    if(len < 0) return;
+    len = std::min<int>(len, sizeof(msg)-1);
+
+    if(sync || LogSync || !LogThread || file != LogFile)
+    {
+        // Keep it after what this thread already buffered.
+        if(LogThread && file == LogFile && ThreadLog.mBuffer)
+            drainLogBuffers(true);
+        EnterCriticalSection(&LogLock);
+        fwrite(msg, 1, len, file);
+        fflush(file);
+        LeaveCriticalSection(&LogLock);
+        return;
+    }
+
+    LogBuffer *buffer = getLogBuffer();
+    ULONG writepos = buffer->mWritePos.load(std::memory_order_relaxed);
+    while(LogBuffer::sSize - (writepos - buffer->mReadPos.load(std::memory_order_acquire)) < ULONG(len))
+    {
+        SetEvent(LogEvent);
+        Sleep(1);
+    }
+    for(int i = 0;i < len;)
+    {
+        ULONG start = (writepos+i) % LogBuffer::sSize;
+        int todo = std::min<int>(len-i, LogBuffer::sSize-start);
+        memcpy(buffer->mData+start, msg+i, todo);
+        i += todo;
+    }
+    buffer->mWritePos.store(writepos+len);
+    wakeLogWriter();
+}
+
+} // namespace
 
 void log_printf(FILE *file, const char *fmt, ...)
 {
     va_list ap;
-
-    EnterCriticalSection(&LogLock);
     va_start(ap, fmt);
-    vfprintf(file, fmt, ap);
+    vlog_printf(file, false, fmt, ap);
     va_end(ap);
+}
 
-    fflush(file);
-    LeaveCriticalSection(&LogLock);
+void log_printf_sync(FILE *file, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vlog_printf(file, true, fmt, ap);
+    va_end(ap);
 }
 
 
@@ -116,6 +345,39 @@ BOOL WINAPI DllMain(HINSTANCE hModule, DWORD reason, void */*lpReserved*/)
                     ERR("Invalid log level: %s\n", str);
             }
 
+            str = getenv("D3DGL_LOGSYNC");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    LogSync = (val != 0);
+                else
+                    ERR("Invalid log sync value: %s\n", str);
+            }
+            if(!LogSync && LogLevel > NONE_)
+                startLogWriter();
+
+            str = getenv("D3DGL_GLERRORS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(strcmp(str, "off") == 0)
+                    GLErrorCheckMode = GLErrorCheck::Off;
+                else if(strcmp(str, "frame") == 0)
+                    GLErrorCheckMode = GLErrorCheck::Frame;
+                else if(strcmp(str, "always") == 0)
+                    GLErrorCheckMode = GLErrorCheck::Always;
+                else if(end && *end == '\0' && val > 0)
+                {
+                    GLErrorCheckMode = GLErrorCheck::Sampled;
+                    GLErrorCheckInterval = val;
+                }
+                else
+                    ERR("Invalid GL error check mode: %s\n", str);
+            }
+
             str = getenv("D3DGL_DEBUGGL");
             if(str && str[0] != '\0')
             {
@@ -127,11 +389,194 @@ BOOL WINAPI DllMain(HINSTANCE hModule, DWORD reason, void */*lpReserved*/)
                     ERR("Invalid log level: %s\n", str);
             }
 
+            str = getenv("D3DGL_QUEUESIZE");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0' && val > 0)
+                    CommandQueueSize = val * 1024;
+                else
+                    ERR("Invalid queue size: %s\n", str);
+            }
+
+            str = getenv("D3DGL_PAYLOADSIZE");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0' && val > 0)
+                    CommandPayloadSize = val * 1024;
+                else
+                    ERR("Invalid payload size: %s\n", str);
+            }
+
+            str = getenv("D3DGL_MAXFRAMELATENCY");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0' && val > 0)
+                    MaxFrameLatency = std::min<unsigned long>(val, MAX_FRAME_LATENCY);
+                else
+                    ERR("Invalid max frame latency: %s\n", str);
+            }
+
+            str = getenv("D3DGL_STREAMREGIONS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    StreamBufferRegions = std::min<unsigned long>(val, MAX_STREAM_REGIONS);
+                else
+                    ERR("Invalid stream buffer region count: %s\n", str);
+            }
+
+            str = getenv("D3DGL_NOSHADOW");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    ShadowWriteOnlyBuffers = (val == 0);
+                else
+                    ERR("Invalid no-shadow value: %s\n", str);
+            }
+
+            str = getenv("D3DGL_QUEUEWAIT");
+            if(str && str[0] != '\0')
+            {
+                if(strcmp(str, "spin") == 0)
+                    CommandQueueWaitMode = QueueWaitMode::Spin;
+                else if(strcmp(str, "block") == 0)
+                    CommandQueueWaitMode = QueueWaitMode::Block;
+                else if(strcmp(str, "hybrid") == 0)
+                    CommandQueueWaitMode = QueueWaitMode::Hybrid;
+                else if(strcmp(str, "adaptive") == 0)
+                    CommandQueueWaitMode = QueueWaitMode::Adaptive;
+                else
+                    ERR("Invalid queue wait mode: %s\n", str);
+            }
+
+            str = getenv("D3DGL_MULTITHREADED");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    CommandQueueForceLocking = (val != 0);
+                else
+                    ERR("Invalid multithreaded value: %s\n", str);
+            }
+
+            str = getenv("D3DGL_RECORD");
+            if(str && str[0] != '\0')
+                CommandStreamFile = str;
+
+            str = getenv("D3DGL_QUEUESTATS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    CommandQueueStatsInterval = val;
+                else
+                    ERR("Invalid queue stats interval: %s\n", str);
+            }
+
+            str = getenv("D3DGL_GPUTIMING");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    GPUTimingInterval = val;
+                else
+                    ERR("Invalid GPU timing interval: %s\n", str);
+            }
+
+            str = getenv("D3DGL_TIMELINE");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    TimelineFrames = val;
+                else
+                    ERR("Invalid timeline frame count: %s\n", str);
+            }
+
+            str = getenv("D3DGL_TIMELINE_START");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    TimelineStartFrame = val;
+                else
+                    ERR("Invalid timeline start frame: %s\n", str);
+            }
+
+            str = getenv("D3DGL_VRAM_BUDGET");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    VRAMBudget = val;
+                else
+                    ERR("Invalid VRAM budget: %s\n", str);
+            }
+
+            str = getenv("D3DGL_SHADERCACHE");
+            if(str && str[0] != '\0')
+                ShaderCacheFile = str;
+
+            str = getenv("D3DGL_ADAPTERCACHE");
+            if(str && str[0] != '\0')
+                AdapterCacheFile = str;
+
+            str = getenv("D3DGL_SHADERTHREADS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    ShaderCompileThreads = val;
+                else
+                    ERR("Invalid shader thread count: %s\n", str);
+            }
+
+            str = getenv("D3DGL_SKIPPENDINGSHADERS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    SkipPendingShaders = (val != 0);
+                else
+                    ERR("Invalid skip pending shaders value: %s\n", str);
+            }
+
             TRACE("DLL_PROCESS_ATTACH\n");
             break;
 
         case DLL_PROCESS_DETACH:
             TRACE("DLL_PROCESS_DETACH\n");
+            // At process exit the writer thread is already gone, maybe in the
+            // middle of a drain, so don't wait on it.
+            if(LogThread)
+            {
+                drainLogBuffers(false);
+                // Unless someone replaced them since.
+                LPTOP_LEVEL_EXCEPTION_FILTER filter = SetUnhandledExceptionFilter(PrevExceptionFilter);
+                if(filter != logExceptionFilter)
+                    SetUnhandledExceptionFilter(filter);
+                std::terminate_handler handler = std::set_terminate(PrevTerminateHandler);
+                if(handler != logTerminateHandler)
+                    std::set_terminate(handler);
+            }
             DeleteCriticalSection(&LogLock);
             break;
     }
@@ -159,6 +604,19 @@ static bool init_d3dgl(void)
         return false;
     }
 
+    inited = true;
+    return true;
+}
+
+// Loading GLEW takes making a couple GL contexts, so it waits until an
+// adapter needs probing or a device is made.
+bool InitGLEW()
+{
+    static bool inited = false;
+    if(inited) return true;
+
+    HINSTANCE hInstance = GetModuleHandleW(nullptr);
+
     HWND hWnd; HDC dc;
     if(!CreateFakeWindow(hInstance, hWnd, dc))
         return false;
@@ -57,6 +57,9 @@ struct Profile;  // predeclare.
 // Context...this is state that changes as we parse through a shader...
 typedef struct Context {
     int isfail;
+    MOJOSHADER_malloc malloc;
+    MOJOSHADER_free free;
+    void *malloc_data;
     int current_position;
     const uint32 *orig_tokens;
     const uint32 *tokens;
@@ -65,6 +68,7 @@ typedef struct Context {
     const MOJOSHADER_samplerMap *samplermap;
     unsigned int samplermap_count;
     unsigned int shadow_samplers;
+    const MOJOSHADER_constants *folded_constants;
     Buffer *output;
     Buffer *preflight;
     Buffer *globals;
@@ -128,6 +132,21 @@ typedef struct Context {
     int texm3x3pad_src1;
 } Context;
 
+
+static inline void *Malloc(Context *ctx, const size_t len)
+{ return ctx->malloc((int)len, ctx->malloc_data); }
+
+static inline void Free(Context *ctx, void *ptr)
+{ ctx->free(ptr, ctx->malloc_data); }
+
+static inline char *StrDup(Context *ctx, const char *str)
+{
+    char *retval = (char*)Malloc(ctx, strlen(str) + 1);
+    if(retval != NULL)
+        strcpy(retval, str);
+    return retval;
+}
+
 // Profile entry points...
 
 // one emit function for each opcode in each profile.
@@ -190,7 +209,7 @@ static int set_output(Context *ctx, Buffer **section)
     // only create output sections on first use.
     if(*section == NULL)
     {
-        *section = buffer_create(256);
+        *section = buffer_create(256, ctx->malloc, ctx->free, ctx->malloc_data);
         if(*section == NULL) return 0;
     }
 
@@ -238,6 +257,14 @@ static inline int shader_is_pixel(const Context *ctx)
 static inline int shader_is_vertex(const Context *ctx)
 { return (ctx->shader_type == MOJOSHADER_TYPE_VERTEX); }
 
+// Integer and boolean constants are written out as literals when the caller
+//  gave their values.
+static inline int is_folded_constant(const Context *ctx, const RegisterType regtype, const int regnum)
+{
+    return ctx->folded_constants && regnum >= 0 && regnum < 16 &&
+           (regtype == REG_TYPE_CONSTINT || regtype == REG_TYPE_CONSTBOOL);
+}
+
 
 static inline int isfail(const Context *ctx)
 { return ctx->isfail; }
@@ -306,12 +333,12 @@ static inline MOJOSHADER_samplerType cvtD3DToMojoSamplerType(const TextureType t
 
 // Deal with register lists...  !!! FIXME: I sort of hate this.
 
-static void free_reglist(RegisterList *item)
+static void free_reglist(Context *ctx, RegisterList *item)
 {
     while (item != NULL)
     {
         RegisterList *next = item->next;
-        free(item);
+        Free(ctx, item);
         item = next;
     }
 }
@@ -320,7 +347,7 @@ static inline uint32 reg_to_ui32(const RegisterType regtype, const int regnum)
 { return ((uint32)regtype) | (((uint32)regnum)<<16); }
 
 // !!! FIXME: ditch this for a hash table.
-static RegisterList *reglist_insert(RegisterList *prev,
+static RegisterList *reglist_insert(Context *ctx, RegisterList *prev,
                                     const RegisterType regtype,
                                     const int regnum)
 {
@@ -339,7 +366,7 @@ static RegisterList *reglist_insert(RegisterList *prev,
     }
 
     // we need to insert an entry after (prev).
-    item = malloc(sizeof(RegisterList));
+    item = Malloc(ctx, sizeof(RegisterList));
     item->regtype = regtype;
     item->regnum = regnum;
     item->usage = MOJOSHADER_USAGE_UNKNOWN;
@@ -386,7 +413,7 @@ static inline RegisterList *set_used_register(Context *ctx, const RegisterType r
                                               const int regnum, const int written)
 {
     RegisterList *reg = NULL;
-    reg = reglist_insert(&ctx->used_registers, regtype, regnum);
+    reg = reglist_insert(ctx, &ctx->used_registers, regtype, regnum);
     if(reg && written) reg->written = 1;
     return reg;
 }
@@ -400,7 +427,7 @@ static inline int get_used_register(Context *ctx, const RegisterType regtype,
 static inline void set_defined_register(Context *ctx, const RegisterType rtype,
                                         const int regnum)
 {
-    reglist_insert(&ctx->defined_registers, rtype, regnum);
+    reglist_insert(ctx, &ctx->defined_registers, rtype, regnum);
 }
 
 static inline int get_defined_register(Context *ctx, const RegisterType rtype,
@@ -413,7 +440,7 @@ static void add_attribute_register(Context *ctx, const RegisterType rtype,
                                    const int regnum, const MOJOSHADER_usage usage,
                                    const int index, const int writemask, int flags)
 {
-    RegisterList *item = reglist_insert(&ctx->attributes, rtype, regnum);
+    RegisterList *item = reglist_insert(ctx, &ctx->attributes, rtype, regnum);
     item->usage = usage;
     item->index = index;
     item->writemask = writemask;
@@ -432,7 +459,7 @@ static inline void add_sampler(Context *ctx, const int regnum,
 
     // !!! FIXME: make sure it doesn't exist?
     // !!! FIXME:  (ps_1_1 assume we can add it multiple times...)
-    RegisterList *item = reglist_insert(&ctx->samplers, rtype, regnum);
+    RegisterList *item = reglist_insert(ctx, &ctx->samplers, rtype, regnum);
 
     if (ctx->samplermap != NULL)
     {
@@ -695,7 +722,7 @@ static const char *get_GLSL_varname(Context *ctx, RegisterType rt, int regnum)
 {
     char buf[64];
     get_GLSL_varname_in_buf(ctx, rt, regnum, buf, sizeof(buf));
-    return strdup(buf);
+    return StrDup(ctx, buf);
 }
 
 
@@ -1252,8 +1279,23 @@ static void emit_GLSL_uniform(Context *ctx, RegisterType regtype, int regnum)
     get_GLSL_varname_in_buf(ctx, regtype, regnum, varname, sizeof (varname));
 
     push_output(ctx, &ctx->globals);
-    get_GLSL_uniform_array_varname(ctx, regtype, name, sizeof(name));
-    output_line(ctx, "#define %s %s[%d]", varname, name, regnum);
+    if(is_folded_constant(ctx, regtype, regnum))
+    {
+        if(regtype == REG_TYPE_CONSTBOOL)
+            output_line(ctx, "#define %s %s", varname,
+                        (ctx->folded_constants->bools&(1u<<regnum)) ? "true" : "false");
+        else
+        {
+            const int *val = ctx->folded_constants->int4[regnum];
+            output_line(ctx, "#define %s ivec4(%d, %d, %d, %d)", varname,
+                        val[0], val[1], val[2], val[3]);
+        }
+    }
+    else
+    {
+        get_GLSL_uniform_array_varname(ctx, regtype, name, sizeof(name));
+        output_line(ctx, "#define %s %s[%d]", varname, name, regnum);
+    }
     pop_output(ctx);
 }
 
@@ -3369,7 +3411,7 @@ static int parse_args_TEXLD(Context *ctx)
 
 static ConstantsList *alloc_constant_listitem(Context *ctx)
 {
-    ConstantsList *item = malloc(sizeof(ConstantsList));
+    ConstantsList *item = Malloc(ctx, sizeof(ConstantsList));
     memset(item, 0, sizeof(ConstantsList));
     item->next = ctx->constants;
     ctx->constants = item;
@@ -4406,11 +4448,19 @@ static Context *build_context(const char *profile,
                               const unsigned int bufsize,
                               const MOJOSHADER_samplerMap *smap,
                               const unsigned int smapcount,
-                              const unsigned int shadowsamp)
+                              const unsigned int shadowsamp,
+                              const MOJOSHADER_constants *consts,
+                              MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
-    Context *ctx = malloc(sizeof(Context));
+    Context *ctx = m(sizeof(Context), d);
+    if(ctx == NULL)
+        return NULL;
     memset(ctx, 0, sizeof (Context));
 
+    ctx->malloc = m;
+    ctx->free = f;
+    ctx->malloc_data = d;
+
     ctx->tokens = (const uint32 *) tokenbuf;
     ctx->orig_tokens = (const uint32 *) tokenbuf;
     ctx->know_shader_size = (bufsize != 0);
@@ -4418,6 +4468,7 @@ static Context *build_context(const char *profile,
     ctx->samplermap = smap;
     ctx->samplermap_count = smapcount;
     ctx->shadow_samplers = shadowsamp;
+    ctx->folded_constants = consts;
     ctx->current_position = MOJOSHADER_POSITION_BEFORE;
     ctx->texm3x2pad_dst0 = -1;
     ctx->texm3x2pad_src0 = -1;
@@ -4426,17 +4477,17 @@ static Context *build_context(const char *profile,
     ctx->texm3x3pad_dst1 = -1;
     ctx->texm3x3pad_src1 = -1;
 
-    ctx->errors = errorlist_create();
+    ctx->errors = errorlist_create(m, f, d);
     if(ctx->errors == NULL)
     {
-        free(ctx);
+        f(ctx, d);
         return NULL;
     }
 
     if(!set_output(ctx, &ctx->mainline))
     {
         errorlist_destroy(ctx->errors);
-        free(ctx);
+        f(ctx, d);
         return NULL;
     }
 
@@ -4451,12 +4502,12 @@ static Context *build_context(const char *profile,
 }
 
 
-static void free_constants_list(ConstantsList *item)
+static void free_constants_list(Context *ctx, ConstantsList *item)
 {
     while(item != NULL)
     {
         ConstantsList *next = item->next;
-        free(item);
+        Free(ctx, item);
         item = next;
     }
 }
@@ -4473,14 +4524,14 @@ static void destroy_context(Context *ctx)
     buffer_destroy(ctx->mainline_intro);
     buffer_destroy(ctx->mainline);
     buffer_destroy(ctx->ignore);
-    free_constants_list(ctx->constants);
-    free_reglist(ctx->used_registers.next);
-    free_reglist(ctx->defined_registers.next);
-    free_reglist(ctx->uniforms.next);
-    free_reglist(ctx->attributes.next);
-    free_reglist(ctx->samplers.next);
+    free_constants_list(ctx, ctx->constants);
+    free_reglist(ctx, ctx->used_registers.next);
+    free_reglist(ctx, ctx->defined_registers.next);
+    free_reglist(ctx, ctx->uniforms.next);
+    free_reglist(ctx, ctx->attributes.next);
+    free_reglist(ctx, ctx->samplers.next);
     errorlist_destroy(ctx->errors);
-    free(ctx);
+    Free(ctx, ctx);
 }
 
 
@@ -4505,7 +4556,7 @@ static inline const char *alloc_varname(Context *ctx, const RegisterList *reg)
 static MOJOSHADER_constant *build_constants(Context *ctx)
 {
     const size_t len = sizeof(MOJOSHADER_constant) * ctx->constant_count;
-    MOJOSHADER_constant *retval = malloc(len);
+    MOJOSHADER_constant *retval = Malloc(ctx, len);
 
     ConstantsList *item = ctx->constants;
     int i;
@@ -4524,10 +4575,59 @@ static MOJOSHADER_constant *build_constants(Context *ctx)
     return retval;
 }
 
+static MOJOSHADER_uniform *build_uniforms(Context *ctx, int *_count)
+{
+    // Relative addressing can read any of the float registers, so they're
+    //  reported as one array covering them all.
+    const int relative = ctx->have_relative_const_registers ? 1 : 0;
+    const int count = ctx->uniform_count + relative;
+    if(count == 0)
+    {
+        *_count = 0;
+        return NULL;
+    }
+
+    const size_t len = sizeof(MOJOSHADER_uniform) * count;
+    MOJOSHADER_uniform *retval = Malloc(ctx, len);
+
+    RegisterList *item = ctx->uniforms.next;
+    int i;
+
+    memset(retval, 0, len);
+
+    for(i = 0; i < ctx->uniform_count; i++)
+    {
+        if(item == NULL)
+        {
+            fail(ctx, "BUG: mismatched uniform list and count");
+            break;
+        }
+
+        switch(item->regtype)
+        {
+            case REG_TYPE_CONST: retval[i].type = MOJOSHADER_UNIFORM_FLOAT; break;
+            case REG_TYPE_CONSTINT: retval[i].type = MOJOSHADER_UNIFORM_INT; break;
+            case REG_TYPE_CONSTBOOL: retval[i].type = MOJOSHADER_UNIFORM_BOOL; break;
+            default: fail(ctx, "BUG: mismatched uniform register type"); break;
+        }
+        retval[i].index = item->regnum;
+        item = item->next;
+    }
+    if(relative)
+    {
+        retval[i].type = MOJOSHADER_UNIFORM_FLOAT;
+        retval[i].index = 0;
+        retval[i].array_count = ctx->uniform_float4_count;
+    }
+
+    *_count = count;
+    return retval;
+}
+
 static MOJOSHADER_sampler *build_samplers(Context *ctx)
 {
     const size_t len = sizeof(MOJOSHADER_sampler) * ctx->sampler_count;
-    MOJOSHADER_sampler *retval = malloc(len);
+    MOJOSHADER_sampler *retval = Malloc(ctx, len);
 
     RegisterList *item = ctx->samplers.next;
     int i;
@@ -4562,7 +4662,7 @@ static MOJOSHADER_attribute *build_attributes(Context *ctx, int *_count)
     }
 
     const size_t len = sizeof (MOJOSHADER_attribute) * ctx->attribute_count;
-    MOJOSHADER_attribute *retval = malloc(len);
+    MOJOSHADER_attribute *retval = Malloc(ctx, len);
     memset(retval, 0, len);
 
     RegisterList *item = ctx->attributes.next;
@@ -4630,7 +4730,7 @@ static MOJOSHADER_attribute *build_outputs(Context *ctx, int *_count)
     }
 
     const size_t len = sizeof(MOJOSHADER_attribute) * ctx->attribute_count;
-    MOJOSHADER_attribute *retval = malloc(len);
+    MOJOSHADER_attribute *retval = Malloc(ctx, len);
     memset(retval, 0, len);
 
     RegisterList *item = ctx->attributes.next;
@@ -4676,18 +4776,21 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
     MOJOSHADER_constant *constants = NULL;
     MOJOSHADER_attribute *attributes = NULL;
     MOJOSHADER_attribute *outputs = NULL;
+    MOJOSHADER_uniform *uniforms = NULL;
     MOJOSHADER_sampler *samplers = NULL;
     MOJOSHADER_error *errors = NULL;
     MOJOSHADER_parseData *retval = NULL;
     size_t output_len = 0;
+    int uniform_count = 0;
     int attribute_count = 0;
     int output_count = 0;
 
-    retval = malloc(sizeof(MOJOSHADER_parseData));
+    retval = Malloc(ctx, sizeof(MOJOSHADER_parseData));
     memset(retval, '\0', sizeof (MOJOSHADER_parseData));
 
     if(!isfail(ctx)) output = build_output(ctx, &output_len);
     if(!isfail(ctx)) constants = build_constants(ctx);
+    if(!isfail(ctx)) uniforms = build_uniforms(ctx, &uniform_count);
     if(!isfail(ctx)) attributes = build_attributes(ctx, &attribute_count);
     if(!isfail(ctx)) outputs = build_outputs(ctx, &output_count);
     if(!isfail(ctx)) samplers = build_samplers(ctx);
@@ -4700,28 +4803,29 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
     {
         int i;
 
-        free(output);
-        free(constants);
+        Free(ctx, output);
+        Free(ctx, constants);
+        Free(ctx, uniforms);
 
         if(attributes != NULL)
         {
             for(i = 0; i < attribute_count; i++)
-                free((void*)attributes[i].name);
-            free(attributes);
+                Free(ctx, (void*)attributes[i].name);
+            Free(ctx, attributes);
         }
 
         if(outputs != NULL)
         {
             for(i = 0; i < output_count; i++)
-                free((void*)outputs[i].name);
-            free(outputs);
+                Free(ctx, (void*)outputs[i].name);
+            Free(ctx, outputs);
         }
 
         if(samplers != NULL)
         {
             for(i = 0; i < ctx->sampler_count; i++)
-                free((void*)samplers[i].name);
-            free(samplers);
+                Free(ctx, (void*)samplers[i].name);
+            Free(ctx, samplers);
         }
     }
     else
@@ -4736,6 +4840,8 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
         retval->minor_ver = (int)ctx->minor_ver;
         retval->constant_count = ctx->constant_count;
         retval->constants = constants;
+        retval->uniform_count = uniform_count;
+        retval->uniforms = uniforms;
         retval->sampler_count = ctx->sampler_count;
         retval->samplers = samplers;
         retval->attribute_count = attribute_count;
@@ -4746,6 +4852,9 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
 
     retval->error_count = error_count;
     retval->errors = errors;
+    retval->malloc = ctx->malloc;
+    retval->free = ctx->free;
+    retval->malloc_data = ctx->malloc_data;
 
     return retval;
 }
@@ -4845,10 +4954,12 @@ static void process_definitions(Context *ctx)
                 ctx->uniform_float4_count = Max(ctx->uniform_float4_count, item->regnum+1);
                 break;
             case REG_TYPE_CONSTINT:
-                ctx->uniform_int4_count = Max(ctx->uniform_int4_count, item->regnum+1);
+                if(!is_folded_constant(ctx, item->regtype, item->regnum))
+                    ctx->uniform_int4_count = Max(ctx->uniform_int4_count, item->regnum+1);
                 break;
             case REG_TYPE_CONSTBOOL:
-                ctx->uniform_bool_count = Max(ctx->uniform_bool_count, item->regnum+1);
+                if(!is_folded_constant(ctx, item->regtype, item->regnum))
+                    ctx->uniform_bool_count = Max(ctx->uniform_bool_count, item->regnum+1);
                 break;
             default: break;
         }
@@ -4891,19 +5002,40 @@ static void process_definitions(Context *ctx)
 //  attempts to read from a temporary register that has not been written by a
 //  previous instruction."  (true for ps_1_*, maybe others). Check this.
 
+static MOJOSHADER_error MOJOSHADER_out_of_mem_error = {
+    "Out of memory", NULL, MOJOSHADER_POSITION_BEFORE
+};
+
+static MOJOSHADER_parseData MOJOSHADER_out_of_mem_data = {
+    1, &MOJOSHADER_out_of_mem_error
+};
+
 const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
                                              const unsigned char *tokenbuf,
                                              const unsigned int bufsize,
                                              const MOJOSHADER_samplerMap *smap,
                                              const unsigned int smapcount,
-                                             const unsigned int shadowsamp)
+                                             const unsigned int shadowsamp,
+                                             const MOJOSHADER_constants *consts,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d)
 {
     MOJOSHADER_parseData *retval = NULL;
     Context *ctx = NULL;
     int rc = 0;
     int failed = 0;
 
-    ctx = build_context(profile, tokenbuf, bufsize, smap, smapcount, shadowsamp);
+    if(m == NULL || f == NULL)
+    {
+        m = MOJOSHADER_internal_malloc;
+        f = MOJOSHADER_internal_free;
+        d = NULL;
+    }
+
+    ctx = build_context(profile, tokenbuf, bufsize, smap, smapcount, shadowsamp, consts, m, f, d);
+    if(ctx == NULL)
+        return &MOJOSHADER_out_of_mem_data;
     if(isfail(ctx))
     {
         retval = build_parsedata(ctx);
@@ -4985,35 +5117,39 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
 void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *_data)
 {
     MOJOSHADER_parseData *data = (MOJOSHADER_parseData*)_data;
-    if(data == NULL) return;  // no-op.
+    if(data == NULL || data == &MOJOSHADER_out_of_mem_data)
+        return;  // no-op.
 
+    MOJOSHADER_free f = data->free;
+    void *d = data->malloc_data;
     int i;
 
     // we don't free(data->profile), because that's internal static data.
 
-    free((void*)data->output);
-    free((void*)data->constants);
+    f((void*)data->output, d);
+    f((void*)data->constants, d);
+    f((void*)data->uniforms, d);
 
     for(i = 0; i < data->error_count; i++)
     {
-        free((void*)data->errors[i].error);
-        free((void*)data->errors[i].filename);
+        f((void*)data->errors[i].error, d);
+        f((void*)data->errors[i].filename, d);
     }
-    free((void*)data->errors);
+    f((void*)data->errors, d);
 
     for(i = 0; i < data->attribute_count; i++)
-        free((void*)data->attributes[i].name);
-    free((void*)data->attributes);
+        f((void*)data->attributes[i].name, d);
+    f((void*)data->attributes, d);
 
     for(i = 0; i < data->output_count; i++)
-        free((void*)data->outputs[i].name);
-    free((void*)data->outputs);
+        f((void*)data->outputs[i].name, d);
+    f((void*)data->outputs, d);
 
     for(i = 0; i < data->sampler_count; i++)
-        free((void*)data->samplers[i].name);
-    free((void*)data->samplers);
+        f((void*)data->samplers[i].name, d);
+    f((void*)data->samplers, d);
 
-    free(data);
+    f(data, d);
 }
 
 
@@ -36,6 +36,17 @@ extern "C" {
  */
 int MOJOSHADER_version(void);
 
+/*
+ * These allocators work just like the C runtime's malloc() and free()
+ *  (in fact, they use malloc() and free() internally if you don't
+ *  specify your own allocator, but don't rely on that behaviour).
+ * (data) is the pointer you supplied when specifying these allocator
+ *  callbacks, in case you need instance-specific data...it is passed through
+ *  to your allocator unmolested, and can be NULL if you like.
+ */
+typedef void *(*MOJOSHADER_malloc)(int bytes, void *data);
+typedef void (*MOJOSHADER_free)(void *ptr, void *data);
+
 /*
  * These are enum values, but they also can be used in bitmasks, so we can
  *  test if an opcode is acceptable: if (op->shader_types & ourtype) {} ...
@@ -179,6 +190,19 @@ typedef struct MOJOSHADER_samplerMap
     MOJOSHADER_samplerType type;
 } MOJOSHADER_samplerMap;
 
+
+/*
+ * This struct is used to specialize a shader on the values of its integer
+ *  and boolean constant registers. (int4) holds the four components of each
+ *  integer register, and (bools) has a bit set for each boolean register
+ *  that's true.
+ */
+typedef struct MOJOSHADER_constants
+{
+    int int4[16][4];
+    unsigned int bools;
+} MOJOSHADER_constants;
+
 /*
  * Data types for attributes. See MOJOSHADER_attribute for more information.
  */
@@ -343,6 +367,18 @@ typedef struct MOJOSHADER_parseData
      */
     MOJOSHADER_constant *constants;
 
+    /*
+     * The number of elements pointed to by (uniforms).
+     */
+    int uniform_count;
+
+    /*
+     * (uniform_count) elements of data that specify Uniforms to be set for
+     *  this shader. See discussion on MOJOSHADER_uniform for details.
+     * This can be NULL on error or if (uniform_count) is zero.
+     */
+    MOJOSHADER_uniform *uniforms;
+
     /*
      * The number of elements pointed to by (samplers).
      */
@@ -380,6 +416,21 @@ typedef struct MOJOSHADER_parseData
      * This can be NULL on error or if (output_count) is zero.
      */
     MOJOSHADER_attribute *outputs;
+
+    /*
+     * This is the malloc implementation you passed to MOJOSHADER_parse().
+     */
+    MOJOSHADER_malloc malloc;
+
+    /*
+     * This is the free implementation you passed to MOJOSHADER_parse().
+     */
+    MOJOSHADER_free free;
+
+    /*
+     * This is the pointer you passed as opaque data for your allocator.
+     */
+    void *malloc_data;
 } MOJOSHADER_parseData;
 
 
@@ -473,6 +524,16 @@ int MOJOSHADER_maxShaderModel(const char *profile);
  *  risk a buffer overflow if you have corrupt data, etc. Supply the value
  *  if you can.
  *
+ * (consts), if not NULL, gives the values of the integer and boolean
+ *  constant registers, which are then written into the output as literals
+ *  instead of being read from uniforms. The output is only valid for those
+ *  values, but static branches and loops on them can be resolved when it's
+ *  compiled.
+ *
+ * (m) and (f) are used for all of the parse's allocations, including the
+ *  returned data, with (d) passed through to them. If either is NULL, the C
+ *  runtime's malloc() and free() are used instead.
+ *
  * This function is thread safe, so long as (m) and (f) are too, and that
  *  (tokenbuf) remains intact for the duration of the call. This allows you
  *  to parse several shaders on separate CPU cores at the same time.
@@ -482,7 +543,11 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
                                              const unsigned int bufsize,
                                              const MOJOSHADER_samplerMap *smap,
                                              const unsigned int smapcount,
-                                             const unsigned int shadowsamp);
+                                             const unsigned int shadowsamp,
+                                             const MOJOSHADER_constants *consts,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d);
 
 /*
  * Call this to dispose of parsing results when you are done with them.
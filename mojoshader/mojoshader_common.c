@@ -2,6 +2,10 @@
 #include "mojoshader_internal.h"
 
 
+void *MOJOSHADER_internal_malloc(int bytes, void *d) { return malloc(bytes); }
+void MOJOSHADER_internal_free(void *ptr, void *d) { free(ptr); }
+
+
 // We chain errors as a linked list with a head/tail for easy appending.
 //  These get flattened before passing to the application.
 typedef struct ErrorItem {
@@ -14,15 +18,21 @@ struct ErrorList
     ErrorItem head;
     ErrorItem *tail;
     int count;
+    MOJOSHADER_malloc m;
+    MOJOSHADER_free f;
+    void *d;
 };
 
-ErrorList *errorlist_create(void)
+ErrorList *errorlist_create(MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
-    ErrorList *retval = (ErrorList*)malloc(sizeof(ErrorList));
+    ErrorList *retval = (ErrorList*)m(sizeof(ErrorList), d);
     if(retval != NULL)
     {
         memset(retval, '\0', sizeof(*retval));
         retval->tail = &retval->head;
+        retval->m = m;
+        retval->f = f;
+        retval->d = d;
     }
     return retval;
 }
@@ -43,16 +53,16 @@ int errorlist_add_fmt(ErrorList *list, const char *fname, const int errpos, cons
 
 int errorlist_add_va(ErrorList *list, const char *_fname, const int errpos, const char *fmt, va_list va)
 {
-    ErrorItem *error = (ErrorItem*)malloc(sizeof(ErrorItem));
+    ErrorItem *error = (ErrorItem*)list->m(sizeof(ErrorItem), list->d);
     if(error == NULL) return 0;
 
     char *fname = NULL;
     if(_fname != NULL)
     {
-        fname = (char*)malloc(strlen(_fname) + 1);
+        fname = (char*)list->m(strlen(_fname) + 1, list->d);
         if (fname == NULL)
         {
-            free(error);
+            list->f(error, list->d);
             return 0;
         }
         strcpy(fname, _fname);
@@ -67,7 +77,7 @@ int errorlist_add_va(ErrorList *list, const char *_fname, const int errpos, cons
     // If we overflowed our scratch buffer, that's okay. We were going to
     //  allocate anyhow...the scratch buffer just lets us avoid a second
     //  run of vsnprintf().
-    char *failstr = (char*)malloc(len + 1);
+    char *failstr = (char*)list->m(len + 1, list->d);
     if(len < sizeof (scratch))
         strcpy(failstr, scratch);  // copy it over.
     else
@@ -100,7 +110,7 @@ MOJOSHADER_error *errorlist_flatten(ErrorList *list)
         return NULL;
 
     int total = 0;
-    MOJOSHADER_error *retval = (MOJOSHADER_error*)malloc(sizeof(MOJOSHADER_error) * list->count);
+    MOJOSHADER_error *retval = (MOJOSHADER_error*)list->m(sizeof(MOJOSHADER_error) * list->count, list->d);
     if(retval == NULL) return NULL;
 
     ErrorItem *item = list->head.next;
@@ -109,7 +119,7 @@ MOJOSHADER_error *errorlist_flatten(ErrorList *list)
         ErrorItem *next = item->next;
         // reuse the string allocations
         memcpy(&retval[total], &item->error, sizeof (MOJOSHADER_error));
-        free(item);
+        list->f(item, list->d);
         item = next;
         total++;
     }
@@ -130,12 +140,12 @@ void errorlist_destroy(ErrorList *list)
     while (item != NULL)
     {
         ErrorItem *next = item->next;
-        free((void*)item->error.error);
-        free((void*)item->error.filename);
-        free(item);
+        list->f((void*)item->error.error, list->d);
+        list->f((void*)item->error.filename, list->d);
+        list->f(item, list->d);
         item = next;
     }
-    free(list);
+    list->f(list, list->d);
 }
 
 
@@ -150,15 +160,21 @@ struct Buffer {
     BufferBlock *head;
     BufferBlock *tail;
     size_t block_size;
+    MOJOSHADER_malloc m;
+    MOJOSHADER_free f;
+    void *d;
 };
 
-Buffer *buffer_create(size_t blksz)
+Buffer *buffer_create(size_t blksz, MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
-    Buffer *buffer = (Buffer*)malloc(sizeof(Buffer));
+    Buffer *buffer = (Buffer*)m(sizeof(Buffer), d);
     if(buffer != NULL)
     {
         memset(buffer, '\0', sizeof(Buffer));
         buffer->block_size = blksz;
+        buffer->m = m;
+        buffer->f = f;
+        buffer->d = d;
     }
     return buffer;
 }
@@ -189,7 +205,7 @@ char *buffer_reserve(Buffer *buffer, const size_t len)
     //  so this buffer is contiguous).
     const size_t bytecount = len > blocksize ? len : blocksize;
     const size_t malloc_len = sizeof(BufferBlock) + bytecount;
-    BufferBlock *item = (BufferBlock*)malloc(malloc_len);
+    BufferBlock *item = (BufferBlock*)buffer->m(malloc_len, buffer->d);
     if(item == NULL) return NULL;
 
     item->data = ((uint8*)item) + sizeof(BufferBlock);
@@ -237,7 +253,7 @@ int buffer_append(Buffer *buffer, const void *_data, size_t len)
         assert(!buffer->tail || buffer->tail->bytes >= blocksize);
         const size_t bytecount = len > blocksize ? len : blocksize;
         const size_t malloc_len = sizeof(BufferBlock) + bytecount;
-        BufferBlock *item = (BufferBlock*)malloc(malloc_len);
+        BufferBlock *item = (BufferBlock*)buffer->m(malloc_len, buffer->d);
         if(item == NULL) return 0;
 
         item->data = ((uint8 *) item) + sizeof (BufferBlock);
@@ -280,14 +296,14 @@ int buffer_append_va(Buffer *buffer, const char *fmt, va_list va)
         return buffer_append(buffer, scratch, len);
 
     // If we overflowed our scratch buffer, heap allocate and try again.
-    char *buf = (char*)malloc(len + 1);
+    char *buf = (char*)buffer->m(len + 1, buffer->d);
 
     va_copy(ap, va);
     vsnprintf(buf, len + 1, fmt, ap);  // rebuild it.
     va_end(ap);
     const int retval = buffer_append(buffer, buf, len);
 
-    free(buf);
+    buffer->f(buf, buffer->d);
     return retval;
 }
 
@@ -302,7 +318,7 @@ void buffer_empty(Buffer *buffer)
     while(item != NULL)
     {
         BufferBlock *next = item->next;
-        free(item);
+        buffer->f(item, buffer->d);
         item = next;
     }
     buffer->head = buffer->tail = NULL;
@@ -311,7 +327,7 @@ void buffer_empty(Buffer *buffer)
 
 char *buffer_flatten(Buffer *buffer)
 {
-    char *retval = (char*)malloc(buffer->total_bytes + 1);
+    char *retval = (char*)buffer->m(buffer->total_bytes + 1, buffer->d);
     if(retval == NULL) return NULL;
 
     BufferBlock *item = buffer->head;
@@ -321,7 +337,7 @@ char *buffer_flatten(Buffer *buffer)
         BufferBlock *next = item->next;
         memcpy(ptr, item->data, item->bytes);
         ptr += item->bytes;
-        free(item);
+        buffer->f(item, buffer->d);
         item = next;
     } // while
     *ptr = '\0';
@@ -349,7 +365,13 @@ char *buffer_merge(Buffer **buffers, const size_t n, size_t *_len)
         len += buffer->total_bytes;
     }
 
-    char *retval = (char*)malloc(len + 1);
+    if(first == NULL)
+    {
+        *_len = 0;
+        return NULL;
+    }
+
+    char *retval = (char*)first->m(len + 1, first->d);
     if(retval == NULL)
     {
         *_len = 0;
@@ -370,7 +392,7 @@ char *buffer_merge(Buffer **buffers, const size_t n, size_t *_len)
             BufferBlock *next = item->next;
             memcpy(ptr, item->data, item->bytes);
             ptr += item->bytes;
-            free(item);
+            buffer->f(item, buffer->d);
             item = next;
         }
 
@@ -389,7 +411,7 @@ void buffer_destroy(Buffer *buffer)
     if(buffer != NULL)
     {
         buffer_empty(buffer);
-        free(buffer);
+        buffer->f(buffer, buffer->d);
     }
 }
 
@@ -1,6 +1,10 @@
 
 #include "adapter.hpp"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
@@ -471,12 +475,193 @@ static const gpu_description gpu_description_table[] =
     {HW_VENDOR_INTEL,      CARD_INTEL_HWM,                 "Intel(R) Haswell Mobile",                                   DRIVER_INTEL_GMA3000, 1024},
 };
 
+const char *find_description(WORD vendor, WORD card)
+{
+    size_t i = 0;
+    while(i < countof(gpu_description_table) && gpu_description_table[i].vendor != vendor)
+        ++i;
+    while(i < countof(gpu_description_table) && gpu_description_table[i].vendor == vendor)
+    {
+        if(gpu_description_table[i].card == card)
+            return gpu_description_table[i].description;
+        ++i;
+    }
+    return nullptr;
+}
+
+
+const char sCacheMagic[8] = { 'D','3','D','G','L','A','D','C' };
+// Increase this when probing changes, so results from older builds are
+// dropped.
+const DWORD sCacheVersion = 1;
+// Anything bigger is from a corrupt file.
+const DWORD sMaxCacheRecord = 1<<20;
+
+std::string get_cache_path()
+{
+    if(AdapterCacheFile)
+    {
+        if(strcmp(AdapterCacheFile, "0") == 0)
+            return std::string();
+        return AdapterCacheFile;
+    }
+
+    const char *dir = getenv("LOCALAPPDATA");
+    if(!dir || !dir[0])
+        return std::string();
+    return std::string(dir) + "\\d3dgl.adaptercache";
+}
+
+// The installed driver's version, from its registry key, so an updated
+// driver gets probed again.
+std::wstring get_driver_version(const DISPLAY_DEVICEW &device)
+{
+    static const WCHAR prefix[] = L"\\Registry\\Machine\\";
+    const size_t prefixlen = countof(prefix)-1;
+    if(_wcsnicmp(device.DeviceKey, prefix, prefixlen) != 0)
+        return std::wstring();
+
+    WCHAR version[64];
+    DWORD size = sizeof(version);
+    if(RegGetValueW(HKEY_LOCAL_MACHINE, device.DeviceKey+prefixlen, L"DriverVersion", RRF_RT_REG_SZ,
+                    nullptr, version, &size) != ERROR_SUCCESS)
+        return std::wstring();
+    return std::wstring(version);
 }
 
 
+class CacheWriter {
+    std::vector<BYTE> mData;
+
+public:
+    void put(const void *data, size_t len)
+    {
+        const BYTE *bytes = reinterpret_cast<const BYTE*>(data);
+        mData.insert(mData.end(), bytes, bytes+len);
+    }
+    void putDWord(DWORD val)
+    { put(&val, sizeof(val)); }
+    void putString(const std::string &str)
+    {
+        putDWord(str.length());
+        put(str.data(), str.length());
+    }
+    void putWString(const std::wstring &str)
+    {
+        putDWord(str.length());
+        put(str.data(), str.length()*sizeof(WCHAR));
+    }
+    template<typename T>
+    void putStruct(const T &val)
+    {
+        putDWord(sizeof(val));
+        put(&val, sizeof(val));
+    }
+
+    const std::vector<BYTE> &getData() const { return mData; }
+};
+
+class CacheReader {
+    const BYTE *mPos;
+    const BYTE *mEnd;
+    bool mOkay;
+
+public:
+    CacheReader(const BYTE *data, size_t len)
+      : mPos(data), mEnd(data+len), mOkay(true)
+    { }
+
+    const BYTE *get(size_t len)
+    {
+        if(!mOkay || size_t(mEnd-mPos) < len)
+        {
+            mOkay = false;
+            return nullptr;
+        }
+        const BYTE *ret = mPos;
+        mPos += len;
+        return ret;
+    }
+    DWORD getDWord()
+    {
+        DWORD val = 0;
+        if(const BYTE *data = get(sizeof(val)))
+            memcpy(&val, data, sizeof(val));
+        return val;
+    }
+    std::string getString()
+    {
+        DWORD len = getDWord();
+        const BYTE *data = get(len);
+        return data ? std::string(reinterpret_cast<const char*>(data), len) : std::string();
+    }
+    std::wstring getWString()
+    {
+        DWORD len = getDWord();
+        if(len > size_t(mEnd-mPos)/sizeof(WCHAR))
+            mOkay = false;
+        const BYTE *data = get(len*sizeof(WCHAR));
+        if(!data) return std::wstring();
+        std::wstring str(len, L'\0');
+        memcpy(&str[0], data, len*sizeof(WCHAR));
+        return str;
+    }
+    // Structs written by a build with a different layout don't match.
+    template<typename T>
+    void getStruct(T &val)
+    {
+        if(getDWord() != sizeof(val))
+            mOkay = false;
+        if(const BYTE *data = get(sizeof(val)))
+            memcpy(&val, data, sizeof(val));
+    }
+
+    bool isOkay() const { return mOkay; }
+};
+
+// Reads the cache's records, each its length then the data, starting with the
+// key. Returns false if there's no valid cache.
+bool read_cache(const std::string &path, std::vector<std::vector<BYTE>> &records)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if(!file) return false;
+
+    char magic[sizeof(sCacheMagic)];
+    DWORD version;
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+              fread(&version, sizeof(version), 1, file) == 1 &&
+              memcmp(magic, sCacheMagic, sizeof(magic)) == 0 && version == sCacheVersion;
+    DWORD len;
+    while(ok && fread(&len, sizeof(len), 1, file) == 1)
+    {
+        if(len > sMaxCacheRecord)
+            break;
+        std::vector<BYTE> data(len);
+        if(fread(data.data(), 1, len, file) != len)
+            break;
+        records.push_back(std::move(data));
+    }
+    fclose(file);
+    return ok;
+}
+
+std::wstring get_record_key(const std::vector<BYTE> &record)
+{
+    CacheReader reader(record.data(), record.size());
+    return reader.getWString();
+}
+
+}
+
+
+const char *AdapterCacheFile = nullptr;
+
+
 D3DAdapter::D3DAdapter(UINT adapter_num)
   : mOrdinal(adapter_num)
   , mInited(false)
+  , mProbed(false)
+  , mUsable(false)
   , mVendorId(HW_VENDOR_SOFTWARE)
   , mDeviceId(CARD_WINE)
   , mDescription("Unknown Device")
@@ -1083,19 +1268,8 @@ void D3DAdapter::init_ids()
 
             mVendorId = vendor.id;
             mDeviceId = renderer_list[i].id;
-
-            i = 0;
-            while(i < countof(gpu_description_table) && gpu_description_table[i].vendor != mVendorId)
-                ++i;
-            while(i < countof(gpu_description_table) && gpu_description_table[i].vendor == mVendorId)
-            {
-                if(gpu_description_table[i].card == mDeviceId)
-                {
-                    mDescription = gpu_description_table[i].description;
-                    break;
-                }
-                ++i;
-            }
+            if(const char *desc = find_description(mVendorId, mDeviceId))
+                mDescription = desc;
 
             TRACE("Detected GPU %04x:%04x, \"%s\"\n", mVendorId, mDeviceId, mDescription);
             return;
@@ -1231,6 +1405,138 @@ void D3DAdapter::init_usage()
 }
 
 
+bool D3DAdapter::load_cache()
+{
+    std::string path = get_cache_path();
+    std::vector<std::vector<BYTE>> records;
+    if(mCacheKey.empty() || path.empty() || !read_cache(path, records))
+        return false;
+
+    for(const std::vector<BYTE> &record : records)
+    {
+        CacheReader reader(record.data(), record.size());
+        if(reader.getWString() != mCacheKey)
+            continue;
+
+        std::string glvendor = reader.getString();
+        std::string glrenderer = reader.getString();
+        std::string glversion = reader.getString();
+
+        Limits limits;
+        D3DCAPS9 caps;
+        reader.getStruct(limits);
+        reader.getStruct(caps);
+        WORD vendorid = reader.getDWord();
+        WORD deviceid = reader.getDWord();
+
+        UsageMap usage;
+        DWORD count = reader.getDWord();
+        for(DWORD i = 0;i < count && reader.isOkay();++i)
+        {
+            DWORD restype = reader.getDWord();
+            D3DFORMAT format = (D3DFORMAT)reader.getDWord();
+            usage[std::make_pair(restype, format)] = reader.getDWord();
+        }
+        FormatSampleMap samples;
+        count = reader.getDWord();
+        for(DWORD i = 0;i < count && reader.isOkay();++i)
+        {
+            D3DFORMAT format = (D3DFORMAT)reader.getDWord();
+            samples[format] = reader.getDWord();
+        }
+        if(!reader.isOkay())
+        {
+            WARN("Corrupt adapter cache record in %s\n", path.c_str());
+            return false;
+        }
+
+        TRACE("Using cached info for adapter %u: GL_VENDOR=%s, GL_RENDERER=%s, GL_VERSION=%s\n",
+              mOrdinal, glvendor.c_str(), glrenderer.c_str(), glversion.c_str());
+        mLimits = limits;
+        mCaps = caps;
+        mVendorId = vendorid;
+        mDeviceId = deviceid;
+        if(const char *desc = find_description(mVendorId, mDeviceId))
+            mDescription = desc;
+        mUsage.swap(usage);
+        mSamples.swap(samples);
+        return true;
+    }
+    return false;
+}
+
+void D3DAdapter::store_cache(const std::string &glvendor, const std::string &glrenderer, const std::string &glversion)
+{
+    std::string path = get_cache_path();
+    if(mCacheKey.empty() || path.empty())
+        return;
+
+    CacheWriter writer;
+    writer.putWString(mCacheKey);
+    writer.putString(glvendor);
+    writer.putString(glrenderer);
+    writer.putString(glversion);
+    writer.putStruct(mLimits);
+    writer.putStruct(mCaps);
+    writer.putDWord(mVendorId);
+    writer.putDWord(mDeviceId);
+    writer.putDWord(mUsage.size());
+    for(const auto &usage : mUsage)
+    {
+        writer.putDWord(usage.first.first);
+        writer.putDWord(usage.first.second);
+        writer.putDWord(usage.second);
+    }
+    writer.putDWord(mSamples.size());
+    for(const auto &samples : mSamples)
+    {
+        writer.putDWord(samples.first);
+        writer.putDWord(samples.second);
+    }
+
+    // Other adapters' records are kept. The new file is written separately
+    // and moved over the old one, so a launch reading it at the same time
+    // never sees it half written.
+    std::vector<std::vector<BYTE>> records;
+    read_cache(path, records);
+
+    char tmpname[32];
+    snprintf(tmpname, sizeof(tmpname), ".%lu.tmp", GetCurrentProcessId());
+    std::string tmppath = path + tmpname;
+    FILE *file = fopen(tmppath.c_str(), "wb");
+    if(!file)
+    {
+        WARN("Failed to create adapter cache %s\n", tmppath.c_str());
+        return;
+    }
+
+    bool ok = fwrite(sCacheMagic, sizeof(sCacheMagic), 1, file) == 1 &&
+              fwrite(&sCacheVersion, sizeof(sCacheVersion), 1, file) == 1;
+    for(const std::vector<BYTE> &record : records)
+    {
+        if(!ok) break;
+        if(get_record_key(record) == mCacheKey)
+            continue;
+        DWORD len = record.size();
+        ok = fwrite(&len, sizeof(len), 1, file) == 1 &&
+             fwrite(record.data(), 1, len, file) == len;
+    }
+    const std::vector<BYTE> &data = writer.getData();
+    DWORD len = data.size();
+    ok = ok && fwrite(&len, sizeof(len), 1, file) == 1 &&
+         fwrite(data.data(), 1, len, file) == len;
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok || !MoveFileExA(tmppath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        WARN("Failed to write adapter cache %s\n", path.c_str());
+        DeleteFileA(tmppath.c_str());
+        return;
+    }
+    TRACE("Stored adapter %u info in %s\n", mOrdinal, path.c_str());
+}
+
+
 bool D3DAdapter::init()
 {
     if(mInited)
@@ -1245,6 +1551,37 @@ bool D3DAdapter::init()
 
     TRACE("Got device name \"%ls\"\n", mDeviceName.c_str());
 
+    std::wstring version = get_driver_version(display_device);
+    if(version.empty())
+        WARN("No driver version for adapter %u, not caching its info\n", mOrdinal);
+    else
+    {
+        WCHAR ordinal[16];
+        _snwprintf(ordinal, countof(ordinal), L"%u", mOrdinal);
+        mCacheKey = std::wstring(ordinal) + L"|" + display_device.DeviceID + L"|" +
+                    display_device.DeviceString + L"|" + version;
+    }
+
+    mInited = true;
+    return true;
+}
+
+bool D3DAdapter::probe()
+{
+    if(mProbed)
+        return mUsable;
+    mProbed = true;
+
+    if(load_cache())
+    {
+        mUsable = true;
+        return true;
+    }
+
+    TRACE("Probing adapter %u\n", mOrdinal);
+    if(!InitGLEW())
+        return false;
+
     HWND hWnd; HDC hDc;
     if(!CreateFakeWindow(GetModuleHandleW(nullptr), hWnd, hDc))
         return false;
@@ -1262,6 +1599,7 @@ bool D3DAdapter::init()
         return false;
     }
 
+    std::string glvendor, glrenderer, glversion;
     bool retval = false;
     if(!wglMakeCurrent(hDc, hGlrc))
         ERR("Failed to make context current!\n");
@@ -1279,6 +1617,10 @@ bool D3DAdapter::init()
         init_caps();
         init_ids();
         init_usage();
+
+        glvendor = reinterpret_cast<const char*>(glGetString(GL_VENDOR));
+        glrenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+        glversion = reinterpret_cast<const char*>(glGetString(GL_VERSION));
         retval = true;
     }
 
@@ -1287,7 +1629,10 @@ bool D3DAdapter::init()
     ReleaseDC(hWnd, hDc);
     DestroyWindow(hWnd);
 
-    mInited = retval;
+    if(retval)
+        store_cache(glvendor, glrenderer, glversion);
+
+    mUsable = retval;
     return retval;
 }
 
@@ -0,0 +1,106 @@
+
+#include "allocators.hpp"
+
+#include <malloc.h>
+
+
+DataPool::DataPool()
+  : mAllocs(0), mHits(0), mInUseBytes(0), mCachedBytes(0), mPeakBytes(0)
+{
+    for(Bucket &bucket : mBuckets)
+    {
+        InitializeSRWLock(&bucket.mLock);
+        bucket.mFree = nullptr;
+    }
+}
+
+DataPool::~DataPool()
+{
+    for(Bucket &bucket : mBuckets)
+    {
+        while(Block *block = bucket.mFree)
+        {
+            bucket.mFree = block->mNext;
+            _aligned_free(block);
+        }
+    }
+}
+
+void DataPool::updatePeak()
+{
+    size_t total = mInUseBytes.load() + mCachedBytes.load();
+    size_t peak = mPeakBytes.load();
+    while(total > peak && !mPeakBytes.compare_exchange_weak(peak, total))
+    { }
+}
+
+void *DataPool::alloc(size_t size)
+{
+    size_t bucket = 0;
+    while(bucket < sNumBuckets && (size_t(1)<<(sMinBucketBits+bucket)) < size)
+        ++bucket;
+    ++mAllocs;
+
+    Block *block = nullptr;
+    if(bucket < sNumBuckets)
+    {
+        size = size_t(1)<<(sMinBucketBits+bucket);
+
+        Bucket &list = mBuckets[bucket];
+        AcquireSRWLockExclusive(&list.mLock);
+        if((block=list.mFree) != nullptr)
+            list.mFree = block->mNext;
+        ReleaseSRWLockExclusive(&list.mLock);
+
+        if(block)
+        {
+            ++mHits;
+            mCachedBytes -= size;
+            mInUseBytes += size;
+            return reinterpret_cast<char*>(block) + sHeaderSize;
+        }
+    }
+
+    block = reinterpret_cast<Block*>(_aligned_malloc(sHeaderSize+size, sHeaderSize));
+    if(!block) throw std::bad_alloc();
+    block->mSize = size;
+
+    mInUseBytes += size;
+    updatePeak();
+    return reinterpret_cast<char*>(block) + sHeaderSize;
+}
+
+void DataPool::free(void *ptr)
+{
+    if(!ptr) return;
+    Block *block = reinterpret_cast<Block*>(reinterpret_cast<char*>(ptr) - sHeaderSize);
+    const size_t size = block->mSize;
+    mInUseBytes -= size;
+
+    size_t bucket = 0;
+    while(bucket < sNumBuckets && (size_t(1)<<(sMinBucketBits+bucket)) < size)
+        ++bucket;
+    // The cache limit is only approximate with multiple threads freeing at
+    // once, which is fine.
+    if(bucket >= sNumBuckets || mCachedBytes.load()+size > sMaxCachedBytes)
+    {
+        _aligned_free(block);
+        return;
+    }
+
+    mCachedBytes += size;
+    Bucket &list = mBuckets[bucket];
+    AcquireSRWLockExclusive(&list.mLock);
+    block->mNext = list.mFree;
+    list.mFree = block;
+    ReleaseSRWLockExclusive(&list.mLock);
+}
+
+void DataPool::getStats(DataPoolStats &stats) const
+{
+    stats.mAllocs = mAllocs.load();
+    stats.mHits = mHits.load();
+    stats.mInUseBytes = mInUseBytes.load();
+    stats.mCachedBytes = mCachedBytes.load();
+    stats.mPeakBytes = mPeakBytes.load();
+}
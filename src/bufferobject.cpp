@@ -1,12 +1,42 @@
 
 #include "bufferobject.hpp"
 
+#include <algorithm>
+
 #include "device.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 #include "private_iids.hpp"
 
 
+UINT StreamBufferRegions = MAX_FRAME_LATENCY+1;
+bool ShadowWriteOnlyBuffers = true;
+
+namespace
+{
+
+// Limit on how far streaming buffers grow to avoid waiting on the GPU, along
+// with MAX_STREAM_REGIONS.
+const GLsizeiptr MaxStreamSize = 16*1024*1024;
+
+} // namespace
+
+
 void D3DGLBufferObject::initGL(const GLubyte *data)
 {
+    if(mStreaming)
+    {
+        initStreamGL(StreamBufferRegions);
+        if(mStreamData)
+        {
+            memset(mStreamData, 0, mLength);
+            mUpdateInProgress = 0;
+            return;
+        }
+        ERR("Failed to create streaming storage for buffer %p, using a shadow copy\n", this);
+        mStreaming = false;
+    }
+
     UINT data_len = (mLength+15) & ~15;
 
     GLenum usage = (mUsage&D3DUSAGE_DYNAMIC) ? GL_DYNAMIC_DRAW : GL_STREAM_DRAW;
@@ -15,6 +45,10 @@ void D3DGLBufferObject::initGL(const GLubyte *data)
     glNamedBufferDataEXT(mBufferId, data_len, data, usage);
     checkGLError();
 
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::BufferData, StreamBufferData{mBufferId, data_len, usage},
+                      data, data ? mLength : 0);
+
     mUpdateInProgress = 0;
 }
 class InitBufferObjectCmd : public Command {
@@ -31,20 +65,47 @@ public:
         mTarget->initGL(mData.get());
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 class DestroyBufferCmd : public Command {
+    VertexArrayCache &mVertexArrays;
     GLuint mBufferId;
 
 public:
-    DestroyBufferCmd(GLuint buffer) : mBufferId(buffer) { }
+    DestroyBufferCmd(VertexArrayCache &vertexarrays, GLuint buffer)
+      : mVertexArrays(vertexarrays), mBufferId(buffer) { }
 
     virtual ULONG execute()
     {
+        mVertexArrays.forgetBufferGL(mBufferId);
         glDeleteBuffers(1, &mBufferId);
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BufferDelete, StreamValue{mBufferId});
+    }
+};
+
+void D3DGLBufferObject::readBufferDataGL()
+{
+    glGetNamedBufferSubDataEXT(mBufferId, 0, mLength, mBufData.get());
+    checkGLError();
+}
+class ReadBufferDataCmd : public Command {
+    D3DGLBufferObject *mTarget;
+
+public:
+    ReadBufferDataCmd(D3DGLBufferObject *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->readBufferDataGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 void D3DGLBufferObject::resizeBufferGL(UINT length)
@@ -52,6 +113,9 @@ void D3DGLBufferObject::resizeBufferGL(UINT length)
     UINT data_len = (length+15) & ~15;
     glNamedBufferDataEXT(mBufferId, data_len, nullptr, GL_STREAM_DRAW);
     checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::BufferData, StreamBufferData{mBufferId, data_len, GL_STREAM_DRAW});
 }
 class ResizeBufferCmd : public Command {
     D3DGLBufferObject *mTarget;
@@ -65,20 +129,24 @@ public:
         mTarget->resizeBufferGL(mLength);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 void D3DGLBufferObject::loadBufferDataGL(UINT offset, UINT length, const GLubyte *data, GLbitfield flags)
 {
     if(!flags)
-        glNamedBufferSubDataEXT(mBufferId, offset, length, &data[offset]);
+        glNamedBufferSubDataEXT(mBufferId, offset, length, data);
     else
     {
         void *ptr = glMapNamedBufferRangeEXT(mBufferId, offset, length, flags);
-        memcpy(ptr, &data[offset], length);
+        memcpy(ptr, data, length);
         glUnmapNamedBufferEXT(mBufferId);
     }
     checkGLError();
 
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::BufferSubData, StreamBufferSubData{mBufferId, offset}, data, length);
+
     --mUpdateInProgress;
 }
 class LoadBufferDataCmd : public Command {
@@ -89,6 +157,7 @@ class LoadBufferDataCmd : public Command {
     GLbitfield mFlags;
 
 public:
+    // The data is only the updated range.
     LoadBufferDataCmd(D3DGLBufferObject *target, UINT offset, UINT length, std::shared_ptr<GLubyte> data, GLbitfield flags)
       : mTarget(target), mOffset(offset), mLength(length), mData(data), mFlags(flags)
     { }
@@ -98,6 +167,207 @@ public:
         mTarget->loadBufferDataGL(mOffset, mLength, mData.get(), mFlags);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLBufferObject::loadBufferRangesGL(const BufferRange *ranges, UINT count, const GLubyte *data, GLbitfield flags)
+{
+    if(!flags)
+    {
+        for(UINT i = 0;i < count;++i)
+            glNamedBufferSubDataEXT(mBufferId, ranges[i].mOffset, ranges[i].mEnd-ranges[i].mOffset,
+                                    &data[ranges[i].mOffset]);
+    }
+    else
+    {
+        // Map the span covering every range once, and copy each into it.
+        UINT start = ranges[0].mOffset;
+        UINT end = ranges[count-1].mEnd;
+        GLubyte *ptr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(mBufferId, start, end-start, flags));
+        for(UINT i = 0;i < count;++i)
+            memcpy(ptr + ranges[i].mOffset-start, &data[ranges[i].mOffset], ranges[i].mEnd-ranges[i].mOffset);
+        glUnmapNamedBufferEXT(mBufferId);
+    }
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+    {
+        for(UINT i = 0;i < count;++i)
+            stream->write(StreamOp::BufferSubData, StreamBufferSubData{mBufferId, ranges[i].mOffset},
+                          &data[ranges[i].mOffset], ranges[i].mEnd-ranges[i].mOffset);
+    }
+
+    --mUpdateInProgress;
+}
+class LoadBufferRangesCmd : public PayloadCommand {
+    D3DGLBufferObject *mTarget;
+    UINT mCount;
+    std::shared_ptr<GLubyte> mData;
+    GLbitfield mFlags;
+
+public:
+    LoadBufferRangesCmd(CommandQueue &queue, D3DGLBufferObject *target, const BufferRange *ranges, UINT count, std::shared_ptr<GLubyte> data, GLbitfield flags)
+      : PayloadCommand(queue, count*sizeof(BufferRange)), mTarget(target), mCount(count), mData(data)
+      , mFlags(flags)
+    {
+        memcpy(mPayload, ranges, count*sizeof(BufferRange));
+    }
+
+    virtual ULONG execute()
+    {
+        mTarget->loadBufferRangesGL(reinterpret_cast<const BufferRange*>(mPayload), mCount,
+                                    mData.get(), mFlags);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLBufferObject::initStreamGL(UINT regions)
+{
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    if(!(mUsage&D3DUSAGE_WRITEONLY))
+        flags |= GL_MAP_READ_BIT;
+    GLsizeiptr size = GLsizeiptr(mRegionStride) * regions;
+
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glNamedBufferStorageEXT(buffer, size, nullptr, flags);
+    GLubyte *ptr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(buffer, 0, size, flags));
+    checkGLError();
+    if(!ptr)
+    {
+        // Leave any existing storage as it is.
+        glDeleteBuffers(1, &buffer);
+        return;
+    }
+
+    if(mBufferId)
+    {
+        // Deleting the old buffer unbinds it, so rebind the new one in its
+        // place if it was the element array.
+        VertexArrayCache &vertexarrays = mParent->getVertexArrays();
+        bool rebind = (vertexarrays.getElementsGL() == mBufferId);
+        deinitStreamGL();
+        if(rebind) vertexarrays.setElementsGL(buffer);
+    }
+
+    mBufferId = buffer;
+    mStreamData = ptr;
+    mStreamRegions = regions;
+    mRegionFences.assign(regions, nullptr);
+}
+class InitStreamBufferCmd : public Command {
+    D3DGLBufferObject *mTarget;
+    UINT mRegions;
+
+public:
+    InitStreamBufferCmd(D3DGLBufferObject *target, UINT regions) : mTarget(target), mRegions(regions) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->initStreamGL(mRegions);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLBufferObject::retireRegionGL(UINT region)
+{
+    GLsync &fence = mRegionFences[region];
+    if(fence) glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    // Check the other regions while here, so the app thread sees them become
+    // free without having to ask.
+    for(UINT i = 0;i < mStreamRegions;++i)
+    {
+        GLsync &other = mRegionFences[i];
+        if(i == region || !other)
+            continue;
+
+        GLint status = GL_UNSIGNALED;
+        glGetSynciv(other, GL_SYNC_STATUS, sizeof(status), nullptr, &status);
+        if(status == GL_SIGNALED)
+        {
+            glDeleteSync(other);
+            other = nullptr;
+            mRegionBusy[i] = false;
+        }
+    }
+    checkGLError();
+}
+class RetireRegionCmd : public Command {
+    D3DGLBufferObject *mTarget;
+    UINT mRegion;
+
+public:
+    RetireRegionCmd(D3DGLBufferObject *target, UINT region) : mTarget(target), mRegion(region) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->retireRegionGL(mRegion);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLBufferObject::waitRegionGL(UINT region)
+{
+    GLsync &fence = mRegionFences[region];
+    if(fence)
+    {
+        GLenum ret;
+        while((ret=glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED)
+            WARN("Timed out waiting for buffer %p region %u\n", this, region);
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait for buffer %p region %u\n", this, region);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    mRegionBusy[region] = false;
+}
+class WaitRegionCmd : public Command {
+    D3DGLBufferObject *mTarget;
+    UINT mRegion;
+
+public:
+    WaitRegionCmd(D3DGLBufferObject *target, UINT region) : mTarget(target), mRegion(region) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->waitRegionGL(mRegion);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLBufferObject::deinitStreamGL()
+{
+    for(GLsync &fence : mRegionFences)
+    {
+        if(fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+    // Deleting the buffer unmaps it.
+    mParent->getVertexArrays().forgetBufferGL(mBufferId);
+    glDeleteBuffers(1, &mBufferId);
+    checkGLError();
+
+    mBufferId = 0;
+    mStreamData = nullptr;
+}
+class DestroyStreamBufferCmd : public Command {
+    D3DGLBufferObject *mTarget;
+
+public:
+    DestroyStreamBufferCmd(D3DGLBufferObject *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->deinitStreamGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
@@ -115,16 +385,30 @@ D3DGLBufferObject::D3DGLBufferObject(D3DGLDevice *parent)
   , mLockedOffset(0)
   , mLockedLength(0)
   , mUpdateInProgress(0)
+  , mUpdateFence(0)
+  , mDirtyDiscard(false)
+  , mDirtySync(false)
+  , mGPUWritten(false)
+  , mStaged(false)
+  , mStreaming(false)
+  , mStreamData(nullptr)
+  , mRegionStride(0)
+  , mStreamRegions(0)
+  , mStreamRegion(0)
 {
 }
 
 D3DGLBufferObject::~D3DGLBufferObject()
 {
-    if(mBufferId)
+    if(mStreaming)
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.waitFence(queue.send<DestroyStreamBufferCmd>(this));
+    }
+    else if(mBufferId)
     {
-        mParent->getQueue().send<DestroyBufferCmd>(mBufferId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        CommandQueue &queue = mParent->getQueue();
+        queue.waitFence(queue.send<DestroyBufferCmd>(make_ref(mParent->getVertexArrays()), mBufferId));
         mBufferId = 0;
     }
 }
@@ -146,12 +430,46 @@ bool D3DGLBufferObject::init_common(UINT length, DWORD usage, D3DPOOL pool)
         return false;
     }
 
+    // Dynamic buffers are written through a persistent mapping when possible.
+    // The command stream can't see writes made that way, so not while it's
+    // being recorded.
+    mStreaming = (mUsage&D3DUSAGE_DYNAMIC) && mPool == D3DPOOL_DEFAULT && StreamBufferRegions > 0 &&
+                 GLEW_ARB_buffer_storage && !CommandStreamFile;
+    mRegionStride = (mLength+255) & ~255;
+
+    // The app can't read back write-only buffers, so without streaming they
+    // don't need a shadow copy if it's not wanted.
+    bool stageable = (mUsage&D3DUSAGE_WRITEONLY) && mPool == D3DPOOL_DEFAULT && !ShadowWriteOnlyBuffers;
+    mStaged = !mStreaming && stageable;
+
     UINT data_len = (mLength+15) & ~15;
-    mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
-    memset(mBufData.get(), 0, data_len);
+    if(!mStreaming && !mStaged)
+    {
+        mBufData.reset(PooledDataAllocator<GLubyte>()(data_len), PooledDataDeallocator<GLubyte>());
+        memset(mBufData.get(), 0, data_len);
+    }
 
     mUpdateInProgress = 1;
     mParent->getQueue().sendSync<InitBufferObjectCmd>(this, mBufData);
+    mUpdateFence = mParent->getQueue().getFence();
+
+    if(mStreaming)
+    {
+        mRegionBusy.reset(new std::atomic<bool>[mStreamRegions]);
+        for(UINT i = 0;i < mStreamRegions;++i)
+            mRegionBusy[i] = false;
+    }
+    else if(!mBufData && !mStaged)
+    {
+        // Streaming storage couldn't be made, so fall back to staging or a
+        // shadow copy.
+        mStaged = stageable;
+        if(!mStaged)
+        {
+            mBufData.reset(PooledDataAllocator<GLubyte>()(data_len), PooledDataDeallocator<GLubyte>());
+            memset(mBufData.get(), 0, data_len);
+        }
+    }
 
     return true;
 }
@@ -227,14 +545,115 @@ void D3DGLBufferObject::resetBufferData(const GLubyte *data, GLuint length)
     if(mUpdateInProgress > 1)
     {
         UINT data_len = (mLength+15) & ~15;
-        mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
+        mBufData.reset(PooledDataAllocator<GLubyte>()(data_len), PooledDataDeallocator<GLubyte>());
     }
     memcpy(mBufData.get(), data, length);
 
-    mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, mLength, mBufData, 0);
+    mUpdateFence = mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, mLength, mBufData, 0);
     mParent->getQueue().unlock();
 }
 
+GLubyte *D3DGLBufferObject::discardRegion()
+{
+    CommandQueue &queue = mParent->getQueue();
+
+    mRegionBusy[mStreamRegion] = true;
+    queue.send<RetireRegionCmd>(this, mStreamRegion);
+
+    UINT next = (mStreamRegion+1) % mStreamRegions;
+    if(mRegionBusy[next])
+    {
+        // The GPU may still be reading the next region. Rather than wait,
+        // grow the storage if there's room, since being this far ahead means
+        // the buffer is discarded many times a frame.
+        UINT regions = mStreamRegions;
+        if(regions*2 <= MAX_STREAM_REGIONS && GLsizeiptr(mRegionStride)*regions*2 <= MaxStreamSize)
+        {
+            queue.sendSync<InitStreamBufferCmd>(this, regions*2);
+            if(mStreamRegions != regions)
+            {
+                TRACE("Buffer %p grew to %u regions\n", this, mStreamRegions);
+                mRegionBusy.reset(new std::atomic<bool>[mStreamRegions]);
+                for(UINT i = 0;i < mStreamRegions;++i)
+                    mRegionBusy[i] = false;
+                next = 0;
+            }
+        }
+        if(mRegionBusy[next])
+            queue.sendSync<WaitRegionCmd>(this, next);
+    }
+
+    mStreamRegion = next;
+    return mStreamData + getDataOffset();
+}
+
+void D3DGLBufferObject::syncRegion()
+{
+    // Writing over data the GPU may still be using, so wait for it to finish.
+    CommandQueue &queue = mParent->getQueue();
+    mRegionBusy[mStreamRegion] = true;
+    queue.send<RetireRegionCmd>(this, mStreamRegion);
+    queue.sendSync<WaitRegionCmd>(this, mStreamRegion);
+}
+
+void D3DGLBufferObject::addDirtyRange(UINT offset, UINT length)
+{
+    UINT end = offset + length;
+
+    // Find the first range that ends at or after the new one starts, then
+    // fold in every range it touches.
+    auto first = std::lower_bound(mDirtyRanges.begin(), mDirtyRanges.end(), offset,
+        [](const BufferRange &range, UINT pos) -> bool
+        { return range.mEnd < pos; }
+    );
+    auto last = first;
+    while(last != mDirtyRanges.end() && last->mOffset <= end)
+    {
+        offset = std::min(offset, last->mOffset);
+        end = std::max(end, last->mEnd);
+        ++last;
+    }
+
+    if(first == last)
+        mDirtyRanges.insert(first, BufferRange{offset, end});
+    else
+    {
+        *first = BufferRange{offset, end};
+        mDirtyRanges.erase(first+1, last);
+    }
+
+    // Too many scattered writes, so just send the whole span.
+    if(mDirtyRanges.size() > sMaxDirtyRanges)
+    {
+        BufferRange span{mDirtyRanges.front().mOffset, mDirtyRanges.back().mEnd};
+        mDirtyRanges.assign(1, span);
+    }
+}
+
+void D3DGLBufferObject::sendDirtyRanges()
+{
+    // Mapping the span only invalidates what's outside the written ranges
+    // when the whole buffer was discarded.
+    GLbitfield flags = 0;
+    if(mDirtyDiscard)
+        flags = GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_WRITE_BIT;
+    else if(!mDirtySync)
+    {
+        flags = GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_WRITE_BIT;
+        if(mDirtyRanges.size() == 1)
+            flags |= GL_MAP_INVALIDATE_RANGE_BIT;
+    }
+
+    ++mUpdateInProgress;
+    mUpdateFence = mParent->getQueue().doSend<LoadBufferRangesCmd>(make_ref(mParent->getQueue()),
+        this, mDirtyRanges.data(), mDirtyRanges.size(), mBufData, flags
+    );
+
+    mDirtyRanges.clear();
+    mDirtyDiscard = false;
+    mDirtySync = false;
+}
+
 ULONG D3DGLBufferObject::releaseIface()
 {
     ULONG ret = --mIfaceCount;
@@ -350,6 +769,7 @@ D3DRESOURCETYPE D3DGLBufferObject::GetType()
 HRESULT D3DGLBufferObject::Lock(UINT offset, UINT length, void **data, DWORD flags)
 {
     TRACE("iface %p, offset %u, length %u, data %p, flags 0x%lx\n", this, offset, length, data, flags);
+    TIMELINE_SCOPE("Buffer::Lock");
 
     if(length == 0)
     {
@@ -399,19 +819,75 @@ HRESULT D3DGLBufferObject::Lock(UINT offset, UINT length, void **data, DWORD fla
         }
     }
 
+    // What the GPU wrote has to be visible before the app reads or writes
+    // around it, unless the contents are being discarded. Staged buffers
+    // can't be read and only upload what's written.
+    if(mGPUWritten)
+    {
+        mGPUWritten = false;
+        if(!(flags&D3DLOCK_DISCARD) && !mStaged)
+        {
+            if(mStreaming)
+                syncRegion();
+            else
+                mParent->getQueue().sendSync<ReadBufferDataCmd>(this);
+        }
+    }
+
+    if(mStreaming)
+    {
+        GLubyte *ptr;
+        if((flags&D3DLOCK_DISCARD))
+            ptr = discardRegion();
+        else
+        {
+            if(!(flags&(D3DLOCK_NOOVERWRITE|D3DLOCK_READONLY)))
+                syncRegion();
+            ptr = mStreamData + getDataOffset();
+        }
+
+        mLockedOffset = offset;
+        mLockedLength = length;
+        mLockedFlags  = flags;
+
+        *data = ptr + mLockedOffset;
+        return D3D_OK;
+    }
+
+    if(mStaged)
+    {
+        // A read-only lock was refused above, so the old contents are never
+        // needed.
+        mStagingData.reset(PooledDataAllocator<GLubyte>()(length), PooledDataDeallocator<GLubyte>());
+
+        mLockedOffset = offset;
+        mLockedLength = length;
+        mLockedFlags  = flags;
+
+        *data = mStagingData.get();
+        return D3D_OK;
+    }
+
     // No need to wait if we're not writing over previous data.
     if((flags&D3DLOCK_DISCARD))
     {
+        // Nothing has drawn with the pending changes, and the contents are
+        // undefined after a discard, so they can be dropped.
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        mDirtyRanges.clear();
+        mDirtySync = false;
+        queue.unlock();
+
         if(mUpdateInProgress > 0)
         {
             UINT data_len = (mLength+15) & ~15;
-            mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
+            mBufData.reset(PooledDataAllocator<GLubyte>()(data_len), PooledDataDeallocator<GLubyte>());
         }
     }
     else if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
     {
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        mParent->getQueue().waitFence(mUpdateFence);
     }
 
     mLockedOffset = offset;
@@ -425,6 +901,7 @@ HRESULT D3DGLBufferObject::Lock(UINT offset, UINT length, void **data, DWORD fla
 HRESULT D3DGLBufferObject::Unlock()
 {
     TRACE("iface %p\n", this);
+    TIMELINE_SCOPE("Buffer::Unlock");
 
     if(mLock == LT_Unlocked)
     {
@@ -432,7 +909,10 @@ HRESULT D3DGLBufferObject::Unlock()
         return D3DERR_INVALIDCALL;
     }
 
-    if(mLock != LT_ReadOnly)
+    // Streaming buffers were written in place. Staged buffers upload the
+    // locked range now, while shadowed buffers upload it along with any
+    // others when the buffer is next drawn with.
+    if(mStaged)
     {
         ++mUpdateInProgress;
         GLbitfield flags = 0;
@@ -440,9 +920,21 @@ HRESULT D3DGLBufferObject::Unlock()
             flags |= GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_WRITE_BIT;
         else if((mLockedFlags&D3DLOCK_NOOVERWRITE))
             flags |= GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_WRITE_BIT;
-        mParent->getQueue().send<LoadBufferDataCmd>(this,
-            mLockedOffset, mLockedLength, mBufData, flags
+        mUpdateFence = mParent->getQueue().send<LoadBufferDataCmd>(this,
+            mLockedOffset, mLockedLength, mStagingData, flags
         );
+        mStagingData.reset();
+    }
+    else if(mLock != LT_ReadOnly && !mStreaming)
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        addDirtyRange(mLockedOffset, mLockedLength);
+        if((mLockedFlags&D3DLOCK_DISCARD))
+            mDirtyDiscard = true;
+        else if(!(mLockedFlags&D3DLOCK_NOOVERWRITE))
+            mDirtySync = true;
+        queue.unlock();
     }
 
     mLockedOffset = 0;
@@ -2,9 +2,18 @@
 #include "commandqueue.hpp"
 
 #include <exception>
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <sstream>
+#include <cxxabi.h>
 
 #include "glew.h"
 #include "trace.hpp"
+#include "allocators.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 
 
 static_assert(sizeof(Command) == sizeof(void*), "Command is larger than a pointer!");
@@ -30,12 +39,158 @@ ULONG FlushGLCmd::execute()
 }
 
 
+size_t CommandQueueSize = 1<<21;
+size_t CommandPayloadSize = 1<<20;
+unsigned int CommandQueueStatsInterval = 0;
+QueueWaitMode CommandQueueWaitMode = QueueWaitMode::Adaptive;
+bool CommandQueueForceLocking = false;
+
+
+static ULONG64 getTicks()
+{
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return count.QuadPart;
+}
+
+static double ticksToMs(ULONG64 ticks, ULONG64 freq)
+{ return ticks * 1000.0 / freq; }
+
+
+class DumpQueueStatsCmd : public Command {
+    CommandQueue *mQueue;
+    ULONG mFrames;
+
+public:
+    DumpQueueStatsCmd(CommandQueue *queue, ULONG frames) : mQueue(queue), mFrames(frames) { }
+
+    virtual ULONG execute()
+    {
+        CommandQueueStats &stats = *mQueue->mStats;
+        const ULONG64 freq = stats.mFrequency;
+
+        EnterCriticalSection(&mQueue->mLock);
+        ULONG stalls = stats.mProducerStalls;
+        ULONG64 stalltime = stats.mProducerStallTime;
+        ULONG64 idletime = stats.mConsumerIdleTime;
+        stats.mProducerStalls = 0;
+        stats.mProducerStallTime = 0;
+        stats.mConsumerIdleTime = 0;
+        LeaveCriticalSection(&mQueue->mLock);
+
+        log_printf(LogFile, "Command queue stats for %lu frames:\n"
+            "  ring high water: %lu of %u bytes\n"
+            "  producer stalls: %lu, %.3fms\n"
+            "  consumer idle:   %.3fms\n",
+            mFrames, stats.mHighWater, mQueue->mQueueSize, stalls,
+            ticksToMs(stalltime, freq), ticksToMs(idletime, freq)
+        );
+        stats.mHighWater = 0;
+
+        DataPoolStats pool;
+        DataPool::get().getStats(pool);
+        log_printf(LogFile, "  data pool: %lu allocs, %lu hits, %lu KB in use, %lu KB cached, %lu KB peak\n",
+            (unsigned long)pool.mAllocs, (unsigned long)pool.mHits, (unsigned long)(pool.mInUseBytes>>10),
+            (unsigned long)(pool.mCachedBytes>>10), (unsigned long)(pool.mPeakBytes>>10)
+        );
+
+        std::vector<CommandTypeStats*> types;
+        for(CommandTypeStats &type : stats.mTypes)
+        {
+            if(type.mCount > 0)
+                types.push_back(&type);
+        }
+        std::sort(types.begin(), types.end(),
+            [](const CommandTypeStats *lhs, const CommandTypeStats *rhs) -> bool
+            { return lhs->mTotalTime > rhs->mTotalTime; }
+        );
+
+        for(CommandTypeStats *type : types)
+        {
+            int status = 0;
+            char *name = abi::__cxa_demangle(type->mType->name(), nullptr, nullptr, &status);
+
+            char hist[CommandTypeStats::sNumBuckets*12];
+            size_t len = 0;
+            hist[0] = '\0';
+            for(ULONG64 count : type->mHistogram)
+            {
+                int ret = snprintf(hist+len, sizeof(hist)-len, " %lu", (unsigned long)count);
+                if(ret < 0 || (size_t)ret >= sizeof(hist)-len)
+                    break;
+                len += ret;
+            }
+
+            log_printf(LogFile, "  %s: %lu calls, %.3fms total, %.3fms max, histogram(us):%s\n",
+                name ? name : type->mType->name(), (unsigned long)type->mCount,
+                ticksToMs(type->mTotalTime, freq), ticksToMs(type->mMaxTime, freq), hist
+            );
+            free(name);
+
+            type->mCount = 0;
+            type->mTotalTime = 0;
+            type->mMaxTime = 0;
+            std::fill(std::begin(type->mHistogram), std::end(type->mHistogram), 0);
+        }
+
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class GetQueueStatsCmd : public Command {
+    CommandQueue *mQueue;
+    CommandQueueStats *mStats;
+
+public:
+    GetQueueStatsCmd(CommandQueue *queue, CommandQueueStats *stats) : mQueue(queue), mStats(stats) { }
+
+    virtual ULONG execute()
+    {
+        EnterCriticalSection(&mQueue->mLock);
+        *mStats = *mQueue->mStats;
+        LeaveCriticalSection(&mQueue->mLock);
+        DataPool::get().getStats(mStats->mDataPool);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+
+static size_t next_pow2(size_t size, size_t minsize)
+{
+    size_t ret = minsize;
+    while(ret < size)
+        ret <<= 1;
+    return ret;
+}
+
+
 CommandQueue::CommandQueue()
-  : mHead(0)
+  : mQueueSize(0)
+  , mQueueMask(0)
+  , mHead(0)
   , mTail(0)
+  , mQueueData(nullptr)
+  , mCommitted(nullptr)
+  , mHeld(sNoHeld)
+  , mHeldPos(0)
+  , mHeldEnd(0)
+  , mPayloadSize(0)
+  , mPayloadMask(0)
+  , mPayloadHead(0)
+  , mPayloadTail(0)
+  , mPayloadData(nullptr)
   , mSpinLock(false)
+  , mSingleProducer(false)
   , mThreadHdl(nullptr)
   , mThreadId(0)
+  , mStatsFrames(0)
+  , mWaitMode(QueueWaitMode::Adaptive)
+  , mParked(false)
+  , mWaiters(0)
+  , mSpinTicks(0)
+  , mMaxSpinTicks(0)
 {
     InitializeCriticalSection(&mLock);
     InitializeConditionVariable(&mCondVar);
@@ -45,10 +200,56 @@ CommandQueue::~CommandQueue()
 {
     deinit();
     DeleteCriticalSection(&mLock);
+
+    AlignedAllocator<char>().deallocate(mPayloadData, mPayloadSize);
+    mPayloadData = nullptr;
+    delete[] mCommitted;
+    mCommitted = nullptr;
+    AlignedAllocator<char>().deallocate(mQueueData, mQueueSize);
+    mQueueData = nullptr;
 }
 
-bool CommandQueue::init()
+bool CommandQueue::init(size_t queuesize, size_t payloadsize, bool singleproducer)
 {
+    mQueueSize = next_pow2(queuesize, sMinQueueSize);
+    mQueueMask = mQueueSize - 1;
+    mPayloadSize = next_pow2(payloadsize, sMinPayloadSize);
+    mPayloadMask = mPayloadSize - 1;
+    mSingleProducer = singleproducer;
+    TRACE("Using %u byte %s-producer command queue, %u byte payload arena\n", mQueueSize,
+          mSingleProducer ? "single" : "multi", mPayloadSize);
+
+    mQueueData = AlignedAllocator<char>().allocate(mQueueSize);
+    mCommitted = new std::atomic<bool>[mQueueSize/sizeof(Command)];
+    for(size_t i = 0;i < mQueueSize/sizeof(Command);++i)
+        mCommitted[i].store(false, std::memory_order_relaxed);
+    mPayloadData = AlignedAllocator<char>().allocate(mPayloadSize);
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    if(CommandQueueStatsInterval > 0)
+    {
+        mStats.reset(new CommandQueueStats());
+        mStats->mFrequency = freq.QuadPart;
+    }
+
+    mWaitMode = CommandQueueWaitMode;
+    mSpinTicks = freq.QuadPart * sHybridSpinUs / 1000000;
+    mMaxSpinTicks = freq.QuadPart * sMaxSpinUs / 1000000;
+
+    if(CommandStreamFile)
+    {
+        static ULONG StreamCount = 0;
+        std::stringstream sstr;
+        sstr<< CommandStreamFile;
+        if(StreamCount++ > 0)
+            sstr<< "."<<StreamCount;
+
+        mRecorder.reset(new CommandStreamWriter());
+        if(!mRecorder->open(sstr.str().c_str()))
+            mRecorder.reset();
+    }
+
     mThreadHdl = CreateThread(nullptr, 1024*1024, thread_func, this, 0, &mThreadId);
     if(!mThreadHdl)
     {
@@ -72,39 +273,250 @@ void CommandQueue::deinit()
         mThreadHdl = nullptr;
         mThreadId = 0;
     }
+    mRecorder.reset();
+}
+
+
+
+void CommandQueue::waitFence(ULONG fence)
+{
+    if(isFencePassed(fence))
+        return;
+
+    // Sent commands may be sitting in the queue until the command thread is
+    // woken up. Once it's going, spin a bit since most waits are short,
+    // before going to sleep on the condition variable.
+    wake();
+    for(int i = 0;i < sFenceSpinCount;++i)
+    {
+        if(isFencePassed(fence))
+            return;
+        YieldProcessor();
+    }
+
+    beginWait();
+    while(!isFencePassed(fence))
+        wait();
+    endWait();
+}
+
+
+template<typename F>
+bool CommandQueue::spinUntil(F done, ULONG64 budget) const
+{
+    if(budget == 0)
+        return false;
+
+    ULONG64 start = getTicks();
+    for(ULONG i = 1;;++i)
+    {
+        if(done())
+            return true;
+        // Don't need to check the time on every iteration.
+        if(!(i&63) && getTicks()-start >= budget)
+            return false;
+        YieldProcessor();
+    }
+}
+
+void CommandQueue::waitForSpace(ULONG head, size_t size)
+{
+    auto fits = [this,head,size]() -> bool
+    { return head-mTail.load(std::memory_order_acquire) + size <= mQueueSize; };
+
+    // The command thread may be asleep with commands waiting to go.
+    wake();
+    if(spinUntil(fits, producerSpinTicks()))
+        return;
+
+    beginWait();
+    WakeAllConditionVariable(&mCondVar);
+    if(!fits())
+        stallWait();
+    endWait();
+}
+
+void CommandQueue::stallWait()
+{
+    if(!mStats)
+    {
+        SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+        return;
+    }
+
+    ULONG64 start = getTicks();
+    SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+    ++mStats->mProducerStalls;
+    mStats->mProducerStallTime += getTicks() - start;
+}
+
+void CommandQueue::recordCommand(const std::type_info &type, ULONG64 ticks)
+{
+    const size_t count = CommandQueueStats::sMaxTypes;
+    size_t idx = (reinterpret_cast<uintptr_t>(&type)/sizeof(void*)) % count;
+    CommandTypeStats *stats = nullptr;
+    for(size_t i = 0;i < count;++i)
+    {
+        CommandTypeStats &entry = mStats->mTypes[(idx+i)%count];
+        if(entry.mType == &type || !entry.mType)
+        {
+            stats = &entry;
+            break;
+        }
+    }
+    if(!stats) return;
+
+    stats->mType = &type;
+    ++stats->mCount;
+    stats->mTotalTime += ticks;
+    stats->mMaxTime = std::max(stats->mMaxTime, ticks);
+
+    ULONG64 us = ticks * 1000000 / mStats->mFrequency;
+    size_t bucket = 0;
+    while(us > 0 && bucket < CommandTypeStats::sNumBuckets-1)
+    {
+        us >>= 1;
+        ++bucket;
+    }
+    ++stats->mHistogram[bucket];
+}
+
+
+void CommandQueue::endFrame()
+{
+    if(!mStats || ++mStatsFrames < CommandQueueStatsInterval)
+        return;
+    send<DumpQueueStatsCmd>(this, mStatsFrames);
+    mStatsFrames = 0;
+}
+
+bool CommandQueue::getStats(CommandQueueStats &stats)
+{
+    if(!mStats)
+        return false;
+    sendSync<GetQueueStatsCmd>(this, &stats);
+    stats.mFrames = mStatsFrames;
+    return true;
 }
 
 
+void *CommandQueue::allocPayload(size_t size, ULONG &end)
+{
+    size = (size+15) & ~size_t(15);
+
+    // Like the command ring, a payload that doesn't fit before the end of
+    // the arena wraps around to the start.
+    ULONG head = mPayloadHead;
+    ULONG pad = mPayloadSize - (head&mPayloadMask);
+    if(pad >= size) pad = 0;
+    if(pad+size > mPayloadSize)
+    {
+        ERR("Payload too large (%u > %u)\n", size, mPayloadSize);
+        std::terminate();
+    }
+
+    auto fits = [this,head,pad,size]() -> bool
+    { return head-mPayloadTail.load(std::memory_order_acquire) + pad+size <= mPayloadSize; };
+    if(!fits())
+    {
+        wake();
+        spinUntil(fits, producerSpinTicks());
+    }
+    while(!fits())
+    {
+        beginWait();
+        WakeAllConditionVariable(&mCondVar);
+        if(head-mPayloadTail.load() + pad+size > mPayloadSize)
+            stallWait();
+        endWait();
+    }
+
+    head += pad;
+    void *ptr = &mPayloadData[head&mPayloadMask];
+    mPayloadHead = end = head + size;
+    return ptr;
+}
+
 
 DWORD CommandQueue::run(void)
 {
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
 
     TRACE("Starting command thread\n");
+    Timeline::setThreadName("Command thread");
 restart_loop:
     while(1)
     {
-        ULONG tail = mTail.load();
-        if(tail == mHead)
+        ULONG tail = mTail.load(std::memory_order_relaxed);
+        std::atomic<bool> &committed = mCommitted[(tail&mQueueMask)/sizeof(Command)];
+        if(!committed.load(std::memory_order_acquire))
         {
-            EnterCriticalSection(&mLock);
-            WakeAllConditionVariable(&mCondVar);
-            while(tail == mHead)
+            auto ready = [&committed]() -> bool
+            { return committed.load(std::memory_order_acquire); };
+
+            ULONG64 idlestart = getTicks();
+            if(!spinUntil(ready, consumerSpinTicks()))
             {
-                if(!SleepConditionVariableCS(&mCondVar, &mLock, INFINITE))
+                // Producers check mParked after sending, so make sure either
+                // they see it set or this sees their commands.
+                EnterCriticalSection(&mLock);
+                WakeAllConditionVariable(&mCondVar);
+                mParked.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while(!ready())
                 {
-                    ERR("SleepConditionVariableCS failed! Error: %lu\n", GetLastError());
-                    LeaveCriticalSection(&mLock);
-                    goto restart_loop;
+                    if(!SleepConditionVariableCS(&mCondVar, &mLock, INFINITE))
+                    {
+                        ERR("SleepConditionVariableCS failed! Error: %lu\n", GetLastError());
+                        mParked.store(false, std::memory_order_relaxed);
+                        LeaveCriticalSection(&mLock);
+                        goto restart_loop;
+                    }
                 }
+                mParked.store(false, std::memory_order_relaxed);
+                LeaveCriticalSection(&mLock);
+            }
+
+            ULONG64 idle = getTicks() - idlestart;
+            if(mStats)
+                mStats->mConsumerIdleTime += idle;
+            if(mWaitMode == QueueWaitMode::Adaptive)
+            {
+                // Aim to spin for about twice the typical gap between
+                // commands, and back off when the gaps are too long for
+                // spinning to catch.
+                if(idle <= mMaxSpinTicks)
+                    mSpinTicks = std::min((mSpinTicks*7 + idle*2) / 8, mMaxSpinTicks);
+                else
+                    mSpinTicks = mSpinTicks*3 / 4;
             }
-            LeaveCriticalSection(&mLock);
         }
 
-        Command *cmd = reinterpret_cast<Command*>(&mQueueData[tail]);
+        Command *cmd = reinterpret_cast<Command*>(&mQueueData[tail&mQueueMask]);
         TRACE("Executing %p\n", cmd);
 
-        ULONG size = cmd->execute();
+        ULONG size;
+        if(!mStats && !Timeline::isActiveGL())
+            size = cmd->execute();
+        else
+        {
+            if(mStats)
+            {
+                ULONG used = mHead.load(std::memory_order_relaxed) - tail;
+                mStats->mHighWater = std::max(mStats->mHighWater, used);
+            }
+
+            const std::type_info &type = typeid(*cmd);
+            ULONG64 start = getTicks();
+            size = cmd->execute();
+            ULONG64 end = getTicks();
+            if(mStats)
+                recordCommand(type, end - start);
+            if(Timeline::isActiveGL())
+                Timeline::addEvent(type, start, end);
+        }
+        if(mRecorder)
+            cmd->record(*mRecorder);
         if(size < sizeof(Command))
         {
             ERR("Command returned too small size (%lu < %u)\n", size, sizeof(Command));
@@ -112,9 +524,20 @@ restart_loop:
         }
         cmd->~Command();
 
-        tail += size;
-        mTail.store(tail&sQueueMask);
-        WakeAllConditionVariable(&mCondVar);
+        committed.store(false, std::memory_order_relaxed);
+        mTail.store(tail+size, std::memory_order_release);
+
+        // A waiter counts itself under the lock before checking the tail, so
+        // either it sees the new tail or this sees it waiting. Taking the lock
+        // makes sure it's asleep before it's signaled, because the command
+        // thread may never park to wake it otherwise.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mWaiters.load(std::memory_order_relaxed))
+        {
+            EnterCriticalSection(&mLock);
+            LeaveCriticalSection(&mLock);
+            WakeAllConditionVariable(&mCondVar);
+        }
     }
     ERR("Command thread loop broken\n");
 
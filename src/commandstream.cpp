@@ -0,0 +1,950 @@
+
+#include "commandstream.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cxxabi.h>
+
+#include "wglew.h"
+#include "trace.hpp"
+#include "commandqueue.hpp"
+
+
+const char *CommandStreamFile = nullptr;
+
+
+namespace
+{
+
+const char StreamMagic[8] = { 'D', '3', 'D', 'G', 'L', 'C', 'S', '\0' };
+const uint32_t StreamVersion = 1;
+
+// Body size of each op, indexed by StreamOp.
+const uint16_t StreamOpSizes[size_t(StreamOp::Count)] = {
+    sizeof(StreamDeviceInit),
+    sizeof(StreamEnable),
+    sizeof(StreamMaterial),
+    sizeof(StreamViewport),
+    sizeof(StreamRect),
+    sizeof(StreamValue),
+    sizeof(StreamValue),
+    sizeof(StreamColorMask),
+    sizeof(StreamValue),
+    sizeof(StreamValue),
+    sizeof(StreamAlphaFunc),
+    sizeof(StreamBlendFunc),
+    sizeof(StreamStencilFunc),
+    sizeof(StreamBlendFunc),
+    sizeof(StreamStencilOp),
+    sizeof(StreamValue),
+    sizeof(StreamDepthBias),
+    sizeof(StreamFog),
+    sizeof(StreamSamplerParam),
+    sizeof(StreamSamplerParam),
+    sizeof(StreamValue),
+    sizeof(StreamValue),
+    sizeof(StreamBindTexture),
+    sizeof(StreamValue),
+    sizeof(StreamBindBuffer),
+    sizeof(StreamValue),
+    sizeof(StreamFBAttachment),
+    sizeof(StreamClear),
+    sizeof(StreamDraw),
+    sizeof(StreamDraw),
+    sizeof(StreamBlit),
+    sizeof(StreamValue),
+    sizeof(StreamValue),
+    sizeof(StreamBufferData),
+    sizeof(StreamBufferSubData),
+    sizeof(StreamValue),
+    sizeof(StreamTexImage),
+    sizeof(StreamTexSubImage),
+    sizeof(StreamBindTexture),
+    sizeof(StreamValue),
+    sizeof(StreamRenderbuffer),
+    sizeof(StreamValue),
+    sizeof(StreamProgram),
+    sizeof(StreamProgram),
+    sizeof(StreamProgram),
+    sizeof(StreamValue),
+    sizeof(StreamProgramStages),
+    sizeof(StreamBindSampler),
+    sizeof(StreamCopyImage),
+};
+
+size_t recordLength(const StreamRecord *record)
+{ return sizeof(StreamRecord) + ((record->mSize+record->mDataSize+7) & ~size_t(7)); }
+
+template<typename T>
+const T &getBody(const StreamRecord *record)
+{ return *reinterpret_cast<const T*>(record+1); }
+
+const char *getData(const StreamRecord *record)
+{ return reinterpret_cast<const char*>(record+1) + record->mSize; }
+
+bool isFace2DTarget(GLenum target)
+{
+    return target == GL_TEXTURE_2D || target == GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
+           target == GL_TEXTURE_CUBE_MAP_NEGATIVE_X || target == GL_TEXTURE_CUBE_MAP_POSITIVE_Y ||
+           target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y || target == GL_TEXTURE_CUBE_MAP_POSITIVE_Z ||
+           target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z;
+}
+
+
+class ReplayRecordCmd : public Command {
+    CommandStreamPlayer *mPlayer;
+    const StreamRecord *mRecord;
+
+public:
+    ReplayRecordCmd(CommandStreamPlayer *player, const StreamRecord *record)
+      : mPlayer(player), mRecord(record)
+    { }
+
+    virtual ULONG execute()
+    {
+        mPlayer->executeGL(mRecord);
+        return sizeof(*this);
+    }
+};
+
+class ReplayResetCmd : public Command {
+    CommandStreamPlayer *mPlayer;
+
+public:
+    ReplayResetCmd(CommandStreamPlayer *player) : mPlayer(player) { }
+
+    virtual ULONG execute()
+    {
+        mPlayer->resetGL();
+        return sizeof(*this);
+    }
+};
+
+} // namespace
+
+
+void Command::record(CommandStreamWriter &stream) const
+{
+    stream.unsupported(typeid(*this));
+}
+
+
+CommandStreamWriter::CommandStreamWriter()
+  : mFile(nullptr)
+  , mStart(0)
+  , mFrequency(1)
+  , mRecords(0)
+  , mBytes(0)
+{
+}
+
+CommandStreamWriter::~CommandStreamWriter()
+{
+    close();
+}
+
+bool CommandStreamWriter::open(const char *fname)
+{
+    mFile = fopen(fname, "wb");
+    if(!mFile)
+    {
+        ERR("Failed to open %s for writing\n", fname);
+        return false;
+    }
+    setvbuf(mFile, nullptr, _IOFBF, 1<<20);
+
+    StreamFileHeader header;
+    memcpy(header.mMagic, StreamMagic, sizeof(header.mMagic));
+    header.mVersion = StreamVersion;
+    header.mReserved = 0;
+    fwrite(&header, sizeof(header), 1, mFile);
+    mBytes = sizeof(header);
+
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&count);
+    mFrequency = count.QuadPart;
+    QueryPerformanceCounter(&count);
+    mStart = count.QuadPart;
+
+    log_printf(LogFile, "Recording command stream to %s\n", fname);
+    return true;
+}
+
+void CommandStreamWriter::close()
+{
+    if(!mFile)
+        return;
+    fclose(mFile);
+    mFile = nullptr;
+
+    log_printf(LogFile, "Recorded %lu command stream records, %lu bytes\n",
+               (unsigned long)mRecords, (unsigned long)mBytes);
+    for(const auto &type : mUnsupported)
+    {
+        int status = 0;
+        char *name = abi::__cxa_demangle(type.first->name(), nullptr, nullptr, &status);
+        log_printf(LogFile, "  not recorded: %s (%lu times)\n", name ? name : type.first->name(),
+                   (unsigned long)type.second);
+        free(name);
+    }
+    mUnsupported.clear();
+}
+
+void CommandStreamWriter::writeRecord(StreamOp op, const void *body, size_t size, const void *data, size_t datalen)
+{
+    static const char padding[8] = { 0 };
+
+    if(!mFile)
+        return;
+
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+
+    StreamRecord record;
+    record.mOp = op;
+    record.mSize = size;
+    record.mDataSize = datalen;
+    record.mTime = (count.QuadPart-mStart) * 1000000 / mFrequency;
+
+    fwrite(&record, sizeof(record), 1, mFile);
+    fwrite(body, 1, size, mFile);
+    if(datalen > 0)
+        fwrite(data, 1, datalen, mFile);
+    size_t pad = recordLength(&record) - sizeof(record) - size - datalen;
+    if(pad > 0)
+        fwrite(padding, 1, pad, mFile);
+
+    if(ferror(mFile))
+    {
+        ERR("Failed to write command stream, stopping recording\n");
+        close();
+        return;
+    }
+
+    ++mRecords;
+    mBytes += recordLength(&record);
+}
+
+
+CommandStreamPlayer::CommandStreamPlayer(CommandQueue &queue, HDC dc)
+  : mQueue(queue)
+  , mDevCtx(dc)
+  , mMainFramebuffer(0)
+  , mCopyFramebuffers{0,0}
+  , mCurrentFramebuffer{0,0}
+  , mActiveStage(0)
+  , mClipPlanes(0)
+  , mAttribArrays(0)
+  , mFrames(0)
+{
+}
+
+bool CommandStreamPlayer::load(const char *fname)
+{
+    FILE *file = fopen(fname, "rb");
+    if(!file)
+    {
+        ERR("Failed to open %s\n", fname);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size < (long)sizeof(StreamFileHeader))
+    {
+        ERR("%s is too small to be a command stream\n", fname);
+        fclose(file);
+        return false;
+    }
+
+    mData.resize((size+7) / 8);
+    size_t got = fread(mData.data(), 1, size, file);
+    fclose(file);
+    if(got != (size_t)size)
+    {
+        ERR("Failed to read %s\n", fname);
+        return false;
+    }
+
+    const char *base = reinterpret_cast<const char*>(mData.data());
+    const StreamFileHeader *header = reinterpret_cast<const StreamFileHeader*>(base);
+    if(memcmp(header->mMagic, StreamMagic, sizeof(header->mMagic)) != 0 ||
+       header->mVersion != StreamVersion)
+    {
+        ERR("%s is not a version %u command stream\n", fname, StreamVersion);
+        return false;
+    }
+
+    mRecords.clear();
+    size_t pos = sizeof(StreamFileHeader);
+    while(pos+sizeof(StreamRecord) <= (size_t)size)
+    {
+        const StreamRecord *record = reinterpret_cast<const StreamRecord*>(base+pos);
+        if(record->mOp >= StreamOp::Count || record->mSize != StreamOpSizes[size_t(record->mOp)] ||
+           pos+recordLength(record) > (size_t)size)
+        {
+            ERR("Bad record at offset %lu, ignoring the rest of the stream\n", (unsigned long)pos);
+            break;
+        }
+        mRecords.push_back(record);
+        pos += recordLength(record);
+    }
+
+    TRACE("Loaded %u records from %s\n", mRecords.size(), fname);
+    return true;
+}
+
+bool CommandStreamPlayer::getWindowSize(GLsizei &width, GLsizei &height) const
+{
+    for(const StreamRecord *record : mRecords)
+    {
+        if(record->mOp != StreamOp::Blit)
+            continue;
+        const StreamBlit &blit = getBody<StreamBlit>(record);
+        if(blit.mDstTarget != GL_NONE)
+            continue;
+        width = std::abs(blit.mDstRect.mRight - blit.mDstRect.mLeft);
+        height = std::abs(blit.mDstRect.mBottom - blit.mDstRect.mTop);
+        return true;
+    }
+    return false;
+}
+
+void CommandStreamPlayer::play(bool timed)
+{
+    LARGE_INTEGER freq, start;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    mFrames = 0;
+    for(const StreamRecord *record : mRecords)
+    {
+        if(timed)
+        {
+            LONGLONG target = start.QuadPart + LONGLONG(record->mTime) * freq.QuadPart / 1000000;
+            LARGE_INTEGER now;
+            while(QueryPerformanceCounter(&now), now.QuadPart < target)
+            {
+                if(target-now.QuadPart > freq.QuadPart/500)
+                    Sleep(1);
+                else
+                    YieldProcessor();
+            }
+        }
+
+        mQueue.send<ReplayRecordCmd>(this, record);
+        if(timed || record->mOp == StreamOp::Swap)
+            mQueue.wake();
+    }
+    mQueue.waitFence(mQueue.send<ReplayResetCmd>(this));
+}
+
+
+GLuint CommandStreamPlayer::getName(std::map<GLuint,GLuint> &names, GLuint name) const
+{
+    if(name == 0)
+        return 0;
+    auto iter = names.find(name);
+    if(iter == names.end())
+    {
+        WARN("Unknown object name %u\n", name);
+        return 0;
+    }
+    return iter->second;
+}
+
+void CommandStreamPlayer::bindMainFramebuffer()
+{
+    if(mCurrentFramebuffer[0] != mMainFramebuffer)
+    {
+        mCurrentFramebuffer[0] = mMainFramebuffer;
+        mCurrentFramebuffer[1] = mMainFramebuffer;
+        glBindFramebuffer(GL_FRAMEBUFFER, mMainFramebuffer);
+    }
+}
+
+void CommandStreamPlayer::attachCopyGL(GLenum fbtarget, GLenum target, GLuint name, GLint level)
+{
+    if(target == GL_RENDERBUFFER)
+        glFramebufferRenderbuffer(fbtarget, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                                  getName(mRenderbuffers, name));
+    else if(isFace2DTarget(target))
+        glFramebufferTexture2D(fbtarget, GL_COLOR_ATTACHMENT0, target,
+                               getName(mTextures, name), level);
+    else
+        ERR("Unhandled blit target: 0x%x\n", target);
+}
+
+
+void CommandStreamPlayer::executeGL(const StreamRecord *record)
+{
+    const char *data = getData(record);
+
+    switch(record->mOp)
+    {
+    case StreamOp::DeviceInit: {
+        const StreamDeviceInit &init = getBody<StreamDeviceInit>(record);
+        GLuint count = std::min<GLuint>(init.mNumSamplers, StreamDeviceInit::sMaxSamplers);
+        for(GLuint i = 0;i < count;++i)
+        {
+            GLint color[4]{0, 0, 0, 0};
+            GLuint sampler;
+            glGenSamplers(1, &sampler);
+            mSamplers[init.mSamplers[i]] = sampler;
+            glBindSampler(i, sampler);
+            glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, GL_REPEAT);
+            glSamplerParameteriv(sampler, GL_TEXTURE_BORDER_COLOR, color);
+            glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glSamplerParameteri(sampler, GL_TEXTURE_SRGB_DECODE_EXT, GL_SKIP_DECODE_EXT);
+            if(GLEW_EXT_texture_filter_anisotropic)
+                glSamplerParameteri(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, 1);
+        }
+
+        GLuint pipeline;
+        glGenProgramPipelines(1, &pipeline);
+        glBindProgramPipeline(pipeline);
+        mPipelines[init.mPipeline] = pipeline;
+
+        glGenFramebuffers(1, &mMainFramebuffer);
+        glGenFramebuffers(2, mCopyFramebuffers);
+        mFramebuffers[init.mMainFramebuffer] = mMainFramebuffer;
+        mFramebuffers[init.mCopyFramebuffers[0]] = mCopyFramebuffers[0];
+        mFramebuffers[init.mCopyFramebuffers[1]] = mCopyFramebuffers[1];
+
+        glActiveTexture(GL_TEXTURE0);
+        mActiveStage = 0;
+        mAttribArrays = 0;
+        mClipPlanes = 0;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, mMainFramebuffer);
+        mCurrentFramebuffer[0] = mMainFramebuffer;
+        mCurrentFramebuffer[1] = mMainFramebuffer;
+        GLenum buffers[4]{
+            GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+            GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3
+        };
+        glDrawBuffers(4, buffers);
+        glFrontFace(GL_CCW);
+        break;
+    }
+
+    case StreamOp::Enable: {
+        const StreamEnable &state = getBody<StreamEnable>(record);
+        if(state.mEnable)
+            glEnable(state.mState);
+        else
+            glDisable(state.mState);
+        break;
+    }
+    case StreamOp::Material: {
+        const StreamMaterial &material = getBody<StreamMaterial>(record);
+        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, material.mShininess);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, material.mDiffuse);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, material.mAmbient);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, material.mSpecular);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, material.mEmission);
+        break;
+    }
+    case StreamOp::Viewport: {
+        const StreamViewport &viewport = getBody<StreamViewport>(record);
+        glViewport(viewport.mX, viewport.mY, viewport.mWidth, viewport.mHeight);
+        glDepthRange(viewport.mMinZ, viewport.mMaxZ);
+        break;
+    }
+    case StreamOp::Scissor: {
+        const StreamRect &rect = getBody<StreamRect>(record);
+        glScissor(rect.mLeft, rect.mTop, rect.mRight-rect.mLeft, rect.mBottom-rect.mTop);
+        break;
+    }
+    case StreamOp::PolygonMode:
+        glPolygonMode(GL_FRONT_AND_BACK, getBody<StreamValue>(record).mValue);
+        break;
+    case StreamOp::CullFace: {
+        GLenum face = getBody<StreamValue>(record).mValue;
+        if(!face)
+            glDisable(GL_CULL_FACE);
+        else
+        {
+            glEnable(GL_CULL_FACE);
+            glCullFace(face);
+        }
+        break;
+    }
+    case StreamOp::ColorMask: {
+        const StreamColorMask &mask = getBody<StreamColorMask>(record);
+        glColorMaski(mask.mIndex,
+            !!(mask.mMask&D3DCOLORWRITEENABLE_RED), !!(mask.mMask&D3DCOLORWRITEENABLE_GREEN),
+            !!(mask.mMask&D3DCOLORWRITEENABLE_BLUE), !!(mask.mMask&D3DCOLORWRITEENABLE_ALPHA)
+        );
+        break;
+    }
+    case StreamOp::DepthMask:
+        glDepthMask(getBody<StreamValue>(record).mValue);
+        break;
+    case StreamOp::DepthFunc:
+        glDepthFunc(getBody<StreamValue>(record).mValue);
+        break;
+    case StreamOp::AlphaFunc: {
+        const StreamAlphaFunc &func = getBody<StreamAlphaFunc>(record);
+        glAlphaFunc(func.mFunc, std::min(std::max(func.mRef, 0.0f), 1.0f));
+        break;
+    }
+    case StreamOp::BlendFunc: {
+        const StreamBlendFunc &func = getBody<StreamBlendFunc>(record);
+        glBlendFunc(func.mSrc, func.mDst);
+        break;
+    }
+    case StreamOp::StencilFunc: {
+        const StreamStencilFunc &func = getBody<StreamStencilFunc>(record);
+        glStencilFuncSeparate(func.mFace, func.mFunc, func.mRef, func.mMask);
+        break;
+    }
+    case StreamOp::BlendOp: {
+        const StreamBlendFunc &op = getBody<StreamBlendFunc>(record);
+        glBlendEquationSeparate(op.mSrc, op.mDst);
+        break;
+    }
+    case StreamOp::StencilOp: {
+        const StreamStencilOp &op = getBody<StreamStencilOp>(record);
+        glStencilOpSeparate(op.mFace, op.mFail, op.mZFail, op.mZPass);
+        break;
+    }
+    case StreamOp::StencilMask:
+        glStencilMask(getBody<StreamValue>(record).mValue);
+        break;
+    case StreamOp::DepthBias: {
+        const StreamDepthBias &bias = getBody<StreamDepthBias>(record);
+        if(bias.mScale == 0.0f && bias.mBias == 0.0f)
+            glDisable(GL_POLYGON_OFFSET_FILL);
+        else
+        {
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(bias.mScale, bias.mBias);
+        }
+        break;
+    }
+    case StreamOp::Fog: {
+        const StreamFog &fog = getBody<StreamFog>(record);
+        glFogfv(fog.mParam, fog.mValues);
+        break;
+    }
+    case StreamOp::SamplerParami: {
+        const StreamSamplerParam &param = getBody<StreamSamplerParam>(record);
+        if(param.mParam != GL_TEXTURE_MAX_ANISOTROPY_EXT || GLEW_EXT_texture_filter_anisotropic)
+            glSamplerParameteri(getName(mSamplers, param.mSampler), param.mParam, param.mValue);
+        break;
+    }
+    case StreamOp::SamplerParamf: {
+        const StreamSamplerParam &param = getBody<StreamSamplerParam>(record);
+        glSamplerParameterfv(getName(mSamplers, param.mSampler), param.mParam, param.mValues);
+        break;
+    }
+
+    case StreamOp::ClipPlanes: {
+        GLuint planes = getBody<StreamValue>(record).mValue;
+        GLuint old_planes = mClipPlanes;
+        mClipPlanes = planes;
+        for(GLuint i = 0;old_planes || planes;++i)
+        {
+            if((planes&1) && !(old_planes&1))
+                glEnable(GL_CLIP_DISTANCE0+i);
+            else if(!(planes&1) && (old_planes&1))
+                glDisable(GL_CLIP_DISTANCE0+i);
+            old_planes >>= 1;
+            planes >>= 1;
+        }
+        break;
+    }
+    case StreamOp::AttribArrays: {
+        GLuint attribs = getBody<StreamValue>(record).mValue;
+        GLuint old_attribs = mAttribArrays;
+        mAttribArrays = attribs;
+        for(GLuint i = 0;old_attribs || attribs;++i)
+        {
+            if((attribs&1) && !(old_attribs&1))
+                glEnableVertexAttribArray(i);
+            else if(!(attribs&1) && (old_attribs&1))
+            {
+                glDisableVertexAttribArray(i);
+                glVertexAttrib4f(i, 0.0f, 0.0f, 0.0f, 1.0f);
+            }
+            old_attribs >>= 1;
+            attribs >>= 1;
+        }
+        break;
+    }
+    case StreamOp::BindTexture: {
+        const StreamBindTexture &bind = getBody<StreamBindTexture>(record);
+        if(bind.mStage != mActiveStage)
+        {
+            mActiveStage = bind.mStage;
+            glActiveTexture(GL_TEXTURE0 + bind.mStage);
+        }
+        glBindTexture(bind.mTarget, getName(mTextures, bind.mTexture));
+        break;
+    }
+    case StreamOp::BindElements:
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, getName(mBuffers, getBody<StreamValue>(record).mValue));
+        break;
+    case StreamOp::BindUniformBuffer: {
+        const StreamBindBuffer &bind = getBody<StreamBindBuffer>(record);
+        glBindBufferBase(GL_UNIFORM_BUFFER, bind.mIndex, getName(mBuffers, bind.mBuffer));
+        break;
+    }
+    case StreamOp::VertexStreams: {
+        GLuint count = std::min<size_t>(getBody<StreamValue>(record).mValue,
+                                        record->mDataSize / sizeof(StreamVertexAttrib));
+        const StreamVertexAttrib *attribs = reinterpret_cast<const StreamVertexAttrib*>(data);
+        GLuint binding = 0;
+        for(GLuint i = 0;i < count;++i)
+        {
+            if(binding != attribs[i].mBuffer)
+            {
+                binding = attribs[i].mBuffer;
+                glBindBuffer(GL_ARRAY_BUFFER, getName(mBuffers, binding));
+            }
+            glVertexAttribPointer(attribs[i].mTarget, attribs[i].mCount, attribs[i].mType,
+                                  attribs[i].mNormalize, attribs[i].mStride,
+                                  reinterpret_cast<GLubyte*>(uintptr_t(attribs[i].mOffset)));
+            if(attribs[i].mStride == 0)
+                glVertexAttribDivisor(attribs[i].mTarget, 65535);
+            else
+                glVertexAttribDivisor(attribs[i].mTarget, attribs[i].mDivisor);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        break;
+    }
+    case StreamOp::FBAttachment: {
+        const StreamFBAttachment &attach = getBody<StreamFBAttachment>(record);
+        if(attach.mTarget == GL_RENDERBUFFER)
+            glNamedFramebufferRenderbufferEXT(mMainFramebuffer, attach.mAttachment, GL_RENDERBUFFER,
+                                              getName(mRenderbuffers, attach.mName));
+        else if(isFace2DTarget(attach.mTarget))
+            glNamedFramebufferTexture2DEXT(mMainFramebuffer, attach.mAttachment, attach.mTarget,
+                                           getName(mTextures, attach.mName), attach.mLevel);
+        break;
+    }
+
+    case StreamOp::Clear: {
+        const StreamClear &clear = getBody<StreamClear>(record);
+        bindMainFramebuffer();
+
+        glPushAttrib(clear.mMask | GL_SCISSOR_BIT);
+        if((clear.mMask&GL_COLOR_BUFFER_BIT))
+        {
+            glClearColor(((clear.mColor>>16)&0xff)/255.0f, ((clear.mColor>>8)&0xff)/255.0f,
+                         (clear.mColor&0xff)/255.0f, ((clear.mColor>>24)&0xff)/255.0f);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        }
+        if((clear.mMask&GL_DEPTH_BUFFER_BIT))
+        {
+            glClearDepth(clear.mDepth);
+            glDepthMask(GL_TRUE);
+        }
+        if((clear.mMask&GL_STENCIL_BUFFER_BIT))
+        {
+            glClearStencil(clear.mStencil);
+            glStencilMask(GL_TRUE);
+        }
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(clear.mRect.mLeft, clear.mRect.mTop, clear.mRect.mRight-clear.mRect.mLeft,
+                  clear.mRect.mBottom-clear.mRect.mTop);
+        glClear(clear.mMask);
+        glPopAttrib();
+        break;
+    }
+    case StreamOp::DrawArrays: {
+        const StreamDraw &draw = getBody<StreamDraw>(record);
+        bindMainFramebuffer();
+        glDrawArraysInstanced(draw.mMode, draw.mBaseVtx, draw.mCount, draw.mNumInstances);
+        break;
+    }
+    case StreamOp::DrawElements: {
+        const StreamDraw &draw = getBody<StreamDraw>(record);
+        bindMainFramebuffer();
+        glDrawElementsInstancedBaseVertex(draw.mMode, draw.mCount, draw.mType,
+                                          reinterpret_cast<GLubyte*>(uintptr_t(draw.mOffset)),
+                                          draw.mNumInstances, draw.mBaseVtx);
+        break;
+    }
+    case StreamOp::Blit: {
+        const StreamBlit &blit = getBody<StreamBlit>(record);
+        if(mCurrentFramebuffer[0] != mCopyFramebuffers[0])
+        {
+            mCurrentFramebuffer[0] = mCopyFramebuffers[0];
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, mCopyFramebuffers[0]);
+        }
+        attachCopyGL(GL_READ_FRAMEBUFFER, blit.mSrcTarget, blit.mSrcName, blit.mSrcLevel);
+
+        GLuint dstfb = blit.mDstTarget ? mCopyFramebuffers[1] : 0;
+        if(mCurrentFramebuffer[1] != dstfb)
+        {
+            mCurrentFramebuffer[1] = dstfb;
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dstfb);
+        }
+        if(blit.mDstTarget)
+            attachCopyGL(GL_DRAW_FRAMEBUFFER, blit.mDstTarget, blit.mDstName, blit.mDstLevel);
+
+        glPushAttrib(GL_SCISSOR_BIT);
+        glDisable(GL_SCISSOR_TEST);
+        glBlitFramebuffer(blit.mSrcRect.mLeft, blit.mSrcRect.mTop, blit.mSrcRect.mRight, blit.mSrcRect.mBottom,
+                          blit.mDstRect.mLeft, blit.mDstRect.mTop, blit.mDstRect.mRight, blit.mDstRect.mBottom,
+                          GL_COLOR_BUFFER_BIT, blit.mFilter);
+        glPopAttrib();
+        break;
+    }
+    case StreamOp::Swap:
+        if(!SwapBuffers(mDevCtx))
+            ERR("Failed to swap buffers, error: 0x%lx\n", GetLastError());
+        ++mFrames;
+        break;
+    case StreamOp::SwapInterval:
+        if(WGLEW_EXT_swap_control)
+            wglSwapIntervalEXT(getBody<StreamValue>(record).mValue);
+        break;
+
+    case StreamOp::BufferData: {
+        const StreamBufferData &buffer = getBody<StreamBufferData>(record);
+        GLuint &name = mBuffers[buffer.mBuffer];
+        if(!name)
+            glGenBuffers(1, &name);
+        glNamedBufferDataEXT(name, buffer.mSize, record->mDataSize ? data : nullptr, buffer.mUsage);
+        break;
+    }
+    case StreamOp::BufferSubData: {
+        const StreamBufferSubData &buffer = getBody<StreamBufferSubData>(record);
+        glNamedBufferSubDataEXT(getName(mBuffers, buffer.mBuffer), buffer.mOffset,
+                                record->mDataSize, data);
+        break;
+    }
+    case StreamOp::BufferDelete: {
+        auto iter = mBuffers.find(getBody<StreamValue>(record).mValue);
+        if(iter != mBuffers.end())
+        {
+            glDeleteBuffers(1, &iter->second);
+            mBuffers.erase(iter);
+        }
+        break;
+    }
+
+    case StreamOp::TextureImage: {
+        const StreamTexImage &image = getBody<StreamTexImage>(record);
+        GLuint &name = mTextures[image.mTexture];
+        if(name)
+            glDeleteTextures(1, &name);
+        glGenTextures(1, &name);
+        glTextureParameteriEXT(name, image.mTarget, GL_TEXTURE_MAX_LEVEL, image.mLevels-1);
+        if(image.mTarget == GL_TEXTURE_3D)
+            glTextureImage3DEXT(name, GL_TEXTURE_3D, 0, image.mInternalFormat, image.mWidth, image.mHeight,
+                                image.mDepth, 0, image.mFormat, image.mType, nullptr);
+        else if(image.mTarget == GL_TEXTURE_CUBE_MAP)
+        {
+            for(GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X;face <= GL_TEXTURE_CUBE_MAP_NEGATIVE_Z;++face)
+                glTextureImage2DEXT(name, face, 0, image.mInternalFormat, image.mWidth, image.mHeight, 0,
+                                    image.mFormat, image.mType, nullptr);
+        }
+        else
+            glTextureImage2DEXT(name, image.mTarget, 0, image.mInternalFormat, image.mWidth, image.mHeight, 0,
+                                image.mFormat, image.mType, nullptr);
+        if(image.mLevels > 1)
+            glGenerateTextureMipmapEXT(name, image.mTarget);
+        break;
+    }
+    case StreamOp::TextureSubImage: {
+        const StreamTexSubImage &image = getBody<StreamTexSubImage>(record);
+        GLuint name = getName(mTextures, image.mTexture);
+        if(image.mType == GL_NONE)
+        {
+            if(image.mTarget == GL_TEXTURE_3D)
+                glCompressedTextureSubImage3DEXT(name, image.mTarget, image.mLevel,
+                    image.mX, image.mY, image.mZ, image.mWidth, image.mHeight, image.mDepth,
+                    image.mFormat, record->mDataSize, data
+                );
+            else
+                glCompressedTextureSubImage2DEXT(name, image.mTarget, image.mLevel,
+                    image.mX, image.mY, image.mWidth, image.mHeight,
+                    image.mFormat, record->mDataSize, data
+                );
+            break;
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, image.mRowLength);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, image.mImageHeight);
+        if(image.mTarget == GL_TEXTURE_3D)
+            glTextureSubImage3DEXT(name, image.mTarget, image.mLevel,
+                image.mX, image.mY, image.mZ, image.mWidth, image.mHeight, image.mDepth,
+                image.mFormat, image.mType, data
+            );
+        else
+            glTextureSubImage2DEXT(name, image.mTarget, image.mLevel,
+                image.mX, image.mY, image.mWidth, image.mHeight,
+                image.mFormat, image.mType, data
+            );
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+        break;
+    }
+    case StreamOp::TextureGenMip: {
+        const StreamBindTexture &tex = getBody<StreamBindTexture>(record);
+        glGenerateTextureMipmapEXT(getName(mTextures, tex.mTexture), tex.mTarget);
+        break;
+    }
+    case StreamOp::TextureDelete: {
+        auto iter = mTextures.find(getBody<StreamValue>(record).mValue);
+        if(iter != mTextures.end())
+        {
+            glDeleteTextures(1, &iter->second);
+            mTextures.erase(iter);
+        }
+        break;
+    }
+
+    case StreamOp::RenderbufferStorage: {
+        const StreamRenderbuffer &rb = getBody<StreamRenderbuffer>(record);
+        GLuint &name = mRenderbuffers[rb.mRenderbuffer];
+        if(name)
+            glDeleteRenderbuffers(1, &name);
+        glGenRenderbuffers(1, &name);
+        glBindRenderbuffer(GL_RENDERBUFFER, name);
+        if(rb.mSamples <= 0)
+            glRenderbufferStorage(GL_RENDERBUFFER, rb.mInternalFormat, rb.mWidth, rb.mHeight);
+        else
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, rb.mSamples, rb.mInternalFormat,
+                                             rb.mWidth, rb.mHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        break;
+    }
+    case StreamOp::RenderbufferDelete: {
+        auto iter = mRenderbuffers.find(getBody<StreamValue>(record).mValue);
+        if(iter != mRenderbuffers.end())
+        {
+            glDeleteRenderbuffers(1, &iter->second);
+            mRenderbuffers.erase(iter);
+        }
+        break;
+    }
+
+    case StreamOp::ProgramCreate: {
+        const StreamProgram &prog = getBody<StreamProgram>(record);
+        if(record->mDataSize == 0 || data[record->mDataSize-1] != '\0')
+        {
+            ERR("Bad source for program %u\n", prog.mProgram);
+            break;
+        }
+        GLuint program = glCreateShaderProgramv(prog.mType, 1, &data);
+        GLint status = GL_FALSE;
+        if(program)
+            glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if(status == GL_FALSE)
+            ERR("Failed to create program %u\n", prog.mProgram);
+        GLuint &name = mPrograms[prog.mProgram];
+        if(name)
+            glDeleteProgram(name);
+        name = program;
+        break;
+    }
+    case StreamOp::ProgramBlock: {
+        const StreamProgram &prog = getBody<StreamProgram>(record);
+        GLuint program = getName(mPrograms, prog.mProgram);
+        GLuint idx = glGetUniformBlockIndex(program, data);
+        if(idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, idx, prog.mType);
+        break;
+    }
+    case StreamOp::ProgramSampler: {
+        const StreamProgram &prog = getBody<StreamProgram>(record);
+        GLuint program = getName(mPrograms, prog.mProgram);
+        glProgramUniform1i(program, glGetUniformLocation(program, data), prog.mType);
+        break;
+    }
+    case StreamOp::ProgramDelete: {
+        auto iter = mPrograms.find(getBody<StreamValue>(record).mValue);
+        if(iter != mPrograms.end())
+        {
+            glDeleteProgram(iter->second);
+            mPrograms.erase(iter);
+        }
+        break;
+    }
+    case StreamOp::UseProgramStages: {
+        const StreamProgramStages &stages = getBody<StreamProgramStages>(record);
+        glUseProgramStages(getName(mPipelines, stages.mPipeline), stages.mStages,
+                           getName(mPrograms, stages.mProgram));
+        break;
+    }
+
+    case StreamOp::BindSampler: {
+        const StreamBindSampler &bind = getBody<StreamBindSampler>(record);
+        mSamplerCache.bindGL(bind.mUnit, bind.mDesc);
+        break;
+    }
+
+    case StreamOp::CopyImage: {
+        const StreamCopyImage &copy = getBody<StreamCopyImage>(record);
+        GLuint src = (copy.mSrcTarget == GL_RENDERBUFFER) ? getName(mRenderbuffers, copy.mSrcName)
+                                                         : getName(mTextures, copy.mSrcName);
+        GLuint dst = (copy.mDstTarget == GL_RENDERBUFFER) ? getName(mRenderbuffers, copy.mDstName)
+                                                         : getName(mTextures, copy.mDstName);
+        glCopyImageSubData(src, copy.mSrcTarget, copy.mSrcLevel, copy.mSrcX, copy.mSrcY, copy.mSrcZ,
+                           dst, copy.mDstTarget, copy.mDstLevel, copy.mDstX, copy.mDstY, copy.mDstZ,
+                           copy.mWidth, copy.mHeight, copy.mDepth);
+        break;
+    }
+
+    case StreamOp::Count:
+        break;
+    }
+    checkGLError();
+}
+
+void CommandStreamPlayer::resetGL()
+{
+    for(GLuint i = 0;mAttribArrays;++i, mAttribArrays >>= 1)
+    {
+        if((mAttribArrays&1))
+            glDisableVertexAttribArray(i);
+    }
+    for(GLuint i = 0;mClipPlanes;++i, mClipPlanes >>= 1)
+    {
+        if((mClipPlanes&1))
+            glDisable(GL_CLIP_DISTANCE0+i);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    mCurrentFramebuffer[0] = mCurrentFramebuffer[1] = 0;
+    glBindProgramPipeline(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    for(auto &name : mFramebuffers)
+        glDeleteFramebuffers(1, &name.second);
+    for(auto &name : mPipelines)
+        glDeleteProgramPipelines(1, &name.second);
+    for(auto &name : mPrograms)
+        glDeleteProgram(name.second);
+    for(auto &name : mRenderbuffers)
+        glDeleteRenderbuffers(1, &name.second);
+    for(auto &name : mTextures)
+        glDeleteTextures(1, &name.second);
+    for(auto &name : mBuffers)
+        glDeleteBuffers(1, &name.second);
+    for(auto &name : mSamplers)
+        glDeleteSamplers(1, &name.second);
+    mSamplerCache.deinitGL();
+    mFramebuffers.clear();
+    mPipelines.clear();
+    mPrograms.clear();
+    mRenderbuffers.clear();
+    mTextures.clear();
+    mBuffers.clear();
+    mSamplers.clear();
+
+    mMainFramebuffer = 0;
+    mCopyFramebuffers[0] = mCopyFramebuffers[1] = 0;
+    mActiveStage = 0;
+    checkGLError();
+}
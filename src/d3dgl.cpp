@@ -40,6 +40,18 @@ void init_adapters(void)
         std::terminate();
     }
 }
+// Probing an adapter, or loading GLEW, makes GL contexts, so it's put off
+// until the adapter's caps or formats are asked for, or a device is made on
+// it.
+bool probe_adapter(UINT adapter, bool needgl=false)
+{
+    static SRWLOCK lock = SRWLOCK_INIT;
+    AcquireSRWLockExclusive(&lock);
+    bool ret = gAdapterList[adapter].probe() && (!needgl || InitGLEW());
+    ReleaseSRWLockExclusive(&lock);
+    return ret;
+}
+
 // Since MinGW doesn't seem to have std::call_once...
 void init_adapters_once()
 {
@@ -166,6 +178,8 @@ HRESULT Direct3DGL::GetAdapterIdentifier(UINT adapter, DWORD flags, D3DADAPTER_I
 
     if(adapter >= gAdapterList.size())
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     snprintf(identifier->Driver, sizeof(identifier->Driver), "%s", "something.dll");
     snprintf(identifier->Description, sizeof(identifier->Description), "%s", gAdapterList[adapter].getDescription());
@@ -253,6 +267,8 @@ HRESULT Direct3DGL::CheckDeviceType(UINT adapter, D3DDEVTYPE devType, D3DFORMAT
 
     if(backBufferFormat != D3DFMT_UNKNOWN)
     {
+        if(!probe_adapter(adapter))
+            WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
         DWORD rtusage = gAdapterList[adapter].getUsage(D3DRTYPE_SURFACE, backBufferFormat);
         if(!(rtusage&D3DUSAGE_RENDERTARGET))
         {
@@ -272,6 +288,8 @@ HRESULT Direct3DGL::CheckDeviceFormat(UINT adapter, D3DDEVTYPE devType, D3DFORMA
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     /* Check that there's at least one mode for the given format. */
     if(gAdapterList[adapter].getModeCount(adapterFormat) == 0)
@@ -302,6 +320,8 @@ HRESULT Direct3DGL::CheckDeviceMultiSampleType(UINT adapter, D3DDEVTYPE devType,
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     if(multiSampleType == D3DMULTISAMPLE_NONE)
     {
@@ -337,6 +357,8 @@ HRESULT Direct3DGL::CheckDepthStencilMatch(UINT adapter, D3DDEVTYPE devType, D3D
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     /* Check that there's at least one mode for the given format. */
     if(gAdapterList[adapter].getModeCount(adapterFormat) == 0)
@@ -369,6 +391,8 @@ HRESULT Direct3DGL::CheckDeviceFormatConversion(UINT adapter, D3DDEVTYPE devType
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     if(dstFormat != D3DFMT_X1R5G5B5 && dstFormat != D3DFMT_A1R5G5B5 && dstFormat != D3DFMT_R5G6B5 &&
        dstFormat != D3DFMT_X8R8G8B8 && dstFormat != D3DFMT_A8R8G8B8 &&
@@ -407,6 +431,8 @@ HRESULT Direct3DGL::GetDeviceCaps(UINT adapter, D3DDEVTYPE devType, D3DCAPS9 *ca
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     *caps = gAdapterList[adapter].getCaps();
     return D3D_OK;
@@ -427,6 +453,8 @@ HRESULT Direct3DGL::CreateDevice(UINT adapter, D3DDEVTYPE devType, HWND window,
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Adapter %u out of range (count=%u)\n", adapter, gAdapterList.size());
     if(devType != D3DDEVTYPE_HAL)
         WARN_AND_RETURN(D3DERR_INVALIDCALL, "Non-HAL type 0x%x not supported\n", devType);
+    if(!probe_adapter(adapter, true))
+        WARN_AND_RETURN(D3DERR_NOTAVAILABLE, "Adapter %u not usable\n", adapter);
 
     if(!window && params->Windowed)
         window = params->hDeviceWindow;
@@ -455,13 +483,13 @@ HRESULT Direct3DGL::CreateDevice(UINT adapter, D3DDEVTYPE devType, HWND window,
         setup_fpu();
 
     // FIXME: handle known flags
-    //D3DCREATE_MULTITHREADED - we should be thread-safe already
     //D3DCREATE_PUREDEVICE
     //D3DCREATE_SOFTWARE_VERTEXPROCESSING - OpenGL handles vertex processing for us
     //D3DCREATE_MIXED_VERTEXPROCESSING    -   ^       ^       ^        ^      ^  ^
     //D3DCREATE_DISABLE_DRIVER_MANAGEMENT
     //D3DCREATE_ADAPTERGROUP_DEVICE
-    DWORD unknown_flags = flags & ~(D3DCREATE_FPU_PRESERVE|D3DCREATE_HARDWARE_VERTEXPROCESSING);
+    DWORD unknown_flags = flags & ~(D3DCREATE_FPU_PRESERVE|D3DCREATE_HARDWARE_VERTEXPROCESSING|
+                                    D3DCREATE_MULTITHREADED);
     if(unknown_flags) FIXME("Unhandled flags: 0x%lx\n", unknown_flags);
 
     D3DGLDevice *device = new D3DGLDevice(this, gAdapterList[adapter], window, flags);
@@ -1,13 +1,19 @@
 
 #include "device.hpp"
 
+#include <algorithm>
 #include <array>
+#include <climits>
+#include <cmath>
+#include <memory>
 #include <sstream>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 #include "glformat.hpp"
 #include "d3dgl.hpp"
 #include "swapchain.hpp"
@@ -22,6 +28,7 @@
 #include "pixelshader.hpp"
 #include "vertexdeclaration.hpp"
 #include "query.hpp"
+#include "stateblock.hpp"
 #include "private_iids.hpp"
 
 
@@ -233,24 +240,115 @@ static const std::array<DWORD,33> DefaultTSSValues = GenerateDefaultTSSValues();
 
 
 // A simple table that maps on/off D3D render states to GL states passed to
-// glEnable/glDisable.
-static const std::map<D3DRENDERSTATETYPE,GLenum> RSStateEnableMap{
-    {D3DRS_DITHERENABLE,         GL_DITHER},
-    {D3DRS_FOGENABLE,            GL_FOG},
-    {D3DRS_COLORVERTEX,          GL_COLOR_MATERIAL},
-    {D3DRS_NORMALIZENORMALS,     GL_NORMALIZE},
-    {D3DRS_SCISSORTESTENABLE,    GL_SCISSOR_TEST},
-    {D3DRS_STENCILENABLE,        GL_STENCIL_TEST},
-    {D3DRS_ALPHATESTENABLE,      GL_ALPHA_TEST},
-    {D3DRS_ALPHABLENDENABLE,     GL_BLEND},
-    {D3DRS_LIGHTING,             GL_LIGHTING},
-    {D3DRS_MULTISAMPLEANTIALIAS, GL_MULTISAMPLE},
-    {D3DRS_POINTSPRITEENABLE,    GL_POINT_SPRITE},
-    {D3DRS_SRGBWRITEENABLE,      GL_FRAMEBUFFER_SRGB},
+// glEnable/glDisable, indexed by the render state. Other states are GL_NONE.
+std::array<GLenum,210> GenerateRSStateEnableMap()
+{
+    std::array<GLenum,210> ret;
+    ret.fill(GL_NONE);
+    ret[D3DRS_DITHERENABLE]         = GL_DITHER;
+    ret[D3DRS_FOGENABLE]            = GL_FOG;
+    ret[D3DRS_COLORVERTEX]          = GL_COLOR_MATERIAL;
+    ret[D3DRS_NORMALIZENORMALS]     = GL_NORMALIZE;
+    ret[D3DRS_SCISSORTESTENABLE]    = GL_SCISSOR_TEST;
+    ret[D3DRS_STENCILENABLE]        = GL_STENCIL_TEST;
+    ret[D3DRS_ALPHATESTENABLE]      = GL_ALPHA_TEST;
+    ret[D3DRS_ALPHABLENDENABLE]     = GL_BLEND;
+    ret[D3DRS_LIGHTING]             = GL_LIGHTING;
+    ret[D3DRS_MULTISAMPLEANTIALIAS] = GL_MULTISAMPLE;
+    ret[D3DRS_POINTSPRITEENABLE]    = GL_POINT_SPRITE;
+    ret[D3DRS_SRGBWRITEENABLE]      = GL_FRAMEBUFFER_SRGB;
     // WARNING: ZENABLE is a three-state setting; FALSE, TRUE, and USEW. USEW
     // is unsupportable with OpenGL, and is special-cased in SetRenderState.
-    {D3DRS_ZENABLE,              GL_DEPTH_TEST}
-};
+    ret[D3DRS_ZENABLE]              = GL_DEPTH_TEST;
+    return ret;
+}
+static const std::array<GLenum,210> RSStateEnableMap = GenerateRSStateEnableMap();
+
+// Render states that go into the fixed-function uniforms, rather than GL
+// state or the program keys.
+std::array<bool,210> GenerateRSFFUniformMap()
+{
+    std::array<bool,210> ret;
+    ret.fill(false);
+    ret[D3DRS_AMBIENT]          = true;
+    ret[D3DRS_FOGSTART]         = true;
+    ret[D3DRS_FOGEND]           = true;
+    ret[D3DRS_FOGDENSITY]       = true;
+    ret[D3DRS_FOGCOLOR]         = true;
+    ret[D3DRS_TEXTUREFACTOR]    = true;
+    ret[D3DRS_POINTSIZE]        = true;
+    ret[D3DRS_POINTSIZE_MIN]    = true;
+    ret[D3DRS_POINTSIZE_MAX]    = true;
+    ret[D3DRS_POINTSCALE_A]     = true;
+    ret[D3DRS_POINTSCALE_B]     = true;
+    ret[D3DRS_POINTSCALE_C]     = true;
+    return ret;
+}
+static const std::array<bool,210> RSFFUniformMap = GenerateRSFFUniformMap();
+
+
+D3DMATRIX MakeIdentityMatrix()
+{
+    D3DMATRIX ret;
+    for(int i = 0;i < 4;++i)
+    {
+        for(int j = 0;j < 4;++j)
+            ret.m[i][j] = (i == j) ? 1.0f : 0.0f;
+    }
+    return ret;
+}
+static const D3DMATRIX IdentityMatrix = MakeIdentityMatrix();
+
+// Row vectors, as D3D uses them, so a point is transformed by a then b.
+D3DMATRIX MultiplyMatrix(const D3DMATRIX &a, const D3DMATRIX &b)
+{
+    D3DMATRIX ret;
+    for(int i = 0;i < 4;++i)
+    {
+        for(int j = 0;j < 4;++j)
+            ret.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] +
+                          a.m[i][2]*b.m[2][j] + a.m[i][3]*b.m[3][j];
+    }
+    return ret;
+}
+
+// The inverse transpose of the upper 3x3, for transforming normals. That's
+// the cofactor matrix divided by the determinant.
+D3DMATRIX MakeNormalMatrix(const D3DMATRIX &mtx)
+{
+    D3DMATRIX ret = IdentityMatrix;
+    for(int i = 0;i < 3;++i)
+    {
+        int i1 = (i+1)%3, i2 = (i+2)%3;
+        for(int j = 0;j < 3;++j)
+        {
+            int j1 = (j+1)%3, j2 = (j+2)%3;
+            ret.m[i][j] = mtx.m[i1][j1]*mtx.m[i2][j2] - mtx.m[i1][j2]*mtx.m[i2][j1];
+        }
+    }
+    float det = mtx.m[0][0]*ret.m[0][0] + mtx.m[0][1]*ret.m[0][1] + mtx.m[0][2]*ret.m[0][2];
+    if(det == 0.0f)
+        return mtx;
+    for(int i = 0;i < 3;++i)
+    {
+        for(int j = 0;j < 3;++j)
+            ret.m[i][j] /= det;
+    }
+    return ret;
+}
+
+void CopyColor(float (&dst)[4], const D3DCOLORVALUE &color)
+{
+    dst[0] = color.r; dst[1] = color.g;
+    dst[2] = color.b; dst[3] = color.a;
+}
+void CopyColor(float (&dst)[4], D3DCOLOR color)
+{
+    dst[0] = ((color>>16)&0xff) / 255.0f;
+    dst[1] = ((color>> 8)&0xff) / 255.0f;
+    dst[2] = ((color    )&0xff) / 255.0f;
+    dst[3] = ((color>>24)&0xff) / 255.0f;
+}
 
 
 GLenum GetGLBlendFunc(DWORD mode)
@@ -391,6 +489,17 @@ GLenum GetGLDrawMode(D3DPRIMITIVETYPE type, UINT &count)
     return GL_POINTS;
 }
 
+// Checks if the registers a shader reads, [usedstart, usedend), aren't all
+// current in the bound slice.
+bool isSliceStale(UINT usedstart, UINT usedend, UINT dirtystart, UINT dirtyend, UINT slicestart, UINT sliceend)
+{
+    if(usedstart >= usedend)
+        return false;
+    if(usedstart < slicestart || usedend > sliceend)
+        return true;
+    return std::max(usedstart, dirtystart) < std::min(usedend, dirtyend);
+}
+
 GLenum GetGLIndexType(D3DFORMAT format, UINT &start)
 {
     switch(format)
@@ -429,32 +538,9 @@ public:
             glDisable(mState);
         return sizeof(*this);
     }
-};
-
-class MaterialSet : public Command {
-    float mShininess;
-    float mDiffuse[4];
-    float mAmbient[4];
-    float mSpecular[4];
-    float mEmission[4];
-
-public:
-    MaterialSet(const D3DMATERIAL9 &material)
-      : mShininess(material.Power)
-      , mDiffuse{material.Diffuse.r, material.Diffuse.g, material.Diffuse.b, material.Diffuse.a}
-      , mAmbient{material.Ambient.r, material.Ambient.g, material.Ambient.b, material.Ambient.a}
-      , mSpecular{material.Specular.r, material.Specular.g, material.Specular.b, material.Specular.a}
-      , mEmission{material.Emissive.r, material.Emissive.g, material.Emissive.b, material.Emissive.a}
-    { }
-
-    virtual ULONG execute()
+    virtual void record(CommandStreamWriter &stream) const
     {
-        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mShininess);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mDiffuse);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mAmbient);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mSpecular);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, mEmission);
-        return sizeof(*this);
+        stream.write(StreamOp::Enable, StreamEnable{mState, mEnable});
     }
 };
 
@@ -474,6 +560,10 @@ public:
         glDepthRange(mMinZ, mMaxZ);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::Viewport, StreamViewport{mX, mY, mWidth, mHeight, mMinZ, mMaxZ});
+    }
 };
 
 class ScissorRectSet : public Command {
@@ -487,6 +577,10 @@ public:
         glScissor(mRect.left, mRect.top, mRect.right-mRect.left, mRect.bottom-mRect.top);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::Scissor, StreamRect{mRect.left, mRect.top, mRect.right, mRect.bottom});
+    }
 };
 
 class PolygonModeSet : public Command {
@@ -500,6 +594,10 @@ public:
         glPolygonMode(GL_FRONT_AND_BACK, mMode);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::PolygonMode, StreamValue{mMode});
+    }
 };
 
 class CullFaceSet : public Command {
@@ -519,6 +617,10 @@ public:
         }
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::CullFace, StreamValue{mFace});
+    }
 };
 
 class ColorMaskSet : public Command {
@@ -536,6 +638,10 @@ public:
         );
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::ColorMask, StreamColorMask{mIndex, mEnable});
+    }
 };
 
 class DepthMaskSet : public Command {
@@ -549,6 +655,10 @@ public:
         glDepthMask(mEnable);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::DepthMask, StreamValue{mEnable});
+    }
 };
 
 class DepthFuncSet : public Command {
@@ -562,6 +672,10 @@ public:
         glDepthFunc(mFunc);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::DepthFunc, StreamValue{mFunc});
+    }
 };
 
 class AlphaFuncSet : public Command {
@@ -576,6 +690,10 @@ public:
         glAlphaFunc(mFunc, std::min(std::max(mRef, 0.0f), 1.0f));
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::AlphaFunc, StreamAlphaFunc{mFunc, mRef});
+    }
 };
 
 class BlendFuncSet : public Command {
@@ -589,6 +707,10 @@ public:
         glBlendFunc(mSrc, mDst);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BlendFunc, StreamBlendFunc{mSrc, mDst});
+    }
 };
 
 class StencilFuncSet : public Command {
@@ -605,6 +727,10 @@ public:
         glStencilFuncSeparate(mFace, mFunc, mRef, mMask);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::StencilFunc, StreamStencilFunc{mFace, mFunc, mRef, mMask});
+    }
 };
 
 class BlendOpSet : public Command {
@@ -619,6 +745,10 @@ public:
         glBlendEquationSeparate(mColorOp, mAlphaOp);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BlendOp, StreamBlendFunc{mColorOp, mAlphaOp});
+    }
 };
 
 class StencilOpSet : public Command {
@@ -637,6 +767,10 @@ public:
         glStencilOpSeparate(mFace, mFail, mZFail, mZPass);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::StencilOp, StreamStencilOp{mFace, mFail, mZFail, mZPass});
+    }
 };
 
 class StencilMaskSet : public Command {
@@ -650,6 +784,10 @@ public:
         glStencilMask(mMask);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::StencilMask, StreamValue{mMask});
+    }
 };
 
 class DepthBiasSet : public Command {
@@ -670,6 +808,10 @@ public:
         }
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::DepthBias, StreamDepthBias{mScale, mBias});
+    }
 };
 
 class FogValuefSet : public Command {
@@ -685,45 +827,32 @@ public:
         glFogfv(mParam, mValues);
         return sizeof(*this);
     }
-};
-
-class SetSamplerParameteri : public Command {
-    GLuint mSampler;
-    GLenum mParameter;
-    GLint mValue;
-
-public:
-    SetSamplerParameteri(GLuint sampler, GLenum parameter, GLint value)
-      : mSampler(sampler), mParameter(parameter), mValue(value)
-    { }
-
-    virtual ULONG execute()
+    virtual void record(CommandStreamWriter &stream) const
     {
-        if(mParameter != GL_TEXTURE_MAX_ANISOTROPY_EXT ||
-           (mParameter == GL_TEXTURE_MAX_ANISOTROPY_EXT && GLEW_EXT_texture_filter_anisotropic))
-        {
-            glSamplerParameteri(mSampler, mParameter, mValue);
-            checkGLError();
-        }
-        return sizeof(*this);
+        stream.write(StreamOp::Fog, StreamFog{mParam, {mValues[0], mValues[1], mValues[2], mValues[3]}});
     }
 };
-class SetSamplerParameter4f : public Command {
-    GLuint mSampler;
-    GLenum mParameter;
-    GLfloat mValues[4];
+
+class SamplerBindCmd : public Command {
+    SamplerCache &mSamplers;
+    GLuint mUnit;
+    GLSamplerDesc mDesc;
 
 public:
-    SetSamplerParameter4f(GLuint sampler, GLenum parameter, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3)
-      : mSampler(sampler), mParameter(parameter), mValues{v0,v1,v2,v3}
+    SamplerBindCmd(SamplerCache &samplers, GLuint unit, const GLSamplerDesc &desc)
+      : mSamplers(samplers), mUnit(unit), mDesc(desc)
     { }
 
     virtual ULONG execute()
     {
-        glSamplerParameterfv(mSampler, mParameter, mValues);
+        mSamplers.bindGL(mUnit, mDesc);
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BindSampler, StreamBindSampler{mUnit, mDesc});
+    }
 };
 
 template<size_t MAXCOUNT>
@@ -756,22 +885,77 @@ public:
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BufferSubData, StreamBufferSubData{mBuffer, GLuint(mOffset)}, mData, mSize);
+    }
 };
 typedef SetBufferValue4fv<1> SetBufferValue4f;
 
+class BindUniformRangeCmd : public Command {
+    GLuint mIndex;
+    GLuint mBuffer;
+    GLintptr mOffset;
+    GLsizeiptr mSize;
+
+public:
+    BindUniformRangeCmd(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+      : mIndex(index), mBuffer(buffer), mOffset(offset), mSize(size)
+    { }
+
+    virtual ULONG execute()
+    {
+        glBindBufferRange(GL_UNIFORM_BUFFER, mIndex, mBuffer, mOffset, mSize);
+        checkGLError();
+        return sizeof(*this);
+    }
+    // Only used with the uniform ring, which isn't used when recording.
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class SetBufferValueData : public PayloadCommand {
+    GLuint mBuffer;
+    GLintptr mOffset;
+    GLsizeiptr mSize;
+
+public:
+    SetBufferValueData(CommandQueue &queue, GLuint buffer, GLintptr offset, const float *data, GLsizeiptr count)
+      : PayloadCommand(queue, count*4*sizeof(float)), mBuffer(buffer), mOffset(offset)
+      , mSize(count*4*sizeof(float))
+    {
+        memcpy(mPayload, data, mSize);
+    }
+
+    virtual ULONG execute()
+    {
+        glNamedBufferSubDataEXT(mBuffer, mOffset, mSize, mPayload);
+        checkGLError();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BufferSubData, StreamBufferSubData{mBuffer, GLuint(mOffset)}, mPayload, mSize);
+    }
+};
+
 
 class ElementArraySet : public Command {
+    VertexArrayCache &mVertexArrays;
     GLuint mBufferId;
 
 public:
-    ElementArraySet(GLuint bufferid) : mBufferId(bufferid) { }
+    ElementArraySet(VertexArrayCache &vertexarrays, GLuint bufferid)
+      : mVertexArrays(vertexarrays), mBufferId(bufferid) { }
 
     virtual ULONG execute()
     {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBufferId);
-        checkGLError();
+        mVertexArrays.setElementsGL(mBufferId);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BindElements, StreamValue{mBufferId});
+    }
 };
 
 
@@ -799,6 +983,10 @@ public:
 
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BindTexture, StreamBindTexture{mStage, mType, mBinding});
+    }
 };
 
 
@@ -814,103 +1002,155 @@ public:
         if(mPlanes != mGLState.clip_plane_enabled)
         {
             UINT old_planes = mGLState.clip_plane_enabled;
+            UINT planes = mPlanes;
             mGLState.clip_plane_enabled = mPlanes;
 
-            for(UINT i = 0;old_planes || mPlanes;++i)
+            for(UINT i = 0;old_planes || planes;++i)
             {
-                if((mPlanes&1) && !(old_planes&1))
+                if((planes&1) && !(old_planes&1))
                     glEnable(GL_CLIP_DISTANCE0+i);
-                else if(!(mPlanes&1) && (old_planes&1))
+                else if(!(planes&1) && (old_planes&1))
                     glDisable(GL_CLIP_DISTANCE0+i);
 
                 old_planes >>= 1;
-                mPlanes >>= 1;
+                planes >>= 1;
             }
             checkGLError();
         }
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::ClipPlanes, StreamValue{mPlanes});
+    }
 };
 
 
-class SetFBAttachmentCmd : public Command {
+class FramebufferSetCmd : public Command {
     GLState &mGLState;
-    GLenum mAttachment;
-    GLenum mTarget;
-    GLuint mId;
-    GLint mLevel;
+    FramebufferCache &mFramebuffers;
+    GPUTimer &mTimer;
+    GLFramebufferDesc mDesc;
 
 public:
-    SetFBAttachmentCmd(GLState &glstate, GLenum attachment, GLenum target, GLuint id, GLint level)
-      : mGLState(glstate), mAttachment(attachment), mTarget(target), mId(id), mLevel(level)
+    FramebufferSetCmd(GLState &glstate, FramebufferCache &framebuffers, GPUTimer &timer, const GLFramebufferDesc &desc)
+      : mGLState(glstate), mFramebuffers(framebuffers), mTimer(timer), mDesc(desc)
     { }
 
     virtual ULONG execute()
     {
-        if(mTarget == GL_RENDERBUFFER)
-            glNamedFramebufferRenderbufferEXT(mGLState.main_framebuffer, mAttachment, GL_RENDERBUFFER, mId);
-        else if(mTarget == GL_TEXTURE_2D || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_X || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_Y ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y || mTarget == GL_TEXTURE_CUBE_MAP_POSITIVE_Z ||
-                mTarget == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z)
-            glNamedFramebufferTexture2DEXT(mGLState.main_framebuffer, mAttachment, mTarget, mId, mLevel);
+        mTimer.markGL();
+
+        // Always rebind, since the previous framebuffer may have been deleted
+        // and its name reused.
+        GLuint fbo = mFramebuffers.getGL(mDesc);
+        mGLState.main_framebuffer = fbo;
+        mGLState.current_framebuffer[0] = fbo;
+        mGLState.current_framebuffer[1] = fbo;
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
         checkGLError();
 
         return sizeof(*this);
     }
-};
-
-
-class SetVertexAttribArrayCmd : public Command {
-    GLState &mGLState;
-    UINT mAttribs;
-
-public:
-    SetVertexAttribArrayCmd(GLState &glstate, UINT attribs) : mGLState(glstate), mAttribs(attribs) { }
-
-    virtual ULONG execute()
+    virtual void record(CommandStreamWriter &stream) const
     {
-        if(mAttribs != mGLState.attrib_array_enabled)
+        // The player reattaches images to its one framebuffer.
+        for(GLuint i = 0;i < 4;++i)
         {
-            UINT old_attribs = mGLState.attrib_array_enabled;
-            mGLState.attrib_array_enabled = mAttribs;
-
-            for(UINT i = 0;old_attribs || mAttribs;++i)
-            {
-                if((mAttribs&1) && !(old_attribs&1))
-                    glEnableVertexAttribArray(i);
-                else if(!(mAttribs&1) && (old_attribs&1))
-                {
-                    glDisableVertexAttribArray(i);
-                    glVertexAttrib4f(i, 0.0f, 0.0f, 0.0f, 1.0f);
-                }
-
-                old_attribs >>= 1;
-                mAttribs >>= 1;
-            }
-            checkGLError();
+            const GLFBAttachment &color = mDesc.mColor[i];
+            stream.write(StreamOp::FBAttachment, StreamFBAttachment{GL_COLOR_ATTACHMENT0+i,
+                color.mId ? color.mTarget : GL_RENDERBUFFER, color.mId, color.mLevel});
+        }
+        if(mDesc.mDepth.mId == 0)
+            stream.write(StreamOp::FBAttachment, StreamFBAttachment{GL_DEPTH_STENCIL_ATTACHMENT,
+                GL_RENDERBUFFER, 0, 0});
+        else
+        {
+            if(mDesc.mDepthAttachment == GL_DEPTH_ATTACHMENT)
+                stream.write(StreamOp::FBAttachment, StreamFBAttachment{GL_STENCIL_ATTACHMENT,
+                    GL_RENDERBUFFER, 0, 0});
+            stream.write(StreamOp::FBAttachment, StreamFBAttachment{mDesc.mDepthAttachment,
+                mDesc.mDepth.mTarget, mDesc.mDepth.mId, mDesc.mDepth.mLevel});
         }
-
-        return sizeof(*this);
     }
 };
 
 
-class ClearCmd : public Command {
+// Clears a list of rectangles with glClearBuffer*, instead of pushing and
+// popping the write masks and scissor. The GL state it touches is taken from
+// the device's last flushed render states and put back afterward. A rect
+// covering the whole surface clears it with no scissor, invalidating it first.
+class ClearCmd : public PayloadCommand {
     GLState &mGLState;
     GLbitfield mMask;
+    GLuint mColorBuffers; // Bitmask, 1<<buffer_index
     GLuint mColor;
     GLfloat mDepth;
     GLuint mStencil;
-    RECT mRect;
+    bool mFull;
+    GLuint mNumRects;
+
+    DWORD mColorWrite[4];
+    DWORD mDepthWrite;
+    DWORD mStencilWrite;
+    DWORD mScissorTest;
+    RECT mScissor;
+
+    const RECT *getRects() const { return static_cast<const RECT*>(mPayload); }
 
 public:
-    ClearCmd(GLState &glstate, GLbitfield mask, GLuint color, GLfloat depth, GLuint stencil, const RECT &rect)
-      : mGLState(glstate), mMask(mask), mColor(color), mDepth(depth), mStencil(stencil), mRect(rect)
-    { }
+    static const DWORD sMaxRects = CommandQueue::sMaxPayloadSize / sizeof(RECT);
+
+    // Rects are clipped to clip, or clip is cleared if there are none. A
+    // clipped rect matching full, the surface extent, makes it a full clear.
+    // At most sMaxRects can be given.
+    ClearCmd(CommandQueue &queue, GLState &glstate, GLbitfield mask, GLuint colorbuffers,
+             GLuint color, GLfloat depth, GLuint stencil, const D3DRECT *rects, DWORD count,
+             const RECT &clip, const RECT &full, const DWORD *glrenderstate, const RECT &scissor)
+      : PayloadCommand(queue, std::max<DWORD>(count, 1)*sizeof(RECT))
+      , mGLState(glstate), mMask(mask), mColorBuffers(colorbuffers), mColor(color)
+      , mDepth(depth), mStencil(stencil), mFull(false), mNumRects(0)
+      , mDepthWrite(glrenderstate[D3DRS_ZWRITEENABLE])
+      , mStencilWrite(glrenderstate[D3DRS_STENCILWRITEMASK])
+      , mScissorTest(glrenderstate[D3DRS_SCISSORTESTENABLE])
+      , mScissor(scissor)
+    {
+        mColorWrite[0] = glrenderstate[D3DRS_COLORWRITEENABLE];
+        mColorWrite[1] = glrenderstate[D3DRS_COLORWRITEENABLE1];
+        mColorWrite[2] = glrenderstate[D3DRS_COLORWRITEENABLE2];
+        mColorWrite[3] = glrenderstate[D3DRS_COLORWRITEENABLE3];
+
+        RECT *out = static_cast<RECT*>(mPayload);
+        if(count == 0)
+            out[mNumRects++] = clip;
+        else for(DWORD i = 0;i < count;++i)
+        {
+            RECT rect{
+                std::max(rects[i].x1, clip.left), std::max(rects[i].y1, clip.top),
+                std::min(rects[i].x2, clip.right), std::min(rects[i].y2, clip.bottom)
+            };
+            if(rect.left < rect.right && rect.top < rect.bottom)
+                out[mNumRects++] = rect;
+        }
+
+        for(GLuint i = 0;i < mNumRects;++i)
+        {
+            if(out[i].left <= full.left && out[i].top <= full.top &&
+               out[i].right >= full.right && out[i].bottom >= full.bottom)
+            {
+                out[0] = full;
+                mNumRects = 1;
+                mFull = true;
+                break;
+            }
+        }
+    }
 
     virtual ULONG execute()
     {
+        if(mNumRects == 0)
+            return sizeof(*this);
+
         if(mGLState.current_framebuffer[0] != mGLState.main_framebuffer)
         {
             mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
@@ -918,85 +1158,174 @@ public:
             glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
         }
 
-        glPushAttrib(mMask | GL_SCISSOR_BIT);
-
         if((mMask&GL_COLOR_BUFFER_BIT))
         {
-            glClearColor(D3DCOLOR_R(mColor)/255.0f, D3DCOLOR_G(mColor)/255.0f,
-                         D3DCOLOR_B(mColor)/255.0f, D3DCOLOR_A(mColor)/255.0f);
-            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            for(GLuint i = 0;i < 4;++i)
+            {
+                if((mColorBuffers&(1<<i)) && (mColorWrite[i]&0xf) != 0xf)
+                    glColorMaski(i, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            }
         }
-        if((mMask&GL_DEPTH_BUFFER_BIT))
-        {
-            glClearDepth(mDepth);
+        if((mMask&GL_DEPTH_BUFFER_BIT) && !mDepthWrite)
             glDepthMask(GL_TRUE);
-        }
-        if((mMask&GL_STENCIL_BUFFER_BIT))
+        if((mMask&GL_STENCIL_BUFFER_BIT) && mStencilWrite != 0xffffffff)
+            glStencilMask(0xffffffff);
+
+        if(mFull)
         {
-            glClearStencil(mStencil);
-            glStencilMask(GL_TRUE);
+            if(mScissorTest)
+                glDisable(GL_SCISSOR_TEST);
+            if(GLEW_ARB_invalidate_subdata)
+            {
+                GLenum attachments[6];
+                GLsizei count = 0;
+                if((mMask&GL_COLOR_BUFFER_BIT))
+                {
+                    for(GLuint i = 0;i < 4;++i)
+                    {
+                        if((mColorBuffers&(1<<i)))
+                            attachments[count++] = GL_COLOR_ATTACHMENT0+i;
+                    }
+                }
+                if((mMask&GL_DEPTH_BUFFER_BIT))
+                    attachments[count++] = GL_DEPTH_ATTACHMENT;
+                if((mMask&GL_STENCIL_BUFFER_BIT))
+                    attachments[count++] = GL_STENCIL_ATTACHMENT;
+                glInvalidateFramebuffer(GL_FRAMEBUFFER, count, attachments);
+            }
         }
+        else if(!mScissorTest)
+            glEnable(GL_SCISSOR_TEST);
 
-        glEnable(GL_SCISSOR_TEST);
-        glScissor(mRect.left, mRect.top, mRect.right-mRect.left, mRect.bottom-mRect.top);
-        glClear(mMask);
+        const GLfloat color[4]{
+            D3DCOLOR_R(mColor)/255.0f, D3DCOLOR_G(mColor)/255.0f,
+            D3DCOLOR_B(mColor)/255.0f, D3DCOLOR_A(mColor)/255.0f
+        };
+        const GLint stencil = mStencil;
+        const RECT *rects = getRects();
+        for(GLuint r = 0;r < mNumRects;++r)
+        {
+            if(!mFull)
+                glScissor(rects[r].left, rects[r].top, rects[r].right-rects[r].left,
+                          rects[r].bottom-rects[r].top);
+
+            if((mMask&GL_COLOR_BUFFER_BIT))
+            {
+                for(GLuint i = 0;i < 4;++i)
+                {
+                    if((mColorBuffers&(1<<i)))
+                        glClearBufferfv(GL_COLOR, i, color);
+                }
+            }
+            if((mMask&(GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT)) == (GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT))
+                glClearBufferfi(GL_DEPTH_STENCIL, 0, mDepth, stencil);
+            else if((mMask&GL_DEPTH_BUFFER_BIT))
+                glClearBufferfv(GL_DEPTH, 0, &mDepth);
+            else if((mMask&GL_STENCIL_BUFFER_BIT))
+                glClearBufferiv(GL_STENCIL, 0, &stencil);
+        }
 
-        glPopAttrib();
+        if(mFull)
+        {
+            if(mScissorTest)
+                glEnable(GL_SCISSOR_TEST);
+        }
+        else
+        {
+            if(!mScissorTest)
+                glDisable(GL_SCISSOR_TEST);
+            glScissor(mScissor.left, mScissor.top, mScissor.right-mScissor.left,
+                      mScissor.bottom-mScissor.top);
+        }
+        if((mMask&GL_COLOR_BUFFER_BIT))
+        {
+            for(GLuint i = 0;i < 4;++i)
+            {
+                if((mColorBuffers&(1<<i)) && (mColorWrite[i]&0xf) != 0xf)
+                    glColorMaski(i,
+                        !!(mColorWrite[i]&D3DCOLORWRITEENABLE_RED), !!(mColorWrite[i]&D3DCOLORWRITEENABLE_GREEN),
+                        !!(mColorWrite[i]&D3DCOLORWRITEENABLE_BLUE), !!(mColorWrite[i]&D3DCOLORWRITEENABLE_ALPHA)
+                    );
+            }
+        }
+        if((mMask&GL_DEPTH_BUFFER_BIT) && !mDepthWrite)
+            glDepthMask(GL_FALSE);
+        if((mMask&GL_STENCIL_BUFFER_BIT) && mStencilWrite != 0xffffffff)
+            glStencilMask(mStencilWrite);
         checkGLError();
 
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        const RECT *rects = getRects();
+        for(GLuint r = 0;r < mNumRects;++r)
+            stream.write(StreamOp::Clear, StreamClear{mMask, mColor, mDepth, mStencil,
+                StreamRect{rects[r].left, rects[r].top, rects[r].right, rects[r].bottom}});
+    }
 };
 
-class SetVtxDataCmd : public Command {
-    GLStreamData mStreams[16];
-    GLuint mNumStreams;
+class SetVtxDataCmd : public PayloadCommand {
+    VertexArrayCache &mVertexArrays;
+    UINT mAttribs;
+    GLuint mNumFormats;
+    GLuint mNumBindings;
+    GLuint mScratchBuffer;
+
+    const GLVertexFormat *getFormats() const
+    { return static_cast<const GLVertexFormat*>(mPayload); }
+    const GLVertexBinding *getBindings() const
+    { return reinterpret_cast<const GLVertexBinding*>(getFormats() + mNumFormats); }
 
 public:
-    SetVtxDataCmd(const GLStreamData *streams, GLuint numstream)
+    SetVtxDataCmd(CommandQueue &queue, VertexArrayCache &vertexarrays, UINT attribs,
+                  const GLVertexFormat *formats, GLuint numformats, const GLVertexBinding *bindings,
+                  GLuint numbindings, GLuint scratchbuffer)
+      : PayloadCommand(queue, numformats*sizeof(GLVertexFormat) + numbindings*sizeof(GLVertexBinding))
+      , mVertexArrays(vertexarrays), mAttribs(attribs), mNumFormats(numformats)
+      , mNumBindings(numbindings), mScratchBuffer(scratchbuffer)
     {
-        for(GLuint i = 0;i < numstream;++i)
-            mStreams[i] = streams[i];
-        mNumStreams = numstream;
+        GLVertexFormat *fmts = static_cast<GLVertexFormat*>(mPayload);
+        std::copy(formats, formats+numformats, fmts);
+        std::copy(bindings, bindings+numbindings, reinterpret_cast<GLVertexBinding*>(fmts+numformats));
     }
 
     virtual ULONG execute()
     {
-        GLuint binding = 0;
-
-        for(GLuint i = 0;i < mNumStreams;++i)
+        mVertexArrays.bindGL(mAttribs, getFormats(), mNumFormats, getBindings(), mNumBindings,
+                             mScratchBuffer);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        const GLVertexFormat *formats = getFormats();
+        const GLVertexBinding *bindings = getBindings();
+        StreamVertexAttrib attribs[16];
+        GLuint count = std::min<GLuint>(mNumFormats, 16);
+        for(GLuint i = 0;i < count;++i)
         {
-            if(binding != mStreams[i].mBufferId)
-            {
-                binding = mStreams[i].mBufferId;
-                glBindBuffer(GL_ARRAY_BUFFER, binding);
-            }
-            glVertexAttribPointer(mStreams[i].mTarget, mStreams[i].mGLCount,
-                                  mStreams[i].mGLType, mStreams[i].mNormalize,
-                                  mStreams[i].mStride, mStreams[i].mPointer);
-            // Setting a high divisor will keep the vertex attribute from
-            // incrementing, just like D3D's stride==0 setting.
-            if(mStreams[i].mStride == 0)
-                glVertexAttribDivisor(mStreams[i].mTarget, 65535);
-            else
-                glVertexAttribDivisor(mStreams[i].mTarget, mStreams[i].mDivisor);
+            const GLVertexBinding &binding = bindings[formats[i].mBinding];
+            attribs[i] = StreamVertexAttrib{
+                binding.mBufferId, binding.mOffset + formats[i].mOffset,
+                formats[i].mGLType, formats[i].mGLCount, formats[i].mNormalize,
+                binding.mStride, formats[i].mTarget, binding.mDivisor
+            };
         }
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        checkGLError();
-
-        return sizeof(*this);
+        stream.write(StreamOp::AttribArrays, StreamValue{mAttribs});
+        stream.write(StreamOp::VertexStreams, StreamValue{count}, attribs, count*sizeof(attribs[0]));
     }
 };
 
 class DrawGLArraysCmd : public Command {
     GLState &mGLState;
     GLenum mMode;
+    GLint mFirst;
     GLint mCount;
     GLsizei mNumInstances;
 
 public:
-    DrawGLArraysCmd(GLState &glstate, GLenum mode, GLint count, GLsizei num_instances)
-      : mGLState(glstate), mMode(mode), mCount(count), mNumInstances(num_instances)
+    DrawGLArraysCmd(GLState &glstate, GLenum mode, GLint first, GLint count, GLsizei num_instances)
+      : mGLState(glstate), mMode(mode), mFirst(first), mCount(count), mNumInstances(num_instances)
     { }
 
     virtual ULONG execute()
@@ -1007,11 +1336,15 @@ public:
             mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
             glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
         }
-        glDrawArraysInstanced(mMode, 0, mCount, mNumInstances);
+        glDrawArraysInstanced(mMode, mFirst, mCount, mNumInstances);
         checkGLError();
 
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::DrawArrays, StreamDraw{mMode, mCount, GL_NONE, 0, mNumInstances, mFirst});
+    }
 };
 
 class DrawGLElementsCmd : public Command {
@@ -1041,69 +1374,381 @@ public:
 
         return sizeof(*this);
     }
-};
-
-} // namespace
-
-
-void D3DGLDevice::readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, GLubyte* data, std::atomic<ULONG> &pendingupdates)
-{
-    if(mGLState.current_framebuffer[0] != mGLState.copy_framebuffers[0])
-    {
-        mGLState.current_framebuffer[0] = mGLState.copy_framebuffers[0];
-        glBindFramebuffer(GL_READ_FRAMEBUFFER, mGLState.current_framebuffer[0]);
-    }
-    if(src_target == GL_RENDERBUFFER)
-        glFramebufferRenderbuffer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, src_binding);
-    else if(src_target == GL_TEXTURE_2D || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
-            src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_X || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_Y ||
-            src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_Z ||
-            src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z)
-        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, src_target, src_binding, src_level);
-    else
+    virtual void record(CommandStreamWriter &stream) const
     {
-        ERR("Unhandled source target: 0x%x\n", src_target);
-        goto done;
+        stream.write(StreamOp::DrawElements, StreamDraw{mMode, mCount, mType,
+            GLuint(reinterpret_cast<uintptr_t>(mPointer)), mNumInstances, mBaseVtx});
     }
+};
 
-    glReadPixels(src_rect.left, src_rect.top, src_rect.right-src_rect.left, src_rect.bottom-src_rect.top,
-                 format, type, data);
+// Non-instanced indexed draws sent one after another, with nothing between
+// them, so they can go out as one call. Sent held, for the next draw to add
+// itself to.
+class MultiDrawGLElementsCmd : public Command {
+    static const GLsizei sMaxDraws = 32;
 
-done:
-    --pendingupdates;
-    checkGLError();
-}
-class ReadFramebufferCmd : public Command {
-    D3DGLDevice *mTarget;
-    GLenum mSrcTarget;
-    GLuint mSrcBinding;
-    GLint mSrcLevel;
-    RECT mSrcRect;
-    GLenum mFormat;
+    GLState &mGLState;
+    GLenum mMode;
     GLenum mType;
-    std::shared_ptr<GLubyte> mData;
-    std::atomic<ULONG> &mPendingUpdates;
+    GLsizei mNumDraws;
+    GLsizei mCounts[sMaxDraws];
+    const GLvoid *mPointers[sMaxDraws];
+    GLint mBaseVtxs[sMaxDraws];
 
 public:
-    ReadFramebufferCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, std::shared_ptr<GLubyte> data, std::atomic<ULONG> &pendingupdates)
-      : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level), mSrcRect(src_rect)
-      , mFormat(format), mType(type), mData(data), mPendingUpdates(pendingupdates)
-    { }
-
-    virtual ULONG execute()
+    MultiDrawGLElementsCmd(GLState &glstate, GLenum mode, GLint count, GLenum type, GLubyte *pointer, GLsizei basevtx)
+      : mGLState(glstate), mMode(mode), mType(type), mNumDraws(1)
     {
-        mTarget->readFramebufferGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect,
-                                   mFormat, mType, mData.get(), mPendingUpdates);
-        return sizeof(*this);
+        mCounts[0] = count;
+        mPointers[0] = pointer;
+        mBaseVtxs[0] = basevtx;
     }
-};
-
 
-void D3DGLDevice::blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect, GLenum filter)
-{
-    if(mGLState.current_framebuffer[0] != mGLState.copy_framebuffers[0])
+    bool add(GLenum mode, GLint count, GLenum type, GLubyte *pointer, GLsizei basevtx)
     {
-        mGLState.current_framebuffer[0] = mGLState.copy_framebuffers[0];
+        if(mode != mMode || type != mType || mNumDraws == sMaxDraws)
+            return false;
+        mCounts[mNumDraws] = count;
+        mPointers[mNumDraws] = pointer;
+        mBaseVtxs[mNumDraws] = basevtx;
+        ++mNumDraws;
+        return true;
+    }
+
+    virtual ULONG execute()
+    {
+        if(mGLState.current_framebuffer[0] != mGLState.main_framebuffer)
+        {
+            mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
+            mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
+            glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
+        }
+        if(mNumDraws == 1)
+            glDrawElementsBaseVertex(mMode, mCounts[0], mType, mPointers[0], mBaseVtxs[0]);
+        else
+            glMultiDrawElementsBaseVertex(mMode, mCounts, mType, mPointers, mNumDraws, mBaseVtxs);
+        checkGLError();
+
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        for(GLsizei i = 0;i < mNumDraws;++i)
+            stream.write(StreamOp::DrawElements, StreamDraw{mMode, mCounts[i], mType,
+                GLuint(reinterpret_cast<uintptr_t>(mPointers[i])), 1, mBaseVtxs[i]});
+    }
+};
+
+
+// A GL image that glCopyImageSubData can use. Cube faces are layers of the
+// cube map.
+struct GLImage {
+    GLenum mTarget;
+    GLuint mName;
+    GLint mLevel;
+    GLint mLayer;
+};
+
+bool GetSurfaceImage(IDirect3DSurface9 *surface, GLImage &image)
+{
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLRenderTarget *rtsurface;
+        D3DGLCubeSurface *cubesurface;
+    };
+    if(SUCCEEDED(surface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        image = GLImage{GL_TEXTURE_2D, tex2dsurface->getParent()->getTextureId(),
+                        (GLint)tex2dsurface->getLevel(), 0};
+        tex2dsurface->Release();
+        return true;
+    }
+    if(SUCCEEDED(surface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
+    {
+        image = GLImage{GL_RENDERBUFFER, rtsurface->getId(), 0, 0};
+        rtsurface->Release();
+        return true;
+    }
+    if(SUCCEEDED(surface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        image = GLImage{GL_TEXTURE_CUBE_MAP, cubesurface->getParent()->getTextureId(),
+                        (GLint)cubesurface->getLevel(),
+                        GLint(cubesurface->getTarget() - GL_TEXTURE_CUBE_MAP_POSITIVE_X)};
+        cubesurface->Release();
+        return true;
+    }
+    return false;
+}
+
+// Sends the deferred uploads of the texture a surface is in, so GL copies to
+// or from it see what was locked into it before, and the uploads don't land
+// on top of what's copied in after. Caller is responsible for holding the
+// queue lock.
+void FlushSurfaceUpdates(IDirect3DSurface9 *surface)
+{
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLCubeSurface *cubesurface;
+    };
+    if(SUCCEEDED(surface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        tex2dsurface->getParent()->flushUpdates();
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(surface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        cubesurface->getParent()->flushUpdates();
+        cubesurface->Release();
+    }
+}
+
+void FlushTextureUpdates(IDirect3DBaseTexture9 *texture)
+{
+    union {
+        void *pointer;
+        D3DGLTexture *tex2d;
+        D3DGLCubeTexture *cubetex;
+    };
+    if(SUCCEEDED(texture->QueryInterface(IID_D3DGLTexture, &pointer)))
+    {
+        tex2d->flushUpdates();
+        tex2d->Release();
+    }
+    else if(SUCCEEDED(texture->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
+    {
+        cubetex->flushUpdates();
+        cubetex->Release();
+    }
+}
+
+class CopyImageCmd : public Command {
+    GLImage mSrc;
+    GLint mSrcX, mSrcY;
+    GLImage mDst;
+    GLint mDstX, mDstY;
+    GLsizei mWidth, mHeight, mLayers;
+
+public:
+    CopyImageCmd(const GLImage &src, GLint srcx, GLint srcy, const GLImage &dst, GLint dstx, GLint dsty,
+                 GLsizei width, GLsizei height, GLsizei layers)
+      : mSrc(src), mSrcX(srcx), mSrcY(srcy), mDst(dst), mDstX(dstx), mDstY(dsty)
+      , mWidth(width), mHeight(height), mLayers(layers)
+    { }
+
+    virtual ULONG execute()
+    {
+        glCopyImageSubData(mSrc.mName, mSrc.mTarget, mSrc.mLevel, mSrcX, mSrcY, mSrc.mLayer,
+                           mDst.mName, mDst.mTarget, mDst.mLevel, mDstX, mDstY, mDst.mLayer,
+                           mWidth, mHeight, mLayers);
+        checkGLError();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::CopyImage, StreamCopyImage{
+            mSrc.mTarget, mSrc.mName, mSrc.mLevel, mSrcX, mSrcY, mSrc.mLayer,
+            mDst.mTarget, mDst.mName, mDst.mLevel, mDstX, mDstY, mDst.mLayer,
+            mWidth, mHeight, mLayers
+        });
+    }
+};
+
+// Runs the vertex shader on points with the rasterizer off, capturing the
+// outputs into the destination buffer.
+class ProcessVerticesCmd : public Command {
+    GLState &mGLState;
+    VertexShaderCode *mCode;
+    const VertexShaderCode::Variant *mVariant;
+    std::shared_ptr<FeedbackLayout> mLayout;
+    std::array<GLfloat,8> mViewport;
+    GLuint mBuffer;
+    UINT mOffset;
+    UINT mStart;
+    UINT mCount;
+    GLuint mVertexProgram;
+    GLuint mFragmentProgram;
+
+public:
+    ProcessVerticesCmd(GLState &glstate, VertexShaderCode *code, const VertexShaderCode::Variant *variant,
+                       std::shared_ptr<FeedbackLayout> layout, const std::array<GLfloat,8> &viewport,
+                       GLuint buffer, UINT offset, UINT start, UINT count, GLuint vprogram,
+                       GLuint fprogram)
+      : mGLState(glstate), mCode(code), mVariant(variant), mLayout(layout), mViewport(viewport)
+      , mBuffer(buffer), mOffset(offset), mStart(start), mCount(count), mVertexProgram(vprogram)
+      , mFragmentProgram(fprogram)
+    { }
+
+    virtual ULONG execute()
+    {
+        GLuint program = mCode->getFeedbackProgramGL(*mVariant, *mLayout);
+        if(!program)
+            return sizeof(*this);
+
+        GLint loc = glGetUniformLocation(program, "PV_VIEWPORT");
+        glProgramUniform4fv(program, loc, 2, mViewport.data());
+
+        glUseProgramStages(mGLState.pipeline, GL_VERTEX_SHADER_BIT, program);
+        glUseProgramStages(mGLState.pipeline, GL_FRAGMENT_SHADER_BIT, 0);
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mBuffer, mOffset, mCount*mLayout->mStride);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, mStart, mCount);
+        glEndTransformFeedback();
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        glDisable(GL_RASTERIZER_DISCARD);
+        glUseProgramStages(mGLState.pipeline, GL_FRAGMENT_SHADER_BIT, mFragmentProgram);
+        glUseProgramStages(mGLState.pipeline, GL_VERTEX_SHADER_BIT, mVertexProgram);
+        checkGLError();
+
+        return sizeof(*this);
+    }
+    // Streams have no ops for transform feedback, and the player's programs
+    // can't be linked with feedback varyings, so this isn't recorded. It
+    // leaves no state behind, but draws that read the destination buffer
+    // later get whatever the stream last put in it.
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+} // namespace
+
+
+void D3DGLDevice::readFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
+                                    GLenum format, GLenum type, const std::shared_ptr<GLubyte> &data, GLint rowlength,
+                                    UINT pitch, ULONG serial, ULONG replaced)
+{
+    // A newer readback into the same surface makes the old one pointless.
+    if(replaced) mReadback.cancelGL(replaced);
+
+    if(src_target == GL_FRONT)
+    {
+        if(mGLState.current_framebuffer[0] != 0)
+        {
+            mGLState.current_framebuffer[0] = 0;
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        }
+        glReadBuffer(GL_FRONT);
+    }
+    else
+    {
+        if(mGLState.current_framebuffer[0] != mGLState.copy_framebuffers[0])
+        {
+            mGLState.current_framebuffer[0] = mGLState.copy_framebuffers[0];
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, mGLState.current_framebuffer[0]);
+        }
+        if(src_target == GL_RENDERBUFFER)
+            glFramebufferRenderbuffer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, src_binding);
+        else if(src_target == GL_TEXTURE_2D || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
+                src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_X || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_Y ||
+                src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y || src_target == GL_TEXTURE_CUBE_MAP_POSITIVE_Z ||
+                src_target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z)
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, src_target, src_binding, src_level);
+        else
+        {
+            ERR("Unhandled source target: 0x%x\n", src_target);
+            checkGLError();
+            return;
+        }
+    }
+
+    // Render targets are drawn upside down, which puts them in D3D's row
+    // order already. The front buffer was flipped when presented.
+    GLsizei height = src_rect.bottom - src_rect.top;
+    mReadback.beginGL(serial, data, pitch, height, src_target == GL_FRONT);
+    glPixelStorei(GL_PACK_ROW_LENGTH, rowlength);
+    glReadPixels(src_rect.left, src_rect.top, src_rect.right-src_rect.left, height,
+                 format, type, nullptr);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    mReadback.endGL(serial);
+
+    if(src_target == GL_FRONT)
+        glReadBuffer(GL_BACK);
+    checkGLError();
+}
+class ReadFramebufferCmd : public Command {
+    D3DGLDevice *mTarget;
+    GLenum mSrcTarget;
+    GLuint mSrcBinding;
+    GLint mSrcLevel;
+    RECT mSrcRect;
+    GLenum mFormat;
+    GLenum mType;
+    std::shared_ptr<GLubyte> mData;
+    GLint mRowLength;
+    UINT mPitch;
+    ULONG mSerial;
+    ULONG mReplaced;
+
+public:
+    ReadFramebufferCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
+                       GLenum format, GLenum type, std::shared_ptr<GLubyte> data, GLint rowlength, UINT pitch,
+                       ULONG serial, ULONG replaced)
+      : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level), mSrcRect(src_rect)
+      , mFormat(format), mType(type), mData(data), mRowLength(rowlength), mPitch(pitch), mSerial(serial)
+      , mReplaced(replaced)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->readFramebufferGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect, mFormat, mType, mData,
+                                   mRowLength, mPitch, mSerial, mReplaced);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class ResolveReadbackCmd : public Command {
+    ReadbackRing &mTarget;
+    ULONG mSerial;
+
+public:
+    ResolveReadbackCmd(ReadbackRing &target, ULONG serial) : mTarget(target), mSerial(serial) { }
+
+    virtual ULONG execute()
+    {
+        mTarget.resolveGL(mSerial);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+
+void D3DGLDevice::queueReadback(D3DGLPlainSurface *surface, GLenum src_target, GLuint src_binding, GLint src_level,
+                                const RECT &rect, GLint rowlength)
+{
+    const GLFormatInfo &format = surface->getFormat();
+    UINT width = rowlength ? rowlength : (rect.right-rect.left);
+    UINT pitch = GLFormatInfo::calcPitch(width, format.bytesperpixel);
+
+    mQueue.lock();
+    ULONG serial = mReadback.next();
+    ULONG replaced = surface->setReadback(serial);
+    mQueue.doSend<ReadFramebufferCmd>(this, src_target, src_binding, src_level, rect, format.format,
+                                      format.type, surface->getBufData(), rowlength, pitch, serial, replaced);
+    mQueue.unlock();
+}
+
+ULONG D3DGLDevice::resolveReadback(ULONG serial)
+{
+    return mQueue.send<ResolveReadbackCmd>(make_ref(mReadback), serial);
+}
+
+
+void D3DGLDevice::blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect, GLenum filter)
+{
+    if(CommandStreamWriter *stream = mQueue.getRecorder())
+        stream->write(StreamOp::Blit, StreamBlit{
+            src_target, src_binding, src_level,
+            StreamRect{src_rect.left, src_rect.top, src_rect.right, src_rect.bottom},
+            dst_target, dst_binding, dst_level,
+            StreamRect{dst_rect.left, dst_rect.top, dst_rect.right, dst_rect.bottom},
+            filter
+        });
+
+    if(mGLState.current_framebuffer[0] != mGLState.copy_framebuffers[0])
+    {
+        mGLState.current_framebuffer[0] = mGLState.copy_framebuffers[0];
         glBindFramebuffer(GL_READ_FRAMEBUFFER, mGLState.current_framebuffer[0]);
     }
     if(src_target == GL_RENDERBUFFER)
@@ -1185,6 +1830,7 @@ public:
                                    mFilter);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 void D3DGLDevice::debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei /*length*/, const GLchar *message) const
@@ -1248,37 +1894,38 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         if(GLDebugLevel < FIXME_) glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, nullptr, GL_FALSE);
         if(GLDebugLevel < ERR_) glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, nullptr, GL_FALSE);
         checkGLError();
+        // Errors come through the callback as they happen, so only poll for
+        // them when asked to for every command.
+        if(GLErrorCheckMode != GLErrorCheck::Always)
+            GLErrorCheckMode = GLErrorCheck::Off;
     }
 
-    glGenSamplers(mGLState.samplers.size(), mGLState.samplers.data());
-    checkGLError();
-
-    for(size_t i = 0;i < mGLState.samplers.size();++i)
-    {
-        auto &sampler = mGLState.samplers[i];
-
-        GLint color[4]{0, 0, 0, 0};
-        glBindSampler(i, sampler);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, GL_REPEAT);
-        glSamplerParameteriv(sampler, GL_TEXTURE_BORDER_COLOR, color);
-        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glSamplerParameteri(sampler, GL_TEXTURE_SRGB_DECODE_EXT, GL_SKIP_DECODE_EXT);
-        if(GLEW_EXT_texture_filter_anisotropic)
-            glSamplerParameteri(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, 1);
-        checkGLError();
-    }
+    mVertexArrays.initGL();
+    mQueries.initGL();
+    mGPUTimer.beginFrameGL();
 
     glGenProgramPipelines(1, &mGLState.pipeline);
     glBindProgramPipeline(mGLState.pipeline);
     checkGLError();
 
-    glGenFramebuffers(1, &mGLState.main_framebuffer);
     glGenFramebuffers(2, mGLState.copy_framebuffers);
     checkGLError();
 
+    CommandStreamWriter *stream = mQueue.getRecorder();
+    if(stream)
+    {
+        StreamDeviceInit init;
+        // Samplers come from BindSampler records.
+        init.mNumSamplers = 0;
+        init.mPipeline = mGLState.pipeline;
+        // Render framebuffers come from FBAttachment records on the player's
+        // own framebuffer.
+        init.mMainFramebuffer = 0;
+        init.mCopyFramebuffers[0] = mGLState.copy_framebuffers[0];
+        init.mCopyFramebuffers[1] = mGLState.copy_framebuffers[1];
+        stream->write(StreamOp::DeviceInit, init);
+    }
+
     {
         GLVertexState vtxState;
 
@@ -1293,6 +1940,19 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         glBindBuffer(GL_UNIFORM_BUFFER, mGLState.ps_uniform_bufferf);
         glBufferData(GL_UNIFORM_BUFFER, mPSConstantsF.size()*sizeof(Vector4f), zero, GL_STREAM_DRAW);
         glBindBufferBase(GL_UNIFORM_BUFFER, PSF_BINDING_IDX, mGLState.ps_uniform_bufferf);
+        // Ints and bools, each register taking a vec4 in std140
+        const GLuint ib_size = mVSConstantsI.size()*sizeof(Vector4f);
+        const std::array<std::pair<GLuint*,GLuint>,4> ibbuffers{{
+            { &mGLState.vs_uniform_bufferi, VSI_BINDING_IDX }, { &mGLState.vs_uniform_bufferb, VSB_BINDING_IDX },
+            { &mGLState.ps_uniform_bufferi, PSI_BINDING_IDX }, { &mGLState.ps_uniform_bufferb, PSB_BINDING_IDX }
+        }};
+        for(const auto &ib : ibbuffers)
+        {
+            glGenBuffers(1, ib.first);
+            glBindBuffer(GL_UNIFORM_BUFFER, *ib.first);
+            glBufferData(GL_UNIFORM_BUFFER, ib_size, zero, GL_STREAM_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, ib.second, *ib.first);
+        }
         // Vertex state
         glGenBuffers(1, &mGLState.vtx_state_uniform_buffer);
         glBindBuffer(GL_UNIFORM_BUFFER, mGLState.vtx_state_uniform_buffer);
@@ -1303,25 +1963,61 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
         glBindBuffer(GL_UNIFORM_BUFFER, mGLState.pos_fixup_uniform_buffer);
         glBufferData(GL_UNIFORM_BUFFER, sizeof(Vector4f), zero, GL_STREAM_DRAW);
         glBindBufferBase(GL_UNIFORM_BUFFER, POSFIXUP_BINDING_IDX, mGLState.pos_fixup_uniform_buffer);
+        // Fixed-function uniforms
+        const std::array<std::pair<GLuint*,GLuint>,2> ffbuffers{{
+            { &mGLState.ffvs_uniform_buffer, FFVS_BINDING_IDX }, { &mGLState.ffps_uniform_buffer, FFPS_BINDING_IDX }
+        }};
+        const std::array<GLuint,2> ffsizes{{ sizeof(FFVertexUniforms), sizeof(FFPixelUniforms) }};
+        static_assert(sizeof(FFVertexUniforms) <= sizeof(zero), "Fixed-function uniforms too large");
+        for(size_t i = 0;i < ffbuffers.size();++i)
+        {
+            glGenBuffers(1, ffbuffers[i].first);
+            glBindBuffer(GL_UNIFORM_BUFFER, *ffbuffers[i].first);
+            glBufferData(GL_UNIFORM_BUFFER, ffsizes[i], zero, GL_STREAM_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, ffbuffers[i].second, *ffbuffers[i].first);
+        }
+
+        if(stream)
+        {
+            const GLuint vsf_size = mVSConstantsF.size()*sizeof(Vector4f);
+            const GLuint psf_size = mPSConstantsF.size()*sizeof(Vector4f);
+            stream->write(StreamOp::BufferData, StreamBufferData{mGLState.vs_uniform_bufferf, vsf_size, GL_STREAM_DRAW},
+                          zero, vsf_size);
+            stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{VSF_BINDING_IDX, mGLState.vs_uniform_bufferf});
+            stream->write(StreamOp::BufferData, StreamBufferData{mGLState.ps_uniform_bufferf, psf_size, GL_STREAM_DRAW},
+                          zero, psf_size);
+            stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{PSF_BINDING_IDX, mGLState.ps_uniform_bufferf});
+            for(const auto &ib : ibbuffers)
+            {
+                stream->write(StreamOp::BufferData, StreamBufferData{*ib.first, ib_size, GL_STREAM_DRAW},
+                              zero, ib_size);
+                stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{ib.second, *ib.first});
+            }
+            stream->write(StreamOp::BufferData, StreamBufferData{mGLState.vtx_state_uniform_buffer, sizeof(vtxState), GL_STREAM_DRAW},
+                          &vtxState, sizeof(vtxState));
+            stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{VTXSTATE_BINDING_IDX, mGLState.vtx_state_uniform_buffer});
+            stream->write(StreamOp::BufferData, StreamBufferData{mGLState.pos_fixup_uniform_buffer, sizeof(Vector4f), GL_STREAM_DRAW},
+                          zero, sizeof(Vector4f));
+            stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{POSFIXUP_BINDING_IDX, mGLState.pos_fixup_uniform_buffer});
+            for(size_t i = 0;i < ffbuffers.size();++i)
+            {
+                stream->write(StreamOp::BufferData, StreamBufferData{*ffbuffers[i].first, ffsizes[i], GL_STREAM_DRAW},
+                              zero, ffsizes[i]);
+                stream->write(StreamOp::BindUniformBuffer, StreamBindBuffer{ffbuffers[i].second, *ffbuffers[i].first});
+            }
+        }
     }
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
     checkGLError();
 
+    GLint align = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    mUniformAlign = std::max(align, 16);
+    checkGLError();
+
     glActiveTexture(GL_TEXTURE0);
     mGLState.active_texture_stage = 0;
 
-    mGLState.attrib_array_enabled = 0;
-
-    {
-        glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
-        mGLState.current_framebuffer[0] = mGLState.main_framebuffer;
-        mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
-        std::array<GLenum,4> buffers{
-            GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
-            GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3
-        };
-        glDrawBuffers(buffers.size(), buffers.data());
-    }
 
     glFrontFace(GL_CCW);
     checkGLError();
@@ -1338,26 +2034,40 @@ public:
         mTarget->initGL(mDc, mGLContext);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 void D3DGLDevice::deinitGL()
 {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+    mVertexArrays.deinitGL();
+
+    mFFShaders.deinitGL();
+
+    glDeleteBuffers(1, &mGLState.ffps_uniform_buffer);
+    glDeleteBuffers(1, &mGLState.ffvs_uniform_buffer);
     glDeleteBuffers(1, &mGLState.vtx_state_uniform_buffer);
     glDeleteBuffers(1, &mGLState.pos_fixup_uniform_buffer);
+    glDeleteBuffers(1, &mGLState.ps_uniform_bufferb);
+    glDeleteBuffers(1, &mGLState.vs_uniform_bufferb);
+    glDeleteBuffers(1, &mGLState.ps_uniform_bufferi);
+    glDeleteBuffers(1, &mGLState.vs_uniform_bufferi);
     glDeleteBuffers(1, &mGLState.ps_uniform_bufferf);
     glDeleteBuffers(1, &mGLState.vs_uniform_bufferf);
 
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
     glDeleteFramebuffers(2, mGLState.copy_framebuffers);
-    glDeleteFramebuffers(1, &mGLState.main_framebuffer);
+    mFramebuffers.deinitGL();
 
     glBindProgramPipeline(0);
     glDeleteProgramPipelines(1, &mGLState.pipeline);
 
-    for(size_t i = 0;i < mGLState.samplers.size();++i)
-        glBindSampler(i, 0);
-    glDeleteSamplers(mGLState.samplers.size(), mGLState.samplers.data());
+    mSamplerCache.deinitGL();
+
+    mReadback.deinitGL();
+    mQueries.deinitGL();
+    mGPUTimer.deinitGL();
 
     wglMakeCurrent(nullptr, nullptr);
 }
@@ -1371,34 +2081,63 @@ public:
         mTarget->deinitGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
+UINT MaxFrameLatency = 1;
+
+
 D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND window, DWORD flags)
   : mRefCount(0)
   , mParent(parent)
   , mAdapter(adapter)
   , mGLDeviceCtx(nullptr)
   , mGLContext(nullptr)
+  , mUploadRing(mQueue, mVertexArrays)
+  , mUniformRing(mQueue, mVertexArrays, 16<<20)
+  , mUniformAlign(16)
+  , mResidency(mQueue)
+  , mFFShaders(mQueue)
   , mWindow(window)
   , mFlags(flags)
   , mAutoDepthStencil(nullptr)
   , mSwapchains{nullptr}
   , mDepthStencil(nullptr)
+  , mMaterial()
   , mInScene(false)
+  , mMaxFrameLatency(MaxFrameLatency)
   , mVSConstantsF{0.0f}
   , mPSConstantsF{0.0f}
+  , mVSConstFDirtyStart(~0u), mVSConstFDirtyEnd(0)
+  , mPSConstFDirtyStart(~0u), mPSConstFDirtyEnd(0)
+  , mVSConstFSliceStart(~0u), mVSConstFSliceEnd(0)
+  , mPSConstFSliceStart(~0u), mPSConstFSliceEnd(0)
+  , mVSConstFSliceSerial(0), mPSConstFSliceSerial(0)
+  , mVSConstantsI(), mPSConstantsI()
+  , mVSConstantsB(0), mPSConstantsB(0)
   , mVertexShader(nullptr)
   , mPixelShader(nullptr)
   , mVertexDecl(nullptr)
   , mIndexBuffer(nullptr)
-  , mPrimitiveUserData(nullptr)
   , mDepthBits(0)
+  , mFBDesc()
   , mShadowSamplers(0)
-  , mNewPixelShader(false)
+  , mCubeSamplers(0)
+  , mNumActiveLights(0)
+  , mFFDirty(FFDirty_Vertex | FFDirty_Pixel)
+  , mFFVertexSliceSerial(0), mFFPixelSliceSerial(0)
+  , mVertexProgram(0)
+  , mFragmentProgram(0)
+  , mDirtySamplers((1u<<MAX_COMBINED_SAMPLERS) - 1)
+  , mRecordingBlock(nullptr)
+  , mVtxAttribs(0)
+  , mNumVtxFormats(0)
+  , mNumVtxBindings(0)
 {
     for(auto &rt : mRenderTargets) rt = nullptr;
     for(auto &tex : mTextures) tex = nullptr;
+    mBoundResources.fill(nullptr);
     for(size_t i = 0;i < mTexStageState.size();++i)
     {
         auto &tss = mTexStageState[i];
@@ -1411,15 +2150,18 @@ D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND win
         std::copy(DefaultSSValues.begin(), DefaultSSValues.end(), ss.begin());
     std::copy(DefaultRSValues.begin(), DefaultRSValues.end(), mRenderState.begin());
     mRenderState[D3DRS_POINTSIZE_MAX] = float_to_dword(mAdapter.getLimits().pointsize_max);
+    mTransforms.fill(IdentityMatrix);
+    mWorldMatrices.fill(IdentityMatrix);
+
+    std::copy(mRenderState.begin(), mRenderState.end(), mGLRenderState.begin());
+    // No sampler is bound yet, so every stage gets one with the first draw.
+    mGLSamplerDescs.fill(GLSamplerDesc{});
 
     mParent->AddRef();
 }
 
 D3DGLDevice::~D3DGLDevice()
 {
-    delete mPrimitiveUserData;
-    mPrimitiveUserData = nullptr;
-
     for(auto &stream : mStreams)
     {
         if(stream.mBuffer)
@@ -1433,8 +2175,7 @@ D3DGLDevice::~D3DGLDevice()
     if(D3DGLVertexDeclaration *vtxdecl = mVertexDecl.exchange(nullptr))
         vtxdecl->releaseIface();
 
-    for(auto &fvfdecl : mVtxDeclMap)
-        delete fvfdecl.second;
+    mVtxDeclMap.forEach([](DWORD, D3DGLVertexDeclaration *vtxdecl) { delete vtxdecl; });
 
     for(auto &schain : mSwapchains)
     {
@@ -1444,8 +2185,12 @@ D3DGLDevice::~D3DGLDevice()
     delete mAutoDepthStencil;
     mAutoDepthStencil = nullptr;
 
+    mWorkers.deinit();
+    mCompiler.deinit();
     if(mQueue.isActive())
     {
+        mUniformRing.deinit();
+        mUploadRing.deinit();
         mQueue.send<DeinitGLDeviceCmd>(this);
         mQueue.deinit();
     }
@@ -1491,7 +2236,10 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
         }
     }
 
-    if(!mQueue.init())
+    // Without D3DCREATE_MULTITHREADED, the app only calls in from one thread,
+    // so the queue doesn't need to guard against other senders.
+    bool singlethread = !(mFlags&D3DCREATE_MULTITHREADED) && !CommandQueueForceLocking;
+    if(!mQueue.init(CommandQueueSize, CommandPayloadSize, singlethread))
         return false;
 
     std::vector<std::array<int,2>> glattrs;
@@ -1539,45 +2287,93 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
         ERR("Failed to create OpenGL context, error %lu\n", GetLastError());
         return false;
     }
+    // Recordings need the programs created in order on the command thread.
+    if(!CommandStreamFile)
+        mCompiler.init(mGLDeviceCtx, mGLContext, &glattrs[0][0]);
 
     mQueue.sendSync<InitGLDeviceCmd>(this, mGLDeviceCtx, mGLContext);
+    if(!mUploadRing.init())
+        return false;
+    // Recorded streams keep binding the whole constant buffers.
+    if(!CommandStreamFile && !mUniformRing.init())
+        return false;
+    mWorkers.init();
+    mResidency.init();
 
     return SUCCEEDED(Reset(params));
 }
 
 
-HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT num_sources)
+HRESULT D3DGLDevice::sendVtxData(const StreamSource *sources, UINT num_sources)
 {
-    D3DGLVertexShader *vshader = mVertexShader;
-    if(!vshader)
+    D3DGLVertexDeclaration *vtxdecl = mVertexDecl;
+    if(!vtxdecl)
     {
-        FIXME("Cannot draw without a vertex shader\n");
-        return D3D_OK;
+        WARN("No vertex declaration set\n");
+        return D3DERR_INVALIDCALL;
     }
 
-    /* Wait for the vertex shader to finish building if it's in the process of
-     * doing so. We need its UsageMap to set the proper vertex attributes.
+    /* Shader objects with the same bytecode share their programs, so there's
+     * nothing to set when switching between them. Stages without a shader
+     * get a program generated for the fixed-function state.
      */
-    while(vshader->checkShadowSamplers(mShadowSamplers),vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
-
-    if(D3DGLPixelShader *pshader = mPixelShader)
-        pshader->setProgram(mGLState.pipeline, mShadowSamplers, mNewPixelShader.exchange(false));
+    D3DGLVertexShader *vshader = mVertexShader;
+    VertexShaderCode *vcode = vshader ? vshader->getCode() : nullptr;
+    D3DGLPixelShader *pshader = mPixelShader;
+    PixelShaderCode *pcode = pshader ? pshader->getCode() : nullptr;
+    if(vcode)
+        vcode->selectVariant(mShadowSamplers, mVSConstantsI, mVSConstantsB);
+    if(pcode)
+        pcode->selectVariant(mShadowSamplers, mPSConstantsI, mPSConstantsB);
+    if(SkipPendingShaders && ((vcode && vcode->isBuilding()) || (pcode && pcode->isBuilding())))
+    {
+        TRACE("Skipping draw while shaders build\n");
+        return S_FALSE;
+    }
 
-    D3DGLVertexDeclaration *vtxdecl = mVertexDecl;
-    if(!vtxdecl)
+    GLuint program;
+    if(vcode)
     {
-        WARN("No vertex declaration set\n");
-        return D3DERR_INVALIDCALL;
+        /* Wait for the vertex shader to finish building if it's in the
+         * process of doing so. We need its UsageMap to set the proper vertex
+         * attributes.
+         */
+        vcode->waitBuilt();
+        program = vcode->getProgram();
+    }
+    else
+        program = mFFShaders.getVertexProgram(getFFVertexKey(vtxdecl));
+    if(program != mVertexProgram)
+    {
+        mQueue.doSend<SetVShaderCmd>(mGLState.pipeline, program);
+        mVertexProgram = program;
+    }
+    if(pcode)
+    {
+        pcode->waitBuilt();
+        program = pcode->getProgram();
     }
+    else
+        program = mFFShaders.getPixelProgram(getFFPixelKey(!vcode, vtxdecl));
+    if(program != mFragmentProgram)
+    {
+        mQueue.doSend<SetPShaderCmd>(mGLState.pipeline, program);
+        mFragmentProgram = program;
+    }
+    flushUniforms(vcode, pcode);
 
-    std::array<GLStreamData,16> streams;
+    // Each stream the declaration uses gets the next binding point.
+    std::array<GLVertexFormat,16> formats;
+    std::array<GLVertexBinding,MAX_STREAMS> bindings;
+    std::array<GLuint,MAX_STREAMS> stream_binding;
+    stream_binding.fill(~0u);
     GLuint cur = 0;
+    GLuint numbindings = 0;
 
     UINT attribs = 0;
     for(const D3DGLVERTEXELEMENT &elem : vtxdecl->getVtxElements())
     {
-        if(cur >= streams.size())
+        if(cur >= formats.size())
         {
             ERR("Too many vertex elements!\n");
             return D3DERR_INVALIDCALL;
@@ -1589,60 +2385,752 @@ HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT
             return D3DERR_INVALIDCALL;
         }
 
-        const StreamSource &source = sources[elem.Stream];
-        D3DGLBufferObject *buffer = source.mBuffer;
-
-        GLint offset = elem.Offset + source.mOffset + source.mStride*startvtx;
-        streams[cur].mBufferId = buffer->getBufferId();
-        streams[cur].mPointer = ((GLubyte*)0) + offset;
-        streams[cur].mGLCount = elem.mGLCount;
-        streams[cur].mGLType = elem.mGLType;
-        streams[cur].mNormalize = elem.mNormalize;
-        streams[cur].mStride = source.mStride;
-        streams[cur].mDivisor = 0;
-        if((source.mFreq&D3DSTREAMSOURCE_INSTANCEDATA))
-            streams[cur].mDivisor = (source.mFreq&0x3fffffff);
-
-        streams[cur].mTarget = vshader->getLocation(elem.Usage, elem.UsageIndex);
-        if(streams[cur].mTarget == -1)
+        GLint target = vcode ? vcode->getLocation(elem.Usage, elem.UsageIndex) :
+                               GetFFAttribLocation(elem.Usage, elem.UsageIndex);
+        if(target == -1)
         {
             TRACE("Skipping element (usage 0x%02x, index %u, vshader %p)\n",
                   elem.Usage, elem.UsageIndex, vshader);
             continue;
         }
-        attribs |= 1<<streams[cur].mTarget;
+
+        if(stream_binding[elem.Stream] == ~0u)
+        {
+            const StreamSource &source = sources[elem.Stream];
+            D3DGLBufferObject *buffer = source.mBuffer;
+            GLVertexBinding &binding = bindings[numbindings];
+
+            binding.mOffset = source.mOffset;
+            if(buffer)
+            {
+                buffer->flushUpdates();
+                binding.mOffset += buffer->getDataOffset();
+                binding.mBufferId = buffer->getBufferId();
+            }
+            else
+                binding.mBufferId = mUploadRing.getBufferId();
+            binding.mStride = source.mStride;
+            binding.mDivisor = 0;
+            if((source.mFreq&D3DSTREAMSOURCE_INSTANCEDATA))
+                binding.mDivisor = (source.mFreq&0x3fffffff);
+            stream_binding[elem.Stream] = numbindings++;
+        }
+
+        formats[cur].mTarget = target;
+        formats[cur].mBinding = stream_binding[elem.Stream];
+        formats[cur].mGLType = elem.mGLType;
+        formats[cur].mGLCount = elem.mGLCount;
+        formats[cur].mNormalize = elem.mNormalize;
+        formats[cur].mOffset = elem.Offset;
+        attribs |= 1<<target;
         ++cur;
     }
 
-    mQueue.doSend<SetVertexAttribArrayCmd>(make_ref(mGLState), attribs);
-    mQueue.doSend<SetVtxDataCmd>(streams.data(), cur);
+    // With nothing sent since the last draw, the same setup is still current
+    // on the command thread. The structs have no padding.
+    if(mQueue.isHeldLast() && attribs == mVtxAttribs && cur == mNumVtxFormats &&
+       numbindings == mNumVtxBindings &&
+       memcmp(formats.data(), mVtxFormats.data(), cur*sizeof(formats[0])) == 0 &&
+       memcmp(bindings.data(), mVtxBindings.data(), numbindings*sizeof(bindings[0])) == 0)
+        return D3D_OK;
+    mVtxAttribs = attribs;
+    mNumVtxFormats = cur;
+    mNumVtxBindings = numbindings;
+    std::copy(formats.begin(), formats.begin()+cur, mVtxFormats.begin());
+    std::copy(bindings.begin(), bindings.begin()+numbindings, mVtxBindings.begin());
+
+    mQueue.doSend<SetVtxDataCmd>(make_ref(mQueue), make_ref(mVertexArrays), attribs, formats.data(), cur,
+                                 bindings.data(), numbindings, mUploadRing.getBufferId());
 
     return D3D_OK;
 }
 
-void D3DGLDevice::resetProjectionFixup(UINT width, UINT height)
+void D3DGLDevice::flushConstantsF(GLuint buffer, const Vector4f *constants, UINT &dirtystart, UINT &dirtyend,
+                                  UINT usedstart, UINT usedend)
 {
-    // OpenGL places pixel coords at the pixel's bottom-left, while D3D places
-    // it at the center. So we have to translate X and Y by /almost/ 0.5 pixels
-    // (almost because of certain triangle edge rules GL is a bit lax on). The
-    // offset is doubled since projection ranges from -1...+1 instead of 0...1.
-    //
-    // We supply the needed X/Y offsets through a (shared) vec4 uniform. The
-    // shader is also responsible for flipping Y and fixing Z depth.
-    float trans[4] = { 0.99f/width, 0.99f/height, 0.0f, 0.0f };
+    UINT start = std::max(dirtystart, usedstart);
+    UINT end = std::min(dirtyend, usedend);
+    if(start >= end)
+        return;
 
-    mQueue.doSend<SetBufferValue4f>(mGLState.pos_fixup_uniform_buffer, 0, trans);
-}
+    if(end-start == 1)
+        mQueue.doSend<SetBufferValue4f>(buffer, start*sizeof(Vector4f), constants[start].ptr());
+    else
+        mQueue.doSend<SetBufferValueData>(make_ref(mQueue), buffer, start*sizeof(Vector4f),
+            constants[start].ptr(), end-start
+        );
 
+    // The range can only shrink from one side. Otherwise the uploaded part
+    // stays in it, and gets uploaded again with the rest.
+    if(start == dirtystart)
+        dirtystart = end;
+    else if(end == dirtyend)
+        dirtyend = start;
+    if(dirtystart >= dirtyend)
+    {
+        dirtystart = ~0u;
+        dirtyend = 0;
+    }
+}
 
-HRESULT D3DGLDevice::QueryInterface(const IID &riid, void **obj)
+void D3DGLDevice::flushUniforms(const VertexShaderCode *vcode, const PixelShaderCode *pcode)
 {
-    TRACE("iface %p, riid %s, obj %p.\n", this, debugstr_guid(riid), obj);
-
-    *obj = NULL;
-    RETURN_IF_IID_TYPE(obj, riid, D3DGLDevice);
-    RETURN_IF_IID_TYPE(obj, riid, IDirect3DDevice9);
-    RETURN_IF_IID_TYPE(obj, riid, IUnknown);
+    UINT ffdirty = mFFDirty & ((vcode ? 0 : FFDirty_Vertex) | (pcode ? 0 : FFDirty_Pixel));
+    mFFDirty &= ~ffdirty;
+
+    if(!mUniformRing.getBufferId())
+    {
+        if(vcode)
+            flushConstantsF(mGLState.vs_uniform_bufferf, mVSConstantsF.data(), mVSConstFDirtyStart,
+                            mVSConstFDirtyEnd, vcode->getConstFStart(), vcode->getConstFEnd());
+        else if((ffdirty&FFDirty_Vertex))
+        {
+            FFVertexUniforms uniforms;
+            fillFFVertexUniforms(uniforms);
+            mQueue.doSend<SetBufferValueData>(make_ref(mQueue), mGLState.ffvs_uniform_buffer, 0,
+                reinterpret_cast<const float*>(&uniforms), sizeof(uniforms)/sizeof(Vector4f)
+            );
+        }
+        if(pcode)
+            flushConstantsF(mGLState.ps_uniform_bufferf, mPSConstantsF.data(), mPSConstFDirtyStart,
+                            mPSConstFDirtyEnd, pcode->getConstFStart(), pcode->getConstFEnd());
+        else if((ffdirty&FFDirty_Pixel))
+        {
+            FFPixelUniforms uniforms;
+            fillFFPixelUniforms(uniforms);
+            mQueue.doSend<SetBufferValueData>(make_ref(mQueue), mGLState.ffps_uniform_buffer, 0,
+                reinterpret_cast<const float*>(&uniforms), sizeof(uniforms)/sizeof(Vector4f)
+            );
+        }
+        return;
+    }
+
+    // Each stage reads one slice, of its shader's float constants or of the
+    // fixed-function uniforms. The constant slices hold the whole register
+    // file, as that's the size the shaders declare, but only the registers
+    // the shader reads get filled in.
+    const ULONG serial = mUniformRing.getRegionSerial();
+    UINT vslen, pslen;
+    bool vsnew, psnew;
+    if(vcode)
+    {
+        vslen = (vcode->getConstFStart() < vcode->getConstFEnd()) ? mVSConstantsF.size()*sizeof(Vector4f) : 0;
+        vsnew = vslen > 0 && (mVSConstFSliceSerial != serial ||
+            isSliceStale(vcode->getConstFStart(), vcode->getConstFEnd(), mVSConstFDirtyStart,
+                         mVSConstFDirtyEnd, mVSConstFSliceStart, mVSConstFSliceEnd));
+    }
+    else
+    {
+        vslen = sizeof(FFVertexUniforms);
+        vsnew = (ffdirty&FFDirty_Vertex) || mFFVertexSliceSerial != serial;
+    }
+    if(pcode)
+    {
+        pslen = (pcode->getConstFStart() < pcode->getConstFEnd()) ? mPSConstantsF.size()*sizeof(Vector4f) : 0;
+        psnew = pslen > 0 && (mPSConstFSliceSerial != serial ||
+            isSliceStale(pcode->getConstFStart(), pcode->getConstFEnd(), mPSConstFDirtyStart,
+                         mPSConstFDirtyEnd, mPSConstFSliceStart, mPSConstFSliceEnd));
+    }
+    else
+    {
+        pslen = sizeof(FFPixelUniforms);
+        psnew = (ffdirty&FFDirty_Pixel) || mFFPixelSliceSerial != serial;
+    }
+    if(!vsnew && !psnew)
+        return;
+
+    // Taking a new slice can leave the region the other stage's slice is in,
+    // so both are taken in the same reserve.
+    UINT psoffset = (vslen+mUniformAlign-1) & ~(mUniformAlign-1);
+    UINT offset = mUniformRing.reserve(psoffset + pslen, mUniformAlign);
+    const ULONG newserial = mUniformRing.getRegionSerial();
+    GLuint buffer = mUniformRing.getBufferId();
+
+    if(vcode && vslen > 0)
+    {
+        UINT start = vcode->getConstFStart();
+        UINT end = vcode->getConstFEnd();
+        mUniformRing.copy(offset + start*sizeof(Vector4f), mVSConstantsF[start].ptr(),
+                          (end-start)*sizeof(Vector4f));
+        mQueue.doSend<BindUniformRangeCmd>(VSF_BINDING_IDX, buffer, offset, vslen);
+        mVSConstFSliceStart = start;
+        mVSConstFSliceEnd = end;
+        mVSConstFSliceSerial = newserial;
+        mVSConstFDirtyStart = ~0u;
+        mVSConstFDirtyEnd = 0;
+    }
+    else if(!vcode)
+    {
+        FFVertexUniforms uniforms;
+        fillFFVertexUniforms(uniforms);
+        mUniformRing.copy(offset, &uniforms, vslen);
+        mQueue.doSend<BindUniformRangeCmd>(FFVS_BINDING_IDX, buffer, offset, vslen);
+        mFFVertexSliceSerial = newserial;
+    }
+    if(pcode && pslen > 0)
+    {
+        UINT start = pcode->getConstFStart();
+        UINT end = pcode->getConstFEnd();
+        mUniformRing.copy(offset + psoffset + start*sizeof(Vector4f), mPSConstantsF[start].ptr(),
+                          (end-start)*sizeof(Vector4f));
+        mQueue.doSend<BindUniformRangeCmd>(PSF_BINDING_IDX, buffer, offset+psoffset, pslen);
+        mPSConstFSliceStart = start;
+        mPSConstFSliceEnd = end;
+        mPSConstFSliceSerial = newserial;
+        mPSConstFDirtyStart = ~0u;
+        mPSConstFDirtyEnd = 0;
+    }
+    else if(!pcode)
+    {
+        FFPixelUniforms uniforms;
+        fillFFPixelUniforms(uniforms);
+        mUniformRing.copy(offset + psoffset, &uniforms, pslen);
+        mQueue.doSend<BindUniformRangeCmd>(FFPS_BINDING_IDX, buffer, offset+psoffset, pslen);
+        mFFPixelSliceSerial = newserial;
+    }
+}
+
+FFVertexKey D3DGLDevice::getFFVertexKey(const D3DGLVertexDeclaration *vtxdecl) const
+{
+    FFVertexKey key;
+    memset(&key, 0, sizeof(key));
+
+    for(const D3DGLVERTEXELEMENT &elem : vtxdecl->getVtxElements())
+    {
+        if(elem.Usage == D3DDECLUSAGE_POSITIONT && elem.UsageIndex == 0)
+            key.mTransformed = true;
+        else if(elem.Usage == D3DDECLUSAGE_NORMAL && elem.UsageIndex == 0)
+            key.mHasNormal = true;
+        else if(elem.Usage == D3DDECLUSAGE_PSIZE && elem.UsageIndex == 0)
+            key.mHasPSize = true;
+        else if(elem.Usage == D3DDECLUSAGE_COLOR && elem.UsageIndex == 0)
+            key.mHasDiffuse = true;
+        else if(elem.Usage == D3DDECLUSAGE_COLOR && elem.UsageIndex == 1)
+            key.mHasSpecular = true;
+        else if(elem.Usage == D3DDECLUSAGE_TEXCOORD && elem.UsageIndex < 8)
+        {
+            DWORD size = (elem.mGLCount == GL_BGRA) ? 4 : std::min<DWORD>(elem.mGLCount, 4);
+            key.mTexCoordSizes &= ~(7u << (elem.UsageIndex*3));
+            key.mTexCoordSizes |= size << (elem.UsageIndex*3);
+        }
+    }
+
+    key.mSpecular = mRenderState[D3DRS_SPECULARENABLE] != FALSE;
+    if(!key.mTransformed)
+    {
+        key.mLocalViewer = mRenderState[D3DRS_LOCALVIEWER] != FALSE;
+        key.mNormalize = mRenderState[D3DRS_NORMALIZENORMALS] != FALSE;
+        key.mPointScale = mRenderState[D3DRS_POINTSCALEENABLE] != FALSE;
+        // Table fog is done per pixel.
+        if(mRenderState[D3DRS_FOGENABLE] && mRenderState[D3DRS_FOGTABLEMODE] == D3DFOG_NONE)
+        {
+            key.mFogMode = mRenderState[D3DRS_FOGVERTEXMODE] & 3;
+            key.mRangeFog = mRenderState[D3DRS_RANGEFOGENABLE] != FALSE;
+        }
+        key.mLighting = mRenderState[D3DRS_LIGHTING] != FALSE;
+    }
+    if(key.mLighting)
+    {
+        key.mNumLights = mNumActiveLights;
+        for(UINT i = 0;i < mNumActiveLights;++i)
+        {
+            const LightState *light = mLights.find(mActiveLights[i]);
+            key.mLightTypes |= (light->mLight.Type&3) << (i*2);
+        }
+        // Vertex colors only replace what the vertex has.
+        bool colorvertex = mRenderState[D3DRS_COLORVERTEX] != FALSE;
+        auto get_source = [&key, colorvertex](DWORD source) -> DWORD
+        {
+            if(!colorvertex || (source == D3DMCS_COLOR1 && !key.mHasDiffuse) ||
+               (source == D3DMCS_COLOR2 && !key.mHasSpecular))
+                return D3DMCS_MATERIAL;
+            return source & 3;
+        };
+        key.mDiffuseSource = get_source(mRenderState[D3DRS_DIFFUSEMATERIALSOURCE]);
+        key.mAmbientSource = get_source(mRenderState[D3DRS_AMBIENTMATERIALSOURCE]);
+        key.mSpecularSource = get_source(mRenderState[D3DRS_SPECULARMATERIALSOURCE]);
+        key.mEmissiveSource = get_source(mRenderState[D3DRS_EMISSIVEMATERIALSOURCE]);
+    }
+
+    for(UINT i = 0;i < 8 && i < mTexStageState.size();++i)
+    {
+        DWORD tci = mTexStageState[i][D3DTSS_TEXCOORDINDEX];
+        key.mStages[i].mIndex = tci & 7;
+        if(!key.mTransformed)
+        {
+            key.mStages[i].mGen = (tci>>16) & 7;
+            key.mStages[i].mTransform = std::min<DWORD>(mTexStageState[i][D3DTSS_TEXTURETRANSFORMFLAGS]&0xff, 4);
+        }
+    }
+
+    return key;
+}
+
+FFPixelKey D3DGLDevice::getFFPixelKey(bool ffvertex, const D3DGLVertexDeclaration *vtxdecl) const
+{
+    FFPixelKey key;
+    memset(&key, 0, sizeof(key));
+
+    // The texcoord input sizes, for projecting untransformed coordinates.
+    std::array<DWORD,8> tcsizes;
+    tcsizes.fill(4);
+    if(ffvertex)
+    {
+        tcsizes.fill(0);
+        for(const D3DGLVERTEXELEMENT &elem : vtxdecl->getVtxElements())
+        {
+            if(elem.Usage == D3DDECLUSAGE_TEXCOORD && elem.UsageIndex < 8)
+                tcsizes[elem.UsageIndex] = (elem.mGLCount == GL_BGRA) ? 4 : elem.mGLCount;
+        }
+    }
+
+    const UINT numstages = std::min<UINT>(8, std::min<UINT>(mTexStageState.size(),
+                                                            mAdapter.getLimits().fragment_samplers));
+    for(UINT i = 0;i < numstages;++i)
+    {
+        const TexStageStates &tss = mTexStageState[i];
+        auto &stage = key.mStages[i];
+        if(tss[D3DTSS_COLOROP] == D3DTOP_DISABLE)
+            break;
+
+        stage.mColorOp = tss[D3DTSS_COLOROP];
+        stage.mColorArg1 = tss[D3DTSS_COLORARG1];
+        stage.mColorArg2 = tss[D3DTSS_COLORARG2];
+        stage.mColorArg0 = tss[D3DTSS_COLORARG0];
+        stage.mAlphaOp = tss[D3DTSS_ALPHAOP];
+        stage.mAlphaArg1 = tss[D3DTSS_ALPHAARG1];
+        stage.mAlphaArg2 = tss[D3DTSS_ALPHAARG2];
+        stage.mAlphaArg0 = tss[D3DTSS_ALPHAARG0];
+        stage.mResultTemp = tss[D3DTSS_RESULTARG] == D3DTA_TEMP;
+
+        // Fixed-function vertex programs put each stage's coords in its own
+        // output, while shaders have the stage pick one.
+        DWORD tci = tss[D3DTSS_TEXCOORDINDEX] & 7;
+        stage.mTexCoord = ffvertex ? i : tci;
+        if(mTextures[i])
+        {
+            if((mShadowSamplers&(1<<i)))
+                stage.mTexType = FFTEX_SHADOW;
+            else if((mCubeSamplers&(1<<i)))
+                stage.mTexType = FFTEX_CUBE;
+            else
+                stage.mTexType = FFTEX_2D;
+        }
+        DWORD ttff = tss[D3DTSS_TEXTURETRANSFORMFLAGS];
+        if((ttff&D3DTTFF_PROJECTED))
+        {
+            DWORD count = ttff & 0xff;
+            if(!count) count = tcsizes[tci];
+            if(count >= 3)
+                stage.mProjected = std::min<DWORD>(count, 4);
+        }
+    }
+
+    key.mSpecular = mRenderState[D3DRS_SPECULARENABLE] != FALSE;
+    if(mRenderState[D3DRS_FOGENABLE])
+    {
+        switch(mRenderState[D3DRS_FOGTABLEMODE])
+        {
+            case D3DFOG_EXP: key.mFogMode = FFFOG_EXP; break;
+            case D3DFOG_EXP2: key.mFogMode = FFFOG_EXP2; break;
+            case D3DFOG_LINEAR: key.mFogMode = FFFOG_LINEAR; break;
+            default:
+                // Shaders' fog output isn't passed on, so only the
+                // fixed-function vertex programs have vertex fog.
+                if(ffvertex)
+                    key.mFogMode = FFFOG_VERTEX;
+                break;
+        }
+        // Table fog is by eye distance with perspective projections.
+        if(key.mFogMode != FFFOG_VERTEX && key.mFogMode != FFFOG_NONE && ffvertex)
+        {
+            const D3DMATRIX &proj = mTransforms[D3DTS_PROJECTION];
+            key.mWFog = proj._14 != 0.0f || proj._24 != 0.0f || proj._34 != 0.0f || proj._44 != 1.0f;
+        }
+    }
+
+    return key;
+}
+
+void D3DGLDevice::fillFFVertexUniforms(FFVertexUniforms &uniforms) const
+{
+    memset(&uniforms, 0, sizeof(uniforms));
+
+    const D3DMATRIX &view = mTransforms[D3DTS_VIEW];
+    uniforms.World = mWorldMatrices[0];
+    uniforms.WorldView = MultiplyMatrix(mWorldMatrices[0], view);
+    uniforms.WorldViewProj = MultiplyMatrix(uniforms.WorldView, mTransforms[D3DTS_PROJECTION]);
+    uniforms.Normal = MakeNormalMatrix(uniforms.WorldView);
+    for(UINT i = 0;i < 8;++i)
+        uniforms.TexMatrix[i] = mTransforms[D3DTS_TEXTURE0+i];
+
+    CopyColor(uniforms.MaterialDiffuse, mMaterial.Diffuse);
+    CopyColor(uniforms.MaterialAmbient, mMaterial.Ambient);
+    CopyColor(uniforms.MaterialSpecular, mMaterial.Specular);
+    CopyColor(uniforms.MaterialEmissive, mMaterial.Emissive);
+    CopyColor(uniforms.GlobalAmbient, D3DCOLOR(mRenderState[D3DRS_AMBIENT]));
+    uniforms.MaterialPower[0] = mMaterial.Power;
+
+    float fogstart = dword_to_float(mRenderState[D3DRS_FOGSTART]);
+    float fogend = dword_to_float(mRenderState[D3DRS_FOGEND]);
+    uniforms.FogParams[0] = fogstart;
+    uniforms.FogParams[1] = fogend;
+    uniforms.FogParams[2] = dword_to_float(mRenderState[D3DRS_FOGDENSITY]);
+    uniforms.FogParams[3] = (fogend != fogstart) ? 1.0f/(fogend-fogstart) : 0.0f;
+
+    uniforms.PointParams[0] = dword_to_float(mRenderState[D3DRS_POINTSIZE]);
+    uniforms.PointParams[1] = dword_to_float(mRenderState[D3DRS_POINTSIZE_MIN]);
+    uniforms.PointParams[2] = dword_to_float(mRenderState[D3DRS_POINTSIZE_MAX]);
+    uniforms.PointParams[3] = float(mViewport.Height);
+    uniforms.PointScale[0] = dword_to_float(mRenderState[D3DRS_POINTSCALE_A]);
+    uniforms.PointScale[1] = dword_to_float(mRenderState[D3DRS_POINTSCALE_B]);
+    uniforms.PointScale[2] = dword_to_float(mRenderState[D3DRS_POINTSCALE_C]);
+
+    // Screen space, y down and z in the depth range, back to D3D clip space.
+    float zrange = mViewport.MaxZ - mViewport.MinZ;
+    uniforms.ScreenScale[0] = 2.0f / std::max(mViewport.Width, 1ul);
+    uniforms.ScreenScale[1] = -2.0f / std::max(mViewport.Height, 1ul);
+    uniforms.ScreenScale[2] = (zrange != 0.0f) ? 1.0f/zrange : 0.0f;
+    uniforms.ScreenOffset[0] = -1.0f - mViewport.X*uniforms.ScreenScale[0];
+    uniforms.ScreenOffset[1] = 1.0f - mViewport.Y*uniforms.ScreenScale[1];
+    uniforms.ScreenOffset[2] = -mViewport.MinZ*uniforms.ScreenScale[2];
+
+    // Lights are in eye space, like the positions and normals they're
+    // applied to.
+    for(UINT i = 0;i < mNumActiveLights;++i)
+    {
+        const D3DLIGHT9 &light = mLights.find(mActiveLights[i])->mLight;
+        FFLightUniforms &dst = uniforms.Lights[i];
+        CopyColor(dst.Diffuse, light.Diffuse);
+        CopyColor(dst.Specular, light.Specular);
+        CopyColor(dst.Ambient, light.Ambient);
+        const D3DVECTOR &pos = light.Position;
+        const D3DVECTOR &dir = light.Direction;
+        for(int j = 0;j < 3;++j)
+        {
+            dst.Position[j] = pos.x*view.m[0][j] + pos.y*view.m[1][j] + pos.z*view.m[2][j] + view.m[3][j];
+            dst.Direction[j] = dir.x*view.m[0][j] + dir.y*view.m[1][j] + dir.z*view.m[2][j];
+        }
+        float len = std::sqrt(dst.Direction[0]*dst.Direction[0] + dst.Direction[1]*dst.Direction[1] +
+                              dst.Direction[2]*dst.Direction[2]);
+        if(len > 0.0f)
+        {
+            for(int j = 0;j < 3;++j)
+                dst.Direction[j] /= len;
+        }
+        dst.Attenuation[0] = light.Attenuation0;
+        dst.Attenuation[1] = light.Attenuation1;
+        dst.Attenuation[2] = light.Attenuation2;
+        dst.Attenuation[3] = light.Range;
+        float cosphi = std::cos(light.Phi*0.5f);
+        float costheta = std::cos(light.Theta*0.5f);
+        dst.Spot[0] = cosphi;
+        dst.Spot[1] = (costheta > cosphi) ? 1.0f/(costheta-cosphi) : 1e6f;
+        dst.Spot[2] = light.Falloff;
+    }
+}
+
+void D3DGLDevice::fillFFPixelUniforms(FFPixelUniforms &uniforms) const
+{
+    memset(&uniforms, 0, sizeof(uniforms));
+
+    CopyColor(uniforms.TextureFactor, D3DCOLOR(mRenderState[D3DRS_TEXTUREFACTOR]));
+    CopyColor(uniforms.FogColor, D3DCOLOR(mRenderState[D3DRS_FOGCOLOR]));
+    float fogstart = dword_to_float(mRenderState[D3DRS_FOGSTART]);
+    float fogend = dword_to_float(mRenderState[D3DRS_FOGEND]);
+    uniforms.FogParams[0] = fogstart;
+    uniforms.FogParams[1] = fogend;
+    uniforms.FogParams[2] = dword_to_float(mRenderState[D3DRS_FOGDENSITY]);
+    uniforms.FogParams[3] = (fogend != fogstart) ? 1.0f/(fogend-fogstart) : 0.0f;
+    for(UINT i = 0;i < 8 && i < mTexStageState.size();++i)
+        CopyColor(uniforms.StageConstant[i], D3DCOLOR(mTexStageState[i][D3DTSS_CONSTANT]));
+}
+
+void D3DGLDevice::sendConstantsB(GLuint buffer, UINT bools, UINT start, UINT count)
+{
+    INT values[16][4] = {{0}};
+    for(UINT i = 0;i < count;++i)
+        values[i][0] = (bools>>(start+i)) & 1;
+    mQueue.doSend<SetBufferValueData>(make_ref(mQueue), buffer, start*sizeof(Vector4f),
+        reinterpret_cast<const float*>(values), count
+    );
+}
+
+void D3DGLDevice::resetProjectionFixup(UINT width, UINT height)
+{
+    // OpenGL places pixel coords at the pixel's bottom-left, while D3D places
+    // it at the center. So we have to translate X and Y by /almost/ 0.5 pixels
+    // (almost because of certain triangle edge rules GL is a bit lax on). The
+    // offset is doubled since projection ranges from -1...+1 instead of 0...1.
+    //
+    // We supply the needed X/Y offsets through a (shared) vec4 uniform. The
+    // shader is also responsible for flipping Y and fixing Z depth.
+    float trans[4] = { 0.99f/width, 0.99f/height, 0.0f, 0.0f };
+
+    mQueue.doSend<SetBufferValue4f>(mGLState.pos_fixup_uniform_buffer, 0, trans);
+}
+
+void D3DGLDevice::applyRenderState(D3DRENDERSTATETYPE state, DWORD value)
+{
+    mGLRenderState[state] = value;
+    GLenum glstate = RSStateEnableMap[state];
+    if(glstate != GL_NONE)
+        mQueue.doSend<StateEnable>(glstate, value!=0);
+    else switch(state)
+    {
+        case D3DRS_FILLMODE:
+        {
+            GLenum mode = GL_FILL;
+            if(value == D3DFILL_POINT)
+                mode = GL_POINT;
+            else if(value == D3DFILL_WIREFRAME)
+                mode = GL_LINE;
+            else if(value != D3DFILL_SOLID)
+                WARN("Invalid fill mode: 0x%lx\n", value);
+
+            mQueue.doSend<PolygonModeSet>(mode);
+            break;
+        }
+
+        case D3DRS_CULLMODE:
+        {
+            GLenum face = GL_NONE;
+            if(value == D3DCULL_CW)
+                face = GL_FRONT;
+            else if(value == D3DCULL_CCW)
+                face = GL_BACK;
+            else if(value != D3DCULL_NONE)
+                WARN("Unhandled cull mode: 0x%lx\n", value);
+
+            mQueue.doSend<CullFaceSet>(face);
+            break;
+        }
+
+        case D3DRS_COLORWRITEENABLE:
+        case D3DRS_COLORWRITEENABLE1:
+        case D3DRS_COLORWRITEENABLE2:
+        case D3DRS_COLORWRITEENABLE3:
+            mQueue.doSend<ColorMaskSet>((state == D3DRS_COLORWRITEENABLE) ? 0 :
+                                        (state-D3DRS_COLORWRITEENABLE1+1), value);
+            break;
+
+        case D3DRS_ZWRITEENABLE:
+            mQueue.doSend<DepthMaskSet>(value);
+            break;
+
+        case D3DRS_ZFUNC:
+            mQueue.doSend<DepthFuncSet>(GetGLCompFunc(value));
+            break;
+
+        case D3DRS_SLOPESCALEDEPTHBIAS:
+        case D3DRS_DEPTHBIAS:
+            mQueue.doSend<DepthBiasSet>(
+                dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
+                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
+            );
+            mGLRenderState[D3DRS_SLOPESCALEDEPTHBIAS] = mRenderState[D3DRS_SLOPESCALEDEPTHBIAS];
+            mGLRenderState[D3DRS_DEPTHBIAS] = mRenderState[D3DRS_DEPTHBIAS];
+            break;
+
+        case D3DRS_ALPHAFUNC:
+        case D3DRS_ALPHAREF:
+            mQueue.doSend<AlphaFuncSet>(GetGLCompFunc(mRenderState[D3DRS_ALPHAFUNC]),
+                                        mRenderState[D3DRS_ALPHAREF] / 255.0f);
+            mGLRenderState[D3DRS_ALPHAFUNC] = mRenderState[D3DRS_ALPHAFUNC];
+            mGLRenderState[D3DRS_ALPHAREF] = mRenderState[D3DRS_ALPHAREF];
+            break;
+
+        // FIXME: Handle D3DRS_SEPARATEALPHABLENDENABLE
+        case D3DRS_SRCBLEND:
+        case D3DRS_DESTBLEND:
+            mQueue.doSend<BlendFuncSet>(GetGLBlendFunc(mRenderState[D3DRS_SRCBLEND]),
+                                        GetGLBlendFunc(mRenderState[D3DRS_DESTBLEND]));
+            mGLRenderState[D3DRS_SRCBLEND] = mRenderState[D3DRS_SRCBLEND];
+            mGLRenderState[D3DRS_DESTBLEND] = mRenderState[D3DRS_DESTBLEND];
+            break;
+        case D3DRS_BLENDOP:
+            mQueue.doSend<BlendOpSet>(GetGLBlendOp(value));
+            break;
+
+        case D3DRS_CLIPPLANEENABLE:
+            mQueue.doSend<ClipPlaneEnableCmd>(make_ref(mGLState), value);
+            break;
+
+        case D3DRS_STENCILWRITEMASK:
+            mQueue.doSend<StencilMaskSet>(value);
+            break;
+
+        case D3DRS_STENCILFUNC:
+        case D3DRS_STENCILREF:
+        case D3DRS_STENCILMASK:
+            {
+                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
+                mQueue.doSend<StencilFuncSet>(face,
+                    GetGLCompFunc(mRenderState[D3DRS_STENCILFUNC]),
+                    mRenderState[D3DRS_STENCILREF].load(),
+                    mRenderState[D3DRS_STENCILMASK].load()
+                );
+            }
+            mGLRenderState[D3DRS_STENCILFUNC] = mRenderState[D3DRS_STENCILFUNC];
+            mGLRenderState[D3DRS_STENCILREF] = mRenderState[D3DRS_STENCILREF];
+            mGLRenderState[D3DRS_STENCILMASK] = mRenderState[D3DRS_STENCILMASK];
+            break;
+
+        case D3DRS_STENCILFAIL:
+        case D3DRS_STENCILZFAIL:
+        case D3DRS_STENCILPASS:
+            {
+                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
+                mQueue.doSend<StencilOpSet>(face,
+                    GetGLStencilOp(mRenderState[D3DRS_STENCILFAIL]),
+                    GetGLStencilOp(mRenderState[D3DRS_STENCILZFAIL]),
+                    GetGLStencilOp(mRenderState[D3DRS_STENCILPASS])
+                );
+            }
+            mGLRenderState[D3DRS_STENCILFAIL] = mRenderState[D3DRS_STENCILFAIL];
+            mGLRenderState[D3DRS_STENCILZFAIL] = mRenderState[D3DRS_STENCILZFAIL];
+            mGLRenderState[D3DRS_STENCILPASS] = mRenderState[D3DRS_STENCILPASS];
+            break;
+
+        // FIXME: These probably shouldn't set OpenGL state while
+        // D3DRS_TWOSIDEDSTENCILMODE is false.
+        case D3DRS_CCW_STENCILFUNC:
+            mQueue.doSend<StencilFuncSet>(GL_BACK,
+                GetGLCompFunc(mRenderState[D3DRS_CCW_STENCILFUNC]),
+                mRenderState[D3DRS_STENCILREF].load(),
+                mRenderState[D3DRS_STENCILMASK].load()
+            );
+            break;
+
+        case D3DRS_CCW_STENCILFAIL:
+        case D3DRS_CCW_STENCILZFAIL:
+        case D3DRS_CCW_STENCILPASS:
+            mQueue.doSend<StencilOpSet>(GL_BACK,
+                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILFAIL]),
+                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILZFAIL]),
+                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILPASS])
+            );
+            mGLRenderState[D3DRS_CCW_STENCILFAIL] = mRenderState[D3DRS_CCW_STENCILFAIL];
+            mGLRenderState[D3DRS_CCW_STENCILZFAIL] = mRenderState[D3DRS_CCW_STENCILZFAIL];
+            mGLRenderState[D3DRS_CCW_STENCILPASS] = mRenderState[D3DRS_CCW_STENCILPASS];
+            break;
+
+        // FIXME: This should probably set the GL_BACK stencil func/ops from
+        // CCW state when enabled, or set GL_FRONT_AND_BACK from CW state when
+        // disabled.
+        case D3DRS_TWOSIDEDSTENCILMODE:
+            break;
+
+        case D3DRS_FOGCOLOR:
+            mQueue.doSend<FogValuefSet>(GL_FOG_COLOR,
+                D3DCOLOR_R(value)/255.0f, D3DCOLOR_G(value)/255.0f,
+                D3DCOLOR_B(value)/255.0f, D3DCOLOR_A(value)/255.0f
+            );
+            break;
+
+        default:
+            FIXME("Unhandled state %s, value 0x%lx\n", d3drs_to_str(state), value);
+            break;
+    }
+}
+
+GLSamplerDesc D3DGLDevice::getSamplerDesc(DWORD sampler) const
+{
+    const SamplerStates &states = mSamplerState[sampler];
+    DWORD minfilter = states[D3DSAMP_MINFILTER];
+    DWORD magfilter = states[D3DSAMP_MAGFILTER];
+    DWORD color = states[D3DSAMP_BORDERCOLOR];
+
+    GLSamplerDesc desc;
+    desc.mWrapS = GetGLWrapMode(states[D3DSAMP_ADDRESSU]);
+    desc.mWrapT = GetGLWrapMode(states[D3DSAMP_ADDRESSV]);
+    desc.mWrapR = GetGLWrapMode(states[D3DSAMP_ADDRESSW]);
+    desc.mMinFilter = GetGLFilterMode(minfilter, states[D3DSAMP_MIPFILTER]);
+    desc.mMagFilter = GetGLFilterMode(magfilter, D3DTEXF_NONE);
+    desc.mMaxAnisotropy = (minfilter == D3DTEXF_ANISOTROPIC || magfilter == D3DTEXF_ANISOTROPIC) ?
+                          std::max<DWORD>(states[D3DSAMP_MAXANISOTROPY], 1) : 1;
+    desc.mLodBias = dword_to_float(states[D3DSAMP_MIPMAPLODBIAS]);
+    // D3D's max mip level is the largest (most detailed) level to use.
+    desc.mMinLod = GLfloat(states[D3DSAMP_MAXMIPLEVEL]);
+    desc.mBorderColor[0] = D3DCOLOR_R(color)/255.0f;
+    desc.mBorderColor[1] = D3DCOLOR_G(color)/255.0f;
+    desc.mBorderColor[2] = D3DCOLOR_B(color)/255.0f;
+    desc.mBorderColor[3] = D3DCOLOR_A(color)/255.0f;
+    desc.mCompareMode = (mShadowSamplers&(1<<sampler)) ? GL_COMPARE_REF_TO_TEXTURE : GL_NONE;
+    desc.mSRGBDecode = states[D3DSAMP_SRGBTEXTURE] ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT;
+    return desc;
+}
+
+void D3DGLDevice::flushStateChanges()
+{
+    if(mDirtyRenderStates.any())
+    {
+        for(size_t i = 0;i < mDirtyRenderStates.size();++i)
+        {
+            if(!mDirtyRenderStates.test(i))
+                continue;
+            DWORD value = mRenderState[i];
+            if(value != mGLRenderState[i])
+                applyRenderState((D3DRENDERSTATETYPE)i, value);
+        }
+        mDirtyRenderStates.reset();
+    }
+
+    for(DWORD sampler = 0;mDirtySamplers;++sampler)
+    {
+        if(!(mDirtySamplers&(1u<<sampler)))
+            continue;
+        mDirtySamplers &= ~(1u<<sampler);
+
+        GLSamplerDesc desc = getSamplerDesc(sampler);
+        if(desc != mGLSamplerDescs[sampler])
+        {
+            mGLSamplerDescs[sampler] = desc;
+            mQueue.doSend<SamplerBindCmd>(make_ref(mSamplerCache), sampler, desc);
+        }
+    }
+
+    flushPendingUploads();
+}
+
+void D3DGLDevice::removePendingUpload(D3DGLTexture *texture)
+{
+    auto iter = std::find(mPendingTextures.begin(), mPendingTextures.end(), texture);
+    if(iter != mPendingTextures.end())
+    {
+        *iter = mPendingTextures.back();
+        mPendingTextures.pop_back();
+    }
+}
+
+void D3DGLDevice::removePendingUpload(D3DGLCubeTexture *texture)
+{
+    auto iter = std::find(mPendingCubeTextures.begin(), mPendingCubeTextures.end(), texture);
+    if(iter != mPendingCubeTextures.end())
+    {
+        *iter = mPendingCubeTextures.back();
+        mPendingCubeTextures.pop_back();
+    }
+}
+
+void D3DGLDevice::flushPendingUploads()
+{
+    // Flushing a texture takes it off its list.
+    while(!mPendingTextures.empty())
+        mPendingTextures.back()->flushUpdates();
+    while(!mPendingCubeTextures.empty())
+        mPendingCubeTextures.back()->flushUpdates();
+}
+
+
+HRESULT D3DGLDevice::QueryInterface(const IID &riid, void **obj)
+{
+    TRACE("iface %p, riid %s, obj %p.\n", this, debugstr_guid(riid), obj);
+
+    *obj = NULL;
+    RETURN_IF_IID_TYPE(obj, riid, D3DGLDevice);
+    RETURN_IF_IID_TYPE(obj, riid, IDirect3DDevice9);
+    RETURN_IF_IID_TYPE(obj, riid, IUnknown);
 
     if(riid == IID_IDirect3DDevice9Ex)
     {
@@ -1678,14 +3166,21 @@ HRESULT D3DGLDevice::TestCooperativeLevel()
 
 UINT D3DGLDevice::GetAvailableTextureMem()
 {
-    FIXME("iface %p : stub!\n", this);
-    return 0;
+    TRACE("iface %p\n", this);
+
+    // Rounded down to the nearest MB, like native.
+    UINT64 avail = mResidency.getAvailableMem() >> 20;
+    return UINT(std::min<UINT64>(avail, 0xffffffff>>20) << 20);
 }
 
 HRESULT D3DGLDevice::EvictManagedResources()
 {
-    FIXME("iface %p : stub!\n", this);
-    return E_NOTIMPL;
+    TRACE("iface %p\n", this);
+
+    mQueue.lock();
+    mResidency.evictAll();
+    mQueue.unlock();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetDirect3D(IDirect3D9 **d3d9)
@@ -1982,19 +3477,48 @@ HRESULT D3DGLDevice::Reset(D3DPRESENT_PARAMETERS *params)
     mScissorRect = RECT{0, 0, (LONG)params->BackBufferWidth, (LONG)params->BackBufferHeight};
     mQueue.doSend<ScissorRectSet>(mScissorRect);
 
+    mFBDesc = GLFramebufferDesc{};
+    for(GLFBAttachment &color : mFBDesc.mColor)
+        color.mTarget = GL_RENDERBUFFER;
+    mFBDesc.mColor[0].mId = schain->getBackbuffer()->getId();
+    mFBDesc.mDepthAttachment = GL_DEPTH_STENCIL_ATTACHMENT;
+    mFBDesc.mDepth.mTarget = GL_RENDERBUFFER;
     if(mAutoDepthStencil)
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState),
-            mAutoDepthStencil->getFormat().getDepthStencilAttachment(),
-            GL_RENDERBUFFER, mAutoDepthStencil->getId(), 0
-        );
-    mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState),
-        GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, schain->getBackbuffer()->getId(), 0
-    );
+    {
+        mFBDesc.mDepthAttachment = mAutoDepthStencil->getFormat().getDepthStencilAttachment();
+        mFBDesc.mDepth.mId = mAutoDepthStencil->getId();
+    }
+    mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
     mQueue.unlock();
 
     return D3D_OK;
 }
 
+HRESULT D3DGLDevice::SetMaximumFrameLatency(UINT maxlatency)
+{
+    TRACE("iface %p, maxlatency %u\n", this, maxlatency);
+
+    if(maxlatency == 0)
+        maxlatency = MaxFrameLatency;
+    else if(maxlatency > MAX_FRAME_LATENCY)
+    {
+        WARN("Clamping frame latency %u to %u\n", maxlatency, MAX_FRAME_LATENCY);
+        maxlatency = MAX_FRAME_LATENCY;
+    }
+    mMaxFrameLatency = maxlatency;
+    return D3D_OK;
+}
+
+HRESULT D3DGLDevice::GetMaximumFrameLatency(UINT *maxlatency)
+{
+    TRACE("iface %p, maxlatency %p\n", this, maxlatency);
+
+    if(!maxlatency)
+        return D3DERR_INVALIDCALL;
+    *maxlatency = mMaxFrameLatency;
+    return D3D_OK;
+}
+
 HRESULT D3DGLDevice::Present(const RECT *srcRect, const RECT *dstRect, HWND dstWindowOverride, const RGNDATA *dirtyRegion)
 {
     TRACE("iface %p, srcRect %p, dstRect %p, dstWindowOverride %p, dirtyRegion %p : semi-stub\n",
@@ -2354,14 +3878,246 @@ HRESULT D3DGLDevice::CreateDepthStencilSurface(UINT width, UINT height, D3DFORMA
 
 HRESULT D3DGLDevice::UpdateSurface(IDirect3DSurface9 *srcsurface, const RECT *srcrect, IDirect3DSurface9 *dstsurface, const POINT *dstpoint)
 {
-    FIXME("iface %p, srcsurface %p, srcrect %p, dstsurface %p, dstpoint %p : stub!\n", this, srcsurface, srcrect, dstsurface, dstpoint);
-    return E_NOTIMPL;
+    TRACE("iface %p, srcsurface %p, srcrect %p, dstsurface %p, dstpoint %p\n", this, srcsurface, srcrect, dstsurface, dstpoint);
+
+    if(!srcsurface || !dstsurface)
+    {
+        WARN("Null surface (src %p, dst %p)\n", srcsurface, dstsurface);
+        return D3DERR_INVALIDCALL;
+    }
+
+    D3DSURFACE_DESC srcdesc, dstdesc;
+    srcsurface->GetDesc(&srcdesc);
+    dstsurface->GetDesc(&dstdesc);
+    if(dstdesc.Pool != D3DPOOL_DEFAULT || srcdesc.Format != dstdesc.Format)
+    {
+        WARN("Invalid surfaces (src pool 0x%x format %s, dst pool 0x%x format %s)\n",
+             srcdesc.Pool, d3dfmt_to_str(srcdesc.Format), dstdesc.Pool, d3dfmt_to_str(dstdesc.Format));
+        return D3DERR_INVALIDCALL;
+    }
+
+    RECT rect{0, 0, (LONG)srcdesc.Width, (LONG)srcdesc.Height};
+    if(srcrect) rect = *srcrect;
+    POINT point{0, 0};
+    if(dstpoint) point = *dstpoint;
+    RECT dstrect{point.x, point.y, point.x + rect.right-rect.left, point.y + rect.bottom-rect.top};
+    if(rect.left < 0 || rect.top < 0 || rect.left >= rect.right || rect.top >= rect.bottom ||
+       rect.right > (LONG)srcdesc.Width || rect.bottom > (LONG)srcdesc.Height ||
+       dstrect.left < 0 || dstrect.top < 0 ||
+       dstrect.right > (LONG)dstdesc.Width || dstrect.bottom > (LONG)dstdesc.Height)
+    {
+        WARN("Invalid rect (%ld,%ld)-(%ld,%ld) to (%ld,%ld)\n", rect.left, rect.top,
+             rect.right, rect.bottom, point.x, point.y);
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(srcdesc.Pool == D3DPOOL_DEFAULT)
+    {
+        // Stays on the GPU.
+        GLImage src, dst;
+        if(!GLEW_ARB_copy_image || !GetSurfaceImage(srcsurface, src) || !GetSurfaceImage(dstsurface, dst))
+        {
+            FIXME("Unhandled default pool copy from %p to %p\n", srcsurface, dstsurface);
+            return E_NOTIMPL;
+        }
+        mQueue.lock();
+        FlushSurfaceUpdates(srcsurface);
+        FlushSurfaceUpdates(dstsurface);
+        mQueue.doSend<CopyImageCmd>(src, rect.left, rect.top, dst, dstrect.left, dstrect.top,
+                                    rect.right-rect.left, rect.bottom-rect.top, 1);
+        mQueue.unlock();
+        return D3D_OK;
+    }
+
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLPlainSurface *plainsurface;
+    };
+    if(FAILED(dstsurface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        FIXME("Unhandled destination surface %p\n", dstsurface);
+        return E_NOTIMPL;
+    }
+    D3DGLTexture *dsttex = tex2dsurface->getParent();
+    DWORD dstlevel = tex2dsurface->getLevel();
+    tex2dsurface->Release();
+
+    // The upload reads right from the source's system memory.
+    D3DGLPlainSurface *srcplain = nullptr;
+    D3DGLTexture *srctex = nullptr;
+    const GLubyte *data;
+    UINT pitch;
+    if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLPlainSurface, &pointer)))
+    {
+        srcplain = plainsurface;
+        srcplain->resolveReadback();
+        const GLFormatInfo &fmt = srcplain->getFormat();
+        data = srcplain->getBufData().get();
+        pitch = dsttex->isCompressed() ? GLFormatInfo::calcBlockPitch(srcdesc.Width, fmt.bytesperblock) :
+                GLFormatInfo::calcPitch(srcdesc.Width, fmt.bytesperpixel);
+    }
+    else if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        srctex = tex2dsurface->getParent();
+        data = srctex->getLevelData(tex2dsurface->getLevel());
+        pitch = srctex->getLevelPitch(tex2dsurface->getLevel());
+        tex2dsurface->Release();
+    }
+    else
+    {
+        FIXME("Unhandled source surface %p\n", srcsurface);
+        return E_NOTIMPL;
+    }
+
+    if(dsttex->isCompressed())
+    {
+        // Block-aligned, unless reaching the edge of the surface.
+        if((rect.left&3) || (rect.top&3) || (dstrect.left&3) || (dstrect.top&3) ||
+           (((rect.right-rect.left)&3) && dstrect.right != (LONG)dstdesc.Width) ||
+           (((rect.bottom-rect.top)&3) && dstrect.bottom != (LONG)dstdesc.Height))
+        {
+            if(srcplain) srcplain->Release();
+            WARN("Unaligned rect for compressed format %s\n", d3dfmt_to_str(srcdesc.Format));
+            return D3DERR_INVALIDCALL;
+        }
+        data += rect.top/4*pitch + rect.left/4*dsttex->getFormat().bytesperblock;
+    }
+    else
+        data += rect.top*pitch + rect.left*dsttex->getFormat().bytesperpixel;
+
+    mQueue.lock();
+    dsttex->flushUpdates();
+    if(ULONG fence = dsttex->sendUpload(dstlevel, dstrect, data, pitch))
+    {
+        if(srcplain) srcplain->setUpdateFence(fence);
+        if(srctex) srctex->setUpdateFence(fence);
+    }
+    mQueue.unlock();
+    if(srcplain) srcplain->Release();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::UpdateTexture(IDirect3DBaseTexture9 *srctexture, IDirect3DBaseTexture9 *dsttexture)
 {
-    FIXME("iface %p, srctexture %p, dsttexture %p : stub!\n", this, srctexture, dsttexture);
-    return E_NOTIMPL;
+    TRACE("iface %p, srctexture %p, dsttexture %p\n", this, srctexture, dsttexture);
+
+    if(!srctexture || !dsttexture)
+    {
+        WARN("Null texture (src %p, dst %p)\n", srctexture, dsttexture);
+        return D3DERR_INVALIDCALL;
+    }
+
+    union {
+        void *pointer;
+        D3DGLTexture *tex2d;
+        D3DGLCubeTexture *cubetex;
+    };
+    GLImage src, dst;
+    D3DSURFACE_DESC srcdesc, dstdesc;
+    DWORD srclevels, dstlevels;
+    if(SUCCEEDED(srctexture->QueryInterface(IID_D3DGLTexture, &pointer)))
+    {
+        D3DGLTexture *srctex = tex2d;
+        if(FAILED(dsttexture->QueryInterface(IID_D3DGLTexture, &pointer)))
+        {
+            srctex->Release();
+            WARN("Mismatched texture types (src %p, dst %p)\n", srctexture, dsttexture);
+            return D3DERR_INVALIDCALL;
+        }
+        D3DGLTexture *dsttex = tex2d;
+        srcdesc = srctex->getDesc();
+        dstdesc = dsttex->getDesc();
+        srclevels = srctex->GetLevelCount();
+        dstlevels = dsttex->GetLevelCount();
+        src = GLImage{GL_TEXTURE_2D, srctex->getTextureId(), 0, 0};
+        dst = GLImage{GL_TEXTURE_2D, dsttex->getTextureId(), 0, 0};
+
+        if(srcdesc.Pool == D3DPOOL_SYSTEMMEM && dstdesc.Pool == D3DPOOL_DEFAULT &&
+           srcdesc.Format == dstdesc.Format && srcdesc.Width >= dstdesc.Width &&
+           srclevels >= dstlevels)
+        {
+            mQueue.lock();
+            dsttex->flushUpdates();
+            dsttex->updateFrom(srctex);
+            mQueue.unlock();
+            srctex->Release();
+            dsttex->Release();
+            return D3D_OK;
+        }
+        srctex->Release();
+        dsttex->Release();
+    }
+    else if(SUCCEEDED(srctexture->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
+    {
+        D3DGLCubeTexture *srctex = cubetex;
+        if(FAILED(dsttexture->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
+        {
+            srctex->Release();
+            WARN("Mismatched texture types (src %p, dst %p)\n", srctexture, dsttexture);
+            return D3DERR_INVALIDCALL;
+        }
+        D3DGLCubeTexture *dsttex = cubetex;
+        srcdesc = srctex->getDesc();
+        dstdesc = dsttex->getDesc();
+        srclevels = srctex->GetLevelCount();
+        dstlevels = dsttex->GetLevelCount();
+        src = GLImage{GL_TEXTURE_CUBE_MAP, srctex->getTextureId(), 0, 0};
+        dst = GLImage{GL_TEXTURE_CUBE_MAP, dsttex->getTextureId(), 0, 0};
+        srctex->Release();
+        dsttex->Release();
+    }
+    else
+    {
+        FIXME("Unhandled texture types (src %p, dst %p)\n", srctexture, dsttexture);
+        return E_NOTIMPL;
+    }
+
+    if(dstdesc.Pool != D3DPOOL_DEFAULT || srcdesc.Format != dstdesc.Format ||
+       srcdesc.Width < dstdesc.Width || srclevels < dstlevels)
+    {
+        WARN("Invalid textures (src pool 0x%x format %s %ux%u, dst pool 0x%x format %s %ux%u)\n",
+             srcdesc.Pool, d3dfmt_to_str(srcdesc.Format), srcdesc.Width, srcdesc.Height,
+             dstdesc.Pool, d3dfmt_to_str(dstdesc.Format), dstdesc.Width, dstdesc.Height);
+        return D3DERR_INVALIDCALL;
+    }
+    if(srcdesc.Pool != D3DPOOL_DEFAULT || !GLEW_ARB_copy_image)
+    {
+        FIXME("Unhandled copy from pool 0x%x\n", srcdesc.Pool);
+        return E_NOTIMPL;
+    }
+
+    // Default to default copies stay on the GPU, skipping the source's extra
+    // top levels.
+    DWORD srclevel = 0;
+    while(std::max(1u, srcdesc.Width>>srclevel) > dstdesc.Width)
+        ++srclevel;
+    if((dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dstlevels = 1;
+    if(srclevels-std::min(srclevel, srclevels) < dstlevels)
+    {
+        WARN("Not enough source levels (src %lu from level %lu, dst %lu)\n", srclevels, srclevel,
+             dstlevels);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    FlushTextureUpdates(srctexture);
+    FlushTextureUpdates(dsttexture);
+    for(DWORD level = 0;level < dstlevels;++level)
+    {
+        src.mLevel = srclevel + level;
+        dst.mLevel = level;
+        mQueue.doSend<CopyImageCmd>(src, 0, 0, dst, 0, 0, (GLsizei)std::max(1u, dstdesc.Width>>level),
+            (GLsizei)std::max(1u, dstdesc.Height>>level), (dst.mTarget == GL_TEXTURE_CUBE_MAP) ? 6 : 1
+        );
+    }
+    mQueue.unlock();
+    if((dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dsttexture->GenerateMipSubLevels();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3DSurface9 *dstsurface)
@@ -2404,16 +4160,9 @@ HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3D
     D3DGLPlainSurface *plainsurface;
     if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLPlainSurface, (void**)&plainsurface)))
     {
-        std::atomic<ULONG> &pendingupdates = plainsurface->getPendingUpdates();
-        std::shared_ptr<GLubyte> data = plainsurface->getBufData();
-        GLFormatInfo format = plainsurface->getFormat();
+        // The data is copied out when the surface is locked.
         RECT rect{ 0, 0, (LONG)srcdesc.Width, (LONG)srcdesc.Height };
-
-        ++pendingupdates;
-        mQueue.send<ReadFramebufferCmd>(this, src_target, src_binding, src_level, rect,
-            format.format, format.type, data, make_ref(pendingupdates)
-        );
-
+        queueReadback(plainsurface, src_target, src_binding, src_level, rect, 0);
         plainsurface->Release();
     }
     else
@@ -2427,8 +4176,15 @@ HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3D
 
 HRESULT D3DGLDevice::GetFrontBufferData(UINT swapchain, IDirect3DSurface9 *dstsurface)
 {
-    FIXME("iface %p, swapchain %u, dstsurface %p : stub!\n", this, swapchain, dstsurface);
-    return E_NOTIMPL;
+    TRACE("iface %p, swapchain %u, dstsurface %p\n", this, swapchain, dstsurface);
+
+    if(swapchain >= mSwapchains.size())
+    {
+        FIXME("Out of range swapchain (%u >= %u)\n", swapchain, mSwapchains.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    return mSwapchains[swapchain]->GetFrontBufferData(dstsurface);
 }
 
 HRESULT D3DGLDevice::StretchRect(IDirect3DSurface9 *srcSurface, const RECT *srcRect, IDirect3DSurface9 *dstSurface, const RECT *dstRect, D3DTEXTUREFILTERTYPE filter)
@@ -2542,35 +4298,108 @@ HRESULT D3DGLDevice::StretchRect(IDirect3DSurface9 *srcSurface, const RECT *srcR
         dst_rect.right = desc.Width;
         dst_rect.bottom = desc.Height;
     }
-
-    if(!(src_mask&dst_mask))
+
+    if(!(src_mask&dst_mask))
+    {
+        FIXME("Mismatched format buffer masks: 0x%x & 0x%x\n", src_mask, dst_mask);
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(!(src_mask&GL_COLOR_BUFFER_BIT))
+    {
+        if(filter != D3DTEXF_POINT)
+        {
+            FIXME("Invalid filter 0x%x for non-color blit\n", filter);
+            return D3DERR_INVALIDCALL;
+        }
+        FIXME("Unhandled non-color blit\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    FlushSurfaceUpdates(srcSurface);
+    FlushSurfaceUpdates(dstSurface);
+    mQueue.doSend<BlitFramebufferCmd>(this, src_target, src_binding, src_level, src_rect,
+                                      dst_target, dst_binding, dst_level, dst_rect,
+                                      GetGLFilterMode(filter, D3DTEXF_NONE));
+    mQueue.unlock();
+
+    return D3D_OK;
+}
+
+HRESULT D3DGLDevice::ColorFill(IDirect3DSurface9 *surface, const RECT *rect, D3DCOLOR color)
+{
+    TRACE("iface %p, surface %p, rect %p, color 0x%08lx\n", this, surface, rect, color);
+
+    if(!surface)
+    {
+        WARN("Null surface\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    D3DSURFACE_DESC desc;
+    surface->GetDesc(&desc);
+    if(desc.Pool != D3DPOOL_DEFAULT || (desc.Usage&D3DUSAGE_DEPTHSTENCIL))
+    {
+        WARN("Surface %p not a default pool color surface (pool 0x%x, usage 0x%lx)\n", surface,
+             desc.Pool, desc.Usage);
+        return D3DERR_INVALIDCALL;
+    }
+
+    // The surface is filled by clearing it as the only attachment of a
+    // framebuffer, then going back to the render targets.
+    GLFramebufferDesc fbdesc{};
+    for(GLFBAttachment &attachment : fbdesc.mColor)
+        attachment.mTarget = GL_RENDERBUFFER;
+    fbdesc.mDepthAttachment = GL_DEPTH_STENCIL_ATTACHMENT;
+    fbdesc.mDepth.mTarget = GL_RENDERBUFFER;
+
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLRenderTarget *rtsurface;
+        D3DGLCubeSurface *cubesurface;
+    };
+    if(SUCCEEDED(surface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        fbdesc.mColor[0] = GLFBAttachment{
+            GL_TEXTURE_2D, tex2dsurface->getParent()->getTextureId(), (GLint)tex2dsurface->getLevel()
+        };
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(surface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
     {
-        FIXME("Mismatched format buffer masks: 0x%x & 0x%x\n", src_mask, dst_mask);
-        return D3DERR_INVALIDCALL;
+        fbdesc.mColor[0] = GLFBAttachment{GL_RENDERBUFFER, rtsurface->getId(), 0};
+        rtsurface->Release();
     }
-
-    if(!(src_mask&GL_COLOR_BUFFER_BIT))
+    else if(SUCCEEDED(surface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
     {
-        if(filter != D3DTEXF_POINT)
-        {
-            FIXME("Invalid filter 0x%x for non-color blit\n", filter);
-            return D3DERR_INVALIDCALL;
-        }
-        FIXME("Unhandled non-color blit\n");
-        return D3DERR_INVALIDCALL;
+        fbdesc.mColor[0] = GLFBAttachment{
+            cubesurface->getTarget(), cubesurface->getParent()->getTextureId(), (GLint)cubesurface->getLevel()
+        };
+        cubesurface->Release();
+    }
+    else
+    {
+        FIXME("Unhandled surface %p\n", surface);
+        return E_NOTIMPL;
     }
 
-    mQueue.send<BlitFramebufferCmd>(this, src_target, src_binding, src_level, src_rect,
-                                    dst_target, dst_binding, dst_level, dst_rect,
-                                    GetGLFilterMode(filter, D3DTEXF_NONE));
+    RECT full{0, 0, (LONG)desc.Width, (LONG)desc.Height};
+    D3DRECT fillrect;
+    if(rect)
+        fillrect = D3DRECT{rect->left, rect->top, rect->right, rect->bottom};
 
-    return D3D_OK;
-}
+    mQueue.lock();
+    FlushSurfaceUpdates(surface);
+    mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), fbdesc);
+    mQueue.doSend<ClearCmd>(make_ref(mQueue), make_ref(mGLState), GL_COLOR_BUFFER_BIT, 1u, color,
+                            0.0f, 0u, rect ? &fillrect : nullptr, rect ? 1ul : 0ul, full, full,
+                            mGLRenderState.data(), mScissorRect);
+    mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
+    mQueue.unlock();
 
-HRESULT D3DGLDevice::ColorFill(IDirect3DSurface9 *surface, const RECT *rect, D3DCOLOR color)
-{
-    FIXME("iface %p, surface %p, rect %p, color 0x%08lx : stub!\n", this, surface, rect, color);
-    return E_NOTIMPL;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::CreateOffscreenPlainSurface(UINT width, UINT height, D3DFORMAT format, D3DPOOL pool, IDirect3DSurface9 **surface, HANDLE *handle)
@@ -2631,9 +4460,8 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
 
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(rtarget);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
-            GL_RENDERBUFFER, 0, 0
-        );
+        mFBDesc.mColor[index] = GLFBAttachment{GL_RENDERBUFFER, 0, 0};
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
         if(rtarget) rtarget->Release();
         return D3D_OK;
@@ -2657,9 +4485,10 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
 
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(tex2dsurface);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
-            GL_TEXTURE_2D, tex2d->getTextureId(), tex2dsurface->getLevel()
-        );
+        mFBDesc.mColor[index] = GLFBAttachment{
+            GL_TEXTURE_2D, tex2d->getTextureId(), (GLint)tex2dsurface->getLevel()
+        };
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else if(SUCCEEDED(rtarget->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
@@ -2673,9 +4502,8 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
 
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(surface);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
-            GL_RENDERBUFFER, surface->getId(), 0
-        );
+        mFBDesc.mColor[index] = GLFBAttachment{GL_RENDERBUFFER, surface->getId(), 0};
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else if(SUCCEEDED(rtarget->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
@@ -2690,9 +4518,10 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
 
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(cubesurface);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
-            cubesurface->getTarget(), cubetex->getTextureId(), cubesurface->getLevel()
-        );
+        mFBDesc.mColor[index] = GLFBAttachment{
+            cubesurface->getTarget(), cubetex->getTextureId(), (GLint)cubesurface->getLevel()
+        };
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else
@@ -2735,8 +4564,9 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
             dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
             dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
         );
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_DEPTH_STENCIL_ATTACHMENT,
-                                          GL_RENDERBUFFER, 0, 0);
+        mFBDesc.mDepthAttachment = GL_DEPTH_STENCIL_ATTACHMENT;
+        mFBDesc.mDepth = GLFBAttachment{GL_RENDERBUFFER, 0, 0};
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
         if(depthstencil) depthstencil->Release();
 
@@ -2777,17 +4607,11 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
                 dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
             );
         }
-        if(attachment == GL_DEPTH_ATTACHMENT)
-        {
-            // If the previous attachment was GL_DEPTH_STENCIL_ATTACHMENT, and
-            // this is GL_DEPTH_ATTACHMENT, the previous attachment would
-            // remain as the stencil buffer.
-            mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_STENCIL_ATTACHMENT,
-                                              GL_RENDERBUFFER, 0, 0);
-        }
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), attachment,
-            GL_TEXTURE_2D, tex2d->getTextureId(), tex2dsurface->getLevel()
-        );
+        mFBDesc.mDepthAttachment = attachment;
+        mFBDesc.mDepth = GLFBAttachment{
+            GL_TEXTURE_2D, tex2d->getTextureId(), (GLint)tex2dsurface->getLevel()
+        };
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else if(SUCCEEDED(depthstencil->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
@@ -2812,12 +4636,9 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
                 dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
             );
         }
-        if(attachment == GL_DEPTH_ATTACHMENT)
-            mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_STENCIL_ATTACHMENT,
-                                              GL_RENDERBUFFER, 0, 0);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), attachment,
-            GL_RENDERBUFFER, surface->getId(), 0
-        );
+        mFBDesc.mDepthAttachment = attachment;
+        mFBDesc.mDepth = GLFBAttachment{GL_RENDERBUFFER, surface->getId(), 0};
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else if(SUCCEEDED(depthstencil->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
@@ -2843,12 +4664,11 @@ HRESULT D3DGLDevice::SetDepthStencilSurface(IDirect3DSurface9 *depthstencil)
                 dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
             );
         }
-        if(attachment == GL_DEPTH_ATTACHMENT)
-            mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_STENCIL_ATTACHMENT,
-                                              GL_RENDERBUFFER, 0, 0);
-        mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), attachment,
-            cubesurface->getTarget(), cubetex->getTextureId(), cubesurface->getLevel()
-        );
+        mFBDesc.mDepthAttachment = attachment;
+        mFBDesc.mDepth = GLFBAttachment{
+            cubesurface->getTarget(), cubetex->getTextureId(), (GLint)cubesurface->getLevel()
+        };
+        mQueue.doSend<FramebufferSetCmd>(make_ref(mGLState), make_ref(mFramebuffers), make_ref(mGPUTimer), mFBDesc);
         mQueue.unlock();
     }
     else
@@ -2932,40 +4752,138 @@ HRESULT D3DGLDevice::Clear(DWORD count, const D3DRECT *rects, DWORD flags, D3DCO
         mask |= GL_STENCIL_BUFFER_BIT;
     }
 
-    if(count == 0)
+    if(count > 0 && !rects)
     {
-        RECT main_rect;
-        main_rect.left = mViewport.X;
-        main_rect.top = mViewport.Y;
-        main_rect.right = main_rect.left + mViewport.Width;
-        main_rect.bottom = main_rect.top + mViewport.Height;
-        mQueue.doSend<ClearCmd>(make_ref(mGLState), mask, color, depth, stencil, main_rect);
+        mQueue.unlock();
+        WARN("Null rects with count %lu\n", count);
+        return D3DERR_INVALIDCALL;
     }
-    else
+
+    // Clears are limited to the viewport, and the scissor rect when enabled.
+    RECT clip{
+        (LONG)mViewport.X, (LONG)mViewport.Y,
+        (LONG)(mViewport.X+mViewport.Width), (LONG)(mViewport.Y+mViewport.Height)
+    };
+    if(mRenderState[D3DRS_SCISSORTESTENABLE])
+    {
+        clip.left = std::max(clip.left, mScissorRect.left);
+        clip.top = std::max(clip.top, mScissorRect.top);
+        clip.right = std::min(clip.right, mScissorRect.right);
+        clip.bottom = std::min(clip.bottom, mScissorRect.bottom);
+    }
+
+    GLuint colorbuffers = 0;
+    for(size_t i = 0;i < mRenderTargets.size() && i < 4;++i)
     {
-        FIXME("Rectangles not yet handled\n");
+        if(mRenderTargets[i].load())
+            colorbuffers |= 1<<i;
     }
+
+    // It's only a full clear if it covers every surface being cleared.
+    D3DSURFACE_DESC desc;
+    mRenderTargets[0].load()->GetDesc(&desc);
+    RECT full{0, 0, (LONG)desc.Width, (LONG)desc.Height};
+    if((mask&(GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT)))
+    {
+        mDepthStencil.load()->GetDesc(&desc);
+        if((mask&GL_COLOR_BUFFER_BIT) && (full.right != (LONG)desc.Width || full.bottom != (LONG)desc.Height))
+            full = RECT{0, 0, LONG_MAX, LONG_MAX};
+        else
+            full = RECT{0, 0, (LONG)desc.Width, (LONG)desc.Height};
+    }
+
+    // Lots of rects are split across commands, to keep the payloads small.
+    do {
+        DWORD num = count;
+        if(num > ClearCmd::sMaxRects)
+            num = ClearCmd::sMaxRects;
+        mQueue.doSend<ClearCmd>(make_ref(mQueue), make_ref(mGLState), mask, colorbuffers, color,
+                                depth, stencil, rects, num, clip, full, mGLRenderState.data(),
+                                mScissorRect);
+        rects += num;
+        count -= num;
+    } while(count > 0);
     mQueue.unlock();
 
     return D3D_OK;
 }
 
+D3DMATRIX *D3DGLDevice::getTransform(D3DTRANSFORMSTATETYPE state)
+{
+    if(state >= D3DTS_WORLDMATRIX(0) && state <= D3DTS_WORLDMATRIX(255))
+        return &mWorldMatrices[state - D3DTS_WORLDMATRIX(0)];
+    if(state == D3DTS_VIEW || state == D3DTS_PROJECTION ||
+       (state >= D3DTS_TEXTURE0 && state <= D3DTS_TEXTURE7))
+        return &mTransforms[state];
+    return nullptr;
+}
+
 HRESULT D3DGLDevice::SetTransform(D3DTRANSFORMSTATETYPE state, const D3DMATRIX *matrix)
 {
-    FIXME("iface %p, state 0x%x, matrix %p : stub!\n", this, state, matrix);
-    return E_NOTIMPL;
+    TRACE("iface %p, state 0x%x, matrix %p\n", this, state, matrix);
+
+    D3DMATRIX *dst = getTransform(state);
+    if(!dst || !matrix)
+    {
+        WARN("Invalid transform state 0x%x, or null matrix %p\n", state, matrix);
+        return D3DERR_INVALIDCALL;
+    }
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordTransform(state, *matrix);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    *dst = *matrix;
+    mFFDirty |= FFDirty_Vertex;
+    mQueue.unlock();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetTransform(D3DTRANSFORMSTATETYPE state, D3DMATRIX *matrix)
 {
-    FIXME("iface %p, state 0x%x, matrix %p : stub!\n", this, state, matrix);
-    return E_NOTIMPL;
+    TRACE("iface %p, state 0x%x, matrix %p\n", this, state, matrix);
+
+    D3DMATRIX *src = getTransform(state);
+    if(!src || !matrix)
+    {
+        WARN("Invalid transform state 0x%x, or null matrix %p\n", state, matrix);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    *matrix = *src;
+    mQueue.unlock();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::MultiplyTransform(D3DTRANSFORMSTATETYPE state, const D3DMATRIX *matrix)
 {
-    FIXME("iface %p, state 0x%x, matrix %p : stub!\n", this, state, matrix);
-    return E_NOTIMPL;
+    TRACE("iface %p, state 0x%x, matrix %p\n", this, state, matrix);
+
+    D3DMATRIX *dst = getTransform(state);
+    if(!dst || !matrix)
+    {
+        WARN("Invalid transform state 0x%x, or null matrix %p\n", state, matrix);
+        return D3DERR_INVALIDCALL;
+    }
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        // Multiplies what the block has so far, or the device's transform.
+        const D3DMATRIX *base = block->findTransform(state);
+        mQueue.lock();
+        D3DMATRIX result = MultiplyMatrix(*matrix, base ? *base : *dst);
+        mQueue.unlock();
+        block->recordTransform(state, result);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    *dst = MultiplyMatrix(*matrix, *dst);
+    mFFDirty |= FFDirty_Vertex;
+    mQueue.unlock();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetViewport(const D3DVIEWPORT9 *viewport)
@@ -2979,8 +4897,15 @@ HRESULT D3DGLDevice::SetViewport(const D3DVIEWPORT9 *viewport)
         return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordViewport(*viewport);
+        return D3D_OK;
+    }
+
     mQueue.lock();
     mViewport = *viewport;
+    mFFDirty |= FFDirty_Vertex;
     resetProjectionFixup(mViewport.Width, mViewport.Height);
     mQueue.doSend<ViewportSet>(mViewport.X, mViewport.Y,
         std::min(mViewport.Width, 0x7ffffffful), std::min(mViewport.Height, 0x7ffffffful),
@@ -3003,9 +4928,16 @@ HRESULT D3DGLDevice::GetViewport(D3DVIEWPORT9 *viewport)
 HRESULT D3DGLDevice::SetMaterial(const D3DMATERIAL9 *material)
 {
     TRACE("iface %p, material %p\n", this, material);
+
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordMaterial(*material);
+        return D3D_OK;
+    }
+
     mQueue.lock();
     mMaterial = *material;
-    mQueue.doSend<MaterialSet>(mMaterial);
+    mFFDirty |= FFDirty_Vertex;
     mQueue.unlock();
     return D3D_OK;
 }
@@ -3016,249 +4948,195 @@ HRESULT D3DGLDevice::GetMaterial(D3DMATERIAL9 *material)
     mQueue.lock();
     *material = mMaterial;
     mQueue.unlock();
-    return E_NOTIMPL;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetLight(DWORD index, const D3DLIGHT9 *light)
 {
-    FIXME("iface %p, index %lu, light %p : stub!\n", this, index, light);
-    return E_NOTIMPL;
-}
-
-HRESULT D3DGLDevice::GetLight(DWORD index, D3DLIGHT9 *light)
-{
-    FIXME("iface %p, index %lu, light %p : stub!\n", this, index, light);
-    return E_NOTIMPL;
-}
-
-HRESULT D3DGLDevice::LightEnable(DWORD index, WINBOOL enable)
-{
-    FIXME("iface %p, index %lu, enable %u : stub!\n", this, index, enable);
-    return E_NOTIMPL;
-}
-
-HRESULT D3DGLDevice::GetLightEnable(DWORD index, WINBOOL *enable)
-{
-    FIXME("iface %p, index %lu, enable %p : stub!\n", this, index, enable);
-    return E_NOTIMPL;
-}
-
-HRESULT D3DGLDevice::SetClipPlane(DWORD index, const float *plane)
-{
-    TRACE("iface %p, index %lu, plane %p\n", this, index, plane);
+    TRACE("iface %p, index %lu, light %p\n", this, index, light);
 
-    if(index >= mClipPlane.size() || index >= mAdapter.getLimits().clipplanes)
+    if(!light || light->Type < D3DLIGHT_POINT || light->Type > D3DLIGHT_DIRECTIONAL)
     {
-        WARN("Clip plane index out of range (%lu >= %u)\n", index,
-             std::min(mAdapter.getLimits().clipplanes, mClipPlane.size()));
+        WARN("Invalid light %p\n", light);
         return D3DERR_INVALIDCALL;
     }
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordLight(index, *light);
+        return D3D_OK;
+    }
 
     mQueue.lock();
-    memcpy(mClipPlane[index].ptr(), plane, sizeof(mClipPlane[index]));
-    // FIXME: Clip plane needs to be set using the view matrix when no vertex
-    // shader is set.
-    mQueue.doSend<SetBufferValue4f>(mGLState.vtx_state_uniform_buffer,
-        offsetof(GLVertexState, ClipPlane[index]), mClipPlane[index].ptr()
-    );
+    if(LightState *state = mLights.find(index))
+    {
+        state->mLight = *light;
+        if(state->mEnabled)
+            mFFDirty |= FFDirty_Vertex;
+    }
+    else
+        mLights.insert(index, LightState{*light, false});
     mQueue.unlock();
-
     return D3D_OK;
 }
 
-HRESULT D3DGLDevice::GetClipPlane(DWORD index, float *plane)
+HRESULT D3DGLDevice::GetLight(DWORD index, D3DLIGHT9 *light)
 {
-    TRACE("iface %p, index %lu, plane %p\n", this, index, plane);
+    TRACE("iface %p, index %lu, light %p\n", this, index, light);
 
-    if(index >= mClipPlane.size() || index >= mAdapter.getLimits().clipplanes)
+    HRESULT hr = D3D_OK;
+    mQueue.lock();
+    if(const LightState *state = mLights.find(index))
+        *light = state->mLight;
+    else
     {
-        WARN("Clip plane index out of range (%lu >= %u)\n", index,
-             std::min(mAdapter.getLimits().clipplanes, mClipPlane.size()));
-        return D3DERR_INVALIDCALL;
+        WARN("Light %lu not set\n", index);
+        hr = D3DERR_INVALIDCALL;
     }
-
-    mQueue.lock();
-    memcpy(plane, mClipPlane[index].ptr(), sizeof(mClipPlane[index]));
     mQueue.unlock();
-
-    return D3D_OK;
+    return hr;
 }
 
-HRESULT D3DGLDevice::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
+HRESULT D3DGLDevice::LightEnable(DWORD index, WINBOOL enable)
 {
-    TRACE("iface %p, state %s, value 0x%lx\n", this, d3drs_to_str(state), value);
+    TRACE("iface %p, index %lu, enable %u\n", this, index, enable);
 
-    mQueue.lock();
-    auto glstate = RSStateEnableMap.find(state);
-    if(glstate != RSStateEnableMap.end())
+    if(D3DGLStateBlock *block = mRecordingBlock)
     {
-        if(state == D3DRS_ZENABLE && value == D3DZB_USEW)
-        {
-            FIXME("W-buffer not handled\n");
-            return D3DERR_INVALIDCALL;
-        }
-        mRenderState[state] = value;
-        mQueue.doSend<StateEnable>(glstate->second, value!=0);
+        block->recordLightEnable(index, enable);
+        return D3D_OK;
     }
-    else switch(state)
+
+    mQueue.lock();
+    LightState *state = mLights.find(index);
+    if(!state)
     {
-        case D3DRS_FILLMODE:
-        {
-            GLenum mode = GL_FILL;
-            if(value == D3DFILL_POINT)
-                mode = GL_POINT;
-            else if(value == D3DFILL_WIREFRAME)
-                mode = GL_LINE;
-            else if(value != D3DFILL_SOLID)
-                WARN("Invalid fill mode: 0x%lx\n", value);
+        // Enabling a light that was never set gives it the default.
+        D3DLIGHT9 light;
+        memset(&light, 0, sizeof(light));
+        light.Type = D3DLIGHT_DIRECTIONAL;
+        light.Diffuse.r = light.Diffuse.g = light.Diffuse.b = 1.0f;
+        light.Direction.z = 1.0f;
+        mLights.insert(index, LightState{light, false});
+        state = mLights.find(index);
+    }
 
-            mRenderState[state] = value;
-            mQueue.doSend<PolygonModeSet>(mode);
-            break;
-        }
+    if(!enable == !state->mEnabled)
+    {
+        mQueue.unlock();
+        return D3D_OK;
+    }
+    state->mEnabled = !!enable;
 
-        case D3DRS_CULLMODE:
+    auto active_end = mActiveLights.begin() + mNumActiveLights;
+    if(!enable)
+    {
+        auto iter = std::find(mActiveLights.begin(), active_end, index);
+        if(iter != active_end)
         {
-            GLenum face = GL_NONE;
-            if(value == D3DCULL_CW)
-                face = GL_FRONT;
-            else if(value == D3DCULL_CCW)
-                face = GL_BACK;
-            else if(value != D3DCULL_NONE)
-                WARN("Unhandled cull mode: 0x%lx\n", value);
-
-            mRenderState[state] = value;
-            mQueue.doSend<CullFaceSet>(face);
-            break;
+            std::copy(iter+1, active_end, iter);
+            --mNumActiveLights;
         }
+    }
+    else if(mNumActiveLights < std::min<UINT>(mActiveLights.size(), mAdapter.getLimits().lights))
+        mActiveLights[mNumActiveLights++] = index;
+    else
+        FIXME("Too many active lights, light %lu ignored\n", index);
+    mFFDirty |= FFDirty_Vertex;
+    mQueue.unlock();
 
-        case D3DRS_COLORWRITEENABLE:
-        case D3DRS_COLORWRITEENABLE1:
-        case D3DRS_COLORWRITEENABLE2:
-        case D3DRS_COLORWRITEENABLE3:
-            mRenderState[state] = value;
-            mQueue.doSend<ColorMaskSet>(state-D3DRS_COLORWRITEENABLE, value);
-            break;
+    return D3D_OK;
+}
 
-        case D3DRS_ZWRITEENABLE:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthMaskSet>(value);
-            break;
+HRESULT D3DGLDevice::GetLightEnable(DWORD index, WINBOOL *enable)
+{
+    TRACE("iface %p, index %lu, enable %p\n", this, index, enable);
 
-        case D3DRS_ZFUNC:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthFuncSet>(GetGLCompFunc(value));
-            break;
+    HRESULT hr = D3D_OK;
+    mQueue.lock();
+    if(const LightState *state = mLights.find(index))
+        *enable = state->mEnabled ? TRUE : FALSE;
+    else
+    {
+        WARN("Light %lu not set\n", index);
+        hr = D3DERR_INVALIDCALL;
+    }
+    mQueue.unlock();
+    return hr;
+}
 
-        case D3DRS_SLOPESCALEDEPTHBIAS:
-        case D3DRS_DEPTHBIAS:
-            mRenderState[state] = value;
-            mQueue.doSend<DepthBiasSet>(
-                dword_to_float(mRenderState[D3DRS_SLOPESCALEDEPTHBIAS]),
-                dword_to_float(mRenderState[D3DRS_DEPTHBIAS]) * (float)((1u<<mDepthBits) - 1u)
-            );
-            break;
+HRESULT D3DGLDevice::SetClipPlane(DWORD index, const float *plane)
+{
+    TRACE("iface %p, index %lu, plane %p\n", this, index, plane);
 
-        case D3DRS_ALPHAFUNC:
-        case D3DRS_ALPHAREF:
-            mRenderState[state] = value;
-            mQueue.doSend<AlphaFuncSet>(GetGLCompFunc(mRenderState[D3DRS_ALPHAFUNC]),
-                                        mRenderState[D3DRS_ALPHAREF] / 255.0f);
-            break;
+    if(index >= mClipPlane.size() || index >= mAdapter.getLimits().clipplanes)
+    {
+        WARN("Clip plane index out of range (%lu >= %u)\n", index,
+             std::min(mAdapter.getLimits().clipplanes, mClipPlane.size()));
+        return D3DERR_INVALIDCALL;
+    }
 
-        // FIXME: Handle D3DRS_SEPARATEALPHABLENDENABLE
-        case D3DRS_SRCBLEND:
-        case D3DRS_DESTBLEND:
-            mRenderState[state] = value;
-            mQueue.doSend<BlendFuncSet>(GetGLBlendFunc(mRenderState[D3DRS_SRCBLEND]),
-                                        GetGLBlendFunc(mRenderState[D3DRS_DESTBLEND]));
-            break;
-        case D3DRS_BLENDOP:
-            mRenderState[state] = value;
-            mQueue.doSend<BlendOpSet>(GetGLBlendOp(value));
-            break;
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordClipPlane(index, plane);
+        return D3D_OK;
+    }
 
-        case D3DRS_CLIPPLANEENABLE:
-            mRenderState[state] = value;
-            mQueue.doSend<ClipPlaneEnableCmd>(make_ref(mGLState), value);
-            break;
+    mQueue.lock();
+    memcpy(mClipPlane[index].ptr(), plane, sizeof(mClipPlane[index]));
+    // FIXME: Clip plane needs to be set using the view matrix when no vertex
+    // shader is set.
+    mQueue.doSend<SetBufferValue4f>(mGLState.vtx_state_uniform_buffer,
+        offsetof(GLVertexState, ClipPlane[index]), mClipPlane[index].ptr()
+    );
+    mQueue.unlock();
 
-        case D3DRS_STENCILWRITEMASK:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilMaskSet>(value);
-            break;
+    return D3D_OK;
+}
 
-        case D3DRS_STENCILFUNC:
-        case D3DRS_STENCILREF:
-        case D3DRS_STENCILMASK:
-            {
-                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
-                mRenderState[state] = value;
-                mQueue.doSend<StencilFuncSet>(face,
-                    GetGLCompFunc(mRenderState[D3DRS_STENCILFUNC]),
-                    mRenderState[D3DRS_STENCILREF].load(),
-                    mRenderState[D3DRS_STENCILMASK].load()
-                );
-            }
-            break;
+HRESULT D3DGLDevice::GetClipPlane(DWORD index, float *plane)
+{
+    TRACE("iface %p, index %lu, plane %p\n", this, index, plane);
 
-        case D3DRS_STENCILFAIL:
-        case D3DRS_STENCILZFAIL:
-        case D3DRS_STENCILPASS:
-            {
-                GLenum face = mRenderState[D3DRS_TWOSIDEDSTENCILMODE] ? GL_FRONT : GL_FRONT_AND_BACK;
-                mRenderState[state] = value;
-                mQueue.doSend<StencilOpSet>(face,
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILFAIL]),
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILZFAIL]),
-                    GetGLStencilOp(mRenderState[D3DRS_STENCILPASS])
-                );
-            }
-            break;
+    if(index >= mClipPlane.size() || index >= mAdapter.getLimits().clipplanes)
+    {
+        WARN("Clip plane index out of range (%lu >= %u)\n", index,
+             std::min(mAdapter.getLimits().clipplanes, mClipPlane.size()));
+        return D3DERR_INVALIDCALL;
+    }
 
-        // FIXME: These probably shouldn't set OpenGL state while
-        // D3DRS_TWOSIDEDSTENCILMODE is false.
-        case D3DRS_CCW_STENCILFUNC:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilFuncSet>(GL_BACK,
-                GetGLCompFunc(mRenderState[D3DRS_CCW_STENCILFUNC]),
-                mRenderState[D3DRS_STENCILREF].load(),
-                mRenderState[D3DRS_STENCILMASK].load()
-            );
-            break;
+    mQueue.lock();
+    memcpy(plane, mClipPlane[index].ptr(), sizeof(mClipPlane[index]));
+    mQueue.unlock();
 
-        case D3DRS_CCW_STENCILFAIL:
-        case D3DRS_CCW_STENCILZFAIL:
-        case D3DRS_CCW_STENCILPASS:
-            mRenderState[state] = value;
-            mQueue.doSend<StencilOpSet>(GL_BACK,
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILFAIL]),
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILZFAIL]),
-                GetGLStencilOp(mRenderState[D3DRS_CCW_STENCILPASS])
-            );
-            break;
+    return D3D_OK;
+}
 
-        // FIXME: This should probably set the GL_BACK stencil func/ops from
-        // CCW state when enabled, or set GL_FRONT_AND_BACK from CW state when
-        // disabled.
-        case D3DRS_TWOSIDEDSTENCILMODE:
-            mRenderState[state] = value;
-            break;
+HRESULT D3DGLDevice::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
+{
+    TRACE("iface %p, state %s, value 0x%lx\n", this, d3drs_to_str(state), value);
 
-        case D3DRS_FOGCOLOR:
-            mRenderState[state] = value;
-            mQueue.doSend<FogValuefSet>(GL_FOG_COLOR,
-                D3DCOLOR_R(value)/255.0f, D3DCOLOR_G(value)/255.0f,
-                D3DCOLOR_B(value)/255.0f, D3DCOLOR_A(value)/255.0f
-            );
-            break;
+    if(state >= mRenderState.size())
+    {
+        FIXME("Unhandled state %s, value 0x%lx\n", d3drs_to_str(state), value);
+        return D3D_OK;
+    }
+    if(state == D3DRS_ZENABLE && value == D3DZB_USEW)
+    {
+        FIXME("W-buffer not handled\n");
+        return D3DERR_INVALIDCALL;
+    }
 
-        default:
-            FIXME("Unhandled state %s, value 0x%lx\n", d3drs_to_str(state), value);
-            if(state < mRenderState.size())
-                mRenderState[state] = value;
-            break;
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordRenderState(state, value);
+        return D3D_OK;
     }
+
+    mQueue.lock();
+    mRenderState[state].store(value, std::memory_order_relaxed);
+    mDirtyRenderStates.set(state);
+    if(RSFFUniformMap[state])
+        mFFDirty = FFDirty_Vertex | FFDirty_Pixel;
     mQueue.unlock();
 
     return D3D_OK;
@@ -3278,22 +5156,98 @@ HRESULT D3DGLDevice::GetRenderState(D3DRENDERSTATETYPE state, DWORD *value)
     return D3D_OK;
 }
 
+void D3DGLDevice::applyStates(const D3DGLStateBlock &block)
+{
+    if(D3DGLStateBlock *recording = mRecordingBlock)
+    {
+        for(const auto &rs : block.getRenderStates())
+            recording->recordRenderState(rs.mState, rs.mValue);
+        for(const auto &ss : block.getSamplerStates())
+            recording->recordSamplerState(ss.mSampler, ss.mType, ss.mValue);
+        for(const auto &tss : block.getTexStageStates())
+            recording->recordTexStageState(tss.mStage, tss.mType, tss.mValue);
+        return;
+    }
+
+    mQueue.lock();
+    for(const auto &rs : block.getRenderStates())
+    {
+        mRenderState[rs.mState].store(rs.mValue, std::memory_order_relaxed);
+        mDirtyRenderStates.set(rs.mState);
+    }
+    for(const auto &ss : block.getSamplerStates())
+    {
+        mSamplerState[ss.mSampler][ss.mType].store(ss.mValue, std::memory_order_relaxed);
+        mDirtySamplers |= 1u<<ss.mSampler;
+    }
+    for(const auto &tss : block.getTexStageStates())
+        mTexStageState[tss.mStage][tss.mType].store(tss.mValue, std::memory_order_relaxed);
+    mFFDirty = FFDirty_Vertex | FFDirty_Pixel;
+    mQueue.unlock();
+}
+
+void D3DGLDevice::getLightIndices(std::vector<DWORD> &indices)
+{
+    mQueue.lock();
+    mLights.forEach([&indices](DWORD index, const LightState&) { indices.push_back(index); });
+    mQueue.unlock();
+}
+
+void D3DGLDevice::captureStates(D3DGLStateBlock &block)
+{
+    for(auto &rs : block.getRenderStates())
+        rs.mValue = mRenderState[rs.mState];
+    for(auto &ss : block.getSamplerStates())
+        ss.mValue = mSamplerState[ss.mSampler][ss.mType];
+    for(auto &tss : block.getTexStageStates())
+        tss.mValue = mTexStageState[tss.mStage][tss.mType];
+}
+
 HRESULT D3DGLDevice::CreateStateBlock(D3DSTATEBLOCKTYPE type, IDirect3DStateBlock9 **stateblock)
 {
-    FIXME("iface %p, type 0x%x, stateblock %p : stub!\n", this, type, stateblock);
-    return E_NOTIMPL;
+    TRACE("iface %p, type 0x%x, stateblock %p\n", this, type, stateblock);
+
+    D3DGLStateBlock *block = new D3DGLStateBlock(this);
+    HRESULT hr = block->init(type);
+    if(FAILED(hr))
+    {
+        delete block;
+        return hr;
+    }
+
+    *stateblock = block;
+    (*stateblock)->AddRef();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::BeginStateBlock()
 {
-    FIXME("iface %p : stub!\n", this);
-    return E_NOTIMPL;
+    TRACE("iface %p\n", this);
+
+    if(mRecordingBlock)
+    {
+        WARN("Already recording a state block\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    mRecordingBlock = new D3DGLStateBlock(this);
+    mRecordingBlock->AddRef();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::EndStateBlock(IDirect3DStateBlock9 **stateblock)
 {
-    FIXME("iface %p, stateblock %p : stub!\n", this, stateblock);
-    return E_NOTIMPL;
+    TRACE("iface %p, stateblock %p\n", this, stateblock);
+
+    if(!mRecordingBlock)
+    {
+        WARN("Not recording a state block\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    *stateblock = mRecordingBlock;
+    mRecordingBlock = nullptr;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetClipStatus(const D3DCLIPSTATUS9 *status)
@@ -3339,10 +5293,20 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
         return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordTexture(stage, texture);
+        return D3D_OK;
+    }
+
     if(!texture)
     {
         mQueue.lock();
         texture = mTextures[stage].exchange(texture);
+        if(ManagedResource *old = mBoundResources[stage])
+            mResidency.unbind(old);
+        mBoundResources[stage] = nullptr;
+        mCubeSamplers &= ~(1<<stage);
         mQueue.doSend<SetTextureCmd>(make_ref(mGLState), stage, GL_TEXTURE_2D, 0);
         mQueue.unlock();
         if(texture) texture->Release();
@@ -3352,6 +5316,7 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
     GLenum type = GL_TEXTURE_2D;
     GLuint binding = 0;
     int texflags = GLFormatInfo::Normal;
+    ManagedResource *managed = nullptr;
     union {
         void *pointer;
         D3DGLTexture *tex2d;
@@ -3362,12 +5327,16 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
         type = GL_TEXTURE_2D;
         binding = tex2d->getTextureId();
         texflags = tex2d->getFormat().flags;
+        if(tex2d->getDesc().Pool == D3DPOOL_MANAGED && tex2d->getDesc().Format != D3DFMT_NULL)
+            managed = tex2d;
     }
     else if(SUCCEEDED(texture->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
     {
         type = GL_TEXTURE_CUBE_MAP;
         binding = cubetex->getTextureId();
         texflags = cubetex->getFormat().flags;
+        if(cubetex->getDesc().Pool == D3DPOOL_MANAGED && cubetex->getDesc().Format != D3DFMT_NULL)
+            managed = cubetex;
     }
     else
     {
@@ -3378,14 +5347,22 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
     mQueue.lock();
     // Texture being set already has an added reference
     texture = mTextures[stage].exchange(texture);
+    if(ManagedResource *old = mBoundResources[stage])
+        mResidency.unbind(old);
+    mBoundResources[stage] = managed;
+    if(managed)
+    {
+        // An evicted texture gets a new ID when it's restored.
+        mResidency.bind(managed);
+        binding = (type == GL_TEXTURE_2D) ? tex2d->getTextureId() : cubetex->getTextureId();
+    }
+    // The compare mode is part of the stage's sampler.
     if(!(texflags&GLFormatInfo::ShadowTexture))
     {
         if((mShadowSamplers&(1<<stage)))
         {
             mShadowSamplers &= ~(1<<stage);
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[stage],
-                GL_TEXTURE_COMPARE_MODE, GL_NONE
-            );
+            mDirtySamplers |= 1u<<stage;
         }
     }
     else
@@ -3393,11 +5370,13 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
         if(!(mShadowSamplers&(1<<stage)))
         {
             mShadowSamplers |= (1<<stage);
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[stage],
-                GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE
-            );
+            mDirtySamplers |= 1u<<stage;
         }
     }
+    if(type == GL_TEXTURE_CUBE_MAP)
+        mCubeSamplers |= 1<<stage;
+    else
+        mCubeSamplers &= ~(1<<stage);
     mQueue.doSend<SetTextureCmd>(make_ref(mGLState), stage, type, binding);
     mQueue.unlock();
     if(texture) texture->Release();
@@ -3426,7 +5405,7 @@ HRESULT D3DGLDevice::GetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE
 
 HRESULT D3DGLDevice::SetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE type, DWORD value)
 {
-    FIXME("iface %p, stage %lu, type %s, value 0x%lx : stub!\n", this, stage, d3dtss_to_str(type), value);
+    TRACE("iface %p, stage %lu, type %s, value 0x%lx\n", this, stage, d3dtss_to_str(type), value);
 
     if(stage >= mTexStageState.size() || stage >= mAdapter.getLimits().fragment_samplers)
     {
@@ -3435,7 +5414,19 @@ HRESULT D3DGLDevice::SetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE
     }
 
     if(type < mTexStageState[stage].size())
-        mTexStageState[stage][type] = value;
+    {
+        if(D3DGLStateBlock *block = mRecordingBlock)
+            block->recordTexStageState(stage, type, value);
+        else if(type == D3DTSS_CONSTANT)
+        {
+            mQueue.lock();
+            mTexStageState[stage][type].store(value, std::memory_order_relaxed);
+            mFFDirty |= FFDirty_Pixel;
+            mQueue.unlock();
+        }
+        else
+            mTexStageState[stage][type].store(value, std::memory_order_relaxed);
+    }
     return D3D_OK;
 }
 
@@ -3479,83 +5470,15 @@ HRESULT D3DGLDevice::SetSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type, DW
         return D3DERR_INVALIDCALL;
     }
 
-    mQueue.lock();
-    DWORD oldvalue = mSamplerState[sampler][type].exchange(value);
-    switch(type)
+    if(D3DGLStateBlock *block = mRecordingBlock)
     {
-        case D3DSAMP_ADDRESSU:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_S, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_ADDRESSV:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_T, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_ADDRESSW:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_WRAP_R, GetGLWrapMode(value)
-            );
-            break;
-        case D3DSAMP_BORDERCOLOR:
-            mQueue.doSend<SetSamplerParameter4f>(mGLState.samplers[sampler],
-                GL_TEXTURE_BORDER_COLOR, D3DCOLOR_R(value)/255.0f, D3DCOLOR_G(value)/255.0f,
-                D3DCOLOR_B(value)/255.0f, D3DCOLOR_A(value)/255.0f
-            );
-            break;
-        case D3DSAMP_MAGFILTER:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MAG_FILTER, GetGLFilterMode(value, D3DTEXF_NONE)
-            );
-            break;
-        case D3DSAMP_MINFILTER:
-            if((oldvalue == D3DTEXF_ANISOTROPIC) != (value == D3DTEXF_ANISOTROPIC))
-                mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                    GL_TEXTURE_MAX_ANISOTROPY_EXT, (value == D3DTEXF_ANISOTROPIC) ?
-                                                   mSamplerState[sampler][D3DSAMP_MAXANISOTROPY].load() :
-                                                   1ul
-                );
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MIN_FILTER, GetGLFilterMode(value,
-                    mSamplerState[sampler][D3DSAMP_MIPFILTER]
-                )
-            );
-            break;
-        case D3DSAMP_MIPFILTER:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MIN_FILTER, GetGLFilterMode(
-                    mSamplerState[sampler][D3DSAMP_MINFILTER], value
-                )
-            );
-            break;
-        case D3DSAMP_MIPMAPLODBIAS:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_LOD_BIAS, value
-            );
-            break;
-        case D3DSAMP_MAXMIPLEVEL:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_MAX_LOD, value
-            );
-            break;
-        case D3DSAMP_MAXANISOTROPY:
-            if(mSamplerState[sampler][D3DSAMP_MIPFILTER] == D3DTEXF_ANISOTROPIC)
-                mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                    GL_TEXTURE_MAX_ANISOTROPY_EXT, value
-                );
-            break;
-        case D3DSAMP_SRGBTEXTURE:
-            mQueue.doSend<SetSamplerParameteri>(mGLState.samplers[sampler],
-                GL_TEXTURE_SRGB_DECODE_EXT, value ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT
-            );
-            break;
-        case D3DSAMP_ELEMENTINDEX:
-        case D3DSAMP_DMAPOFFSET:
-        default:
-            FIXME("Unhandled sampler state: %s\n", d3dsamp_to_str(type));
-            break;
+        block->recordSamplerState(sampler, type, value);
+        return D3D_OK;
     }
+
+    mQueue.lock();
+    mSamplerState[sampler][type].store(value, std::memory_order_relaxed);
+    mDirtySamplers |= 1u<<sampler;
     mQueue.unlock();
 
     return D3D_OK;
@@ -3601,6 +5524,12 @@ HRESULT D3DGLDevice::SetScissorRect(const RECT *rect)
         return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordScissorRect(*rect);
+        return D3D_OK;
+    }
+
     mQueue.lock();
     mScissorRect = *rect;
     mQueue.doSend<ScissorRectSet>(*rect);
@@ -3647,109 +5576,270 @@ float D3DGLDevice::GetNPatchMode()
 HRESULT D3DGLDevice::DrawPrimitive(D3DPRIMITIVETYPE type, UINT startvtx, UINT count)
 {
     TRACE("iface %p, type 0x%x, startVtx %u, count %u\n", this, type, startvtx, count);
+    TIMELINE_SCOPE("DrawPrimitive");
 
     mQueue.lock();
-    HRESULT hr = sendVtxData(startvtx, mStreams.data(), mStreams.size());
-    if(SUCCEEDED(hr))
+    flushStateChanges();
+    HRESULT hr = sendVtxData(mStreams.data(), mStreams.size());
+    if(hr == D3D_OK)
     {
         GLenum mode = GetGLDrawMode(type, count);
-        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, count, 1/*num_instances*/);
+        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, startvtx, count, 1/*num_instances*/);
+    }
+    mQueue.unlock();
+
+    return SUCCEEDED(hr) ? D3D_OK : hr;
+}
+
+HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, UINT minvtx, UINT numvtx, UINT startidx, UINT count)
+{
+    TRACE("iface %p, type 0x%x, startvtx %d, minvtx %u, numvtx %u, startidx %u, count %u\n", this, type, startvtx, minvtx, numvtx, startidx, count);
+    TIMELINE_SCOPE("DrawIndexedPrimitive");
+
+    if(type == D3DPT_POINTLIST)
+    {
+        WARN("Pointlist not allowed for indexed rendering\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    D3DGLBufferObject *idxbuffer;
+
+    mQueue.lock();
+    flushStateChanges();
+    HRESULT hr = sendVtxData(mStreams.data(), mStreams.size());
+    if(hr == D3D_OK)
+    {
+        if(!(idxbuffer=mIndexBuffer))
+        {
+            WARN("No index buffer set\n");
+            hr = D3DERR_INVALIDCALL;
+        }
+        else
+        {
+            GLsizei num_instances = 1;
+            if((mStreams[0].mFreq&D3DSTREAMSOURCE_INDEXEDDATA))
+                num_instances = (mStreams[0].mFreq&0x3fffffff);
+
+            idxbuffer->flushUpdates();
+
+            GLenum mode = GetGLDrawMode(type, count);
+            GLenum type = GetGLIndexType(idxbuffer->getFormat(), startidx);
+            GLubyte *pointer = ((GLubyte*)nullptr) + idxbuffer->getDataOffset() + startidx;
+            if(num_instances != 1)
+                mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
+                    mode, count, type, pointer, num_instances, startvtx
+                );
+            else
+            {
+                // If nothing's been sent since the last draw, this one can go
+                // with it.
+                MultiDrawGLElementsCmd *draw = mQueue.reclaimHeld<MultiDrawGLElementsCmd>();
+                if(draw && draw->add(mode, count, type, pointer, startvtx))
+                    mQueue.rehold();
+                else
+                {
+                    if(draw) mQueue.rehold();
+                    mQueue.doSendHeld<MultiDrawGLElementsCmd>(make_ref(mGLState),
+                        mode, count, type, pointer, startvtx
+                    );
+                }
+            }
+        }
+    }
+    mQueue.unlock();
+    return SUCCEEDED(hr) ? D3D_OK : hr;
+}
+
+HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const void *vtxData, UINT vtxStride)
+{
+    TRACE("iface %p, type 0x%x, count %u, vtxData %p, vtxStride %u\n", this, type, count, vtxData, vtxStride);
+    TIMELINE_SCOPE("DrawPrimitiveUP");
+
+    GLenum mode = GetGLDrawMode(type, count);
+    UINT vtxlen = vtxStride*count;
+
+    mQueue.lock();
+    flushStateChanges();
+
+    StreamSource stream;
+    stream.mBuffer = nullptr;
+    stream.mOffset = mUploadRing.reserve(vtxlen);
+    stream.mStride = vtxStride;
+    stream.mFreq = mStreams[0].mFreq;
+    mUploadRing.copy(stream.mOffset, vtxData, vtxlen);
+
+    HRESULT hr = sendVtxData(&stream, 1);
+    if(SUCCEEDED(hr))
+    {
+        if(mStreams[0].mBuffer)
+            mStreams[0].mBuffer->releaseIface();
+        mStreams[0].mBuffer = nullptr;
+        mStreams[0].mOffset = 0;
+        mStreams[0].mStride = 0;
+
+        if(hr == D3D_OK)
+            mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, 0, count, 1/*num_instances*/);
     }
     mQueue.unlock();
 
-    return hr;
+    return SUCCEEDED(hr) ? D3D_OK : hr;
 }
 
-HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, UINT minvtx, UINT numvtx, UINT startidx, UINT count)
+HRESULT D3DGLDevice::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE type, UINT minvtx, UINT numvtx, UINT count, const void *idxdata, D3DFORMAT idxformat, const void *vtxdata, UINT vtxstride)
 {
-    TRACE("iface %p, type 0x%x, startvtx %d, minvtx %u, numvtx %u, startidx %u, count %u\n", this, type, startvtx, minvtx, numvtx, startidx, count);
+    TRACE("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
+    TIMELINE_SCOPE("DrawIndexedPrimitiveUP");
 
     if(type == D3DPT_POINTLIST)
     {
         WARN("Pointlist not allowed for indexed rendering\n");
         return D3DERR_INVALIDCALL;
     }
+    if(idxformat != D3DFMT_INDEX16 && idxformat != D3DFMT_INDEX32)
+    {
+        WARN("Invalid index format: %s\n", d3dfmt_to_str(idxformat));
+        return D3DERR_INVALIDCALL;
+    }
 
-    D3DGLBufferObject *idxbuffer;
+    GLenum mode = GetGLDrawMode(type, count);
+    UINT idxlen = count;
+    GLenum idxtype = GetGLIndexType(idxformat, idxlen);
+    UINT vtxlen = (vtxstride*numvtx + 15) & ~15;
 
+    // Only the referenced vertices are copied, so the indices are offset by
+    // -minvtx to land on them.
     mQueue.lock();
-    HRESULT hr = sendVtxData(startvtx, mStreams.data(), mStreams.size());
+    flushStateChanges();
+
+    StreamSource stream;
+    stream.mBuffer = nullptr;
+    stream.mOffset = mUploadRing.reserve(vtxlen + idxlen);
+    stream.mStride = vtxstride;
+    stream.mFreq = mStreams[0].mFreq;
+    mUploadRing.copy(stream.mOffset, reinterpret_cast<const GLubyte*>(vtxdata) + vtxstride*minvtx,
+                     vtxstride*numvtx);
+    mUploadRing.copy(stream.mOffset+vtxlen, idxdata, idxlen);
+
+    HRESULT hr = sendVtxData(&stream, 1);
     if(SUCCEEDED(hr))
     {
-        if(!(idxbuffer=mIndexBuffer))
-        {
-            WARN("No index buffer set\n");
-            hr = D3DERR_INVALIDCALL;
-        }
-        else
-        {
-            GLsizei num_instances = 1;
-            if((mStreams[0].mFreq&D3DSTREAMSOURCE_INDEXEDDATA))
-                num_instances = (mStreams[0].mFreq&0x3fffffff);
+        // Like D3D, the stream 0 and index buffer bindings are unset after.
+        if(mStreams[0].mBuffer)
+            mStreams[0].mBuffer->releaseIface();
+        mStreams[0].mBuffer = nullptr;
+        mStreams[0].mOffset = 0;
+        mStreams[0].mStride = 0;
+        if(D3DGLBufferObject *idxbuffer = mIndexBuffer.exchange(nullptr))
+            idxbuffer->releaseIface();
 
-            GLenum mode = GetGLDrawMode(type, count);
-            GLenum type = GetGLIndexType(idxbuffer->getFormat(), startidx);
-            GLubyte *pointer = ((GLubyte*)nullptr) + startidx;
+        if(hr == D3D_OK)
+        {
+            GLubyte *pointer = ((GLubyte*)nullptr) + stream.mOffset + vtxlen;
+            mQueue.doSend<ElementArraySet>(make_ref(mVertexArrays), mUploadRing.getBufferId());
             mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
-                mode, count, type, pointer, num_instances, minvtx
+                mode, count, idxtype, pointer, 1/*num_instances*/, -GLsizei(minvtx)
             );
         }
     }
     mQueue.unlock();
-    return hr;
+
+    return SUCCEEDED(hr) ? D3D_OK : hr;
 }
 
-HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const void *vtxData, UINT vtxStride)
+HRESULT D3DGLDevice::ProcessVertices(UINT startidx, UINT dstidx, UINT vtxcount, IDirect3DVertexBuffer9 *dstbuffer, IDirect3DVertexDeclaration9 *vtxdecl, DWORD flags)
 {
-    TRACE("iface %p, type 0x%x, count %u, vtxData %p, vtxStride %u\n", this, type, count, vtxData, vtxStride);
+    TRACE("iface %p, startidx %u, dstidx %u, vtxcount %u, dstbuffer %p, vtxdecl %p, flags 0x%lx\n", this, startidx, dstidx, vtxcount, dstbuffer, vtxdecl, flags);
+    TIMELINE_SCOPE("ProcessVertices");
 
-    GLenum mode = GetGLDrawMode(type, count);
+    if(!dstbuffer)
+    {
+        WARN("No destination buffer\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(!vtxdecl)
+    {
+        FIXME("Output declaration from the destination FVF not supported\n");
+        return E_NOTIMPL;
+    }
+    if((flags&~D3DPV_DONOTCOPYDATA))
+        FIXME("Unhandled flags: 0x%lx\n", flags);
+
+    D3DGLBufferObject *dst;
+    if(FAILED(dstbuffer->QueryInterface(IID_D3DGLBufferObject, (void**)&dst)))
+        return D3DERR_INVALIDCALL;
+    dst->Release();
+    D3DGLVertexDeclaration *outdecl;
+    if(FAILED(vtxdecl->QueryInterface(IID_D3DGLVertexDeclaration, (void**)&outdecl)))
+        return D3DERR_INVALIDCALL;
+    outdecl->Release();
+
+    D3DGLVertexShader *vshader = mVertexShader;
+    if(!vshader)
+    {
+        FIXME("Processing vertices without a vertex shader not supported\n");
+        return E_NOTIMPL;
+    }
 
-    if(!mPrimitiveUserData)
+    auto layout = std::make_shared<FeedbackLayout>();
+    HRESULT hr = layout->init(outdecl);
+    if(FAILED(hr))
+        return hr;
+    if(!GLEW_ARB_transform_feedback3)
     {
-        mPrimitiveUserData = new D3DGLBufferObject(this);
-        if(!mPrimitiveUserData->init_vbo(vtxStride*count, D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT))
+        for(const std::string &name : layout->mVaryings)
         {
-            ERR("Failed to initialize vertex data storage\n");
-            return D3DERR_INVALIDCALL;
+            if(name.compare(0, 3, "gl_") == 0)
+            {
+                FIXME("Skipped output elements need ARB_transform_feedback3\n");
+                return E_NOTIMPL;
+            }
         }
     }
-    mPrimitiveUserData->resetBufferData(reinterpret_cast<const GLubyte*>(vtxData),
-                                        vtxStride*count);
 
-    mQueue.lock();
-    StreamSource stream;
-    stream.mBuffer = mPrimitiveUserData;
-    stream.mOffset = 0;
-    stream.mStride = vtxStride;
-    stream.mFreq = mStreams[0].mFreq;
-
-    HRESULT hr = sendVtxData(0, &stream, 1);
-    if(SUCCEEDED(hr))
+    D3DVERTEXBUFFER_DESC desc;
+    dst->GetDesc(&desc);
+    if(vtxcount == 0 || layout->mStride == 0 || dstidx > desc.Size/layout->mStride ||
+       vtxcount > desc.Size/layout->mStride - dstidx)
     {
-        if(mStreams[0].mBuffer)
-            mStreams[0].mBuffer->releaseIface();
-        mStreams[0].mBuffer = nullptr;
-        mStreams[0].mOffset = 0;
-        mStreams[0].mStride = 0;
-
-        mQueue.doSend<DrawGLArraysCmd>(make_ref(mGLState), mode, count, 1/*num_instances*/);
+        WARN("Vertices out of range (%u + %u, stride %u, size %u)\n", dstidx, vtxcount,
+             layout->mStride, desc.Size);
+        return D3DERR_INVALIDCALL;
     }
-    mQueue.unlock();
 
-    return hr;
-}
+    // D3D screen space: y goes down, and z is scaled to the depth range.
+    const D3DVIEWPORT9 &vp = mViewport;
+    std::array<GLfloat,8> viewport{{
+        vp.Width*0.5f, vp.Height*-0.5f, vp.MaxZ-vp.MinZ, 0.0f,
+        vp.X + vp.Width*0.5f, vp.Y + vp.Height*0.5f, vp.MinZ, 0.0f
+    }};
 
-HRESULT D3DGLDevice::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE type, UINT minvtx, UINT numvtx, UINT count, const void *idxdata, D3DFORMAT idxformat, const void *vtxdata, UINT vtxstride)
-{
-    FIXME("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u : stub!\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
-    return E_NOTIMPL;
-}
+    mQueue.lock();
+    flushStateChanges();
+    hr = sendVtxData(mStreams.data(), mStreams.size());
+    if(hr == S_FALSE)
+    {
+        // The results are needed, so wait for the shaders instead of
+        // skipping.
+        vshader->getCode()->waitBuilt();
+        if(D3DGLPixelShader *pshader = mPixelShader)
+            pshader->getCode()->waitBuilt();
+        hr = sendVtxData(mStreams.data(), mStreams.size());
+    }
+    if(hr == D3D_OK)
+    {
+        VertexShaderCode *vcode = vshader->getCode();
+        // Anything still pending for the destination goes first, so it isn't
+        // uploaded over the results later.
+        dst->flushUpdates();
+        mQueue.doSend<ProcessVerticesCmd>(make_ref(mGLState), vcode, vcode->getFeedbackVariant(), layout,
+            viewport, dst->getBufferId(), dst->getDataOffset() + dstidx*layout->mStride, startidx,
+            vtxcount, mVertexProgram, mFragmentProgram
+        );
+        dst->setGPUWritten();
+    }
+    mQueue.unlock();
 
-HRESULT D3DGLDevice::ProcessVertices(UINT startidx, UINT dstidx, UINT vtxcount, IDirect3DVertexBuffer9 *dstbuffer, IDirect3DVertexDeclaration9 *vtxdecl, DWORD flags)
-{
-    FIXME("iface %p, startidx %u, dstidx %u, vtxcount %u, dstbuffer %p, vtxdecl %p, flags 0x%lx : stub!\n", this, startidx, dstidx, vtxcount, dstbuffer, vtxdecl, flags);
-    return E_NOTIMPL;
+    return SUCCEEDED(hr) ? D3D_OK : hr;
 }
 
 HRESULT D3DGLDevice::CreateVertexDeclaration(const D3DVERTEXELEMENT9 *elems, IDirect3DVertexDeclaration9 **decl)
@@ -3773,6 +5863,12 @@ HRESULT D3DGLDevice::SetVertexDeclaration(IDirect3DVertexDeclaration9 *decl)
 {
     TRACE("iface %p, decl %p\n", this, decl);
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordVertexDecl(decl);
+        return D3D_OK;
+    }
+
     D3DGLVertexDeclaration *vtxdecl = nullptr;
     if(decl)
     {
@@ -3819,9 +5915,8 @@ HRESULT D3DGLDevice::SetFVF(DWORD fvf)
     D3DGLVertexDeclaration *vtxdecl;
 
     mQueue.lock();
-    auto fvfdecl = mVtxDeclMap.find(fvf);
-    if(fvfdecl != mVtxDeclMap.end())
-        vtxdecl = fvfdecl->second;
+    if(D3DGLVertexDeclaration **fvfdecl = mVtxDeclMap.find(fvf))
+        vtxdecl = *fvfdecl;
     else
     {
         vtxdecl = new D3DGLVertexDeclaration(this);
@@ -3832,7 +5927,13 @@ HRESULT D3DGLDevice::SetFVF(DWORD fvf)
             mQueue.unlock();
             return hr;
         }
-        mVtxDeclMap.insert(std::make_pair(fvf, vtxdecl));
+        mVtxDeclMap.insert(fvf, vtxdecl);
+    }
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        mQueue.unlock();
+        block->recordVertexDecl(vtxdecl);
+        return D3D_OK;
     }
     vtxdecl->addIface();
     vtxdecl = mVertexDecl.exchange(vtxdecl);
@@ -3883,10 +5984,14 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
         if(FAILED(hr)) return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordVertexShader(shader);
+        if(vshader) vshader->Release();
+        return D3D_OK;
+    }
+
     mQueue.lock();
-    // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(vshader && vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
     D3DGLVertexShader *oldshader = mVertexShader.exchange(vshader);
     if(vshader)
     {
@@ -3894,13 +5999,10 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
         // appropriate global values, and the new shader's local constants
         // should be filled with what the shader defined.
 
-        if(GLuint program = vshader->getProgram())
-            mQueue.doSend<SetVShaderCmd>(mGLState.pipeline, program);
-        else
-        {
-            vshader->addPendingUpdate();
-            mQueue.doSend<CompileAndSetVShaderCmd>(vshader, mGLState.pipeline);
-        }
+        /* The program is set when drawing, but it can start building now so
+         * it's more likely to be ready by then.
+         */
+        vshader->getCode()->selectVariant(mShadowSamplers, mVSConstantsI, mVSConstantsB);
     }
     else if(oldshader)
     {
@@ -3931,41 +6033,16 @@ HRESULT D3DGLDevice::SetVertexShaderConstantF(UINT start, const float *values, U
         return D3DERR_INVALIDCALL;
     }
 
-    mQueue.lock();
-    memcpy(mVSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    if(D3DGLStateBlock *block = mRecordingBlock)
     {
-    set_more:
-        if(count == 1)
-            mQueue.doSend<SetBufferValue4f>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-        else if(count <= 4)
-            mQueue.doSend<SetBufferValue4fv<4>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 32)
-            mQueue.doSend<SetBufferValue4fv<32>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 64)
-            mQueue.doSend<SetBufferValue4fv<64>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 128)
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else
-        {
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.vs_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-            values += 128*4;
-            start += 128;
-            count -= 128;
-            goto set_more;
-        }
+        block->recordVSConstantsF(start, values, count);
+        return D3D_OK;
     }
+
+    mQueue.lock();
+    memcpy(mVSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    mVSConstFDirtyStart = std::min(mVSConstFDirtyStart, start);
+    mVSConstFDirtyEnd = std::max(mVSConstFDirtyEnd, start+count);
     mQueue.unlock();
 
     return D3D_OK;
@@ -3990,26 +6067,91 @@ HRESULT D3DGLDevice::GetVertexShaderConstantF(UINT start, float *values, UINT co
 
 HRESULT D3DGLDevice::SetVertexShaderConstantI(UINT start, const int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mVSConstantsI.size() || count > mVSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mVSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordVSConstantsI(start, values, count);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    memcpy(mVSConstantsI[start].data(), values, count*sizeof(mVSConstantsI[0]));
+    mQueue.doSend<SetBufferValueData>(make_ref(mQueue), mGLState.vs_uniform_bufferi, start*sizeof(Vector4f),
+        reinterpret_cast<const float*>(mVSConstantsI[start].data()), count
+    );
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetVertexShaderConstantI(UINT start, int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mVSConstantsI.size() || count > mVSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mVSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    memcpy(values, mVSConstantsI[start].data(), count*sizeof(mVSConstantsI[0]));
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetVertexShaderConstantB(UINT start, const WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > 16)\n", start, count);
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordVSConstantsB(start, values, count);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    for(UINT i = 0;i < count;++i)
+    {
+        if(values[i]) mVSConstantsB |= 1<<(start+i);
+        else mVSConstantsB &= ~(1<<(start+i));
+    }
+    sendConstantsB(mGLState.vs_uniform_bufferb, mVSConstantsB, start, count);
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetVertexShaderConstantB(UINT start, WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > 16)\n", start, count);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    for(UINT i = 0;i < count;++i)
+        values[i] = (mVSConstantsB>>(start+i)) & 1;
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetStreamSource(UINT index, IDirect3DVertexBuffer9 *stream, UINT offset, UINT stride)
@@ -4022,6 +6164,12 @@ HRESULT D3DGLDevice::SetStreamSource(UINT index, IDirect3DVertexBuffer9 *stream,
         return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordStreamSource(index, stream, offset, stride);
+        return D3D_OK;
+    }
+
     if(!stream)
     {
         if(mStreams[index].mBuffer)
@@ -4088,6 +6236,12 @@ HRESULT D3DGLDevice::SetStreamSourceFreq(UINT index, UINT divisor)
     if(!(divisor&(D3DSTREAMSOURCE_INDEXEDDATA|D3DSTREAMSOURCE_INSTANCEDATA)) && divisor != 1)
         FIXME("Unexpected divisor value: 0x%x\n", divisor);
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordStreamFreq(index, divisor);
+        return D3D_OK;
+    }
+
     mStreams[index].mFreq = divisor;
     return D3D_OK;
 }
@@ -4110,6 +6264,12 @@ HRESULT D3DGLDevice::SetIndices(IDirect3DIndexBuffer9 *index)
 {
     TRACE("iface %p, index %p\n", this, index);
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordIndices(index);
+        return D3D_OK;
+    }
+
     D3DGLBufferObject *buffer = nullptr;
     if(index)
     {
@@ -4122,7 +6282,7 @@ HRESULT D3DGLDevice::SetIndices(IDirect3DIndexBuffer9 *index)
 
     mQueue.lock();
     D3DGLBufferObject *oldbuffer = mIndexBuffer.exchange(buffer);
-    mQueue.doSend<ElementArraySet>(buffer ? buffer->getBufferId() : 0);
+    mQueue.doSend<ElementArraySet>(make_ref(mVertexArrays), buffer ? buffer->getBufferId() : 0);
     mQueue.unlock();
     if(oldbuffer) oldbuffer->releaseIface();
 
@@ -4167,10 +6327,14 @@ HRESULT D3DGLDevice::SetPixelShader(IDirect3DPixelShader9 *shader)
         if(FAILED(hr)) return D3DERR_INVALIDCALL;
     }
 
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordPixelShader(shader);
+        if(pshader) pshader->Release();
+        return D3D_OK;
+    }
+
     mQueue.lock();
-    // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(pshader && pshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
     D3DGLPixelShader *oldshader = mPixelShader.exchange(pshader);
     if(pshader)
     {
@@ -4179,9 +6343,10 @@ HRESULT D3DGLDevice::SetPixelShader(IDirect3DPixelShader9 *shader)
         // should be filled with what the shader defined.
 
         /* Don't set the fragment program yet. We'll do it when it draws
-         * and we have the proper shadow sampler setup.
+         * and we have the proper shadow sampler setup, but the program for
+         * the current setup can start building now.
          */
-        mNewPixelShader = true;
+        pshader->getCode()->selectVariant(mShadowSamplers, mPSConstantsI, mPSConstantsB);
     }
     else if(oldshader)
     {
@@ -4212,41 +6377,16 @@ HRESULT D3DGLDevice::SetPixelShaderConstantF(UINT start, const float *values, UI
         return D3DERR_INVALIDCALL;
     }
 
-    mQueue.lock();
-    memcpy(mPSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    if(D3DGLStateBlock *block = mRecordingBlock)
     {
-    set_more:
-        if(count == 1)
-            mQueue.doSend<SetBufferValue4f>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-        else if(count <= 4)
-            mQueue.doSend<SetBufferValue4fv<4>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 32)
-            mQueue.doSend<SetBufferValue4fv<32>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 64)
-            mQueue.doSend<SetBufferValue4fv<64>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else if(count <= 128)
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values, count
-            );
-        else
-        {
-            mQueue.doSend<SetBufferValue4fv<128>>(mGLState.ps_uniform_bufferf,
-                start*sizeof(Vector4f), values
-            );
-            values += 128*4;
-            start += 128;
-            count -= 128;
-            goto set_more;
-        }
+        block->recordPSConstantsF(start, values, count);
+        return D3D_OK;
     }
+
+    mQueue.lock();
+    memcpy(mPSConstantsF[start].ptr(), values, count*sizeof(Vector4f));
+    mPSConstFDirtyStart = std::min(mPSConstFDirtyStart, start);
+    mPSConstFDirtyEnd = std::max(mPSConstFDirtyEnd, start+count);
     mQueue.unlock();
 
     return D3D_OK;
@@ -4271,26 +6411,91 @@ HRESULT D3DGLDevice::GetPixelShaderConstantF(UINT start, float *values, UINT cou
 
 HRESULT D3DGLDevice::SetPixelShaderConstantI(UINT start, const int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mPSConstantsI.size() || count > mPSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mPSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordPSConstantsI(start, values, count);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    memcpy(mPSConstantsI[start].data(), values, count*sizeof(mPSConstantsI[0]));
+    mQueue.doSend<SetBufferValueData>(make_ref(mQueue), mGLState.ps_uniform_bufferi, start*sizeof(Vector4f),
+        reinterpret_cast<const float*>(mPSConstantsI[start].data()), count
+    );
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetPixelShaderConstantI(UINT start, int *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= mPSConstantsI.size() || count > mPSConstantsI.size()-start)
+    {
+        WARN("Invalid constants range (%u + %u > %u)\n", start, count, mPSConstantsI.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    memcpy(values, mPSConstantsI[start].data(), count*sizeof(mPSConstantsI[0]));
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetPixelShaderConstantB(UINT start, const WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > 16)\n", start, count);
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(D3DGLStateBlock *block = mRecordingBlock)
+    {
+        block->recordPSConstantsB(start, values, count);
+        return D3D_OK;
+    }
+
+    mQueue.lock();
+    for(UINT i = 0;i < count;++i)
+    {
+        if(values[i]) mPSConstantsB |= 1<<(start+i);
+        else mPSConstantsB &= ~(1<<(start+i));
+    }
+    sendConstantsB(mGLState.ps_uniform_bufferb, mPSConstantsB, start, count);
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetPixelShaderConstantB(UINT start, WINBOOL *values, UINT count)
 {
-    FIXME("iface %p, start %u, values %p, count %u : stub!\n", this, start, values, count);
-    return E_NOTIMPL;
+    TRACE("iface %p, start %u, values %p, count %u\n", this, start, values, count);
+
+    if(start >= 16 || count > 16-start)
+    {
+        WARN("Invalid constants range (%u + %u > 16)\n", start, count);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mQueue.lock();
+    for(UINT i = 0;i < count;++i)
+        values[i] = (mPSConstantsB>>(start+i)) & 1;
+    mQueue.unlock();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::DrawRectPatch(UINT handle, const float *numsegs, const D3DRECTPATCH_INFO *pinfo)
@@ -4315,6 +6520,10 @@ HRESULT D3DGLDevice::CreateQuery(D3DQUERYTYPE type, IDirect3DQuery9 **query)
 {
     TRACE("iface %p, type %s, query %p\n", this, d3dquery_to_str(type), query);
 
+    // Without a query, this checks if the type is supported.
+    if(!query)
+        return D3DGLQuery::isSupported(type) ? D3D_OK : D3DERR_NOTAVAILABLE;
+
     D3DGLQuery *_query = new D3DGLQuery(this);
     if(!_query->init(type))
     {
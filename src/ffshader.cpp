@@ -0,0 +1,649 @@
+
+#include "ffshader.hpp"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "device.hpp"
+#include "trace.hpp"
+#include "commandqueue.hpp"
+#include "commandstream.hpp"
+#include "shadercache.hpp"
+
+
+namespace
+{
+
+// Fixed-function keys are stored in the shader cache in place of bytecode,
+// after one of these (which D3D bytecode can't start with) and the version.
+// Increase the version when the generated GLSL changes.
+const DWORD sVertexMagic = 0x53564646; // "FFVS"
+const DWORD sPixelMagic = 0x53504646;  // "FFPS"
+const DWORD sVersion = 1;
+
+template<typename T>
+std::vector<DWORD> MakeCacheCode(DWORD magic, const T &key)
+{
+    std::vector<DWORD> code(2 + sizeof(key)/sizeof(DWORD));
+    code[0] = magic;
+    code[1] = sVersion;
+    memcpy(&code[2], &key, sizeof(key));
+    return code;
+}
+
+
+const char sVertexHeader[] =
+"#version 330\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"layout(std140) uniform pos_fixup { vec4 POS_FIXUP; };\n"
+"layout(std140) uniform vertex_state {\n"
+"    vec4 ClipPlane[8];\n"
+"};\n"
+"struct FFLight {\n"
+"    vec4 Diffuse;\n"
+"    vec4 Specular;\n"
+"    vec4 Ambient;\n"
+"    vec4 Position;\n"
+"    vec4 Direction;\n"
+"    vec4 Attenuation;\n"
+"    vec4 Spot;\n"
+"};\n"
+"layout(std140) uniform ffp_vertex {\n"
+"    mat4 World;\n"
+"    mat4 WorldView;\n"
+"    mat4 WorldViewProj;\n"
+"    mat4 NormalMatrix;\n"
+"    mat4 TexMatrix[8];\n"
+"    vec4 MaterialDiffuse;\n"
+"    vec4 MaterialAmbient;\n"
+"    vec4 MaterialSpecular;\n"
+"    vec4 MaterialEmissive;\n"
+"    vec4 GlobalAmbient;\n"
+"    vec4 MaterialPower;\n"
+"    vec4 FogParams;\n"
+"    vec4 PointParams;\n"
+"    vec4 PointScale;\n"
+"    vec4 ScreenScale;\n"
+"    vec4 ScreenOffset;\n"
+"    FFLight Lights[8];\n"
+"};\n"
+"out gl_PerVertex {\n"
+"    vec4 gl_Position;\n"
+"    float gl_PointSize;\n"
+"    float gl_ClipDistance[8];\n"
+"};\n"
+"layout(location=0) out vec4 vs_output[10];\n";
+
+// Lights add to the ambient, diffuse, and specular sums, which the material
+// colors are applied to after.
+const char sLightFuncs[] =
+"vec3 ff_amb, ff_diff, ff_spec;\n"
+"void ff_add_light(FFLight l, vec3 dir, float att, vec3 normal, vec3 eye)\n"
+"{\n"
+"    ff_amb += l.Ambient.rgb*att;\n"
+"    float ndl = dot(normal, dir);\n"
+"    if(ndl > 0.0)\n"
+"    {\n"
+"        ff_diff += l.Diffuse.rgb*(ndl*att);\n"
+"#ifdef FF_SPECULAR\n"
+"        float ndh = dot(normal, normalize(dir + eye));\n"
+"        if(ndh > 0.0)\n"
+"            ff_spec += l.Specular.rgb*(pow(ndh, MaterialPower.x)*att);\n"
+"#endif\n"
+"    }\n"
+"}\n"
+"void ff_directional(FFLight l, vec3 normal, vec3 eye)\n"
+"{ ff_add_light(l, -l.Direction.xyz, 1.0, normal, eye); }\n"
+"void ff_point(FFLight l, vec3 pos, vec3 normal, vec3 eye, bool spot)\n"
+"{\n"
+"    vec3 dir = l.Position.xyz - pos;\n"
+"    float dist = length(dir);\n"
+"    if(dist > l.Attenuation.w)\n"
+"        return;\n"
+"    dir = (dist > 0.0) ? dir/dist : vec3(0.0);\n"
+"    float att = 1.0 / max(dot(l.Attenuation.xyz, vec3(1.0, dist, dist*dist)), 1e-8);\n"
+"    if(spot)\n"
+"    {\n"
+"        float s = clamp((dot(-dir, l.Direction.xyz) - l.Spot.x)*l.Spot.y, 0.0, 1.0);\n"
+"        att *= (s > 0.0) ? pow(s, l.Spot.z) : 0.0;\n"
+"    }\n"
+"    ff_add_light(l, dir, att, normal, eye);\n"
+"}\n";
+
+const char *GetMaterialSource(DWORD source, const char *material)
+{
+    if(source == D3DMCS_COLOR1) return "ff_diffuse";
+    if(source == D3DMCS_COLOR2) return "ff_specular";
+    return material;
+}
+
+// Fills out a texcoord input to 4 components like D3D does for transforming
+// it, with 1 after the last given one.
+std::string ExpandTexCoord(UINT index, UINT size)
+{
+    std::stringstream sstr;
+    sstr<< "ff_texcoord"<<index;
+    std::string name = sstr.str();
+    switch(size)
+    {
+        case 1: return "vec4("+name+".x, 1.0, 0.0, 0.0)";
+        case 2: return "vec4("+name+".xy, 1.0, 0.0)";
+        case 3: return "vec4("+name+".xyz, 1.0)";
+    }
+    return name;
+}
+
+std::string GenerateVertexGLSL(const FFVertexKey &key)
+{
+    std::stringstream src;
+    src<< sVertexHeader;
+    src<< "layout(location="<<FFATTRIB_POSITION<<") in vec4 ff_position;\n";
+    if(key.mHasNormal)
+        src<< "layout(location="<<FFATTRIB_NORMAL<<") in vec3 ff_normal;\n";
+    if(key.mHasPSize)
+        src<< "layout(location="<<FFATTRIB_PSIZE<<") in float ff_psize;\n";
+    if(key.mHasDiffuse)
+        src<< "layout(location="<<FFATTRIB_DIFFUSE<<") in vec4 ff_diffuse;\n";
+    if(key.mHasSpecular)
+        src<< "layout(location="<<FFATTRIB_SPECULAR<<") in vec4 ff_specular;\n";
+    for(UINT i = 0;i < 8;++i)
+    {
+        if(((key.mTexCoordSizes>>(i*3))&7))
+            src<< "layout(location="<<FFATTRIB_TEXCOORD0+i<<") in vec4 ff_texcoord"<<i<<";\n";
+    }
+    if(key.mLighting)
+    {
+        if(key.mSpecular)
+            src<< "#define FF_SPECULAR\n";
+        src<< sLightFuncs;
+    }
+
+    bool reflect = false;
+    for(const auto &stage : key.mStages)
+        reflect |= (stage.mGen == (D3DTSS_TCI_CAMERASPACEREFLECTIONVECTOR>>16) ||
+                    stage.mGen == (D3DTSS_TCI_SPHEREMAP>>16));
+
+    src<< "void main()\n"
+          "{\n";
+    src<< "    vec4 diffuse = "<<(key.mHasDiffuse ? "ff_diffuse" : "vec4(1.0)")<<";\n"
+          "    vec4 specular = "<<(key.mHasSpecular ? "ff_specular" : "vec4(0.0)")<<";\n"
+          "    float psize = "<<(key.mHasPSize ? "ff_psize" : "PointParams.x")<<";\n";
+    if(key.mTransformed)
+    {
+        // Back to clip space from the viewport, so it goes through the same
+        // fixup as everything else.
+        src<< "    float w = (ff_position.w != 0.0) ? 1.0/ff_position.w : 1.0;\n"
+              "    gl_Position = vec4(ff_position.xyz*ScreenScale.xyz + ScreenOffset.xyz, 1.0) * w;\n"
+              "    for(int i = 0;i < 8;++i)\n"
+              "        gl_ClipDistance[i] = 1.0;\n";
+    }
+    else
+    {
+        // Clip planes are in world space without a shader.
+        src<< "    vec4 viewpos = WorldView * ff_position;\n"
+              "    gl_Position = WorldViewProj * ff_position;\n"
+              "    for(int i = 0;i < 8;++i)\n"
+              "        gl_ClipDistance[i] = dot(World * ff_position, ClipPlane[i]);\n";
+        src<< "    vec3 normal = "<<(key.mHasNormal ? "mat3(NormalMatrix) * ff_normal" : "vec3(0.0)")<<";\n";
+        if(key.mHasNormal && key.mNormalize)
+            src<< "    if(dot(normal, normal) > 0.0) normal = normalize(normal);\n";
+        src<< "    vec3 eye = "<<(key.mLocalViewer ? "-normalize(viewpos.xyz)" : "vec3(0.0, 0.0, -1.0)")<<";\n";
+        if(reflect)
+            src<< "    vec3 reflvec = reflect(-eye, normal);\n";
+    }
+
+    if(key.mLighting)
+    {
+        src<< "    ff_amb = GlobalAmbient.rgb;\n"
+              "    ff_diff = vec3(0.0);\n"
+              "    ff_spec = vec3(0.0);\n";
+        for(UINT i = 0;i < key.mNumLights;++i)
+        {
+            DWORD type = (key.mLightTypes>>(i*2)) & 3;
+            if(type == D3DLIGHT_DIRECTIONAL)
+                src<< "    ff_directional(Lights["<<i<<"], normal, eye);\n";
+            else if(type == D3DLIGHT_POINT || type == D3DLIGHT_SPOT)
+                src<< "    ff_point(Lights["<<i<<"], viewpos.xyz, normal, eye, "<<
+                      ((type == D3DLIGHT_SPOT) ? "true" : "false")<<");\n";
+        }
+        src<< "    vec4 mdiff = "<<GetMaterialSource(key.mDiffuseSource, "MaterialDiffuse")<<";\n"
+              "    vec4 mamb = "<<GetMaterialSource(key.mAmbientSource, "MaterialAmbient")<<";\n"
+              "    vec4 mspec = "<<GetMaterialSource(key.mSpecularSource, "MaterialSpecular")<<";\n"
+              "    vec4 memis = "<<GetMaterialSource(key.mEmissiveSource, "MaterialEmissive")<<";\n"
+              "    diffuse = vec4(memis.rgb + mamb.rgb*ff_amb + mdiff.rgb*ff_diff, mdiff.a);\n"
+              "    specular = vec4(mspec.rgb*ff_spec, mspec.a);\n";
+    }
+
+    if(key.mFogMode != D3DFOG_NONE)
+    {
+        src<< "    float fogz = "<<(key.mRangeFog ? "length(viewpos.xyz)" : "abs(viewpos.z)")<<";\n";
+        if(key.mFogMode == D3DFOG_LINEAR)
+            src<< "    specular.a = (FogParams.y - fogz) * FogParams.w;\n";
+        else if(key.mFogMode == D3DFOG_EXP)
+            src<< "    specular.a = exp(-FogParams.z * fogz);\n";
+        else
+            src<< "    specular.a = exp(-(FogParams.z*fogz) * (FogParams.z*fogz));\n";
+    }
+
+    for(UINT i = 0;i < 8;++i)
+    {
+        const auto &stage = key.mStages[i];
+        UINT size = (key.mTexCoordSizes>>(stage.mIndex*3)) & 7;
+        std::stringstream coord;
+        switch(stage.mGen)
+        {
+            case D3DTSS_TCI_CAMERASPACENORMAL>>16:
+                coord<< "vec4(normal, 1.0)";
+                break;
+            case D3DTSS_TCI_CAMERASPACEPOSITION>>16:
+                coord<< "vec4(viewpos.xyz, 1.0)";
+                break;
+            case D3DTSS_TCI_CAMERASPACEREFLECTIONVECTOR>>16:
+                coord<< "vec4(reflvec, 1.0)";
+                break;
+            case D3DTSS_TCI_SPHEREMAP>>16:
+                coord<< "vec4(reflvec.xy / (2.0*length(reflvec + vec3(0.0, 0.0, 1.0))) + 0.5, 0.0, 1.0)";
+                break;
+            default:
+                if(!size)
+                    coord<< "vec4(0.0, 0.0, 0.0, 1.0)";
+                else if(stage.mTransform)
+                    coord<< ExpandTexCoord(stage.mIndex, size);
+                else
+                    coord<< "ff_texcoord"<<stage.mIndex;
+                break;
+        }
+        if(stage.mTransform)
+            src<< "    vs_output["<<i<<"] = TexMatrix["<<i<<"] * "<<coord.str()<<";\n";
+        else
+            src<< "    vs_output["<<i<<"] = "<<coord.str()<<";\n";
+    }
+
+    if(key.mPointScale && !key.mTransformed)
+        src<< "    float pdist = length(viewpos.xyz);\n"
+              "    psize *= PointParams.w * inversesqrt(max(dot(PointScale.xyz, vec3(1.0, pdist, pdist*pdist)), 1e-8));\n";
+
+    src<< "    vs_output[8] = clamp(diffuse, 0.0, 1.0);\n"
+          "    vs_output[9] = clamp(specular, 0.0, 1.0);\n"
+          "    gl_PointSize = clamp(psize, PointParams.y, PointParams.z);\n"
+          "    gl_Position.xy = gl_Position.xy*vec2(1.0,-1.0) + POS_FIXUP.xy*gl_Position.ww;\n"
+          "    gl_Position.z = gl_Position.z*2.0 - gl_Position.w;\n"
+          "}\n";
+    return src.str();
+}
+
+
+const char sPixelHeader[] =
+"#version 330\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"layout(std140) uniform ffp_fragment {\n"
+"    vec4 TextureFactor;\n"
+"    vec4 FogColor;\n"
+"    vec4 FogParams;\n"
+"    vec4 StageConstant[8];\n"
+"};\n"
+"layout(location=0) in vec4 ps_input[10];\n"
+"layout(location=0) out vec4 ff_color;\n";
+
+std::string GetStageArg(DWORD arg, UINT stage)
+{
+    std::stringstream sstr;
+    switch(arg&D3DTA_SELECTMASK)
+    {
+        case D3DTA_DIFFUSE: sstr<< "diffuse"; break;
+        case D3DTA_CURRENT: sstr<< "current"; break;
+        case D3DTA_TEXTURE: sstr<< "tex"; break;
+        case D3DTA_TFACTOR: sstr<< "TextureFactor"; break;
+        case D3DTA_SPECULAR: sstr<< "specular"; break;
+        case D3DTA_TEMP: sstr<< "temp"; break;
+        case D3DTA_CONSTANT: sstr<< "StageConstant["<<stage<<"]"; break;
+        default:
+            FIXME("Unhandled stage argument 0x%lx\n", arg);
+            sstr<< "current";
+            break;
+    }
+    if((arg&D3DTA_ALPHAREPLICATE))
+        sstr<< ".aaaa";
+    std::string ret = sstr.str();
+    if((arg&D3DTA_COMPLEMENT))
+        ret = "(vec4(1.0) - "+ret+")";
+    return ret;
+}
+
+bool UsesTexture(DWORD op, DWORD arg1, DWORD arg2, DWORD arg0)
+{
+    if(op == D3DTOP_BLENDTEXTUREALPHA || op == D3DTOP_BLENDTEXTUREALPHAPM)
+        return true;
+    return (arg1&D3DTA_SELECTMASK) == D3DTA_TEXTURE || (arg2&D3DTA_SELECTMASK) == D3DTA_TEXTURE ||
+           ((op == D3DTOP_MULTIPLYADD || op == D3DTOP_LERP) && (arg0&D3DTA_SELECTMASK) == D3DTA_TEXTURE);
+}
+
+// The stage operation as a vec4, for taking the rgb or alpha from.
+std::string GetStageOp(DWORD op, const std::string &a1, const std::string &a2, const std::string &a0)
+{
+    switch(op)
+    {
+        case D3DTOP_SELECTARG1: return a1;
+        case D3DTOP_SELECTARG2: return a2;
+        case D3DTOP_MODULATE: return a1+"*"+a2;
+        case D3DTOP_MODULATE2X: return a1+"*"+a2+"*2.0";
+        case D3DTOP_MODULATE4X: return a1+"*"+a2+"*4.0";
+        case D3DTOP_ADD: return a1+" + "+a2;
+        case D3DTOP_ADDSIGNED: return a1+" + "+a2+" - vec4(0.5)";
+        case D3DTOP_ADDSIGNED2X: return "("+a1+" + "+a2+" - vec4(0.5))*2.0";
+        case D3DTOP_SUBTRACT: return a1+" - "+a2;
+        case D3DTOP_ADDSMOOTH: return a1+" + "+a2+"*(vec4(1.0) - "+a1+")";
+        case D3DTOP_BLENDDIFFUSEALPHA: return "mix("+a2+", "+a1+", diffuse.a)";
+        case D3DTOP_BLENDTEXTUREALPHA: return "mix("+a2+", "+a1+", tex.a)";
+        case D3DTOP_BLENDFACTORALPHA: return "mix("+a2+", "+a1+", TextureFactor.a)";
+        case D3DTOP_BLENDTEXTUREALPHAPM: return a1+" + "+a2+"*(1.0 - tex.a)";
+        case D3DTOP_BLENDCURRENTALPHA: return "mix("+a2+", "+a1+", current.a)";
+        case D3DTOP_MODULATEALPHA_ADDCOLOR: return a1+" + "+a1+".aaaa*"+a2;
+        case D3DTOP_MODULATECOLOR_ADDALPHA: return a1+"*"+a2+" + "+a1+".aaaa";
+        case D3DTOP_MODULATEINVALPHA_ADDCOLOR: return "(1.0 - "+a1+".a)*"+a2+" + "+a1;
+        case D3DTOP_MODULATEINVCOLOR_ADDALPHA: return "(vec4(1.0) - "+a1+")*"+a2+" + "+a1+".aaaa";
+        case D3DTOP_DOTPRODUCT3: return "vec4(4.0*dot(("+a1+" - vec4(0.5)).rgb, ("+a2+" - vec4(0.5)).rgb))";
+        case D3DTOP_MULTIPLYADD: return a0+" + "+a1+"*"+a2;
+        case D3DTOP_LERP: return "mix("+a2+", "+a1+", "+a0+")";
+    }
+    FIXME("Unhandled stage op %lu\n", op);
+    return "current";
+}
+
+std::string GenerateSampler(UINT stage, DWORD textype, DWORD projected, DWORD coordidx)
+{
+    std::stringstream sstr, coord;
+    coord<< "ps_input["<<coordidx<<"]";
+    sstr<< "ff_sampler"<<stage;
+    std::string name = sstr.str();
+    if(textype == FFTEX_CUBE)
+        return "texture("+name+", "+coord.str()+".xyz)";
+    if(textype == FFTEX_SHADOW)
+    {
+        if(projected == 4)
+            return "vec4(textureProj("+name+", "+coord.str()+"))";
+        return "vec4(texture("+name+", "+coord.str()+".xyz))";
+    }
+    if(projected == 4)
+        return "textureProj("+name+", "+coord.str()+")";
+    if(projected == 3)
+        return "textureProj("+name+", "+coord.str()+".xyz)";
+    return "texture("+name+", "+coord.str()+".xy)";
+}
+
+std::string GeneratePixelGLSL(const FFPixelKey &key)
+{
+    std::stringstream src, body;
+    src<< sPixelHeader;
+    body<< "void main()\n"
+           "{\n"
+           "    vec4 diffuse = ps_input[8];\n"
+           "    vec4 specular = ps_input[9];\n"
+           "    vec4 current = diffuse;\n"
+           "    vec4 temp = vec4(0.0);\n";
+    for(UINT i = 0;i < 8 && key.mStages[i].mColorOp > D3DTOP_DISABLE;++i)
+    {
+        const auto &stage = key.mStages[i];
+        body<< "    {\n";
+        if(stage.mTexType != FFTEX_NONE &&
+           (UsesTexture(stage.mColorOp, stage.mColorArg1, stage.mColorArg2, stage.mColorArg0) ||
+            (stage.mAlphaOp != D3DTOP_DISABLE &&
+             UsesTexture(stage.mAlphaOp, stage.mAlphaArg1, stage.mAlphaArg2, stage.mAlphaArg0))))
+        {
+            static const char *const sSamplerTypes[] = { "", "sampler2D", "samplerCube", "sampler2DShadow" };
+            src<< "uniform "<<sSamplerTypes[stage.mTexType]<<" ff_sampler"<<i<<";\n";
+            body<< "        vec4 tex = "<<GenerateSampler(i, stage.mTexType, stage.mProjected, stage.mTexCoord)<<";\n";
+        }
+        else
+            body<< "        vec4 tex = vec4(1.0);\n";
+
+        std::string color = GetStageOp(stage.mColorOp, GetStageArg(stage.mColorArg1, i),
+                                       GetStageArg(stage.mColorArg2, i), GetStageArg(stage.mColorArg0, i));
+        body<< "        vec4 res;\n";
+        if(stage.mColorOp == D3DTOP_DOTPRODUCT3)
+            body<< "        res = clamp("<<color<<", 0.0, 1.0);\n";
+        else
+        {
+            body<< "        res.rgb = clamp(("<<color<<").rgb, 0.0, 1.0);\n";
+            if(stage.mAlphaOp == D3DTOP_DISABLE)
+                body<< "        res.a = current.a;\n";
+            else
+            {
+                std::string alpha = GetStageOp(stage.mAlphaOp, GetStageArg(stage.mAlphaArg1, i),
+                    GetStageArg(stage.mAlphaArg2, i), GetStageArg(stage.mAlphaArg0, i));
+                body<< "        res.a = clamp(("<<alpha<<").a, 0.0, 1.0);\n";
+            }
+        }
+        body<< "        "<<(stage.mResultTemp ? "temp" : "current")<<" = res;\n"
+               "    }\n";
+    }
+
+    if(key.mSpecular)
+        body<< "    current.rgb = clamp(current.rgb + specular.rgb, 0.0, 1.0);\n";
+    if(key.mFogMode != FFFOG_NONE)
+    {
+        if(key.mFogMode == FFFOG_VERTEX)
+            body<< "    float fog = specular.a;\n";
+        else
+        {
+            body<< "    float fogz = "<<(key.mWFog ? "1.0/gl_FragCoord.w" : "gl_FragCoord.z")<<";\n";
+            if(key.mFogMode == FFFOG_LINEAR)
+                body<< "    float fog = (FogParams.y - fogz) * FogParams.w;\n";
+            else if(key.mFogMode == FFFOG_EXP)
+                body<< "    float fog = exp(-FogParams.z * fogz);\n";
+            else
+                body<< "    float fog = exp(-(FogParams.z*fogz) * (FogParams.z*fogz));\n";
+        }
+        body<< "    current.rgb = mix(FogColor.rgb, current.rgb, clamp(fog, 0.0, 1.0));\n";
+    }
+    body<< "    ff_color = current;\n"
+           "}\n";
+
+    src<< body.str();
+    return src.str();
+}
+
+
+void BindBlockGL(GLuint program, const char *name, GLuint binding, CommandStreamWriter *stream)
+{
+    GLuint idx = glGetUniformBlockIndex(program, name);
+    if(idx != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, idx, binding);
+    if(stream)
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, binding}, name, strlen(name)+1);
+}
+
+// Gets the program from the shader cache, or builds it from the source.
+GLuint CreateProgramGL(GLenum type, const std::vector<DWORD> &code, const std::string &source,
+                       CommandStreamWriter *stream)
+{
+    // Recordings need the GLSL source to recreate the program, which a cached
+    // one doesn't have.
+    GLuint program = 0;
+    ShaderVariant variant;
+    memset(&variant, 0, sizeof(variant));
+    ShaderReflection refl;
+    if(!stream)
+        program = ShaderCache::loadProgramGL(type, code, variant, refl);
+    if(program)
+    {
+        TRACE("Loaded cached fixed-function program 0x%x\n", program);
+        return program;
+    }
+
+    TRACE("Generated fixed-function shader:\n----\n%s\n----\n", source.c_str());
+    program = ShaderCache::createProgramGL(type, source.c_str());
+    checkGLError();
+    if(!program)
+    {
+        FIXME("Failed to create fixed-function program\n");
+        return 0;
+    }
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE)
+    {
+        GLint logLen = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        FIXME("Fixed-function program not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+              log.data(), source.c_str());
+
+        glDeleteProgram(program);
+        checkGLError();
+        return 0;
+    }
+
+    if(stream)
+        stream->write(StreamOp::ProgramCreate, StreamProgram{program, type},
+                      source.c_str(), source.length()+1);
+    else
+        ShaderCache::storeProgramGL(type, code, variant, program, refl);
+    return program;
+}
+
+
+class BuildFFVertexCmd : public Command {
+    FFShaderCache *mTarget;
+    const FFVertexKey *mKey;
+    GLuint *mProgram;
+
+public:
+    BuildFFVertexCmd(FFShaderCache *target, const FFVertexKey *key, GLuint *program)
+      : mTarget(target), mKey(key), mProgram(program) { }
+
+    virtual ULONG execute()
+    {
+        *mProgram = mTarget->buildVertexProgramGL(*mKey);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class BuildFFPixelCmd : public Command {
+    FFShaderCache *mTarget;
+    const FFPixelKey *mKey;
+    GLuint *mProgram;
+
+public:
+    BuildFFPixelCmd(FFShaderCache *target, const FFPixelKey *key, GLuint *program)
+      : mTarget(target), mKey(key), mProgram(program) { }
+
+    virtual ULONG execute()
+    {
+        *mProgram = mTarget->buildPixelProgramGL(*mKey);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+} // namespace
+
+
+GLint GetFFAttribLocation(BYTE usage, BYTE index)
+{
+    switch(usage)
+    {
+        case D3DDECLUSAGE_POSITION:
+        case D3DDECLUSAGE_POSITIONT:
+            return (index == 0) ? FFATTRIB_POSITION : -1;
+        case D3DDECLUSAGE_NORMAL:
+            return (index == 0) ? FFATTRIB_NORMAL : -1;
+        case D3DDECLUSAGE_PSIZE:
+            return (index == 0) ? FFATTRIB_PSIZE : -1;
+        case D3DDECLUSAGE_COLOR:
+            return (index == 0) ? FFATTRIB_DIFFUSE : (index == 1) ? FFATTRIB_SPECULAR : -1;
+        case D3DDECLUSAGE_TEXCOORD:
+            return (index < 8) ? FFATTRIB_TEXCOORD0+index : -1;
+    }
+    return -1;
+}
+
+
+GLuint FFShaderCache::getVertexProgram(const FFVertexKey &key)
+{
+    auto iter = mVertexPrograms.find(key);
+    if(iter == mVertexPrograms.end())
+    {
+        iter = mVertexPrograms.insert(std::make_pair(key, 0u)).first;
+        mQueue.waitFence(mQueue.doSend<BuildFFVertexCmd>(this, &iter->first, &iter->second));
+    }
+    return iter->second;
+}
+
+GLuint FFShaderCache::getPixelProgram(const FFPixelKey &key)
+{
+    auto iter = mPixelPrograms.find(key);
+    if(iter == mPixelPrograms.end())
+    {
+        iter = mPixelPrograms.insert(std::make_pair(key, 0u)).first;
+        mQueue.waitFence(mQueue.doSend<BuildFFPixelCmd>(this, &iter->first, &iter->second));
+    }
+    return iter->second;
+}
+
+
+GLuint FFShaderCache::buildVertexProgramGL(const FFVertexKey &key)
+{
+    CommandStreamWriter *stream = mQueue.getRecorder();
+    GLuint program = CreateProgramGL(GL_VERTEX_SHADER, MakeCacheCode(sVertexMagic, key),
+                                     GenerateVertexGLSL(key), stream);
+    if(!program)
+        return 0;
+
+    BindBlockGL(program, "pos_fixup", POSFIXUP_BINDING_IDX, stream);
+    BindBlockGL(program, "vertex_state", VTXSTATE_BINDING_IDX, stream);
+    BindBlockGL(program, "ffp_vertex", FFVS_BINDING_IDX, stream);
+    checkGLError();
+
+    TRACE("Created fixed-function vertex program 0x%x\n", program);
+    return program;
+}
+
+GLuint FFShaderCache::buildPixelProgramGL(const FFPixelKey &key)
+{
+    CommandStreamWriter *stream = mQueue.getRecorder();
+    GLuint program = CreateProgramGL(GL_FRAGMENT_SHADER, MakeCacheCode(sPixelMagic, key),
+                                     GeneratePixelGLSL(key), stream);
+    if(!program)
+        return 0;
+
+    BindBlockGL(program, "ffp_fragment", FFPS_BINDING_IDX, stream);
+    // Stages sample from the unit of the same index.
+    for(GLuint i = 0;i < 8;++i)
+    {
+        std::stringstream sstr;
+        sstr<< "ff_sampler"<<i;
+        std::string name = sstr.str();
+        GLint loc = glGetUniformLocation(program, name.c_str());
+        if(loc == -1)
+            continue;
+        glProgramUniform1i(program, loc, i);
+        if(stream)
+            stream->write(StreamOp::ProgramSampler, StreamProgram{program, i}, name.c_str(),
+                          name.length()+1);
+    }
+    checkGLError();
+
+    TRACE("Created fixed-function fragment program 0x%x\n", program);
+    return program;
+}
+
+void FFShaderCache::deinitGL()
+{
+    for(auto &entry : mVertexPrograms)
+    {
+        if(entry.second)
+            glDeleteProgram(entry.second);
+    }
+    mVertexPrograms.clear();
+    for(auto &entry : mPixelPrograms)
+    {
+        if(entry.second)
+            glDeleteProgram(entry.second);
+    }
+    mPixelPrograms.clear();
+}
@@ -0,0 +1,108 @@
+
+#include "framebuffercache.hpp"
+
+#include <cstring>
+
+#include "trace.hpp"
+
+
+bool GLFramebufferDesc::operator==(const GLFramebufferDesc &rhs) const
+{ return memcmp(this, &rhs, sizeof(*this)) == 0; }
+
+size_t FramebufferCache::Hasher::operator()(const GLFramebufferDesc &desc) const
+{
+    static_assert(sizeof(GLFramebufferDesc)%sizeof(DWORD) == 0, "Unexpected GLFramebufferDesc size");
+
+    DWORD vals[sizeof(desc)/sizeof(DWORD)];
+    memcpy(vals, &desc, sizeof(desc));
+
+    size_t hash = 2166136261u;
+    for(DWORD val : vals)
+    {
+        hash ^= val;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+namespace
+{
+
+void attachGL(GLuint fbo, GLenum attachment, const GLFBAttachment &image)
+{
+    if(image.mId == 0)
+        return;
+    if(image.mTarget == GL_RENDERBUFFER)
+        glNamedFramebufferRenderbufferEXT(fbo, attachment, GL_RENDERBUFFER, image.mId);
+    else
+        glNamedFramebufferTexture2DEXT(fbo, attachment, image.mTarget, image.mId, image.mLevel);
+}
+
+bool usesImage(const GLFBAttachment &image, bool renderbuffer, GLuint id)
+{
+    return image.mId == id && (image.mTarget == GL_RENDERBUFFER) == renderbuffer;
+}
+
+} // namespace
+
+GLuint FramebufferCache::createGL(const GLFramebufferDesc &desc)
+{
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    for(GLuint i = 0;i < 4;++i)
+        attachGL(fbo, GL_COLOR_ATTACHMENT0+i, desc.mColor[i]);
+    attachGL(fbo, desc.mDepthAttachment, desc.mDepth);
+
+    static const GLenum buffers[4]{
+        GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+        GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3
+    };
+    glFramebufferDrawBuffersEXT(fbo, 4, buffers);
+    checkGLError();
+
+    mFramebuffers.insert(std::make_pair(desc, fbo));
+    return fbo;
+}
+
+
+void FramebufferCache::deinitGL()
+{
+    for(auto &entry : mFramebuffers)
+        glDeleteFramebuffers(1, &entry.second);
+    mFramebuffers.clear();
+}
+
+GLuint FramebufferCache::getGL(const GLFramebufferDesc &desc)
+{
+    auto iter = mFramebuffers.find(desc);
+    if(iter != mFramebuffers.end())
+        return iter->second;
+
+    if(mFramebuffers.size() >= sMaxFramebuffers)
+    {
+        TRACE("Purging %u framebuffers\n", mFramebuffers.size());
+        deinitGL();
+    }
+    return createGL(desc);
+}
+
+void FramebufferCache::forgetGL(bool renderbuffer, GLuint id)
+{
+    auto iter = mFramebuffers.begin();
+    while(iter != mFramebuffers.end())
+    {
+        const GLFramebufferDesc &desc = iter->first;
+        bool used = usesImage(desc.mDepth, renderbuffer, id);
+        for(GLuint i = 0;i < 4 && !used;++i)
+            used = usesImage(desc.mColor[i], renderbuffer, id);
+        if(!used)
+        {
+            ++iter;
+            continue;
+        }
+
+        glDeleteFramebuffers(1, &iter->second);
+        iter = mFramebuffers.erase(iter);
+    }
+}
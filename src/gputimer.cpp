@@ -0,0 +1,160 @@
+
+#include "gputimer.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+
+unsigned int GPUTimingInterval = 0;
+
+
+GPUTimer::GPUTimer()
+  : mLastSwap(0)
+  , mFrames(0)
+  , mPasses(0)
+  , mGPUTime(0.0)
+  , mGPUMax(0.0)
+  , mInterval(0.0)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    mFrequency = freq.QuadPart;
+}
+
+
+void GPUTimer::counterGL()
+{
+    if(mFreeNames.empty())
+    {
+        mFreeNames.resize(16);
+        glGenQueries(mFreeNames.size(), mFreeNames.data());
+    }
+    GLuint name = mFreeNames.back();
+    mFreeNames.pop_back();
+
+    glQueryCounter(name, GL_TIMESTAMP);
+    checkGLError();
+    mCurrent.mStamps.push_back(name);
+}
+
+void GPUTimer::stampGL()
+{
+    // Passes past the limit are counted with the last one.
+    if(!mCurrent.mStamps.empty() && mCurrent.mStamps.size() < sMaxPasses)
+        counterGL();
+}
+
+void GPUTimer::endFrameGL()
+{
+    if(!GPUTimingInterval || mCurrent.mStamps.empty())
+        return;
+    counterGL();
+
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    mCurrent.mInterval = (count.QuadPart-mLastSwap) * 1000.0 / mFrequency;
+
+    mPending.push_back(std::move(mCurrent));
+    mCurrent.mStamps.clear();
+
+    resolveGL(mPending.size() > sMaxPending);
+}
+
+void GPUTimer::beginFrameGL()
+{
+    if(!GPUTimingInterval)
+        return;
+
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    mLastSwap = count.QuadPart;
+    counterGL();
+}
+
+
+void GPUTimer::resolveGL(bool wait)
+{
+    while(!mPending.empty())
+    {
+        Frame &frame = mPending.front();
+
+        // Timestamps finish in order, so once the frame's last one is
+        // available, they all are.
+        if(!wait)
+        {
+            GLuint avail = GL_FALSE;
+            glGetQueryObjectuiv(frame.mStamps.back(), GL_QUERY_RESULT_AVAILABLE, &avail);
+            if(!avail) break;
+        }
+        wait = false;
+
+        mScratch.resize(frame.mStamps.size());
+        for(size_t i = 0;i < frame.mStamps.size();++i)
+            glGetQueryObjectui64v(frame.mStamps[i], GL_QUERY_RESULT, &mScratch[i]);
+        checkGLError();
+
+        size_t passes = mScratch.size()-1;
+        if(mPassTime.size() < passes)
+        {
+            mPassTime.resize(passes, 0.0);
+            mPassCount.resize(passes, 0);
+        }
+        for(size_t i = 0;i < passes;++i)
+        {
+            mPassTime[i] += (mScratch[i+1]-mScratch[i]) / 1000000.0;
+            ++mPassCount[i];
+        }
+
+        double gputime = (mScratch.back()-mScratch.front()) / 1000000.0;
+        mGPUTime += gputime;
+        mGPUMax = std::max(mGPUMax, gputime);
+        mInterval += frame.mInterval;
+        mPasses += passes;
+        ++mFrames;
+
+        mFreeNames.insert(mFreeNames.end(), frame.mStamps.begin(), frame.mStamps.end());
+        mPending.pop_front();
+
+        if(mFrames >= GPUTimingInterval)
+            report();
+    }
+}
+
+void GPUTimer::report()
+{
+    log_printf(LogFile, "GPU timing for %lu frames:\n"
+        "  gpu frame:     %.3fms avg, %.3fms max\n"
+        "  swap interval: %.3fms avg\n"
+        "  passes:        %.1f per frame\n",
+        mFrames, mGPUTime/mFrames, mGPUMax, mInterval/mFrames, (double)mPasses/mFrames
+    );
+    for(size_t i = 0;i < mPassTime.size();++i)
+    {
+        if(mPassCount[i] > 0)
+            log_printf(LogFile, "  pass %u: %.3fms avg, in %lu frames\n", (unsigned int)i,
+                       mPassTime[i]/mPassCount[i], mPassCount[i]);
+    }
+
+    mFrames = 0;
+    mPasses = 0;
+    mGPUTime = 0.0;
+    mGPUMax = 0.0;
+    mInterval = 0.0;
+    mPassTime.clear();
+    mPassCount.clear();
+}
+
+void GPUTimer::deinitGL()
+{
+    for(Frame &frame : mPending)
+        mFreeNames.insert(mFreeNames.end(), frame.mStamps.begin(), frame.mStamps.end());
+    mPending.clear();
+    mFreeNames.insert(mFreeNames.end(), mCurrent.mStamps.begin(), mCurrent.mStamps.end());
+    mCurrent.mStamps.clear();
+
+    if(!mFreeNames.empty())
+        glDeleteQueries(mFreeNames.size(), mFreeNames.data());
+    mFreeNames.clear();
+    checkGLError();
+}
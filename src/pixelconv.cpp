@@ -0,0 +1,130 @@
+
+#include "pixelconv.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace
+{
+
+void convertR8G8B8(GLubyte *dst, const GLubyte *src, size_t count)
+{
+    // Four pixels fit exactly in three 32-bit words, which get shifted apart
+    // into four.
+    for(;count >= 4;count -= 4)
+    {
+        uint32_t in[3], out[4];
+        memcpy(in, src, sizeof(in));
+        out[0] = 0xff000000 | in[0];
+        out[1] = 0xff000000 | (in[0]>>24) | (in[1]<<8);
+        out[2] = 0xff000000 | (in[1]>>16) | (in[2]<<16);
+        out[3] = 0xff000000 | (in[2]>>8);
+        memcpy(dst, out, sizeof(out));
+        src += 12;
+        dst += 16;
+    }
+    for(;count > 0;--count)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0xff;
+        src += 3;
+        dst += 4;
+    }
+}
+
+inline GLubyte expand3(unsigned int val) { return GLubyte((val*0x49)>>1); }
+inline GLubyte expand2(unsigned int val) { return GLubyte(val*0x55); }
+inline GLubyte expand4(unsigned int val) { return GLubyte(val*0x11); }
+
+void convertA8R3G3B2(GLubyte *dst, const GLubyte *src, size_t count)
+{
+#ifdef HAVE_SSE2
+    const __m128i mask3 = _mm_set1_epi16(7);
+    const __m128i mask2 = _mm_set1_epi16(3);
+    for(;count >= 8;count -= 8)
+    {
+        __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i r = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(val, 5), mask3),
+                                                   _mm_set1_epi16(0x49)), 1);
+        __m128i g = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(val, 2), mask3),
+                                                   _mm_set1_epi16(0x49)), 1);
+        __m128i b = _mm_mullo_epi16(_mm_and_si128(val, mask2), _mm_set1_epi16(0x55));
+        __m128i a = _mm_srli_epi16(val, 8);
+
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        __m128i ra = _mm_or_si128(r, _mm_slli_epi16(a, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+16), _mm_unpackhi_epi16(bg, ra));
+        src += 16;
+        dst += 32;
+    }
+#endif
+    for(;count > 0;--count)
+    {
+        dst[0] = expand2(src[0]&3);
+        dst[1] = expand3((src[0]>>2)&7);
+        dst[2] = expand3(src[0]>>5);
+        dst[3] = src[1];
+        src += 2;
+        dst += 4;
+    }
+}
+
+void convertA4L4(GLubyte *dst, const GLubyte *src, size_t count)
+{
+#ifdef HAVE_SSE2
+    const __m128i mask4 = _mm_set1_epi8(0x0f);
+    for(;count >= 16;count -= 16)
+    {
+        __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i l = _mm_and_si128(val, mask4);
+        __m128i a = _mm_and_si128(_mm_srli_epi16(val, 4), mask4);
+        // Nibbles shifted up a nibble stay within their own byte.
+        l = _mm_or_si128(l, _mm_slli_epi16(l, 4));
+        a = _mm_or_si128(a, _mm_slli_epi16(a, 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi8(l, a));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+16), _mm_unpackhi_epi8(l, a));
+        src += 16;
+        dst += 32;
+    }
+#endif
+    for(;count > 0;--count)
+    {
+        dst[0] = expand4(src[0]&15);
+        dst[1] = expand4(src[0]>>4);
+        src += 1;
+        dst += 2;
+    }
+}
+
+} // namespace
+
+
+const PixelConverter ConvertR8G8B8{ 4, convertR8G8B8 };
+const PixelConverter ConvertA8R3G3B2{ 4, convertA8R3G3B2 };
+const PixelConverter ConvertA4L4{ 2, convertA4L4 };
+
+
+void PixelConverter::convertBox(GLubyte *dst, UINT dstpitch, UINT dstslice, const GLubyte *src, UINT srcpitch,
+                                UINT srcslice, UINT width, UINT height, UINT depth) const
+{
+    for(UINT z = 0;z < depth;++z)
+    {
+        GLubyte *dstrow = dst + z*dstslice;
+        const GLubyte *srcrow = src + z*srcslice;
+        for(UINT y = 0;y < height;++y)
+        {
+            convert(dstrow, srcrow, width);
+            dstrow += dstpitch;
+            srcrow += srcpitch;
+        }
+    }
+}
@@ -2,99 +2,182 @@
 #include "pixelshader.hpp"
 
 #include <sstream>
+#include <algorithm>
+#include <cstring>
 
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
+#include "shadercompiler.hpp"
+#include "shaderarena.hpp"
 #include "private_iids.hpp"
 
 
-GLuint D3DGLPixelShader::compileShaderGL(UINT shadowmask)
+GLuint PixelShaderCode::buildProgramGL(const ShaderVariant &key, std::string&& source,
+                                       CommandStreamWriter *stream)
 {
-    const MOJOSHADER_parseData *shader = nullptr;
-    GLuint program = 0;
+    if(source.empty())
+    {
+        MOJOSHADER_constants consts;
+        memcpy(consts.int4, key.mInts, sizeof(consts.int4));
+        consts.bools = key.mBools;
+
+        ShaderArena &arena = ShaderArena::get();
+        const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
+            reinterpret_cast<const unsigned char*>(mCode.data()),
+            mCode.size() * sizeof(decltype(mCode)::value_type),
+            nullptr, 0, key.mShadowSamplers, key.mFolded ? &consts : nullptr,
+            ShaderArena::allocate, ShaderArena::deallocate, &arena
+        );
+        if(shader->error_count > 0)
+        {
+            std::stringstream sstr;
+            for(int i = 0;i < shader->error_count;++i)
+                sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
+            ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
+            MOJOSHADER_freeParseData(shader);
+            arena.reset();
+            return 0;
+        }
+        if(mCode.size() != (std::size_t)shader->token_count)
+            ERR("Token count mismatch (previous: %u, now: %d)\n",
+                mCode.size(), shader->token_count);
+        TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
-    shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(mCode.data()),
-        mCode.size() * sizeof(decltype(mCode)::value_type),
-        nullptr, 0, shadowmask
-    );
-    if(shader->error_count > 0)
+        source = shader->output;
+        MOJOSHADER_freeParseData(shader);
+        arena.reset();
+    }
+
+    GLuint program = ShaderCache::createProgramGL(GL_FRAGMENT_SHADER, source.c_str());
+    checkGLError();
+    if(!program)
     {
-        std::stringstream sstr;
-        for(int i = 0;i < shader->error_count;++i)
-            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
-        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        goto done;
+        FIXME("Failed to create shader program\n");
+        return 0;
     }
-    if(mCode.size() != (std::size_t)shader->token_count)
-        ERR("Token count mismatch (previous: %u, now: %d)\n",
-            mCode.size(), shader->token_count);
-    TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
+    GLint logLen = 0;
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE)
     {
-        program = glCreateShaderProgramv(GL_FRAGMENT_SHADER, 1, &shader->output);
-        checkGLError();
-        if(!program)
-        {
-            FIXME("Failed to create shader program\n");
-            goto done;
-        }
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+              log.data(), source.c_str());
 
-        GLint logLen = 0;
-        GLint status = GL_FALSE;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-        if(status == GL_FALSE)
-        {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                  log.data(), shader->output);
+        glDeleteProgram(program);
+        checkGLError();
+        return 0;
+    }
 
-            glDeleteProgram(program);
-            program = 0;
-            checkGLError();
+    TRACE("Created fragment shader program 0x%x\n", program);
+    if(stream)
+        stream->write(StreamOp::ProgramCreate, StreamProgram{program, GL_FRAGMENT_SHADER},
+                      source.c_str(), source.length()+1);
 
-            goto done;
-        }
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+    if(logLen > 4)
+    {
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+             log.data(), source.c_str());
+    }
 
-        mPrograms.insert(std::make_pair(shadowmask, program));
-        TRACE("Created fragment shader program 0x%x\n", program);
+    return program;
+}
 
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-        if(logLen > 4)
+GLuint PixelShaderCode::compileShaderGL(const ShaderVariant &key, GLuint &slot, bool async)
+{
+    TIMELINE_SCOPE_GL("PixelShader::compileShaderGL");
+    CommandStreamWriter *stream = async ? nullptr : mParent->getQueue().getRecorder();
+
+    // Only the build without shadow samplers or folded constants uses the
+    // source from when the shader was created, so it's dropped once that's
+    // done.
+    std::string source;
+    if(!key.mShadowSamplers && !key.mFolded)
+        source.swap(mSource);
+
+    // Recordings need the GLSL source to recreate the program, which a cached
+    // one doesn't have.
+    GLuint program = 0;
+    if(!stream)
+    {
+        ShaderReflection cached;
+        program = ShaderCache::loadProgramGL(GL_FRAGMENT_SHADER, mCode, key, cached);
+    }
+    if(program)
+        TRACE("Loaded cached fragment shader program 0x%x\n", program);
+    else
+    {
+        program = buildProgramGL(key, std::move(source), stream);
+        if(!program)
         {
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                 log.data(), shader->output);
+            if(!async) --mPendingUpdates;
+            return 0;
         }
+        if(!stream)
+            ShaderCache::storeProgramGL(GL_FRAGMENT_SHADER, mCode, key, program, mReflection);
     }
+    slot = program;
 
     {
         GLuint v4f_idx = glGetUniformBlockIndex(program, "ps_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, PSF_BINDING_IDX);
+        GLuint v4i_idx = glGetUniformBlockIndex(program, "ps_ivec4");
+        if(v4i_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, v4i_idx, PSI_BINDING_IDX);
+        GLuint b_idx = glGetUniformBlockIndex(program, "ps_bool");
+        if(b_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, b_idx, PSB_BINDING_IDX);
+    }
+    if(stream)
+    {
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, PSF_BINDING_IDX}, "ps_vec4", sizeof("ps_vec4"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, PSI_BINDING_IDX}, "ps_ivec4", sizeof("ps_ivec4"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, PSB_BINDING_IDX}, "ps_bool", sizeof("ps_bool"));
     }
 
-    for(int i = 0;i < shader->sampler_count;++i)
+    for(const ShaderVariable &sampler : mReflection.mSamplers)
     {
-        GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
-        TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name,
-            shader->samplers[i].index, loc);
-        glProgramUniform1i(program, loc, shader->samplers[i].index);
+        GLint loc = glGetUniformLocation(program, sampler.mName.c_str());
+        TRACE("Got sampler %s:%u at location %d\n", sampler.mName.c_str(), sampler.mIndex, loc);
+        glProgramUniform1i(program, loc, sampler.mIndex);
+        if(stream)
+            stream->write(StreamOp::ProgramSampler, StreamProgram{program, GLenum(sampler.mIndex)},
+                          sampler.mName.c_str(), sampler.mName.length()+1);
     }
 
     checkGLError();
 
-done:
-    MOJOSHADER_freeParseData(shader);
-
-    --mPendingUpdates;
+    if(!async) --mPendingUpdates;
     return program;
 }
 
+class CompilePShaderCmd : public Command {
+    PixelShaderCode *mTarget;
+    ShaderVariant mKey;
+    GLuint *mSlot;
+
+public:
+    CompilePShaderCmd(PixelShaderCode *target, const ShaderVariant &key, GLuint *slot)
+      : mTarget(target), mKey(key), mSlot(slot) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->compileShaderGL(mKey, *mSlot, false);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
 
 class DeinitPShaderCmd : public Command {
     GLuint mProgram;
@@ -107,24 +190,104 @@ public:
         glDeleteProgram(mProgram);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::ProgramDelete, StreamValue{mProgram});
+    }
 };
 
 
-D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
+PixelShaderCode::PixelShaderCode(D3DGLDevice *parent, std::vector<DWORD>&& code, ShaderCodeInfo&& info)
   : mRefCount(0)
   , mParent(parent)
   , mPendingUpdates(0)
-  , mSamplerMask(0)
+  , mUpdateFence(0)
+  , mSamplerMask(info.mSamplerMask)
+  , mConstFStart(info.mConstFStart)
+  , mConstFEnd(info.mConstFEnd)
+  , mConstIMask(info.mConstIMask)
+  , mConstBMask(info.mConstBMask)
+  , mSpecializations(0)
+  , mSelected()
+  , mRequested()
+  , mReflection(std::move(info.mReflection))
+  , mSource(std::move(info.mSource))
+  , mCode(std::move(code))
+{
+}
+
+PixelShaderCode::~PixelShaderCode()
+{
+    waitBuilt();
+    for(auto &program : mPrograms)
+    {
+        if(program.second)
+            mParent->getQueue().send<DeinitPShaderCmd>(program.second);
+    }
+}
+
+void PixelShaderCode::startCompile(const ShaderVariant &key)
+{
+    ShaderCompiler &compiler = mParent->getShaderCompiler();
+    // The entry is made here so the build only fills it in, and never
+    // changes the map while it's being looked at.
+    GLuint &slot = mPrograms[key];
+    ++mPendingUpdates;
+    if(compiler.isActive())
+        compiler.queue([this, key, &slot]() -> void { compileShaderGL(key, slot, true); },
+                       mPendingUpdates);
+    else
+        mUpdateFence = mParent->getQueue().doSend<CompilePShaderCmd>(this, key, &slot);
+}
+
+void PixelShaderCode::waitBuilt()
+{
+    ShaderCompiler &compiler = mParent->getShaderCompiler();
+    if(compiler.isActive())
+        compiler.wait(mPendingUpdates);
+    else
+        mParent->getQueue().waitFence(mUpdateFence);
+}
+
+void PixelShaderCode::selectVariant(UINT shadowmask, const ShaderConstantsI &ints, UINT bools)
+{
+    ShaderVariant key = makeShaderVariant(shadowmask&mSamplerMask, mConstIMask, ints, mConstBMask, bools);
+    if(!mBuilds.empty() && mRequested == key)
+        return;
+
+    mRequested = key;
+    auto iter = std::find(mBuilds.begin(), mBuilds.end(), key);
+    if(iter == mBuilds.end() && key.mFolded && mSpecializations >= MaxShaderSpecializations)
+    {
+        TRACE("Pixel shader %p has too many constant sets, reading them from uniforms\n", this);
+        key = makeShaderVariant(key.mShadowSamplers, 0, ints, 0, 0);
+        iter = std::find(mBuilds.begin(), mBuilds.end(), key);
+    }
+    mSelected = key;
+    if(iter != mBuilds.end())
+        return;
+
+    TRACE("Building program for shadow sampler mask 0x%x, bools 0x%x\n", key.mShadowSamplers, key.mBools);
+    if(key.mFolded)
+        ++mSpecializations;
+    mBuilds.push_back(key);
+    startCompile(key);
+}
+
+
+D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
+  : mRefCount(0)
+  , mParent(parent)
+  , mCode(nullptr)
 {
     mParent->AddRef();
 }
 
 D3DGLPixelShader::~D3DGLPixelShader()
 {
-    if(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
-    for(auto &program : mPrograms)
-        mParent->getQueue().send<DeinitPShaderCmd>(program.second);
+    if(mCode)
+        mParent->getPixelShaderCodes().release(mCode);
+    mCode = nullptr;
     mParent->Release();
 }
 
@@ -140,8 +303,10 @@ bool D3DGLPixelShader::init(const DWORD *data)
           (((*data>>16)==0xfffe) ? "vertex" : ((*data>>16)==0xffff) ? "pixel" : "unknown"),
           (*data>>8)&0xff, *data&0xff, MOJOSHADER_PROFILE_GLSL330);
 
+    ShaderArena &arena = ShaderArena::get();
     const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0
+        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0, nullptr,
+        ShaderArena::allocate, ShaderArena::deallocate, &arena
     );
     if(shader->error_count > 0)
     {
@@ -150,45 +315,52 @@ bool D3DGLPixelShader::init(const DWORD *data)
             sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
         ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
         MOJOSHADER_freeParseData(shader);
+        arena.reset();
         return false;
     }
     // Save the tokens used
-    mCode.insert(mCode.end(), data, data+shader->token_count);
+    std::vector<DWORD> code(data, data+shader->token_count);
 
     TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
+    // The output is the program without shadow samplers, which is usually
+    // the first one built, so it's kept instead of parsing again for it.
+    ShaderCodeInfo info{0, 224, 0, 0, 0, ShaderReflection(), shader->output};
     for(int i = 0;i < shader->sampler_count;++i)
-        mSamplerMask |= 1<<shader->samplers[i].index;
-
-    MOJOSHADER_freeParseData(shader);
-
-    return true;
-}
-
-void D3DGLPixelShader::setProgram(GLuint pipeline, UINT shadowmask, bool force)
-{
-    CommandQueue &queue = mParent->getQueue();
-    while(mPendingUpdates > 0)
-        queue.wakeAndSleep();
-
-    shadowmask &= mSamplerMask;
-    auto iter = mPrograms.find(shadowmask);
-    if(iter != mPrograms.end())
     {
-        if(force || mShadowSamplers != shadowmask)
+        info.mSamplerMask |= 1<<shader->samplers[i].index;
+        info.mReflection.mSamplers.push_back(ShaderVariable{
+            0, UINT(shader->samplers[i].index), shader->samplers[i].name
+        });
+    }
+    for(int i = 0;i < shader->uniform_count;++i)
+    {
+        const MOJOSHADER_uniform &uniform = shader->uniforms[i];
+        if(uniform.type == MOJOSHADER_UNIFORM_INT || uniform.type == MOJOSHADER_UNIFORM_BOOL)
         {
-            mShadowSamplers = shadowmask;
-            queue.doSend<SetPShaderCmd>(pipeline, iter->second);
+            UINT &mask = (uniform.type == MOJOSHADER_UNIFORM_INT) ? info.mConstIMask : info.mConstBMask;
+            if(uniform.index >= 0 && uniform.index < 16)
+                mask |= 1<<uniform.index;
+            continue;
         }
+        if(uniform.type != MOJOSHADER_UNIFORM_FLOAT)
+            continue;
+        UINT count = std::max(uniform.array_count, 1);
+        info.mConstFStart = std::min<UINT>(info.mConstFStart, uniform.index);
+        info.mConstFEnd = std::min<UINT>(std::max<UINT>(info.mConstFEnd, uniform.index+count), 224);
     }
-    else
-    {
-        TRACE("Building program for shadow sampler mask 0x%x\n", shadowmask);
 
-        mShadowSamplers = shadowmask;
-        ++mPendingUpdates;
-        queue.doSend<CompileAndSetPShaderCmd>(this, pipeline, shadowmask);
-    }
+    // Bool and integer constants get folded into the programs, so the output
+    // would only be used if the shader falls back to reading them from
+    // uniforms.
+    if(info.mConstIMask || info.mConstBMask)
+        info.mSource = std::string();
+
+    MOJOSHADER_freeParseData(shader);
+    arena.reset();
+
+    mCode = mParent->getPixelShaderCodes().get(mParent, std::move(code), std::move(info));
+    return true;
 }
 
 
@@ -234,8 +406,9 @@ HRESULT D3DGLPixelShader::GetFunction(void *data, UINT *size)
 {
     TRACE("iface %p, data %p, size %p\n", this, data, size);
 
-    *size = mCode.size() * sizeof(decltype(mCode)::value_type);
+    const std::vector<DWORD> &code = mCode->getCode();
+    *size = code.size() * sizeof(DWORD);
     if(data)
-        memcpy(data, mCode.data(), mCode.size() * sizeof(decltype(mCode)::value_type));
+        memcpy(data, code.data(), code.size() * sizeof(DWORD));
     return D3D_OK;
 }
@@ -2,6 +2,7 @@
 #include "plainsurface.hpp"
 
 #include "trace.hpp"
+#include "timeline.hpp"
 #include "glformat.hpp"
 #include "device.hpp"
 #include "private_iids.hpp"
@@ -11,28 +12,27 @@
 D3DGLPlainSurface::D3DGLPlainSurface(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
-  , mPendingUpdates(0)
+  , mUpdateFence(0)
+  , mReadbackSerial(0)
   , mLock(LT_Unlocked)
 {
 }
 
 D3DGLPlainSurface::~D3DGLPlainSurface()
 {
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    mParent->getQueue().waitFence(mUpdateFence);
 }
 
 bool D3DGLPlainSurface::init(const D3DSURFACE_DESC *desc)
 {
     mDesc = *desc;
 
-    auto fmtinfo = gFormatList.find(mDesc.Format);
-    if(fmtinfo == gFormatList.end())
+    mGLFormat = FindGLFormat(mDesc.Format);
+    if(!mGLFormat)
     {
         ERR("Failed to find info for format %s\n", d3dfmt_to_str(mDesc.Format));
         return false;
     }
-    mGLFormat = &fmtinfo->second;
 
     mIsCompressed = (mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
                      mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
@@ -50,6 +50,13 @@ bool D3DGLPlainSurface::init(const D3DSURFACE_DESC *desc)
     return true;
 }
 
+void D3DGLPlainSurface::resolveReadback()
+{
+    if(ULONG serial = mReadbackSerial.exchange(0))
+        mUpdateFence = mParent->resolveReadback(serial);
+    mParent->getQueue().waitFence(mUpdateFence);
+}
+
 
 HRESULT D3DGLPlainSurface::QueryInterface(REFIID riid, void **obj)
 {
@@ -153,6 +160,7 @@ HRESULT D3DGLPlainSurface::GetDesc(D3DSURFACE_DESC *desc)
 HRESULT D3DGLPlainSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect, DWORD flags)
 {
     TRACE("iface %p, lockedRect %p, rect %p, flags 0x%lx\n", this, lockedRect, rect, flags);
+    TIMELINE_SCOPE("PlainSurface::LockRect");
 
     if(mDesc.Format == D3DFMT_NULL)
     {
@@ -190,8 +198,7 @@ HRESULT D3DGLPlainSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect
         }
     }
 
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    resolveReadback();
 
     GLubyte *memPtr = mBufData.get();
     mLockRegion = *rect;
@@ -216,6 +223,7 @@ HRESULT D3DGLPlainSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect
 HRESULT D3DGLPlainSurface::UnlockRect()
 {
     TRACE("iface %p\n", this);
+    TIMELINE_SCOPE("PlainSurface::UnlockRect");
 
     if(mLock == LT_Unlocked)
     {
@@ -5,106 +5,130 @@
 #include "private_iids.hpp"
 
 
-void D3DGLQuery::initGL()
+namespace
 {
-    glGenQueries(1, &mQueryId);
-    checkGLError();
-}
-class QueryInitCmd : public Command {
-    D3DGLQuery *mTarget;
+
+class BeginQueryCmd : public Command {
+    QueryPool &mPool;
+    UINT mSlot;
+    GLenum mTarget;
 
 public:
-    QueryInitCmd(D3DGLQuery *target) : mTarget(target) { }
+    BeginQueryCmd(QueryPool &pool, UINT slot, GLenum target)
+      : mPool(pool), mSlot(slot), mTarget(target)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->initGL();
+        mPool.beginGL(mSlot, mTarget);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
-class QueryDeinitCmd : public Command {
-    GLuint mQueryId;
+class EndQueryCmd : public Command {
+    QueryPool &mPool;
+    UINT mSlot;
+    GLenum mTarget;
+    ULONG mSerial;
 
 public:
-    QueryDeinitCmd(GLuint queryid) : mQueryId(queryid) { }
+    EndQueryCmd(QueryPool &pool, UINT slot, GLenum target, ULONG serial)
+      : mPool(pool), mSlot(slot), mTarget(target), mSerial(serial)
+    { }
 
     virtual ULONG execute()
     {
-        glDeleteQueries(1, &mQueryId);
-        checkGLError();
+        mPool.endGL(mSlot, mTarget, mSerial);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
-void D3DGLQuery::beginQueryGL()
-{
-    glBeginQuery(mQueryType, mQueryId);
-    checkGLError();
-}
-class BeginQueryCmd : public Command {
-    D3DGLQuery *mTarget;
+class QueryCounterCmd : public Command {
+    QueryPool &mPool;
+    UINT mSlot;
+    ULONG mSerial;
 
 public:
-    BeginQueryCmd(D3DGLQuery *target) : mTarget(target) { }
+    QueryCounterCmd(QueryPool &pool, UINT slot, ULONG serial)
+      : mPool(pool), mSlot(slot), mSerial(serial)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->beginQueryGL();
+        mPool.counterGL(mSlot, mSerial);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
-void D3DGLQuery::endQueryGL()
-{
-    glEndQuery(mQueryType);
-    checkGLError();
-}
-class EndQueryCmd : public Command {
-    D3DGLQuery *mTarget;
+class QueryEventCmd : public Command {
+    QueryPool &mPool;
+    UINT mSlot;
+    ULONG mSerial;
 
 public:
-    EndQueryCmd(D3DGLQuery *target) : mTarget(target) { }
+    QueryEventCmd(QueryPool &pool, UINT slot, ULONG serial)
+      : mPool(pool), mSlot(slot), mSerial(serial)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->endQueryGL();
+        mPool.eventGL(mSlot, mSerial);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
-void D3DGLQuery::queryDataGL()
-{
-    GLint avail = GL_FALSE;
-    glGetQueryObjectiv(mQueryId, GL_QUERY_RESULT_AVAILABLE, &avail);
-    if(avail)
-    {
-        glGetQueryObjectuiv(mQueryId, GL_QUERY_RESULT, &mQueryResult);
-        mState = Signaled;
-    }
-    --mPendingQueries;
-    checkGLError();
-}
-class QueryDataCmd : public Command {
-    D3DGLQuery *mTarget;
+class QueryCollectCmd : public Command {
+    QueryPool &mPool;
 
 public:
-    QueryDataCmd(D3DGLQuery *target) : mTarget(target) { }
+    QueryCollectCmd(QueryPool &pool) : mPool(pool) { }
 
     virtual ULONG execute()
     {
-        mTarget->queryDataGL();
+        mPool.collectGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
+bool GetGLQueryType(D3DQUERYTYPE type, GLenum &target)
+{
+    switch(type)
+    {
+        case D3DQUERYTYPE_OCCLUSION:
+            target = GL_SAMPLES_PASSED;
+            return true;
+        case D3DQUERYTYPE_TIMESTAMP:
+            target = GL_TIMESTAMP;
+            return true;
+        // These are marked like events. GL's timestamp frequency is fixed,
+        // and it has no way to tell if it changed, so they're only there for
+        // the app to wait on.
+        case D3DQUERYTYPE_EVENT:
+        case D3DQUERYTYPE_TIMESTAMPDISJOINT:
+        case D3DQUERYTYPE_TIMESTAMPFREQ:
+            target = GL_NONE;
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+} // namespace
+
 
 D3DGLQuery::D3DGLQuery(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
   , mQueryType(GL_NONE)
-  , mQueryId(0)
-  , mPendingQueries(0)
+  , mQuerySlot(QueryPool::sMaxQueries)
+  , mQuerySerial(0)
+  , mQueryResult(0)
   , mState(Signaled)
 {
     mParent->AddRef();
@@ -112,12 +136,17 @@ D3DGLQuery::D3DGLQuery(D3DGLDevice *parent)
 
 D3DGLQuery::~D3DGLQuery()
 {
-    if(mQueryId)
+    if(mQuerySlot < QueryPool::sMaxQueries)
     {
-        mParent->getQueue().send<QueryDeinitCmd>(mQueryId);
-        while(mPendingQueries)
-            mParent->getQueue().wakeAndSleep();
-        mQueryId = 0;
+        CommandQueue &queue = mParent->getQueue();
+        QueryPool &pool = mParent->getQueryPool();
+
+        queue.lock();
+        if(mState == Building && mQueryType == GL_SAMPLES_PASSED)
+            queue.doSend<EndQueryCmd>(make_ref(pool), mQuerySlot, mQueryType, 0);
+        pool.free(mQuerySlot);
+        queue.unlock();
+        mQuerySlot = QueryPool::sMaxQueries;
     }
 
     mParent->Release();
@@ -127,18 +156,32 @@ bool D3DGLQuery::init(D3DQUERYTYPE type)
 {
     mType = type;
 
-    if(mType == D3DQUERYTYPE_OCCLUSION)
-        mQueryType = GL_SAMPLES_PASSED;
-    else
+    if(!GetGLQueryType(mType, mQueryType))
     {
         FIXME("Query type %s unsupported\n", d3dquery_to_str(mType));
         return false;
     }
 
-    mParent->getQueue().sendSync<QueryInitCmd>(this);
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    bool ok = mParent->getQueryPool().alloc(mQuerySlot);
+    queue.unlock();
+    if(!ok)
+    {
+        ERR("Out of query slots (max %u)\n", QueryPool::sMaxQueries);
+        mQuerySlot = QueryPool::sMaxQueries;
+        return false;
+    }
+
     return true;
 }
 
+bool D3DGLQuery::isSupported(D3DQUERYTYPE type)
+{
+    GLenum target;
+    return GetGLQueryType(type, target);
+}
+
 
 HRESULT D3DGLQuery::QueryInterface(REFIID riid, void **obj)
 {
@@ -189,6 +232,10 @@ DWORD D3DGLQuery::GetDataSize()
 
     if(mType == D3DQUERYTYPE_OCCLUSION)
         return sizeof(DWORD);
+    if(mType == D3DQUERYTYPE_EVENT || mType == D3DQUERYTYPE_TIMESTAMPDISJOINT)
+        return sizeof(BOOL);
+    if(mType == D3DQUERYTYPE_TIMESTAMP || mType == D3DQUERYTYPE_TIMESTAMPFREQ)
+        return sizeof(UINT64);
 
     ERR("Unexpected query type: %s\n", d3dquery_to_str(mType));
     return 0;
@@ -204,20 +251,49 @@ HRESULT D3DGLQuery::Issue(DWORD flags)
         return D3DERR_INVALIDCALL;
     }
 
+    CommandQueue &queue = mParent->getQueue();
+    QueryPool &pool = mParent->getQueryPool();
+
+    if(mQueryType != GL_SAMPLES_PASSED)
+    {
+        // Events and timestamps only have an end. A disjoint query's begin
+        // has nothing to mark.
+        if((flags&D3DISSUE_END))
+        {
+            queue.lock();
+            mQuerySerial = pool.next();
+            mState = Issued;
+            if(mQueryType == GL_TIMESTAMP)
+                queue.doSend<QueryCounterCmd>(make_ref(pool), mQuerySlot, mQuerySerial);
+            else
+                queue.doSend<QueryEventCmd>(make_ref(pool), mQuerySlot, mQuerySerial);
+            queue.unlock();
+        }
+        else if((flags&D3DISSUE_BEGIN) && mType == D3DQUERYTYPE_TIMESTAMPDISJOINT)
+            mState = Building;
+        return D3D_OK;
+    }
+
     // FIXME: Make sure another occlusion query object isn't building.
     if((flags&D3DISSUE_END) && mState == Building)
     {
+        queue.lock();
+        mQuerySerial = pool.next();
         mState = Issued;
-        mParent->getQueue().send<EndQueryCmd>(this);
+        queue.doSend<EndQueryCmd>(make_ref(pool), mQuerySlot, mQueryType, mQuerySerial);
+        queue.unlock();
     }
 
     if((flags&D3DISSUE_BEGIN))
     {
-        // Need to wait for any data queries to finish first
-        while(mPendingQueries)
-            mParent->getQueue().wakeAndSleep();
+        // Restarting a query drops what it had so far. A result still pending
+        // from a previous issue is ignored once the query is ended again.
+        queue.lock();
+        if(mState == Building)
+            queue.doSend<EndQueryCmd>(make_ref(pool), mQuerySlot, mQueryType, 0);
         mState = Building;
-        mParent->getQueue().send<BeginQueryCmd>(this);
+        queue.doSend<BeginQueryCmd>(make_ref(pool), mQuerySlot, mQueryType);
+        queue.unlock();
     }
 
     return D3D_OK;
@@ -229,17 +305,31 @@ HRESULT D3DGLQuery::GetData(void *data, DWORD size, DWORD flags)
 
     if(mState == Issued)
     {
-        ULONG zero = 0;
-        if(mPendingQueries.compare_exchange_strong(zero, 1))
-            mParent->getQueue().send<QueryDataCmd>(this);
-        if((flags&D3DGETDATA_FLUSH))
-            mParent->getQueue().flush();
-        return S_FALSE;
+        QueryPool &pool = mParent->getQueryPool();
+        UINT64 value;
+        if(pool.getResult(mQuerySlot, mQuerySerial, value))
+        {
+            mQueryResult = value;
+            mState = Signaled;
+        }
+        else
+        {
+            // One collect at a time is enough, since it gets everything the
+            // GPU has finished.
+            CommandQueue &queue = mParent->getQueue();
+            if(pool.queueCollect())
+                queue.send<QueryCollectCmd>(make_ref(pool));
+            if((flags&D3DGETDATA_FLUSH))
+                queue.flush();
+            return S_FALSE;
+        }
     }
 
     union {
         void *pointer;
         DWORD *occlusion_result;
+        BOOL *event_result;
+        UINT64 *timestamp_result;
     };
     pointer = data;
 
@@ -252,7 +342,27 @@ HRESULT D3DGLQuery::GetData(void *data, DWORD size, DWORD flags)
                 WARN("Size %lu too small\n", size);
                 return D3DERR_INVALIDCALL;
             }
-            *occlusion_result = mQueryResult;
+            *occlusion_result = (DWORD)mQueryResult;
+            return D3D_OK;
+        }
+        if(mType == D3DQUERYTYPE_EVENT || mType == D3DQUERYTYPE_TIMESTAMPDISJOINT)
+        {
+            if(size < sizeof(*event_result))
+            {
+                WARN("Size %lu too small\n", size);
+                return D3DERR_INVALIDCALL;
+            }
+            *event_result = (mType == D3DQUERYTYPE_EVENT);
+            return D3D_OK;
+        }
+        if(mType == D3DQUERYTYPE_TIMESTAMP || mType == D3DQUERYTYPE_TIMESTAMPFREQ)
+        {
+            if(size < sizeof(*timestamp_result))
+            {
+                WARN("Size %lu too small\n", size);
+                return D3DERR_INVALIDCALL;
+            }
+            *timestamp_result = (mType == D3DQUERYTYPE_TIMESTAMP) ? mQueryResult : 1000000000;
             return D3D_OK;
         }
 
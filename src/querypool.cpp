@@ -0,0 +1,232 @@
+
+#include "querypool.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+
+QueryPool::QueryPool()
+  : mResults(new Result[sMaxQueries])
+  , mNumSlots(0)
+  , mNextSerial(0)
+  , mCollectQueued(false)
+  , mResultBuffer(0)
+{
+    for(UINT i = 0;i < sMaxQueries;++i)
+    {
+        mResults[i].mSerial = 0;
+        mResults[i].mValue = 0;
+    }
+}
+
+
+bool QueryPool::alloc(UINT &slot)
+{
+    if(!mFreeSlots.empty())
+    {
+        slot = mFreeSlots.back();
+        mFreeSlots.pop_back();
+        return true;
+    }
+    if(mNumSlots >= sMaxQueries)
+        return false;
+    slot = mNumSlots++;
+    return true;
+}
+
+void QueryPool::free(UINT slot)
+{
+    mFreeSlots.push_back(slot);
+}
+
+ULONG QueryPool::next()
+{
+    // 0 means no result.
+    if(++mNextSerial == 0)
+        ++mNextSerial;
+    return mNextSerial;
+}
+
+
+bool QueryPool::getResult(UINT slot, ULONG serial, UINT64 &value) const
+{
+    // The serial is checked again after, in case the slot was republished
+    // while reading the value.
+    const Result &result = mResults[slot];
+    if(result.mSerial.load(std::memory_order_acquire) != serial)
+        return false;
+    value = result.mValue.load(std::memory_order_acquire);
+    return result.mSerial.load(std::memory_order_acquire) == serial;
+}
+
+
+GLuint QueryPool::getNameGL(UINT slot)
+{
+    if(slot >= mNames.size())
+    {
+        size_t count = (slot/sNameBlock + 1) * sNameBlock;
+        size_t old = mNames.size();
+        mNames.resize(count);
+        mIssued.resize(count, 0);
+        glGenQueries(count-old, &mNames[old]);
+        checkGLError();
+    }
+    return mNames[slot];
+}
+
+void QueryPool::initGL()
+{
+    if(GLEW_ARB_query_buffer_object)
+    {
+        glGenBuffers(1, &mResultBuffer);
+        glNamedBufferDataEXT(mResultBuffer, sMaxQueries*sizeof(GLuint64), nullptr, GL_STREAM_READ);
+        checkGLError();
+    }
+}
+
+void QueryPool::deinitGL()
+{
+    for(Batch &batch : mBatches)
+        glDeleteSync(batch.mFence);
+    mBatches.clear();
+    mUnfenced.clear();
+
+    if(!mNames.empty())
+        glDeleteQueries(mNames.size(), mNames.data());
+    mNames.clear();
+    mIssued.clear();
+
+    if(mResultBuffer)
+        glDeleteBuffers(1, &mResultBuffer);
+    mResultBuffer = 0;
+    checkGLError();
+}
+
+void QueryPool::beginGL(UINT slot, GLenum target)
+{
+    glBeginQuery(target, getNameGL(slot));
+    checkGLError();
+}
+
+void QueryPool::resultGL(UINT slot, GLenum target, ULONG serial)
+{
+    if(mResultBuffer)
+    {
+        // The GPU writes the result once it's available, without stalling
+        // here.
+        glBindBuffer(GL_QUERY_BUFFER, mResultBuffer);
+        glGetQueryObjectui64v(getNameGL(slot), GL_QUERY_RESULT,
+                              reinterpret_cast<GLuint64*>(slot*sizeof(GLuint64)));
+        glBindBuffer(GL_QUERY_BUFFER, 0);
+    }
+    checkGLError();
+
+    // A serial of 0 is a query ended without being issued, with no result.
+    if(serial)
+    {
+        mIssued[slot] = serial;
+        mUnfenced.push_back(Pending{slot, serial, target});
+    }
+}
+
+void QueryPool::endGL(UINT slot, GLenum target, ULONG serial)
+{
+    glEndQuery(target);
+    resultGL(slot, target, serial);
+}
+
+void QueryPool::counterGL(UINT slot, ULONG serial)
+{
+    glQueryCounter(getNameGL(slot), GL_TIMESTAMP);
+    resultGL(slot, GL_TIMESTAMP, serial);
+}
+
+void QueryPool::eventGL(UINT slot, ULONG serial)
+{
+    getNameGL(slot);
+    mIssued[slot] = serial;
+    mUnfenced.push_back(Pending{slot, serial, GL_NONE});
+    fenceGL();
+}
+
+
+void QueryPool::fenceGL()
+{
+    if(mUnfenced.empty())
+        return;
+
+    mBatches.emplace_back();
+    Batch &batch = mBatches.back();
+    batch.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    batch.mQueries.swap(mUnfenced);
+    checkGLError();
+}
+
+void QueryPool::publishGL(const Batch &batch)
+{
+    UINT first = sMaxQueries, last = 0;
+    for(const Pending &query : batch.mQueries)
+    {
+        if(query.mTarget != GL_NONE)
+        {
+            first = std::min(first, query.mSlot);
+            last = std::max(last, query.mSlot);
+        }
+    }
+    if(mResultBuffer && first <= last)
+    {
+        // One read for the whole batch.
+        mScratch.resize(last-first+1);
+        glGetNamedBufferSubDataEXT(mResultBuffer, first*sizeof(GLuint64), mScratch.size()*sizeof(GLuint64),
+                                   mScratch.data());
+    }
+
+    for(const Pending &query : batch.mQueries)
+    {
+        // Reissued queries only get their latest result.
+        if(mIssued[query.mSlot] != query.mSerial)
+            continue;
+
+        UINT64 value = TRUE;
+        if(query.mTarget != GL_NONE)
+        {
+            if(mResultBuffer)
+                value = mScratch[query.mSlot-first];
+            else
+            {
+                // The fence signaled, so this doesn't wait.
+                GLuint64 res = 0;
+                glGetQueryObjectui64v(mNames[query.mSlot], GL_QUERY_RESULT, &res);
+                value = res;
+            }
+        }
+
+        Result &result = mResults[query.mSlot];
+        result.mSerial.store(0, std::memory_order_release);
+        result.mValue.store(value, std::memory_order_release);
+        result.mSerial.store(query.mSerial, std::memory_order_release);
+    }
+    checkGLError();
+}
+
+void QueryPool::collectGL()
+{
+    mCollectQueued = false;
+
+    fenceGL();
+    while(!mBatches.empty())
+    {
+        Batch &batch = mBatches.front();
+        GLenum ret = glClientWaitSync(batch.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if(ret == GL_TIMEOUT_EXPIRED)
+            break;
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait for query batch\n");
+
+        publishGL(batch);
+        glDeleteSync(batch.mFence);
+        mBatches.pop_front();
+    }
+    checkGLError();
+}
@@ -0,0 +1,144 @@
+
+#include "readbackring.hpp"
+
+#include <cstring>
+
+#include "trace.hpp"
+
+
+ReadbackRing::ReadbackRing()
+  : mNextSerial(0)
+{
+    for(Slot &slot : mSlots)
+    {
+        slot.mBufferId = 0;
+        slot.mSize = 0;
+        slot.mFence = nullptr;
+        slot.mSerial = 0;
+        slot.mPitch = 0;
+        slot.mRows = 0;
+        slot.mFlip = false;
+    }
+}
+
+
+ULONG ReadbackRing::next()
+{
+    // 0 means no readback.
+    if(++mNextSerial == 0)
+        ++mNextSerial;
+    return mNextSerial;
+}
+
+
+void ReadbackRing::finishGL(Slot &slot)
+{
+    if(slot.mFence)
+    {
+        GLenum ret;
+        while((ret=glClientWaitSync(slot.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED)
+            WARN("Timed out waiting for readback %lu\n", slot.mSerial);
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait for readback %lu\n", slot.mSerial);
+        glDeleteSync(slot.mFence);
+        slot.mFence = nullptr;
+    }
+
+    if(slot.mDest)
+    {
+        UINT len = slot.mPitch * slot.mRows;
+        const GLubyte *src = reinterpret_cast<const GLubyte*>(
+            glMapNamedBufferRangeEXT(slot.mBufferId, 0, len, GL_MAP_READ_BIT)
+        );
+        if(!src)
+            ERR("Failed to map readback %lu\n", slot.mSerial);
+        else
+        {
+            GLubyte *dst = slot.mDest.get();
+            if(!slot.mFlip)
+                memcpy(dst, src, len);
+            else
+            {
+                for(UINT row = 0;row < slot.mRows;++row)
+                    memcpy(dst + (slot.mRows-1-row)*slot.mPitch, src + row*slot.mPitch, slot.mPitch);
+            }
+            glUnmapNamedBufferEXT(slot.mBufferId);
+        }
+        checkGLError();
+    }
+
+    slot.mDest.reset();
+    slot.mSerial = 0;
+}
+
+
+void ReadbackRing::beginGL(ULONG serial, const std::shared_ptr<GLubyte> &dest, UINT pitch, UINT rows, bool flip)
+{
+    Slot &slot = getSlot(serial);
+    if(slot.mSerial)
+        finishGL(slot);
+
+    UINT len = pitch * rows;
+    if(slot.mSize < len)
+    {
+        if(!slot.mBufferId)
+            glGenBuffers(1, &slot.mBufferId);
+        glNamedBufferDataEXT(slot.mBufferId, len, nullptr, GL_STREAM_READ);
+        slot.mSize = len;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.mBufferId);
+    checkGLError();
+
+    slot.mSerial = serial;
+    slot.mDest = dest;
+    slot.mPitch = pitch;
+    slot.mRows = rows;
+    slot.mFlip = flip;
+}
+
+void ReadbackRing::endGL(ULONG serial)
+{
+    Slot &slot = getSlot(serial);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    checkGLError();
+}
+
+void ReadbackRing::resolveGL(ULONG serial)
+{
+    Slot &slot = getSlot(serial);
+    if(slot.mSerial == serial)
+        finishGL(slot);
+}
+
+void ReadbackRing::cancelGL(ULONG serial)
+{
+    Slot &slot = getSlot(serial);
+    if(slot.mSerial == serial)
+    {
+        // The buffer can be written again without waiting, as the GPU
+        // orders its own writes.
+        if(slot.mFence)
+            glDeleteSync(slot.mFence);
+        slot.mFence = nullptr;
+        slot.mDest.reset();
+        slot.mSerial = 0;
+    }
+}
+
+void ReadbackRing::deinitGL()
+{
+    for(Slot &slot : mSlots)
+    {
+        if(slot.mFence)
+            glDeleteSync(slot.mFence);
+        slot.mFence = nullptr;
+        if(slot.mBufferId)
+            glDeleteBuffers(1, &slot.mBufferId);
+        slot.mBufferId = 0;
+        slot.mSize = 0;
+        slot.mDest.reset();
+        slot.mSerial = 0;
+    }
+    checkGLError();
+}
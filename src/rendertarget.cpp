@@ -4,21 +4,30 @@
 #include "trace.hpp"
 #include "glformat.hpp"
 #include "device.hpp"
+#include "commandstream.hpp"
 #include "private_iids.hpp"
 
 
 class DeleteRenderbuffer : public Command {
+    FramebufferCache &mFramebuffers;
     GLuint mId;
 
 public:
-    DeleteRenderbuffer(GLuint id) : mId(id) { }
+    DeleteRenderbuffer(FramebufferCache &framebuffers, GLuint id)
+      : mFramebuffers(framebuffers), mId(id)
+    { }
 
     virtual ULONG execute()
     {
+        mFramebuffers.forgetGL(true, mId);
         glDeleteRenderbuffers(1, &mId);
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::RenderbufferDelete, StreamValue{mId});
+    }
 };
 
 
@@ -36,6 +45,12 @@ void D3DGLRenderTarget::initGL()
 
     glBindRenderbuffer(GL_RENDERBUFFER, 0);
     checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::RenderbufferStorage, StreamRenderbuffer{
+            mId, mGLFormat->internalformat, GLsizei(mDesc.Width), GLsizei(mDesc.Height),
+            (mDesc.MultiSampleType <= D3DMULTISAMPLE_NONE) ? 0 : GLsizei(mDesc.MultiSampleType)
+        });
 }
 class InitRenderTargetCmd : public Command {
     D3DGLRenderTarget *mTarget;
@@ -48,6 +63,7 @@ public:
         mTarget->initGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 D3DGLRenderTarget::D3DGLRenderTarget(D3DGLDevice *parent)
@@ -62,7 +78,7 @@ D3DGLRenderTarget::D3DGLRenderTarget(D3DGLDevice *parent)
 D3DGLRenderTarget::~D3DGLRenderTarget()
 {
     if(mId != 0)
-        mParent->getQueue().send<DeleteRenderbuffer>(mId);
+        mParent->getQueue().send<DeleteRenderbuffer>(make_ref(mParent->getFramebuffers()), mId);
 }
 
 bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto)
@@ -70,13 +86,12 @@ bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto)
     mDesc = *desc;
     mIsAuto = isauto;
 
-    auto fmtinfo = gFormatList.find(mDesc.Format);
-    if(fmtinfo == gFormatList.end())
+    mGLFormat = FindGLFormat(mDesc.Format);
+    if(!mGLFormat)
     {
         ERR("Failed to find info for format %s\n", d3dfmt_to_str(mDesc.Format));
         return false;
     }
-    mGLFormat = &fmtinfo->second;
 
     if(mDesc.Format != D3DFMT_NULL)
         mParent->getQueue().sendSync<InitRenderTargetCmd>(this);
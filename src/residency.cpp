@@ -0,0 +1,240 @@
+
+#include "residency.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+#include "commandqueue.hpp"
+#include "commandstream.hpp"
+
+
+UINT VRAMBudget = 0;
+
+
+namespace
+{
+
+class QueryDedicatedMemCmd : public Command {
+    ResidencyManager *mTarget;
+
+public:
+    QueryDedicatedMemCmd(ResidencyManager *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->queryDedicatedMemGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class QueryFreeMemCmd : public Command {
+    ResidencyManager *mTarget;
+
+public:
+    QueryFreeMemCmd(ResidencyManager *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->queryFreeMemGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+} // namespace
+
+
+ResidencyManager::ResidencyManager(CommandQueue &queue)
+  : mQueue(queue), mBudget(0), mResidentSize(0), mFrame(1), mHasMemInfo(false), mQueriedMem(0)
+{
+}
+
+
+void ResidencyManager::queryDedicatedMemGL()
+{
+    mHasMemInfo = true;
+    if(GLEW_NVX_gpu_memory_info)
+    {
+        GLint kb = 0;
+        glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &kb);
+        mQueriedMem = UINT64(kb) * 1024;
+    }
+    else if(GLEW_ATI_meminfo)
+    {
+        // The first value is the total free memory in the pool, in KB.
+        GLint kb[4] = { 0, 0, 0, 0 };
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, kb);
+        mQueriedMem = UINT64(kb[0]) * 1024;
+    }
+    else
+        mHasMemInfo = false;
+    checkGLError();
+}
+
+void ResidencyManager::queryFreeMemGL()
+{
+    mHasMemInfo = true;
+    if(GLEW_NVX_gpu_memory_info)
+    {
+        GLint kb = 0;
+        glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &kb);
+        mQueriedMem = UINT64(kb) * 1024;
+    }
+    else if(GLEW_ATI_meminfo)
+    {
+        GLint kb[4] = { 0, 0, 0, 0 };
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, kb);
+        mQueriedMem = UINT64(kb[0]) * 1024;
+    }
+    else
+        mHasMemInfo = false;
+    checkGLError();
+}
+
+
+void ResidencyManager::init()
+{
+    if(VRAMBudget)
+    {
+        mBudget = UINT64(VRAMBudget) << 20;
+        TRACE("Using managed resource budget of %uMB\n", VRAMBudget);
+        return;
+    }
+
+    mQueue.sendSync<QueryDedicatedMemCmd>(this);
+    if(!mHasMemInfo || !mQueriedMem)
+    {
+        TRACE("No memory info, not limiting managed resources\n");
+        mBudget = 0;
+        return;
+    }
+
+    // Leave a quarter for render targets and default pool resources.
+    mBudget = mQueriedMem / 4 * 3;
+    TRACE("Using managed resource budget of %luMB, of %luMB\n", (ULONG)(mBudget>>20), (ULONG)(mQueriedMem>>20));
+}
+
+
+void ResidencyManager::add(ManagedResource *res, UINT64 size)
+{
+    res->mSize = size;
+    res->mLastUsed = mFrame;
+    res->mResident = true;
+    mResidentSize += size;
+    mResources.push_back(res);
+}
+
+void ResidencyManager::remove(ManagedResource *res)
+{
+    auto iter = std::find(mResources.begin(), mResources.end(), res);
+    if(iter == mResources.end())
+        return;
+    if(res->mResident)
+        mResidentSize -= res->mSize;
+    *iter = mResources.back();
+    mResources.pop_back();
+}
+
+
+void ResidencyManager::doEvict(ManagedResource *res)
+{
+    TRACE("Evicting %p, %lu bytes\n", res, (ULONG)res->mSize);
+    res->evict();
+    res->mResident = false;
+    mResidentSize -= res->mSize;
+}
+
+void ResidencyManager::use(ManagedResource *res)
+{
+    res->mLastUsed = mFrame;
+    if(res->mResident)
+        return;
+
+    TRACE("Restoring %p, %lu bytes\n", res, (ULONG)res->mSize);
+    res->mResident = true;
+    mResidentSize += res->mSize;
+    res->restore();
+}
+
+DWORD ResidencyManager::setPriority(ManagedResource *res, DWORD priority)
+{
+    DWORD old = res->mPriority;
+    res->mPriority = priority;
+    return old;
+}
+
+
+void ResidencyManager::endFrame()
+{
+    DWORD frame = mFrame++;
+    if(!mBudget || mResidentSize <= mBudget)
+        return;
+
+    std::vector<ManagedResource*> candidates;
+    for(ManagedResource *res : mResources)
+    {
+        if(res->mResident && !res->mBindCount && res->mLastUsed != frame)
+            candidates.push_back(res);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+        [](const ManagedResource *lhs, const ManagedResource *rhs) -> bool
+        {
+            if(lhs->mPriority != rhs->mPriority)
+                return lhs->mPriority < rhs->mPriority;
+            return lhs->mLastUsed < rhs->mLastUsed;
+        }
+    );
+
+    for(ManagedResource *res : candidates)
+    {
+        if(mResidentSize <= mBudget)
+            break;
+        doEvict(res);
+    }
+    if(mResidentSize > mBudget)
+        WARN("Resident managed resources over budget (%luMB > %luMB)\n", (ULONG)(mResidentSize>>20),
+             (ULONG)(mBudget>>20));
+}
+
+void ResidencyManager::evictAll()
+{
+    for(ManagedResource *res : mResources)
+    {
+        if(res->mResident && !res->mBindCount)
+            doEvict(res);
+    }
+}
+
+
+UINT64 ResidencyManager::getAvailableMem()
+{
+    mQueue.sendSync<QueryFreeMemCmd>(this);
+
+    mQueue.lock();
+    UINT64 avail;
+    if(mHasMemInfo)
+    {
+        // Evicted resources don't take any memory now, but would if they
+        // were used again.
+        UINT64 evicted = 0;
+        for(const ManagedResource *res : mResources)
+        {
+            if(!res->mResident)
+                evicted += res->mSize;
+        }
+        avail = (mQueriedMem > evicted) ? mQueriedMem-evicted : 0;
+    }
+    else
+    {
+        UINT64 total = sDefaultMemory;
+        if(mBudget > total) total = mBudget;
+        UINT64 used = 0;
+        for(const ManagedResource *res : mResources)
+            used += res->mSize;
+        avail = (total > used) ? total-used : 0;
+    }
+    mQueue.unlock();
+
+    return avail;
+}
@@ -0,0 +1,97 @@
+
+#include "samplercache.hpp"
+
+#include <cstring>
+
+#include "trace.hpp"
+
+
+bool GLSamplerDesc::operator==(const GLSamplerDesc &rhs) const
+{ return memcmp(this, &rhs, sizeof(*this)) == 0; }
+
+size_t SamplerCache::Hasher::operator()(const GLSamplerDesc &desc) const
+{
+    static_assert(sizeof(GLSamplerDesc)%sizeof(DWORD) == 0, "Unexpected GLSamplerDesc size");
+
+    DWORD vals[sizeof(desc)/sizeof(DWORD)];
+    memcpy(vals, &desc, sizeof(desc));
+
+    size_t hash = 2166136261u;
+    for(DWORD val : vals)
+    {
+        hash ^= val;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+GLuint SamplerCache::createGL(const GLSamplerDesc &desc)
+{
+    GLuint sampler;
+    glGenSamplers(1, &sampler);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, desc.mWrapS);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, desc.mWrapT);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, desc.mWrapR);
+    glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR, desc.mBorderColor);
+    glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, desc.mMinFilter);
+    glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, desc.mMagFilter);
+    glSamplerParameterf(sampler, GL_TEXTURE_LOD_BIAS, desc.mLodBias);
+    glSamplerParameterf(sampler, GL_TEXTURE_MIN_LOD, desc.mMinLod);
+    glSamplerParameteri(sampler, GL_TEXTURE_COMPARE_MODE, desc.mCompareMode);
+    glSamplerParameteri(sampler, GL_TEXTURE_SRGB_DECODE_EXT, desc.mSRGBDecode);
+    if(GLEW_EXT_texture_filter_anisotropic)
+        glSamplerParameteri(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, desc.mMaxAnisotropy);
+    checkGLError();
+
+    mSamplers.insert(std::make_pair(desc, sampler));
+    return sampler;
+}
+
+void SamplerCache::purgeGL()
+{
+    TRACE("Purging %u samplers\n", mSamplers.size());
+
+    // Deleting a bound sampler unbinds it, so units still using one get it
+    // made again.
+    for(auto &entry : mSamplers)
+        glDeleteSamplers(1, &entry.second);
+    mSamplers.clear();
+
+    for(size_t i = 0;i < mBound.size();++i)
+    {
+        if(mBound[i].mWrapS != 0)
+            glBindSampler(i, createGL(mBound[i]));
+    }
+}
+
+
+void SamplerCache::deinitGL()
+{
+    for(size_t i = 0;i < mBound.size();++i)
+        glBindSampler(i, 0);
+    mBound.clear();
+
+    for(auto &entry : mSamplers)
+        glDeleteSamplers(1, &entry.second);
+    mSamplers.clear();
+}
+
+void SamplerCache::bindGL(GLuint unit, const GLSamplerDesc &desc)
+{
+    GLuint sampler;
+    auto iter = mSamplers.find(desc);
+    if(iter != mSamplers.end())
+        sampler = iter->second;
+    else
+    {
+        if(mSamplers.size() >= sMaxSamplers)
+            purgeGL();
+        sampler = createGL(desc);
+    }
+    glBindSampler(unit, sampler);
+
+    if(unit >= mBound.size())
+        mBound.resize(unit+1, GLSamplerDesc{});
+    mBound[unit] = desc;
+}
@@ -0,0 +1,69 @@
+
+#include "shaderarena.hpp"
+
+#include <cstdlib>
+
+
+namespace
+{
+
+thread_local ShaderArena ThreadArena;
+
+} // namespace
+
+
+ShaderArena::ShaderArena()
+  : mCurrent(0), mUsed(0)
+{
+}
+
+ShaderArena::~ShaderArena()
+{
+    reset();
+    for(char *block : mBlocks)
+        free(block);
+}
+
+
+ShaderArena &ShaderArena::get()
+{
+    return ThreadArena;
+}
+
+
+void *ShaderArena::alloc(size_t len)
+{
+    len = (len+15) & ~size_t(15);
+    if(len > sMaxBlockAlloc)
+    {
+        char *block = static_cast<char*>(malloc(len));
+        if(block) mLargeBlocks.push_back(block);
+        return block;
+    }
+
+    if(mBlocks.empty() || mUsed+len > sBlockSize)
+    {
+        size_t next = mBlocks.empty() ? 0 : mCurrent+1;
+        if(next == mBlocks.size())
+        {
+            char *block = static_cast<char*>(malloc(sBlockSize));
+            if(!block) return nullptr;
+            mBlocks.push_back(block);
+        }
+        mCurrent = next;
+        mUsed = 0;
+    }
+
+    void *ret = mBlocks[mCurrent] + mUsed;
+    mUsed += len;
+    return ret;
+}
+
+void ShaderArena::reset()
+{
+    for(char *block : mLargeBlocks)
+        free(block);
+    mLargeBlocks.clear();
+    mCurrent = 0;
+    mUsed = 0;
+}
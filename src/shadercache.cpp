@@ -0,0 +1,436 @@
+
+#include "shadercache.hpp"
+
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <io.h>
+
+#include "trace.hpp"
+
+
+const char *ShaderCacheFile = nullptr;
+
+
+namespace
+{
+
+const char sMagic[8] = { 'D','3','D','G','L','S','H','C' };
+// Increase this when the generated GLSL changes, e.g. from updating
+// MojoShader, so programs built from older output are dropped.
+const DWORD sVersion = 2;
+// Anything bigger is from a corrupt file.
+const DWORD sMaxRecordSize = 64<<20;
+
+SRWLOCK CacheLock = SRWLOCK_INIT;
+bool CacheOpened = false;
+FILE *CacheFile = nullptr;
+UINT64 DriverHash = 0;
+// Offsets of the records in the file, by key.
+std::unordered_map<UINT64,long> CacheIndex;
+
+
+UINT64 fnv1a(const void *data, size_t len, UINT64 hash=0xcbf29ce484222325ull)
+{
+    const BYTE *bytes = reinterpret_cast<const BYTE*>(data);
+    for(size_t i = 0;i < len;++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+UINT64 makeKey(GLenum type, const std::vector<DWORD> &code, const ShaderVariant &variant)
+{
+    UINT64 hash = fnv1a(&type, sizeof(type));
+    hash = fnv1a(&variant, sizeof(variant), hash);
+    hash = fnv1a(&DriverHash, sizeof(DriverHash), hash);
+    return fnv1a(code.data(), code.size()*sizeof(DWORD), hash);
+}
+
+
+class RecordWriter {
+    std::vector<BYTE> mData;
+
+public:
+    void putDWord(DWORD val)
+    { put(&val, sizeof(val)); }
+    void putQWord(UINT64 val)
+    { put(&val, sizeof(val)); }
+    void put(const void *data, size_t len)
+    {
+        const BYTE *bytes = reinterpret_cast<const BYTE*>(data);
+        mData.insert(mData.end(), bytes, bytes+len);
+    }
+    void putString(const std::string &str)
+    {
+        putDWord(str.length());
+        put(str.data(), str.length());
+    }
+    void putVariables(const std::vector<ShaderVariable> &vars)
+    {
+        putDWord(vars.size());
+        for(const ShaderVariable &var : vars)
+        {
+            putDWord(var.mUsage);
+            putDWord(var.mIndex);
+            putString(var.mName);
+        }
+    }
+
+    const std::vector<BYTE> &getData() const { return mData; }
+};
+
+class RecordReader {
+    const BYTE *mPos;
+    const BYTE *mEnd;
+    bool mOkay;
+
+public:
+    RecordReader(const std::vector<BYTE> &data)
+      : mPos(data.data()), mEnd(data.data()+data.size()), mOkay(true)
+    { }
+
+    const BYTE *get(size_t len)
+    {
+        if(!mOkay || size_t(mEnd-mPos) < len)
+        {
+            mOkay = false;
+            return nullptr;
+        }
+        const BYTE *ret = mPos;
+        mPos += len;
+        return ret;
+    }
+    DWORD getDWord()
+    {
+        DWORD val = 0;
+        if(const BYTE *data = get(sizeof(val)))
+            memcpy(&val, data, sizeof(val));
+        return val;
+    }
+    UINT64 getQWord()
+    {
+        UINT64 val = 0;
+        if(const BYTE *data = get(sizeof(val)))
+            memcpy(&val, data, sizeof(val));
+        return val;
+    }
+    std::string getString()
+    {
+        DWORD len = getDWord();
+        const BYTE *data = get(len);
+        return data ? std::string(reinterpret_cast<const char*>(data), len) : std::string();
+    }
+    void getVariables(std::vector<ShaderVariable> &vars)
+    {
+        DWORD count = getDWord();
+        vars.clear();
+        for(DWORD i = 0;i < count && mOkay;++i)
+        {
+            ShaderVariable var;
+            var.mUsage = getDWord();
+            var.mIndex = getDWord();
+            var.mName = getString();
+            vars.push_back(std::move(var));
+        }
+    }
+
+    bool isOkay() const { return mOkay; }
+};
+
+
+// Each record is its length, its key, then the data.
+bool readRecord(long offset, UINT64 &key, std::vector<BYTE> &data)
+{
+    if(fseek(CacheFile, offset, SEEK_SET) != 0)
+        return false;
+
+    DWORD len;
+    if(fread(&len, sizeof(len), 1, CacheFile) != 1 ||
+       fread(&key, sizeof(key), 1, CacheFile) != 1)
+        return false;
+    if(len > sMaxRecordSize)
+        return false;
+    data.resize(len);
+    return fread(data.data(), 1, len, CacheFile) == len;
+}
+
+
+std::string getDefaultPath()
+{
+    const char *dir = getenv("LOCALAPPDATA");
+    if(!dir || !dir[0])
+        return std::string();
+
+    char exepath[MAX_PATH];
+    DWORD len = GetModuleFileNameA(nullptr, exepath, sizeof(exepath));
+    if(len == 0 || len >= sizeof(exepath))
+        return std::string();
+    std::string exename(exepath, len);
+    size_t slash = exename.find_last_of("\\/");
+    if(slash != std::string::npos)
+        exename.erase(0, slash+1);
+    size_t dot = exename.rfind('.');
+    if(dot != std::string::npos)
+        exename.erase(dot);
+
+    return std::string(dir) + "\\d3dgl-" + exename + ".shadercache";
+}
+
+bool writeHeader()
+{
+    return fwrite(sMagic, sizeof(sMagic), 1, CacheFile) == 1 &&
+           fwrite(&sVersion, sizeof(sVersion), 1, CacheFile) == 1 &&
+           fflush(CacheFile) == 0;
+}
+
+void openCache()
+{
+    CacheOpened = true;
+
+    if(!GLEW_ARB_get_program_binary)
+    {
+        TRACE("No ARB_get_program_binary, not caching shaders\n");
+        return;
+    }
+
+    std::string path;
+    if(ShaderCacheFile)
+    {
+        if(strcmp(ShaderCacheFile, "0") == 0)
+        {
+            TRACE("Shader cache disabled\n");
+            return;
+        }
+        path = ShaderCacheFile;
+    }
+    else
+        path = getDefaultPath();
+    if(path.empty())
+    {
+        WARN("No path for the shader cache\n");
+        return;
+    }
+
+    // Programs from one driver generally can't be loaded by another, so
+    // don't bother looking them up.
+    const char *vendor = reinterpret_cast<const char*>(glGetString(GL_VENDOR));
+    const char *renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    const char *version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+    if(vendor) DriverHash = fnv1a(vendor, strlen(vendor), DriverHash);
+    if(renderer) DriverHash = fnv1a(renderer, strlen(renderer), DriverHash);
+    if(version) DriverHash = fnv1a(version, strlen(version), DriverHash);
+
+    CacheFile = fopen(path.c_str(), "r+b");
+    if(CacheFile)
+    {
+        char magic[sizeof(sMagic)];
+        DWORD version;
+        if(fread(magic, sizeof(magic), 1, CacheFile) != 1 ||
+           fread(&version, sizeof(version), 1, CacheFile) != 1 ||
+           memcmp(magic, sMagic, sizeof(magic)) != 0 || version != sVersion)
+        {
+            TRACE("Discarding old shader cache %s\n", path.c_str());
+            fclose(CacheFile);
+            CacheFile = nullptr;
+        }
+    }
+    if(!CacheFile)
+    {
+        CacheFile = fopen(path.c_str(), "w+b");
+        if(!CacheFile || !writeHeader())
+        {
+            WARN("Failed to create shader cache %s\n", path.c_str());
+            if(CacheFile) fclose(CacheFile);
+            CacheFile = nullptr;
+            return;
+        }
+        TRACE("Created shader cache %s\n", path.c_str());
+        return;
+    }
+
+    long offset = ftell(CacheFile);
+    UINT64 key;
+    std::vector<BYTE> data;
+    while(readRecord(offset, key, data))
+    {
+        CacheIndex[key] = offset;
+        offset = ftell(CacheFile);
+    }
+    // Drop anything partially written after the last good record, so new
+    // records can be appended.
+    fflush(CacheFile);
+    if(_chsize(_fileno(CacheFile), offset) != 0)
+        WARN("Failed to truncate shader cache %s\n", path.c_str());
+    TRACE("Loaded %u programs from shader cache %s\n", (UINT)CacheIndex.size(), path.c_str());
+}
+
+} // namespace
+
+
+GLuint ShaderCache::createProgramGL(GLenum type, const char *source,
+                                    const std::function<void(GLuint)> &prelink)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if(status == GL_FALSE)
+    {
+        GLint loglen = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &loglen);
+        std::vector<char> log(std::max(loglen, 1));
+        glGetShaderInfoLog(shader, log.size(), nullptr, log.data());
+        FIXME("Shader compile failed:\n----\n%s\n----\n", log.data());
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+    if(GLEW_ARB_get_program_binary)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(program, shader);
+    if(prelink)
+        prelink(program);
+    glLinkProgram(program);
+    glDetachShader(program, shader);
+    glDeleteShader(shader);
+    return program;
+}
+
+
+GLuint ShaderCache::loadProgramGL(GLenum type, const std::vector<DWORD> &code, const ShaderVariant &variant,
+                                  ShaderReflection &refl)
+{
+    GLuint program = 0;
+
+    AcquireSRWLockExclusive(&CacheLock);
+    if(!CacheOpened)
+        openCache();
+    if(!CacheFile)
+        goto done;
+    {
+        UINT64 key = makeKey(type, code, variant);
+        auto iter = CacheIndex.find(key);
+        if(iter == CacheIndex.end())
+            goto done;
+
+        UINT64 filekey;
+        std::vector<BYTE> data;
+        if(!readRecord(iter->second, filekey, data) || filekey != key)
+        {
+            WARN("Failed to read shader cache record at %ld\n", iter->second);
+            CacheIndex.erase(iter);
+            goto done;
+        }
+
+        // The key is just a hash, make sure this is the same shader.
+        RecordReader reader(data);
+        DWORD rectype = reader.getDWord();
+        const BYTE *recvariant = reader.get(sizeof(variant));
+        UINT64 recdriver = reader.getQWord();
+        DWORD codelen = reader.getDWord();
+        const BYTE *reccode = reader.get(codelen*sizeof(DWORD));
+        if(!reader.isOkay() || rectype != type || memcmp(recvariant, &variant, sizeof(variant)) != 0 ||
+           recdriver != DriverHash || codelen != code.size() ||
+           memcmp(reccode, code.data(), codelen*sizeof(DWORD)) != 0)
+            goto done;
+
+        GLenum format = reader.getDWord();
+        DWORD binlen = reader.getDWord();
+        const BYTE *binary = reader.get(binlen);
+        reader.getVariables(refl.mAttributes);
+        reader.getVariables(refl.mSamplers);
+        if(!reader.isOkay())
+        {
+            WARN("Corrupt shader cache record at %ld\n", iter->second);
+            CacheIndex.erase(iter);
+            goto done;
+        }
+
+        program = glCreateProgram();
+        glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        glProgramBinary(program, format, binary, binlen);
+
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if(status == GL_FALSE)
+        {
+            // Likely a driver update, it'll get replaced once recompiled.
+            TRACE("Cached program rejected by the driver\n");
+            glDeleteProgram(program);
+            program = 0;
+            CacheIndex.erase(iter);
+        }
+        checkGLError();
+    }
+done:
+    ReleaseSRWLockExclusive(&CacheLock);
+
+    if(!program)
+    {
+        refl.mAttributes.clear();
+        refl.mSamplers.clear();
+    }
+    return program;
+}
+
+void ShaderCache::storeProgramGL(GLenum type, const std::vector<DWORD> &code, const ShaderVariant &variant,
+                                 GLuint program, const ShaderReflection &refl)
+{
+    AcquireSRWLockExclusive(&CacheLock);
+    if(!CacheOpened)
+        openCache();
+    if(CacheFile)
+    {
+        GLint binlen = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binlen);
+        if(binlen > 0)
+        {
+            std::vector<BYTE> binary(binlen);
+            GLenum format = GL_NONE;
+            glGetProgramBinary(program, binlen, &binlen, &format, binary.data());
+            checkGLError();
+
+            RecordWriter writer;
+            writer.putDWord(type);
+            writer.put(&variant, sizeof(variant));
+            writer.putQWord(DriverHash);
+            writer.putDWord(code.size());
+            writer.put(code.data(), code.size()*sizeof(DWORD));
+            writer.putDWord(format);
+            writer.putDWord(binlen);
+            writer.put(binary.data(), binlen);
+            writer.putVariables(refl.mAttributes);
+            writer.putVariables(refl.mSamplers);
+
+            const std::vector<BYTE> &data = writer.getData();
+            UINT64 key = makeKey(type, code, variant);
+            DWORD len = data.size();
+
+            fseek(CacheFile, 0, SEEK_END);
+            long offset = ftell(CacheFile);
+            if(fwrite(&len, sizeof(len), 1, CacheFile) == 1 &&
+               fwrite(&key, sizeof(key), 1, CacheFile) == 1 &&
+               fwrite(data.data(), 1, len, CacheFile) == len &&
+               fflush(CacheFile) == 0)
+                CacheIndex[key] = offset;
+            else
+            {
+                ERR("Failed to write shader cache, disabling\n");
+                fclose(CacheFile);
+                CacheFile = nullptr;
+                CacheIndex.clear();
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&CacheLock);
+}
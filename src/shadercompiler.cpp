@@ -0,0 +1,169 @@
+
+#include "shadercompiler.hpp"
+
+#include <algorithm>
+
+#include "glew.h"
+#include "wglew.h"
+#include "trace.hpp"
+
+
+UINT ShaderCompileThreads = 2;
+bool SkipPendingShaders = false;
+
+
+ShaderCompiler::ShaderCompiler()
+  : mDeviceCtx(nullptr), mStarted(0), mFailed(0), mQuit(false)
+{
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mWakeCond);
+    InitializeConditionVariable(&mDoneCond);
+}
+
+ShaderCompiler::~ShaderCompiler()
+{
+    deinit();
+    DeleteCriticalSection(&mLock);
+}
+
+
+bool ShaderCompiler::init(HDC dc, HGLRC glcontext, const int *attribs)
+{
+    UINT count = std::min(ShaderCompileThreads, sMaxThreads);
+    if(count == 0)
+    {
+        TRACE("Building shaders on the command thread\n");
+        return false;
+    }
+
+    mDeviceCtx = dc;
+    mStarted = 0;
+    mFailed = 0;
+    mQuit = false;
+    // The threads hold pointers into this.
+    mThreads.reserve(count);
+    for(UINT i = 0;i < count;++i)
+    {
+        HGLRC context = wglCreateContextAttribsARB(dc, glcontext, attribs);
+        if(!context)
+        {
+            ERR("Failed to create shared context, error %lu\n", GetLastError());
+            break;
+        }
+
+        mThreads.push_back(Thread{this, nullptr, context});
+        Thread &thread = mThreads.back();
+        thread.mHandle = CreateThread(nullptr, 0, thread_func, &thread, 0, nullptr);
+        if(!thread.mHandle)
+        {
+            ERR("Failed to create shader compile thread, error %lu\n", GetLastError());
+            wglDeleteContext(context);
+            mThreads.pop_back();
+            break;
+        }
+    }
+
+    EnterCriticalSection(&mLock);
+    while(mStarted+mFailed < mThreads.size())
+        SleepConditionVariableCS(&mDoneCond, &mLock, INFINITE);
+    UINT started = mStarted;
+    LeaveCriticalSection(&mLock);
+
+    if(!started)
+    {
+        deinit();
+        return false;
+    }
+    TRACE("Started %u shader compile threads\n", started);
+    return true;
+}
+
+void ShaderCompiler::deinit()
+{
+    if(mThreads.empty())
+        return;
+
+    EnterCriticalSection(&mLock);
+    mQuit = true;
+    WakeAllConditionVariable(&mWakeCond);
+    LeaveCriticalSection(&mLock);
+
+    for(Thread &thread : mThreads)
+    {
+        WaitForSingleObject(thread.mHandle, INFINITE);
+        CloseHandle(thread.mHandle);
+        wglDeleteContext(thread.mContext);
+    }
+    mThreads.clear();
+}
+
+
+void ShaderCompiler::workerLoop(Thread &thread)
+{
+    bool okay = wglMakeCurrent(mDeviceCtx, thread.mContext);
+    if(!okay)
+        ERR("Failed to make shared context current, error %lu\n", GetLastError());
+
+    EnterCriticalSection(&mLock);
+    if(okay) ++mStarted;
+    else ++mFailed;
+    WakeAllConditionVariable(&mDoneCond);
+    if(!okay)
+    {
+        LeaveCriticalSection(&mLock);
+        return;
+    }
+
+    // Queued jobs are still finished when quitting, since something may be
+    // waiting on them.
+    while(!mQuit || !mJobs.empty())
+    {
+        if(mJobs.empty())
+        {
+            SleepConditionVariableCS(&mWakeCond, &mLock, INFINITE);
+            continue;
+        }
+        Job job = std::move(mJobs.front());
+        mJobs.pop_front();
+        LeaveCriticalSection(&mLock);
+
+        job.mFunc();
+        // Other contexts are only guaranteed to see the changes once they've
+        // completed.
+        glFinish();
+
+        EnterCriticalSection(&mLock);
+        --*job.mPending;
+        WakeAllConditionVariable(&mDoneCond);
+    }
+    LeaveCriticalSection(&mLock);
+
+    wglMakeCurrent(nullptr, nullptr);
+}
+
+DWORD CALLBACK ShaderCompiler::thread_func(void *arg)
+{
+    Thread *thread = static_cast<Thread*>(arg);
+    thread->mSelf->workerLoop(*thread);
+    return 0;
+}
+
+
+void ShaderCompiler::queue(std::function<void()>&& job, std::atomic<ULONG> &pending)
+{
+    EnterCriticalSection(&mLock);
+    mJobs.push_back(Job{std::move(job), &pending});
+    WakeConditionVariable(&mWakeCond);
+    LeaveCriticalSection(&mLock);
+}
+
+void ShaderCompiler::wait(const std::atomic<ULONG> &pending)
+{
+    if(pending.load() == 0)
+        return;
+
+    EnterCriticalSection(&mLock);
+    while(pending.load() > 0)
+        SleepConditionVariableCS(&mDoneCond, &mLock, INFINITE);
+    LeaveCriticalSection(&mLock);
+}
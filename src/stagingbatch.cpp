@@ -0,0 +1,66 @@
+
+#include "stagingbatch.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "uploadring.hpp"
+#include "workerpool.hpp"
+#include "pixelconv.hpp"
+
+
+UINT StagingBatch::add(UINT len)
+{
+    UINT offset = mSize;
+    mSize += (len+15) & ~15;
+    return offset;
+}
+
+void StagingBatch::copy(UINT offset, const GLubyte *src, UINT len)
+{
+    const UINT partsize = sPartSize;
+    for(UINT pos = 0;pos < len;pos += partsize)
+        mParts.push_back(Part{offset+pos, src+pos, nullptr, 0, 0, std::min(partsize, len-pos), 1});
+}
+
+void StagingBatch::convert(UINT offset, const PixelConverter &conv, UINT dstpitch, UINT dstslice,
+                           const GLubyte *src, UINT srcpitch, UINT srcslice, UINT width, UINT height,
+                           UINT depth)
+{
+    UINT rows = std::max(1u, sPartSize / std::max(1u, dstpitch));
+    for(UINT z = 0;z < depth;++z)
+    {
+        for(UINT y = 0;y < height;y += rows)
+            mParts.push_back(Part{offset + z*dstslice + y*dstpitch, src + z*srcslice + y*srcpitch, &conv,
+                                  dstpitch, srcpitch, width, std::min(rows, height-y)});
+    }
+}
+
+UINT StagingBatch::stage()
+{
+    UINT base = mRing.reserve(mSize);
+    GLubyte *data = mRing.map(base, mSize);
+
+    auto fill = [this, data](size_t idx) -> void
+    {
+        const Part &part = mParts[idx];
+        if(!part.mConverter)
+            memcpy(data+part.mOffset, part.mSrc, part.mWidth);
+        else
+            part.mConverter->convertBox(data+part.mOffset, part.mDstPitch, 0, part.mSrc, part.mSrcPitch, 0,
+                                        part.mWidth, part.mHeight, 1);
+    };
+    if(mSize >= sMinParallelSize)
+        mPool.run(mParts.size(), fill);
+    else
+    {
+        for(size_t i = 0;i < mParts.size();++i)
+            fill(i);
+    }
+
+    mRing.commit(base, mSize, data);
+    mParts.clear();
+    mSize = 0;
+
+    return base;
+}
@@ -0,0 +1,610 @@
+
+#include "stateblock.hpp"
+
+#include <algorithm>
+#include <map>
+
+#include "device.hpp"
+#include "adapter.hpp"
+#include "trace.hpp"
+#include "private_iids.hpp"
+
+
+namespace
+{
+
+// The states each block type captures, as listed for D3DSTATEBLOCKTYPE.
+const D3DRENDERSTATETYPE PixelRenderStates[] = {
+    D3DRS_ALPHABLENDENABLE, D3DRS_ALPHAFUNC, D3DRS_ALPHAREF, D3DRS_ALPHATESTENABLE,
+    D3DRS_ANTIALIASEDLINEENABLE, D3DRS_BLENDFACTOR, D3DRS_BLENDOP, D3DRS_BLENDOPALPHA,
+    D3DRS_CCW_STENCILFAIL, D3DRS_CCW_STENCILFUNC, D3DRS_CCW_STENCILPASS, D3DRS_CCW_STENCILZFAIL,
+    D3DRS_COLORWRITEENABLE, D3DRS_COLORWRITEENABLE1, D3DRS_COLORWRITEENABLE2, D3DRS_COLORWRITEENABLE3,
+    D3DRS_DEPTHBIAS, D3DRS_DESTBLEND, D3DRS_DESTBLENDALPHA, D3DRS_DITHERENABLE, D3DRS_FILLMODE,
+    D3DRS_FOGDENSITY, D3DRS_FOGEND, D3DRS_FOGSTART, D3DRS_LASTPIXEL, D3DRS_SCISSORTESTENABLE,
+    D3DRS_SEPARATEALPHABLENDENABLE, D3DRS_SHADEMODE, D3DRS_SLOPESCALEDEPTHBIAS, D3DRS_SRCBLEND,
+    D3DRS_SRCBLENDALPHA, D3DRS_SRGBWRITEENABLE, D3DRS_STENCILENABLE, D3DRS_STENCILFAIL,
+    D3DRS_STENCILFUNC, D3DRS_STENCILMASK, D3DRS_STENCILPASS, D3DRS_STENCILREF,
+    D3DRS_STENCILWRITEMASK, D3DRS_STENCILZFAIL, D3DRS_TEXTUREFACTOR, D3DRS_TWOSIDEDSTENCILMODE,
+    D3DRS_WRAP0, D3DRS_WRAP1, D3DRS_WRAP2, D3DRS_WRAP3, D3DRS_WRAP4, D3DRS_WRAP5, D3DRS_WRAP6,
+    D3DRS_WRAP7, D3DRS_WRAP8, D3DRS_WRAP9, D3DRS_WRAP10, D3DRS_WRAP11, D3DRS_WRAP12,
+    D3DRS_WRAP13, D3DRS_WRAP14, D3DRS_WRAP15, D3DRS_ZENABLE, D3DRS_ZFUNC, D3DRS_ZWRITEENABLE
+};
+const D3DRENDERSTATETYPE VertexRenderStates[] = {
+    D3DRS_ADAPTIVETESS_W, D3DRS_ADAPTIVETESS_X, D3DRS_ADAPTIVETESS_Y, D3DRS_ADAPTIVETESS_Z,
+    D3DRS_AMBIENT, D3DRS_AMBIENTMATERIALSOURCE, D3DRS_CLIPPING, D3DRS_CLIPPLANEENABLE,
+    D3DRS_COLORVERTEX, D3DRS_CULLMODE, D3DRS_DIFFUSEMATERIALSOURCE, D3DRS_EMISSIVEMATERIALSOURCE,
+    D3DRS_ENABLEADAPTIVETESSELLATION, D3DRS_FOGCOLOR, D3DRS_FOGDENSITY, D3DRS_FOGENABLE,
+    D3DRS_FOGEND, D3DRS_FOGSTART, D3DRS_FOGTABLEMODE, D3DRS_FOGVERTEXMODE,
+    D3DRS_INDEXEDVERTEXBLENDENABLE, D3DRS_LIGHTING, D3DRS_LOCALVIEWER, D3DRS_MAXTESSELLATIONLEVEL,
+    D3DRS_MINTESSELLATIONLEVEL, D3DRS_MULTISAMPLEANTIALIAS, D3DRS_MULTISAMPLEMASK,
+    D3DRS_NORMALDEGREE, D3DRS_NORMALIZENORMALS, D3DRS_PATCHEDGESTYLE, D3DRS_POINTSCALE_A,
+    D3DRS_POINTSCALE_B, D3DRS_POINTSCALE_C, D3DRS_POINTSCALEENABLE, D3DRS_POINTSIZE,
+    D3DRS_POINTSIZE_MAX, D3DRS_POINTSIZE_MIN, D3DRS_POINTSPRITEENABLE, D3DRS_POSITIONDEGREE,
+    D3DRS_RANGEFOGENABLE, D3DRS_SHADEMODE, D3DRS_SPECULARENABLE, D3DRS_SPECULARMATERIALSOURCE,
+    D3DRS_TWEENFACTOR, D3DRS_VERTEXBLEND
+};
+
+const D3DSAMPLERSTATETYPE PixelSamplerStates[] = {
+    D3DSAMP_ADDRESSU, D3DSAMP_ADDRESSV, D3DSAMP_ADDRESSW, D3DSAMP_BORDERCOLOR, D3DSAMP_MAGFILTER,
+    D3DSAMP_MINFILTER, D3DSAMP_MIPFILTER, D3DSAMP_MIPMAPLODBIAS, D3DSAMP_MAXMIPLEVEL,
+    D3DSAMP_MAXANISOTROPY, D3DSAMP_SRGBTEXTURE, D3DSAMP_ELEMENTINDEX
+};
+const D3DSAMPLERSTATETYPE VertexSamplerStates[] = {
+    D3DSAMP_DMAPOFFSET
+};
+
+const D3DTEXTURESTAGESTATETYPE PixelTexStageStates[] = {
+    D3DTSS_COLOROP, D3DTSS_COLORARG1, D3DTSS_COLORARG2, D3DTSS_ALPHAOP, D3DTSS_ALPHAARG1,
+    D3DTSS_ALPHAARG2, D3DTSS_BUMPENVMAT00, D3DTSS_BUMPENVMAT01, D3DTSS_BUMPENVMAT10,
+    D3DTSS_BUMPENVMAT11, D3DTSS_BUMPENVLSCALE, D3DTSS_BUMPENVLOFFSET, D3DTSS_COLORARG0,
+    D3DTSS_ALPHAARG0, D3DTSS_RESULTARG, D3DTSS_CONSTANT
+};
+const D3DTEXTURESTAGESTATETYPE VertexTexStageStates[] = {
+    D3DTSS_TEXCOORDINDEX, D3DTSS_TEXTURETRANSFORMFLAGS
+};
+
+// The register counts of the version 3 shader models.
+const UINT NumVSConstantsF = 256;
+const UINT NumPSConstantsF = 224;
+const UINT NumConstantsI = 16;
+const UINT NumConstantsB = 16;
+
+DWORD getPublicStage(DWORD stage)
+{
+    if(stage < MAX_FRAGMENT_SAMPLERS)
+        return stage;
+    return stage - MAX_FRAGMENT_SAMPLERS + D3DVERTEXTEXTURESAMPLER0;
+}
+
+template<typename T>
+void replace(T *&ref, T *obj)
+{
+    if(obj) obj->AddRef();
+    if(ref) ref->Release();
+    ref = obj;
+}
+
+} // namespace
+
+
+template<typename T, size_t N>
+void D3DGLStateBlock::Constants<T,N>::setAll(UINT count)
+{
+    mRanges.assign(1, Range{0, count});
+    mValues.assign(count*N, T());
+}
+
+template<typename T, size_t N>
+void D3DGLStateBlock::Constants<T,N>::set(UINT start, const T *values, UINT count)
+{
+    // Recording is rare enough to just rebuild the runs with the new
+    // registers.
+    std::map<UINT,std::array<T,N>> regs;
+    auto src = mValues.cbegin();
+    for(const Range &range : mRanges)
+    {
+        for(UINT i = 0;i < range.mCount;++i, src += N)
+            std::copy(src, src+N, regs[range.mStart+i].begin());
+    }
+    for(UINT i = 0;i < count;++i)
+        std::copy(values + i*N, values + (i+1)*N, regs[start+i].begin());
+
+    mRanges.clear();
+    mValues.clear();
+    for(const auto &reg : regs)
+    {
+        if(mRanges.empty() || mRanges.back().mStart+mRanges.back().mCount != reg.first)
+            mRanges.push_back(Range{reg.first, 0});
+        ++mRanges.back().mCount;
+        mValues.insert(mValues.end(), reg.second.begin(), reg.second.end());
+    }
+}
+
+template<typename T, size_t N> template<typename F>
+void D3DGLStateBlock::Constants<T,N>::capture(D3DGLDevice *device, F get)
+{
+    T *dst = mValues.data();
+    for(const Range &range : mRanges)
+    {
+        (device->*get)(range.mStart, dst, range.mCount);
+        dst += range.mCount*N;
+    }
+}
+
+template<typename T, size_t N> template<typename F>
+void D3DGLStateBlock::Constants<T,N>::apply(D3DGLDevice *device, F set) const
+{
+    const T *src = mValues.data();
+    for(const Range &range : mRanges)
+    {
+        (device->*set)(range.mStart, src, range.mCount);
+        src += range.mCount*N;
+    }
+}
+
+
+D3DGLStateBlock::D3DGLStateBlock(D3DGLDevice *parent)
+  : mRefCount(0)
+  , mParent(parent)
+  , mHasIndices(false), mIndices(nullptr)
+  , mHasVertexDecl(false), mVertexDecl(nullptr)
+  , mHasVertexShader(false), mVertexShader(nullptr)
+  , mHasPixelShader(false), mPixelShader(nullptr)
+  , mHasViewport(false), mViewport{}
+  , mHasScissorRect(false), mScissorRect{}
+  , mHasMaterial(false), mMaterial{}
+{
+    mParent->AddRef();
+}
+
+D3DGLStateBlock::~D3DGLStateBlock()
+{
+    for(Texture &tex : mTextures)
+    {
+        if(tex.mTexture) tex.mTexture->Release();
+    }
+    for(StreamSource &stream : mStreams)
+    {
+        if(stream.mBuffer) stream.mBuffer->Release();
+    }
+    if(mIndices) mIndices->Release();
+    if(mVertexDecl) mVertexDecl->Release();
+    if(mVertexShader) mVertexShader->Release();
+    if(mPixelShader) mPixelShader->Release();
+
+    mParent->Release();
+}
+
+HRESULT D3DGLStateBlock::init(D3DSTATEBLOCKTYPE type)
+{
+    if(type != D3DSBT_ALL && type != D3DSBT_PIXELSTATE && type != D3DSBT_VERTEXSTATE)
+    {
+        WARN("Invalid state block type: 0x%x\n", type);
+        return D3DERR_INVALIDCALL;
+    }
+
+    const D3DAdapter::Limits &limits = mParent->getAdapter().getLimits();
+    bool pixel = (type == D3DSBT_ALL || type == D3DSBT_PIXELSTATE);
+    bool vertex = (type == D3DSBT_ALL || type == D3DSBT_VERTEXSTATE);
+
+    // States in both lists are only included once.
+    std::array<bool,210> renderstates{};
+    if(pixel)
+    {
+        for(D3DRENDERSTATETYPE state : PixelRenderStates)
+            renderstates[state] = true;
+    }
+    if(vertex)
+    {
+        for(D3DRENDERSTATETYPE state : VertexRenderStates)
+            renderstates[state] = true;
+    }
+    for(size_t i = 0;i < renderstates.size();++i)
+    {
+        if(renderstates[i])
+            mRenderStates.push_back(RenderState{D3DRENDERSTATETYPE(i), 0});
+    }
+
+    for(DWORD sampler = 0;sampler < MAX_COMBINED_SAMPLERS;++sampler)
+    {
+        if(pixel)
+        {
+            for(D3DSAMPLERSTATETYPE state : PixelSamplerStates)
+                mSamplerStates.push_back(SamplerState{sampler, state, 0});
+        }
+        if(vertex)
+        {
+            for(D3DSAMPLERSTATETYPE state : VertexSamplerStates)
+                mSamplerStates.push_back(SamplerState{sampler, state, 0});
+        }
+    }
+
+    for(DWORD stage = 0;stage < std::min<UINT>(MAX_TEXTURES, limits.fragment_samplers);++stage)
+    {
+        if(pixel)
+        {
+            for(D3DTEXTURESTAGESTATETYPE state : PixelTexStageStates)
+                mTexStageStates.push_back(TexStageState{stage, state, 0});
+        }
+        if(vertex)
+        {
+            for(D3DTEXTURESTAGESTATETYPE state : VertexTexStageStates)
+                mTexStageStates.push_back(TexStageState{stage, state, 0});
+        }
+    }
+
+    if(pixel)
+    {
+        mHasPixelShader = true;
+        mPSConstantsF.setAll(NumPSConstantsF);
+        mPSConstantsI.setAll(NumConstantsI);
+        mPSConstantsB.setAll(NumConstantsB);
+    }
+    if(vertex)
+    {
+        // Only the lights the device has now.
+        std::vector<DWORD> lights;
+        mParent->getLightIndices(lights);
+        for(DWORD index : lights)
+            mLights.push_back(Light{index, true, {}, true, FALSE});
+
+        mHasVertexDecl = true;
+        mHasVertexShader = true;
+        mVSConstantsF.setAll(NumVSConstantsF);
+        mVSConstantsI.setAll(NumConstantsI);
+        mVSConstantsB.setAll(NumConstantsB);
+        for(UINT i = 0;i < MAX_STREAMS;++i)
+            mStreamFreqs.push_back(StreamFreq{i, 1});
+    }
+    if(type == D3DSBT_ALL)
+    {
+        mTransforms.push_back(Transform{D3DTS_VIEW, {}});
+        mTransforms.push_back(Transform{D3DTS_PROJECTION, {}});
+        for(UINT i = 0;i < 8;++i)
+            mTransforms.push_back(Transform{D3DTRANSFORMSTATETYPE(D3DTS_TEXTURE0+i), {}});
+        for(UINT i = 0;i < 256;++i)
+            mTransforms.push_back(Transform{D3DTS_WORLDMATRIX(i), {}});
+        for(DWORD stage = 0;stage < MAX_COMBINED_SAMPLERS;++stage)
+            mTextures.push_back(Texture{stage, nullptr});
+        for(UINT i = 0;i < MAX_STREAMS;++i)
+            mStreams.push_back(StreamSource{i, nullptr, 0, 0});
+        for(DWORD i = 0;i < std::min(limits.clipplanes, 8u);++i)
+            mClipPlanes.push_back(ClipPlane{i, {{0.0f, 0.0f, 0.0f, 0.0f}}});
+        mHasIndices = true;
+        mHasViewport = true;
+        mHasScissorRect = true;
+        mHasMaterial = true;
+    }
+
+    return Capture();
+}
+
+void D3DGLStateBlock::recordRenderState(D3DRENDERSTATETYPE state, DWORD value)
+{
+    auto iter = std::find_if(mRenderStates.begin(), mRenderStates.end(),
+        [state](const RenderState &rs) -> bool { return rs.mState == state; }
+    );
+    if(iter != mRenderStates.end())
+        iter->mValue = value;
+    else
+        mRenderStates.push_back(RenderState{state, value});
+}
+
+void D3DGLStateBlock::recordSamplerState(DWORD sampler, D3DSAMPLERSTATETYPE type, DWORD value)
+{
+    auto iter = std::find_if(mSamplerStates.begin(), mSamplerStates.end(),
+        [sampler, type](const SamplerState &ss) -> bool
+        { return ss.mSampler == sampler && ss.mType == type; }
+    );
+    if(iter != mSamplerStates.end())
+        iter->mValue = value;
+    else
+        mSamplerStates.push_back(SamplerState{sampler, type, value});
+}
+
+void D3DGLStateBlock::recordTexStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE type, DWORD value)
+{
+    auto iter = std::find_if(mTexStageStates.begin(), mTexStageStates.end(),
+        [stage, type](const TexStageState &tss) -> bool
+        { return tss.mStage == stage && tss.mType == type; }
+    );
+    if(iter != mTexStageStates.end())
+        iter->mValue = value;
+    else
+        mTexStageStates.push_back(TexStageState{stage, type, value});
+}
+
+void D3DGLStateBlock::recordTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
+{
+    auto iter = std::find_if(mTextures.begin(), mTextures.end(),
+        [stage](const Texture &tex) -> bool { return tex.mStage == stage; }
+    );
+    if(iter == mTextures.end())
+        iter = mTextures.insert(iter, Texture{stage, nullptr});
+    replace(iter->mTexture, texture);
+}
+
+void D3DGLStateBlock::recordStreamSource(UINT index, IDirect3DVertexBuffer9 *buffer, UINT offset, UINT stride)
+{
+    auto iter = std::find_if(mStreams.begin(), mStreams.end(),
+        [index](const StreamSource &stream) -> bool { return stream.mIndex == index; }
+    );
+    if(iter == mStreams.end())
+        iter = mStreams.insert(iter, StreamSource{index, nullptr, 0, 0});
+    replace(iter->mBuffer, buffer);
+    iter->mOffset = offset;
+    iter->mStride = stride;
+}
+
+void D3DGLStateBlock::recordStreamFreq(UINT index, UINT divisor)
+{
+    auto iter = std::find_if(mStreamFreqs.begin(), mStreamFreqs.end(),
+        [index](const StreamFreq &freq) -> bool { return freq.mIndex == index; }
+    );
+    if(iter != mStreamFreqs.end())
+        iter->mDivisor = divisor;
+    else
+        mStreamFreqs.push_back(StreamFreq{index, divisor});
+}
+
+void D3DGLStateBlock::recordIndices(IDirect3DIndexBuffer9 *indices)
+{
+    mHasIndices = true;
+    replace(mIndices, indices);
+}
+
+void D3DGLStateBlock::recordVertexDecl(IDirect3DVertexDeclaration9 *decl)
+{
+    mHasVertexDecl = true;
+    replace(mVertexDecl, decl);
+}
+
+void D3DGLStateBlock::recordVertexShader(IDirect3DVertexShader9 *shader)
+{
+    mHasVertexShader = true;
+    replace(mVertexShader, shader);
+}
+
+void D3DGLStateBlock::recordPixelShader(IDirect3DPixelShader9 *shader)
+{
+    mHasPixelShader = true;
+    replace(mPixelShader, shader);
+}
+
+void D3DGLStateBlock::recordViewport(const D3DVIEWPORT9 &viewport)
+{
+    mHasViewport = true;
+    mViewport = viewport;
+}
+
+void D3DGLStateBlock::recordScissorRect(const RECT &rect)
+{
+    mHasScissorRect = true;
+    mScissorRect = rect;
+}
+
+void D3DGLStateBlock::recordMaterial(const D3DMATERIAL9 &material)
+{
+    mHasMaterial = true;
+    mMaterial = material;
+}
+
+void D3DGLStateBlock::recordClipPlane(DWORD index, const float *plane)
+{
+    auto iter = std::find_if(mClipPlanes.begin(), mClipPlanes.end(),
+        [index](const ClipPlane &clip) -> bool { return clip.mIndex == index; }
+    );
+    if(iter == mClipPlanes.end())
+        iter = mClipPlanes.insert(iter, ClipPlane{index, {}});
+    std::copy(plane, plane+4, iter->mPlane.begin());
+}
+
+void D3DGLStateBlock::recordTransform(D3DTRANSFORMSTATETYPE state, const D3DMATRIX &matrix)
+{
+    auto iter = std::find_if(mTransforms.begin(), mTransforms.end(),
+        [state](const Transform &xform) -> bool { return xform.mState == state; }
+    );
+    if(iter != mTransforms.end())
+        iter->mMatrix = matrix;
+    else
+        mTransforms.push_back(Transform{state, matrix});
+}
+
+const D3DMATRIX *D3DGLStateBlock::findTransform(D3DTRANSFORMSTATETYPE state) const
+{
+    auto iter = std::find_if(mTransforms.begin(), mTransforms.end(),
+        [state](const Transform &xform) -> bool { return xform.mState == state; }
+    );
+    return (iter != mTransforms.end()) ? &iter->mMatrix : nullptr;
+}
+
+void D3DGLStateBlock::recordLight(DWORD index, const D3DLIGHT9 &light)
+{
+    auto iter = std::find_if(mLights.begin(), mLights.end(),
+        [index](const Light &lt) -> bool { return lt.mIndex == index; }
+    );
+    if(iter == mLights.end())
+        iter = mLights.insert(iter, Light{index, false, {}, false, FALSE});
+    iter->mHasLight = true;
+    iter->mLight = light;
+}
+
+void D3DGLStateBlock::recordLightEnable(DWORD index, WINBOOL enable)
+{
+    auto iter = std::find_if(mLights.begin(), mLights.end(),
+        [index](const Light &lt) -> bool { return lt.mIndex == index; }
+    );
+    if(iter == mLights.end())
+        iter = mLights.insert(iter, Light{index, false, {}, false, FALSE});
+    iter->mHasEnable = true;
+    iter->mEnable = enable;
+}
+
+void D3DGLStateBlock::recordVSConstantsF(UINT start, const float *values, UINT count)
+{ mVSConstantsF.set(start, values, count); }
+void D3DGLStateBlock::recordVSConstantsI(UINT start, const int *values, UINT count)
+{ mVSConstantsI.set(start, values, count); }
+void D3DGLStateBlock::recordVSConstantsB(UINT start, const WINBOOL *values, UINT count)
+{ mVSConstantsB.set(start, values, count); }
+void D3DGLStateBlock::recordPSConstantsF(UINT start, const float *values, UINT count)
+{ mPSConstantsF.set(start, values, count); }
+void D3DGLStateBlock::recordPSConstantsI(UINT start, const int *values, UINT count)
+{ mPSConstantsI.set(start, values, count); }
+void D3DGLStateBlock::recordPSConstantsB(UINT start, const WINBOOL *values, UINT count)
+{ mPSConstantsB.set(start, values, count); }
+
+
+HRESULT D3DGLStateBlock::QueryInterface(REFIID riid, void **obj)
+{
+    TRACE("iface %p, riid %s, obj %p\n", this, debugstr_guid(riid), obj);
+
+    *obj = NULL;
+    RETURN_IF_IID_TYPE(obj, riid, D3DGLStateBlock);
+    RETURN_IF_IID_TYPE(obj, riid, IDirect3DStateBlock9);
+    RETURN_IF_IID_TYPE(obj, riid, IUnknown);
+
+    FIXME("Unsupported interface %s\n", debugstr_guid(riid));
+    return E_NOINTERFACE;
+}
+
+ULONG D3DGLStateBlock::AddRef()
+{
+    ULONG ret = ++mRefCount;
+    TRACE("%p New refcount: %lu\n", this, ret);
+    return ret;
+}
+
+ULONG D3DGLStateBlock::Release()
+{
+    ULONG ret = --mRefCount;
+    TRACE("%p New refcount: %lu\n", this, ret);
+    if(ret == 0) delete this;
+    return ret;
+}
+
+
+HRESULT D3DGLStateBlock::GetDevice(IDirect3DDevice9 **device)
+{
+    TRACE("iface %p, device %p\n", this, device);
+    *device = mParent;
+    (*device)->AddRef();
+    return D3D_OK;
+}
+
+HRESULT D3DGLStateBlock::Capture()
+{
+    TRACE("iface %p\n", this);
+
+    mParent->captureStates(*this);
+
+    // The getters add a reference to what they return.
+    for(Texture &tex : mTextures)
+    {
+        if(tex.mTexture) tex.mTexture->Release();
+        mParent->GetTexture(getPublicStage(tex.mStage), &tex.mTexture);
+    }
+    for(StreamSource &stream : mStreams)
+    {
+        if(stream.mBuffer) stream.mBuffer->Release();
+        mParent->GetStreamSource(stream.mIndex, &stream.mBuffer, &stream.mOffset, &stream.mStride);
+    }
+    for(StreamFreq &freq : mStreamFreqs)
+        mParent->GetStreamSourceFreq(freq.mIndex, &freq.mDivisor);
+    if(mHasIndices)
+    {
+        if(mIndices) mIndices->Release();
+        mParent->GetIndices(&mIndices);
+    }
+    if(mHasVertexDecl)
+    {
+        if(mVertexDecl) mVertexDecl->Release();
+        mParent->GetVertexDeclaration(&mVertexDecl);
+    }
+    if(mHasVertexShader)
+    {
+        if(mVertexShader) mVertexShader->Release();
+        mParent->GetVertexShader(&mVertexShader);
+    }
+    if(mHasPixelShader)
+    {
+        if(mPixelShader) mPixelShader->Release();
+        mParent->GetPixelShader(&mPixelShader);
+    }
+    if(mHasViewport)
+        mParent->GetViewport(&mViewport);
+    if(mHasScissorRect)
+        mParent->GetScissorRect(&mScissorRect);
+    if(mHasMaterial)
+        mParent->GetMaterial(&mMaterial);
+    for(ClipPlane &clip : mClipPlanes)
+        mParent->GetClipPlane(clip.mIndex, clip.mPlane.data());
+    for(Transform &xform : mTransforms)
+        mParent->GetTransform(xform.mState, &xform.mMatrix);
+    // Lights the device doesn't have keep what the block has.
+    for(Light &light : mLights)
+    {
+        if(light.mHasLight)
+            mParent->GetLight(light.mIndex, &light.mLight);
+        if(light.mHasEnable)
+            mParent->GetLightEnable(light.mIndex, &light.mEnable);
+    }
+
+    mVSConstantsF.capture(mParent, &D3DGLDevice::GetVertexShaderConstantF);
+    mVSConstantsI.capture(mParent, &D3DGLDevice::GetVertexShaderConstantI);
+    mVSConstantsB.capture(mParent, &D3DGLDevice::GetVertexShaderConstantB);
+    mPSConstantsF.capture(mParent, &D3DGLDevice::GetPixelShaderConstantF);
+    mPSConstantsI.capture(mParent, &D3DGLDevice::GetPixelShaderConstantI);
+    mPSConstantsB.capture(mParent, &D3DGLDevice::GetPixelShaderConstantB);
+
+    return D3D_OK;
+}
+
+HRESULT D3DGLStateBlock::Apply()
+{
+    TRACE("iface %p\n", this);
+
+    // Constants go before the shaders, which pick their programs from the
+    // current int and bool constants when set.
+    mVSConstantsF.apply(mParent, &D3DGLDevice::SetVertexShaderConstantF);
+    mVSConstantsI.apply(mParent, &D3DGLDevice::SetVertexShaderConstantI);
+    mVSConstantsB.apply(mParent, &D3DGLDevice::SetVertexShaderConstantB);
+    mPSConstantsF.apply(mParent, &D3DGLDevice::SetPixelShaderConstantF);
+    mPSConstantsI.apply(mParent, &D3DGLDevice::SetPixelShaderConstantI);
+    mPSConstantsB.apply(mParent, &D3DGLDevice::SetPixelShaderConstantB);
+
+    mParent->applyStates(*this);
+
+    for(const Texture &tex : mTextures)
+        mParent->SetTexture(getPublicStage(tex.mStage), tex.mTexture);
+    if(mHasVertexDecl)
+        mParent->SetVertexDeclaration(mVertexDecl);
+    for(const StreamSource &stream : mStreams)
+        mParent->SetStreamSource(stream.mIndex, stream.mBuffer, stream.mOffset, stream.mStride);
+    for(const StreamFreq &freq : mStreamFreqs)
+        mParent->SetStreamSourceFreq(freq.mIndex, freq.mDivisor);
+    if(mHasIndices)
+        mParent->SetIndices(mIndices);
+    if(mHasVertexShader)
+        mParent->SetVertexShader(mVertexShader);
+    if(mHasPixelShader)
+        mParent->SetPixelShader(mPixelShader);
+    if(mHasViewport)
+        mParent->SetViewport(&mViewport);
+    if(mHasScissorRect)
+        mParent->SetScissorRect(&mScissorRect);
+    if(mHasMaterial)
+        mParent->SetMaterial(&mMaterial);
+    for(const ClipPlane &clip : mClipPlanes)
+        mParent->SetClipPlane(clip.mIndex, clip.mPlane.data());
+    for(const Transform &xform : mTransforms)
+        mParent->SetTransform(xform.mState, &xform.mMatrix);
+    for(const Light &light : mLights)
+    {
+        if(light.mHasLight)
+            mParent->SetLight(light.mIndex, &light.mLight);
+        if(light.mHasEnable)
+            mParent->LightEnable(light.mIndex, light.mEnable);
+    }
+
+    return D3D_OK;
+}
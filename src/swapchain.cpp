@@ -1,24 +1,54 @@
 
 #include "swapchain.hpp"
 
+#include <algorithm>
+
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
+#include "timeline.hpp"
 #include "device.hpp"
+#include "commandstream.hpp"
 #include "rendertarget.hpp"
+#include "plainsurface.hpp"
 #include "private_iids.hpp"
 
 
-void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
+void D3DGLSwapChain::swapBuffersGL(size_t backbuffer, UINT maxlatency)
 {
+    TIMELINE_SCOPE_GL("SwapBuffers");
+
+    // Don't let the GL queue up more than maxlatency frames. Present throttles
+    // on mPendingSwaps, so holding off here throttles the app as well. With
+    // one frame in flight, Present already holds the app back and the driver
+    // limits its own queue, like before frame latency was configurable, so
+    // there's no wait.
+    if(maxlatency > 1 && mSwapCount >= maxlatency)
+    {
+        GLsync fence = mSwapFences[(mSwapCount-maxlatency) % mSwapFences.size()];
+        GLenum ret;
+        while((ret=glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED)
+            WARN("Timed out waiting for frame %lu\n", mSwapCount-maxlatency);
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait for frame %lu\n", mSwapCount-maxlatency);
+    }
+
     // Flip the destination since we rendered upside down.
     RECT src_rect = { 0, 0, (INT)mParams.BackBufferWidth, (INT)mParams.BackBufferHeight };
     RECT dst_rect = { 0, (INT)mParams.BackBufferHeight-1, (INT)mParams.BackBufferWidth, 0-1 };
     mParent->blitFramebufferGL(GL_RENDERBUFFER, mBackbuffers[backbuffer]->getId(), 0, src_rect,
                                GL_NONE, 0, 0, dst_rect, GL_NEAREST);
 
+    checkGLFrameErrors();
+    mParent->getGPUTimer().endFrameGL();
     if(!SwapBuffers(mDevCtx))
         ERR("Failed to swap buffers, error: 0x%lx\n", GetLastError());
+    mParent->getGPUTimer().beginFrameGL();
+
+    GLsync &fence = mSwapFences[mSwapCount % mSwapFences.size()];
+    if(fence) glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++mSwapCount;
 
     mParent->getQueue().beginWait();
     --mPendingSwaps;
@@ -27,15 +57,44 @@ void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
 class SwapchainSwapBuffers : public Command {
     D3DGLSwapChain *mTarget;
     size_t mBackbuffer;
+    UINT mMaxLatency;
+
+public:
+    SwapchainSwapBuffers(D3DGLSwapChain *target, size_t backbuffer, UINT maxlatency)
+      : mTarget(target), mBackbuffer(backbuffer), mMaxLatency(maxlatency)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->swapBuffersGL(mBackbuffer, mMaxLatency);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::Swap, StreamValue{0});
+    }
+};
+
+void D3DGLSwapChain::deinitGL()
+{
+    for(GLsync &fence : mSwapFences)
+    {
+        if(fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+}
+class SwapchainDeinitCmd : public Command {
+    D3DGLSwapChain *mTarget;
 
 public:
-    SwapchainSwapBuffers(D3DGLSwapChain *target, size_t backbuffer) : mTarget(target), mBackbuffer(backbuffer) { }
+    SwapchainDeinitCmd(D3DGLSwapChain *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        mTarget->swapBuffersGL(mBackbuffer);
+        mTarget->deinitGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 class SetSwapIntervalCmd : public Command {
@@ -53,6 +112,10 @@ public:
         }
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::SwapInterval, StreamValue{GLuint(mInterval)});
+    }
 };
 
 
@@ -64,18 +127,16 @@ D3DGLSwapChain::D3DGLSwapChain(D3DGLDevice *parent)
   , mDevCtx(nullptr)
   , mIsAuto(false)
   , mPendingSwaps(0)
+  , mSwapCount(0)
 {
+    mSwapFences.fill(nullptr);
 }
 
 D3DGLSwapChain::~D3DGLSwapChain()
 {
-    if(mPendingSwaps > 0)
-    {
-        mParent->getQueue().beginWait();
-        while(mPendingSwaps > 0)
-            mParent->getQueue().wait();
-        mParent->getQueue().endWait();
-    }
+    CommandQueue &queue = mParent->getQueue();
+    if(queue.isActive())
+        queue.waitFence(queue.send<SwapchainDeinitCmd>(this));
 
     for(auto surface : mBackbuffers)
         delete surface;
@@ -225,6 +286,7 @@ ULONG D3DGLSwapChain::Release()
 HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND dstWindowOverride, const RGNDATA *dirtyRegion, DWORD flags)
 {
     TRACE("iface %p, srcRect %p, dstRect %p, dstWindowOverride %p, dirtyRegion %p, flags 0x%lx\n", this, srcRect, dstRect, dstWindowOverride, dirtyRegion, flags);
+    TIMELINE_SCOPE("Present");
 
     if(srcRect || dstRect)
         FIXME("Rectangled present not handled\n");
@@ -239,10 +301,19 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
     if(flags)
         FIXME("Ignoring flags 0x%lx\n", flags);
 
-    // Wait for the last swap to complete before doing the next one
+    // Textures locked since the last draw still need to go out with this
+    // frame, and the frame's end is when managed textures get evicted.
     CommandQueue &cmdqueue = mParent->getQueue();
+    cmdqueue.lock();
+    mParent->flushPendingUploads();
+    mParent->getResidency().endFrame();
+    cmdqueue.unlock();
+
+    // Wait for enough previous swaps to complete before doing the next one
+    UINT maxlatency;
+    mParent->GetMaximumFrameLatency(&maxlatency);
     cmdqueue.beginWait();
-    while(mPendingSwaps > 0)
+    while(mPendingSwaps >= maxlatency)
         cmdqueue.wait();
 
     // Send a swap command while under the wait lock (critical section) to
@@ -251,7 +322,9 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
     // occuring in between the buffer check and the SleepConditionVariableCS
     // call.
     ++mPendingSwaps;
-    cmdqueue.send<SwapchainSwapBuffers>(this, 0);
+    cmdqueue.send<SwapchainSwapBuffers>(this, 0, maxlatency);
+    cmdqueue.endFrame();
+    Timeline::endFrame(cmdqueue);
     cmdqueue.endWait();
 
     cmdqueue.wake();
@@ -261,8 +334,42 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
 
 HRESULT D3DGLSwapChain::GetFrontBufferData(IDirect3DSurface9 *dstSurface)
 {
-    FIXME("iface %p, dstSurface %p : stub!\n", this, dstSurface);
-    return E_NOTIMPL;
+    TRACE("iface %p, dstSurface %p\n", this, dstSurface);
+
+    D3DGLPlainSurface *plainsurface;
+    if(FAILED(dstSurface->QueryInterface(IID_D3DGLPlainSurface, (void**)&plainsurface)))
+    {
+        WARN("Destination is not a plain surface\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    const D3DSURFACE_DESC &desc = plainsurface->getDesc();
+    if(desc.Format != D3DFMT_A8R8G8B8)
+    {
+        WARN("Invalid destination format %s\n", d3dfmt_to_str(desc.Format));
+        plainsurface->Release();
+        return D3DERR_INVALIDCALL;
+    }
+
+    RECT winRect;
+    if(!GetClientRect(mWindow, &winRect))
+    {
+        ERR("Failed to get client rect for window %p, error: %lu\n", mWindow, GetLastError());
+        plainsurface->Release();
+        return D3DERR_INVALIDCALL;
+    }
+    if(mParams.Windowed)
+        FIXME("Only reading the window's client area\n");
+
+    // GL's origin is the bottom-left, so read the rows nearest the top.
+    LONG width = std::min<LONG>(winRect.right-winRect.left, desc.Width);
+    LONG height = std::min<LONG>(winRect.bottom-winRect.top, desc.Height);
+    LONG bottom = winRect.bottom - winRect.top;
+    RECT rect{ 0, bottom-height, width, bottom };
+    mParent->queueReadback(plainsurface, GL_FRONT, 0, 0, rect, desc.Width);
+
+    plainsurface->Release();
+    return D3D_OK;
 }
 
 HRESULT D3DGLSwapChain::GetBackBuffer(UINT backbuffer, D3DBACKBUFFER_TYPE type, IDirect3DSurface9 **out)
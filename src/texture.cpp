@@ -1,10 +1,14 @@
 
 #include "texture.hpp"
 
+#include <cstring>
 #include <limits>
 
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 #include "glformat.hpp"
+#include "pixelconv.hpp"
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
@@ -43,18 +47,7 @@ void D3DGLTexture::initGL()
         h >>= 1;
     }
 
-    glGenTextures(1, &mTexId);
-    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
-    glTextureImage2DEXT(mTexId, GL_TEXTURE_2D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
-                        mGLFormat->format, mGLFormat->type, nullptr);
-    checkGLError();
-
-    // Force allocation of mipmap levels, if any
-    if(mSurfaces.size() > 1)
-    {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
-        checkGLError();
-    }
+    allocGL();
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
@@ -72,20 +65,89 @@ public:
         mTarget->initGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLTexture::allocGL()
+{
+    glGenTextures(1, &mTexId);
+    if(mGLFormat->canUseStorage())
+        glTextureStorage2DEXT(mTexId, GL_TEXTURE_2D, mSurfaces.size(), mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height);
+    else
+    {
+        glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
+        glTextureImage2DEXT(mTexId, GL_TEXTURE_2D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
+                            mGLFormat->format, mGLFormat->type, nullptr);
+        // Force allocation of mipmap levels, if any
+        if(mSurfaces.size() > 1)
+            glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
+    }
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureImage, StreamTexImage{
+            mTexId, GL_TEXTURE_2D, GLint(mSurfaces.size()), mGLFormat->internalformat,
+            GLsizei(mDesc.Width), GLsizei(mDesc.Height), 1, mGLFormat->format, mGLFormat->type
+        });
+}
+class TextureRestoreCmd : public Command {
+    D3DGLTexture *mTarget;
+
+public:
+    TextureRestoreCmd(D3DGLTexture *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->allocGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLTexture::evictGL()
+{
+    glDeleteTextures(1, &mTexId);
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureDelete, StreamValue{mTexId});
+    mTexId = 0;
+}
+class TextureEvictCmd : public Command {
+    D3DGLTexture *mTarget;
+
+public:
+    TextureEvictCmd(D3DGLTexture *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->evictGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 class TextureDeinitCmd : public Command {
+    FramebufferCache &mFramebuffers;
     GLuint mTexId;
 
 public:
-    TextureDeinitCmd(GLuint texid) : mTexId(texid) { }
+    TextureDeinitCmd(FramebufferCache &framebuffers, GLuint texid)
+      : mFramebuffers(framebuffers), mTexId(texid)
+    { }
 
     virtual ULONG execute()
     {
+        mFramebuffers.forgetGL(false, mTexId);
         glDeleteTextures(1, &mTexId);
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::TextureDelete, StreamValue{mTexId});
+    }
 };
 
 
@@ -93,6 +155,9 @@ void D3DGLTexture::genMipmapGL()
 {
     glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
     checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureGenMip, StreamBindTexture{0, GL_TEXTURE_2D, mTexId});
 }
 class TextureGenMipCmd : public Command {
     D3DGLTexture *mTarget;
@@ -105,47 +170,77 @@ public:
         mTarget->genMipmapGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
-void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr)
+const GLubyte *D3DGLTexture::getLevelData(DWORD level) const
+{
+    return &mSysMem[mSurfaces[level]->getDataOffset()];
+}
+
+UINT D3DGLTexture::getLevelPitch(DWORD level) const
+{
+    UINT w = std::max(1u, mDesc.Width>>level);
+    if(mIsCompressed)
+        return GLFormatInfo::calcBlockPitch(w, mGLFormat->bytesperblock);
+    return GLFormatInfo::calcPitch(w, mGLFormat->bytesperpixel);
+}
+
+UINT D3DGLTexture::calcUpdateRange(DWORD level, const RECT &rect, UINT &length) const
+{
+    UINT w = std::max(1u, mDesc.Width>>level);
+
+    if(mIsCompressed)
+    {
+        int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        UINT offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
+        length = mSurfaces[level]->getDataLength() - offset;
+        return offset;
+    }
+
+    int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+    length = (rect.bottom-rect.top-1)*pitch + (rect.right-rect.left)*mGLFormat->bytesperpixel;
+    return (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
+}
+
+void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     /*UINT h = std::max(1u, mDesc.Height>>Level);*/
 
-    D3DGLTextureSurface *surface = mSurfaces[level];
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
     if(mIsCompressed)
     {
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
-            len = surface->getDataLength() - offset;
-            dataPtr += offset;
-        }
         glCompressedTextureSubImage2DEXT(mTexId, GL_TEXTURE_2D, level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
-            mGLFormat->internalformat, len, dataPtr
+            mGLFormat->internalformat, length, dataPtr
         );
+
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, GL_TEXTURE_2D, GLint(level), rect.left, rect.top, 0,
+                rect.right-rect.left, rect.bottom-rect.top, 1,
+                mGLFormat->internalformat, GL_NONE, 0, 0
+            }, dataPtr, length);
     }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
         glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
         glTextureSubImage2DEXT(mTexId, GL_TEXTURE_2D, level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->format, mGLFormat->type, dataPtr
         );
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-    }
 
-    if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, GL_TEXTURE_2D, GLint(level), rect.left, rect.top, 0,
+                rect.right-rect.left, rect.bottom-rect.top, 1,
+                mGLFormat->format, mGLFormat->type, GLint(w), 0
+            }, dataPtr, length);
+    }
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     checkGLError();
 
     --mUpdateInProgress;
@@ -154,16 +249,35 @@ class TextureLoadLevelCmd : public Command {
     D3DGLTexture *mTarget;
     DWORD mLevel;
     RECT mRect;
+    GLuint mPbo;
     const GLubyte *mDataPtr;
+    UINT mLength;
 
 public:
-    TextureLoadLevelCmd(D3DGLTexture *target, DWORD level, const RECT &rect, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mRect(rect), mDataPtr(dataPtr)
+    TextureLoadLevelCmd(D3DGLTexture *target, DWORD level, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length)
+      : mTarget(target), mLevel(level), mRect(rect), mPbo(pbo), mDataPtr(dataPtr), mLength(length)
     { }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mRect, mDataPtr);
+        mTarget->loadTexLevelGL(mLevel, mRect, mPbo, mDataPtr, mLength);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class TextureLoadConvertedCmd : public TextureLoadLevelCmd {
+    GLubyte *mData;
+
+public:
+    TextureLoadConvertedCmd(D3DGLTexture *target, DWORD level, const RECT &rect, GLubyte *data, UINT length)
+      : TextureLoadLevelCmd(target, level, rect, 0, data, length), mData(data)
+    { }
+    ~TextureLoadConvertedCmd() { PooledDataDeallocator<GLubyte>()(mData); }
+
+    virtual ULONG execute()
+    {
+        TextureLoadLevelCmd::execute();
         return sizeof(*this);
     }
 };
@@ -178,17 +292,30 @@ D3DGLTexture::D3DGLTexture(D3DGLDevice *parent)
   , mDirtyRect({std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
                 std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()})
   , mUpdateInProgress(0)
+  , mUpdateFence(0)
+  , mHasPendingRects(false)
   , mLodLevel(0)
 {
 }
 
 D3DGLTexture::~D3DGLTexture()
 {
-    if(mTexId)
+    if(mHasPendingRects || isManaged())
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        if(mHasPendingRects)
+            mParent->removePendingUpload(this);
+        if(isManaged())
+            mParent->getResidency().remove(this);
+        queue.unlock();
+    }
+
+    // An evicted texture already had its GL texture deleted.
+    if(mTexId && isResident())
     {
-        mParent->getQueue().send<TextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        CommandQueue &queue = mParent->getQueue();
+        queue.waitFence(queue.send<TextureDeinitCmd>(make_ref(mParent->getFramebuffers()), mTexId));
         mTexId = 0;
     }
 
@@ -207,14 +334,15 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         ERR("Width of height of 0: %ux%u\n", mDesc.Width, mDesc.Height);
         return false;
     }
+    // New textures are all dirty, for UpdateTexture.
+    mDirtyRect = RECT{0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height};
 
-    auto fmtinfo = gFormatList.find(mDesc.Format);
-    if(fmtinfo == gFormatList.end())
+    mGLFormat = FindGLFormat(mDesc.Format);
+    if(!mGLFormat)
     {
         ERR("Failed to find info for format %s\n", d3dfmt_to_str(mDesc.Format));
         return false;
     }
-    mGLFormat = &fmtinfo->second;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -271,6 +399,7 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         levels = maxLevels;
     for(UINT i = 0;i < levels;++i)
         mSurfaces.push_back(new D3DGLTextureSurface(this, i));
+    mPendingRects.resize(levels);
 
     if(mDesc.Format != D3DFMT_NULL)
     {
@@ -278,18 +407,234 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         mParent->getQueue().sendSync<TextureInitCmd>(this);
     }
 
+    if(isManaged())
+    {
+        UINT64 size = mSysMem.size();
+        if(const PixelConverter *conv = mGLFormat->converter)
+            size = size / mGLFormat->bytesperpixel * conv->dstbpp;
+
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        mParent->getResidency().add(this, size);
+        queue.unlock();
+    }
+
     return true;
 }
 
-void D3DGLTexture::updateTexture(DWORD level, const RECT &rect, const GLubyte *dataPtr)
+void D3DGLTexture::evict()
+{
+    mParent->getQueue().doSend<TextureEvictCmd>(this);
+}
+
+void D3DGLTexture::restore()
+{
+    mParent->getQueue().sendSync<TextureRestoreCmd>(this);
+
+    // The new storage is empty, so everything gets reuploaded.
+    for(DWORD level = 0;level < mPendingRects.size();++level)
+    {
+        LONG w = std::max(1u, mDesc.Width>>level);
+        LONG h = std::max(1u, mDesc.Height>>level);
+        mPendingRects[level].clear();
+        mPendingRects[level].add(RECT{0, 0, w, h});
+    }
+    if(!mHasPendingRects)
+    {
+        mHasPendingRects = true;
+        mParent->addPendingUpload(this);
+    }
+    flushUpdates();
+}
+
+ULONG D3DGLTexture::sendUpload(DWORD level, const RECT &rect, const GLubyte *dataPtr, UINT srcpitch)
+{
+    UINT length;
+    calcUpdateRange(level, rect, length);
+
+    ++mUpdateInProgress;
+    CommandQueue &queue = mParent->getQueue();
+    UploadRing &ring = mParent->getUploadRing();
+    UINT w = std::max(1u, mDesc.Width>>level);
+    UINT width = rect.right - rect.left;
+    UINT height = rect.bottom - rect.top;
+    if(const PixelConverter *conv = mGLFormat->converter)
+    {
+        UINT dstpitch = GLFormatInfo::calcPitch(w, conv->dstbpp);
+        length = (height-1)*dstpitch + width*conv->dstbpp;
+
+        if(ring.canStage(length))
+        {
+            UINT offset = ring.reserve(length);
+            GLubyte *dst = ring.map(offset, length);
+            conv->convertBox(dst, dstpitch, 0, dataPtr, srcpitch, 0, width, height, 1);
+            ring.commit(offset, length, dst);
+            queue.doSend<TextureLoadLevelCmd>(this, level, rect, ring.getBufferId(),
+                                              ((GLubyte*)nullptr) + offset, length);
+        }
+        else
+        {
+            GLubyte *dst = PooledDataAllocator<GLubyte>()(length);
+            conv->convertBox(dst, dstpitch, 0, dataPtr, srcpitch, 0, width, height, 1);
+            queue.doSend<TextureLoadConvertedCmd>(this, level, rect, dst, length);
+        }
+        return 0;
+    }
+
+    UINT rowlen, rows, dstpitch;
+    if(mIsCompressed)
+    {
+        // Compressed uploads read the rect's block rows tightly packed.
+        rowlen = dstpitch = (width+3)/4 * mGLFormat->bytesperblock;
+        rows = (height+3)/4;
+    }
+    else
+    {
+        rowlen = width * mGLFormat->bytesperpixel;
+        rows = height;
+        dstpitch = GLFormatInfo::calcPitch(w, mGLFormat->bytesperpixel);
+    }
+    if(srcpitch != dstpitch)
+    {
+        // Rows are repacked to the pitch the upload expects.
+        length = (rows-1)*dstpitch + rowlen;
+        bool staged = ring.canStage(length);
+        GLubyte *dst;
+        UINT offset = 0;
+        if(staged)
+        {
+            offset = ring.reserve(length);
+            dst = ring.map(offset, length);
+        }
+        else
+            dst = PooledDataAllocator<GLubyte>()(length);
+        for(UINT y = 0;y < rows;++y)
+            memcpy(dst + y*dstpitch, dataPtr + y*srcpitch, rowlen);
+        if(staged)
+        {
+            ring.commit(offset, length, dst);
+            queue.doSend<TextureLoadLevelCmd>(this, level, rect, ring.getBufferId(),
+                                              ((GLubyte*)nullptr) + offset, length);
+        }
+        else
+            queue.doSend<TextureLoadConvertedCmd>(this, level, rect, dst, length);
+        return 0;
+    }
+
+    if(ring.canStage(length))
+    {
+        // The upload reads the staged copy, so the app can write the system
+        // memory again right away.
+        UINT offset = ring.reserve(length);
+        ring.copy(offset, dataPtr, length);
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, ring.getBufferId(),
+                                          ((GLubyte*)nullptr) + offset, length);
+        return 0;
+    }
+    return queue.doSend<TextureLoadLevelCmd>(this, level, rect, 0, dataPtr, length);
+}
+
+void D3DGLTexture::sendUpdate(DWORD level, const RECT &rect)
+{
+    UINT length;
+    const GLubyte *dataPtr = getLevelData(level) + calcUpdateRange(level, rect, length);
+    if(ULONG fence = sendUpload(level, rect, dataPtr, getLevelPitch(level)))
+        mUpdateFence = fence;
+}
+
+void D3DGLTexture::updateFrom(D3DGLTexture *src)
+{
+    // The source's extra top levels are skipped.
+    DWORD srclevel = 0;
+    while(std::max(1u, src->mDesc.Width>>srclevel) > mDesc.Width)
+        ++srclevel;
+
+    const RECT &dirty = src->mDirtyRect;
+    DWORD levels = std::min<DWORD>(mSurfaces.size(), src->mSurfaces.size()-srclevel);
+    bool genmips = (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1;
+    if(genmips) levels = 1;
+
+    ULONG fence = 0;
+    for(DWORD level = 0;level < levels && dirty.left < dirty.right && dirty.top < dirty.bottom;++level)
+    {
+        DWORD slevel = srclevel + level;
+        LONG w = std::max(1u, mDesc.Width>>level);
+        LONG h = std::max(1u, mDesc.Height>>level);
+        RECT rect{
+            dirty.left>>slevel, dirty.top>>slevel,
+            std::min(w, (dirty.right+(1<<slevel)-1)>>slevel),
+            std::min(h, (dirty.bottom+(1<<slevel)-1)>>slevel)
+        };
+        if(mIsCompressed)
+        {
+            rect.left &= ~3;
+            rect.top &= ~3;
+            rect.right = std::min(w, (rect.right+3)&~3);
+            rect.bottom = std::min(h, (rect.bottom+3)&~3);
+        }
+        if(rect.left >= rect.right || rect.top >= rect.bottom)
+            continue;
+
+        // Both are the same format, so the source level has the same layout.
+        UINT length;
+        const GLubyte *dataPtr = src->getLevelData(slevel) + calcUpdateRange(level, rect, length);
+        if(ULONG f = sendUpload(level, rect, dataPtr, getLevelPitch(level)))
+            fence = f;
+    }
+    if(fence)
+        src->mUpdateFence = fence;
+
+    if(genmips)
+        mParent->getQueue().doSend<TextureGenMipCmd>(this);
+
+    src->mDirtyRect = RECT{std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
+                           std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()};
+}
+
+void D3DGLTexture::queueUpdate(DWORD level, const RECT &rect)
 {
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<TextureLoadLevelCmd>(this, level, rect, dataPtr);
+    mPendingRects[level].add(rect);
+    if(!mHasPendingRects)
+    {
+        mHasPendingRects = true;
+        mParent->addPendingUpload(this);
+    }
     queue.unlock();
 }
 
+void D3DGLTexture::flushUpdates()
+{
+    if(!mHasPendingRects)
+        return;
+    mHasPendingRects = false;
+    mParent->removePendingUpload(this);
+
+    // System memory has it all, for when the texture gets restored.
+    if(!isResident())
+    {
+        for(DirtyRects &rects : mPendingRects)
+            rects.clear();
+        return;
+    }
+
+    bool genmips = false;
+    for(DWORD level = 0;level < mPendingRects.size();++level)
+    {
+        DirtyRects &rects = mPendingRects[level];
+        if(rects.empty())
+            continue;
+        for(const RECT &rect : rects)
+            sendUpdate(level, rect);
+        rects.clear();
+        if(level == 0) genmips = true;
+    }
+
+    if(genmips && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
+        mParent->getQueue().doSend<TextureGenMipCmd>(this);
+}
+
 void D3DGLTexture::addIface()
 {
     ++mIfaceCount;
@@ -371,19 +716,44 @@ HRESULT D3DGLTexture::FreePrivateData(REFGUID refguid)
 
 DWORD D3DGLTexture::SetPriority(DWORD priority)
 {
-    FIXME("iface %p, priority %lu : stub!\n", this, priority);
-    return 0;
+    TRACE("iface %p, priority %lu\n", this, priority);
+
+    if(!isManaged())
+        return 0;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    priority = mParent->getResidency().setPriority(this, priority);
+    queue.unlock();
+    return priority;
 }
 
 DWORD D3DGLTexture::GetPriority()
 {
-    FIXME("iface %p : stub!\n", this);
-    return 0;
+    TRACE("iface %p\n", this);
+
+    if(!isManaged())
+        return 0;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    DWORD priority = mParent->getResidency().getPriority(this);
+    queue.unlock();
+    return priority;
 }
 
 void D3DGLTexture::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+
+    if(!isManaged())
+        return;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    mParent->getResidency().use(this);
+    flushUpdates();
+    queue.unlock();
 }
 
 D3DRESOURCETYPE D3DGLTexture::GetType()
@@ -436,7 +806,14 @@ void D3DGLTexture::GenerateMipSubLevels()
 {
     TRACE("iface %p\n", this);
     if(mDesc.Format != D3DFMT_NULL)
-        mParent->getQueue().send<TextureGenMipCmd>(this);
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        flushUpdates();
+        if(isResident())
+            queue.doSend<TextureGenMipCmd>(this);
+        queue.unlock();
+    }
 }
 
 
@@ -624,6 +1001,7 @@ HRESULT D3DGLTextureSurface::GetDesc(D3DSURFACE_DESC *desc)
 HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect, DWORD flags)
 {
     TRACE("iface %p, lockedRect %p, rect %p, flags 0x%lx\n", this, lockedRect, rect, flags);
+    TIMELINE_SCOPE("TextureSurface::LockRect");
 
     if(mParent->mDesc.Format == D3DFMT_NULL)
     {
@@ -672,8 +1050,7 @@ HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *re
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
     {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
+        mParent->mParent->getQueue().waitFence(mParent->mUpdateFence);
     }
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
@@ -706,6 +1083,7 @@ HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *re
 HRESULT D3DGLTextureSurface::UnlockRect()
 {
     TRACE("iface %p\n", this);
+    TIMELINE_SCOPE("TextureSurface::UnlockRect");
 
     if(mLock == LT_Unlocked)
     {
@@ -714,7 +1092,7 @@ HRESULT D3DGLTextureSurface::UnlockRect()
     }
 
     if(mLock != LT_ReadOnly)
-        mParent->updateTexture(mLevel, mLockRegion, &mParent->mSysMem[mDataOffset]);
+        mParent->queueUpdate(mLevel, mLockRegion);
 
     mLock = LT_Unlocked;
     return D3D_OK;
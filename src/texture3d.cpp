@@ -4,7 +4,11 @@
 #include <limits>
 
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 #include "glformat.hpp"
+#include "pixelconv.hpp"
+#include "stagingbatch.hpp"
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
@@ -47,17 +51,26 @@ void D3DGLTexture3D::initGL()
     }
 
     glGenTextures(1, &mTexId);
-    glTextureParameteriEXT(mTexId, GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, mVolumes.size()-1);
-    glTextureImage3DEXT(mTexId, GL_TEXTURE_3D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, mDesc.Depth,
-                        0, mGLFormat->format, mGLFormat->type, nullptr);
-    checkGLError();
-
-    // Force allocation of mipmap levels, if any
-    if(mVolumes.size() > 1)
+    if(mGLFormat->canUseStorage())
+        glTextureStorage3DEXT(mTexId, GL_TEXTURE_3D, mVolumes.size(), mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height, mDesc.Depth);
+    else
     {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
-        checkGLError();
+        glTextureParameteriEXT(mTexId, GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, mVolumes.size()-1);
+        glTextureImage3DEXT(mTexId, GL_TEXTURE_3D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height,
+                            mDesc.Depth, 0, mGLFormat->format, mGLFormat->type, nullptr);
+        // Force allocation of mipmap levels, if any
+        if(mVolumes.size() > 1)
+            glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
     }
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureImage, StreamTexImage{
+            mTexId, GL_TEXTURE_3D, GLint(mVolumes.size()), mGLFormat->internalformat,
+            GLsizei(mDesc.Width), GLsizei(mDesc.Height), GLsizei(mDesc.Depth),
+            mGLFormat->format, mGLFormat->type
+        });
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
@@ -75,6 +88,7 @@ public:
         mTarget->initGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 class Texture3DDeinitCmd : public Command {
@@ -89,6 +103,10 @@ public:
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::TextureDelete, StreamValue{mTexId});
+    }
 };
 
 
@@ -96,6 +114,9 @@ void D3DGLTexture3D::genMipmapGL()
 {
     glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
     checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureGenMip, StreamBindTexture{0, GL_TEXTURE_3D, mTexId});
 }
 class Texture3DGenMipCmd : public Command {
     D3DGLTexture3D *mTarget;
@@ -108,40 +129,54 @@ public:
         mTarget->genMipmapGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
-void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
+UINT D3DGLTexture3D::calcUpdateRange(DWORD level, const D3DBOX &box, UINT &length) const
+{
+    UINT w = std::max(1u, mDesc.Width>>level);
+    UINT h = std::max(1u, mDesc.Height>>level);
+
+    if(mIsCompressed)
+    {
+        int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        int slice = pitch * ((h+3)/4);
+        UINT offset = box.Front*slice + (box.Top/4*pitch) + (box.Left/4*mGLFormat->bytesperblock);
+        length = mVolumes[level]->getDataLength() - offset;
+        return offset;
+    }
+
+    int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+    int slice = pitch * h;
+    length = (box.Back-box.Front-1)*slice + (box.Bottom-box.Top-1)*pitch +
+             (box.Right-box.Left)*mGLFormat->bytesperpixel;
+    return box.Front*slice + (box.Top*pitch) + (box.Left*mGLFormat->bytesperpixel);
+}
+
+void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, GLuint pbo, const GLubyte *dataPtr, UINT length)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     UINT h = std::max(1u, mDesc.Height>>level);
     /*UINT d = std::max(1u, mDesc.Depth>>level);*/
 
-    D3DGLTextureVolume *volume = mVolumes[level];
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
     if(mIsCompressed)
     {
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int slice = pitch * ((h+3)/4);
-            int offset = box.Front*slice + (box.Top/4*pitch) + (box.Left/4*mGLFormat->bytesperblock);
-            len = volume->getDataLength() - offset;
-            dataPtr += offset;
-        }
         glCompressedTextureSubImage3DEXT(mTexId, GL_TEXTURE_3D, level,
             box.Left, box.Top, box.Front, box.Right-box.Left, box.Bottom-box.Top, box.Back-box.Front,
-            mGLFormat->internalformat, len, dataPtr
+            mGLFormat->internalformat, length, dataPtr
         );
+
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, GL_TEXTURE_3D, GLint(level), GLint(box.Left), GLint(box.Top), GLint(box.Front),
+                GLsizei(box.Right-box.Left), GLsizei(box.Bottom-box.Top), GLsizei(box.Back-box.Front),
+                mGLFormat->internalformat, GL_NONE, 0, 0
+            }, dataPtr, length);
     }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        int slice = pitch * h;
-        dataPtr += box.Front*slice + (box.Top*pitch) + (box.Left*mGLFormat->bytesperpixel);
         glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, h);
         glTextureSubImage3DEXT(mTexId, GL_TEXTURE_3D, level,
@@ -150,10 +185,22 @@ void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyt
         );
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, GL_TEXTURE_3D, GLint(level), GLint(box.Left), GLint(box.Top), GLint(box.Front),
+                GLsizei(box.Right-box.Left), GLsizei(box.Bottom-box.Top), GLsizei(box.Back-box.Front),
+                mGLFormat->format, mGLFormat->type, GLint(w), GLint(h)
+            }, dataPtr, length);
     }
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mVolumes.size() > 1)
+    {
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureGenMip, StreamBindTexture{0, GL_TEXTURE_3D, mTexId});
+    }
     checkGLError();
 
     --mUpdateInProgress;
@@ -162,16 +209,35 @@ class Texture3DLoadLevelCmd : public Command {
     D3DGLTexture3D *mTarget;
     DWORD mLevel;
     D3DBOX mBox;
+    GLuint mPbo;
     const GLubyte *mDataPtr;
+    UINT mLength;
+
+public:
+    Texture3DLoadLevelCmd(D3DGLTexture3D *target, DWORD level, const D3DBOX &box, GLuint pbo, const GLubyte *dataPtr, UINT length)
+      : mTarget(target), mLevel(level), mBox(box), mPbo(pbo), mDataPtr(dataPtr), mLength(length)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->loadTexLevelGL(mLevel, mBox, mPbo, mDataPtr, mLength);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class Texture3DLoadConvertedCmd : public Texture3DLoadLevelCmd {
+    GLubyte *mData;
 
 public:
-    Texture3DLoadLevelCmd(D3DGLTexture3D *target, DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mBox(box), mDataPtr(dataPtr)
+    Texture3DLoadConvertedCmd(D3DGLTexture3D *target, DWORD level, const D3DBOX &box, GLubyte *data, UINT length)
+      : Texture3DLoadLevelCmd(target, level, box, 0, data, length), mData(data)
     { }
+    ~Texture3DLoadConvertedCmd() { PooledDataDeallocator<GLubyte>()(mData); }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mBox, mDataPtr);
+        Texture3DLoadLevelCmd::execute();
         return sizeof(*this);
     }
 };
@@ -187,6 +253,7 @@ D3DGLTexture3D::D3DGLTexture3D(D3DGLDevice *parent)
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::min(),
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::max()})
   , mUpdateInProgress(0)
+  , mUpdateFence(0)
   , mLodLevel(0)
 {
 }
@@ -195,9 +262,8 @@ D3DGLTexture3D::~D3DGLTexture3D()
 {
     if(mTexId)
     {
-        mParent->getQueue().send<Texture3DDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        CommandQueue &queue = mParent->getQueue();
+        queue.waitFence(queue.send<Texture3DDeinitCmd>(mTexId));
         mTexId = 0;
     }
 
@@ -217,13 +283,12 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
         return false;
     }
 
-    auto fmtinfo = gFormatList.find(mDesc.Format);
-    if(fmtinfo == gFormatList.end())
+    mGLFormat = FindGLFormat(mDesc.Format);
+    if(!mGLFormat)
     {
         ERR("Failed to find info for format %s\n", d3dfmt_to_str(mDesc.Format));
         return false;
     }
-    mGLFormat = &fmtinfo->second;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -292,10 +357,48 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
 
 void D3DGLTexture3D::updateTexture(DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
 {
+    UINT length;
+    dataPtr += calcUpdateRange(level, box, length);
+
+    const PixelConverter *conv = mGLFormat->converter;
+    UINT h = std::max(1u, mDesc.Height>>level);
+    UINT srcpitch = 0, dstpitch = 0;
+    UINT width = box.Right - box.Left;
+    UINT height = box.Bottom - box.Top;
+    UINT depth = box.Back - box.Front;
+    if(conv)
+    {
+        UINT w = std::max(1u, mDesc.Width>>level);
+        srcpitch = GLFormatInfo::calcPitch(w, mGLFormat->bytesperpixel);
+        dstpitch = GLFormatInfo::calcPitch(w, conv->dstbpp);
+        length = (depth-1)*dstpitch*h + (height-1)*dstpitch + width*conv->dstbpp;
+    }
+
+    ++mUpdateInProgress;
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<Texture3DLoadLevelCmd>(this, level, box, dataPtr);
+    UploadRing &ring = mParent->getUploadRing();
+    if(ring.canStage(length))
+    {
+        // The slices get copied or converted across the worker pool.
+        StagingBatch batch(ring, mParent->getWorkerPool());
+        UINT offset = batch.add(length);
+        if(conv)
+            batch.convert(offset, *conv, dstpitch, dstpitch*h, dataPtr, srcpitch, srcpitch*h, width, height, depth);
+        else
+            batch.copy(offset, dataPtr, length);
+        offset += batch.stage();
+        queue.doSend<Texture3DLoadLevelCmd>(this, level, box, ring.getBufferId(),
+                                            ((GLubyte*)nullptr) + offset, length);
+    }
+    else if(conv)
+    {
+        GLubyte *dst = PooledDataAllocator<GLubyte>()(length);
+        conv->convertBox(dst, dstpitch, dstpitch*h, dataPtr, srcpitch, srcpitch*h, width, height, depth);
+        queue.doSend<Texture3DLoadConvertedCmd>(this, level, box, dst, length);
+    }
+    else
+        mUpdateFence = queue.doSend<Texture3DLoadLevelCmd>(this, level, box, 0, dataPtr, length);
     queue.unlock();
 }
 
@@ -609,6 +712,7 @@ HRESULT D3DGLTextureVolume::GetDesc(D3DVOLUME_DESC *desc)
 HRESULT D3DGLTextureVolume::LockBox(D3DLOCKED_BOX *lockedbox, const D3DBOX *box, DWORD flags)
 {
     TRACE("iface %p, lockedbox %p, box %p, flags 0x%lx\n", this, lockedbox, box, flags);
+    TIMELINE_SCOPE("TextureVolume::LockBox");
 
     if(mParent->mDesc.Format == D3DFMT_NULL)
     {
@@ -658,8 +762,7 @@ HRESULT D3DGLTextureVolume::LockBox(D3DLOCKED_BOX *lockedbox, const D3DBOX *box,
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
     {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
+        mParent->mParent->getQueue().waitFence(mParent->mUpdateFence);
     }
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
@@ -697,6 +800,7 @@ HRESULT D3DGLTextureVolume::LockBox(D3DLOCKED_BOX *lockedbox, const D3DBOX *box,
 HRESULT D3DGLTextureVolume::UnlockBox()
 {
     TRACE("iface %p\n", this);
+    TIMELINE_SCOPE("TextureVolume::UnlockBox");
 
     if(mLock == LT_Unlocked)
     {
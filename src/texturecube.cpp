@@ -5,7 +5,11 @@
 #include <array>
 
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
 #include "glformat.hpp"
+#include "pixelconv.hpp"
+#include "stagingbatch.hpp"
 #include "d3dgl.hpp"
 #include "device.hpp"
 #include "adapter.hpp"
@@ -56,19 +60,7 @@ void D3DGLCubeTexture::initGL()
         }
     }
 
-    glGenTextures(1, &mTexId);
-    glTextureParameteriEXT(mTexId, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
-    for(GLenum face : D3D2GLCubeFace)
-        glTextureImage2DEXT(mTexId, face, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
-                            mGLFormat->format, mGLFormat->type, nullptr);
-    checkGLError();
-
-    // Force allocation of mipmap levels, if any
-    if(mSurfaces.size() > 1)
-    {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
-        checkGLError();
-    }
+    allocGL();
 
     if(mDesc.Pool != D3DPOOL_DEFAULT)
         mSysMem.assign(total_size, 0);
@@ -86,21 +78,91 @@ public:
         mTarget->initGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLCubeTexture::allocGL()
+{
+    glGenTextures(1, &mTexId);
+    if(mGLFormat->canUseStorage())
+        glTextureStorage2DEXT(mTexId, GL_TEXTURE_CUBE_MAP, mSurfaces.size(), mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height);
+    else
+    {
+        glTextureParameteriEXT(mTexId, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
+        for(GLenum face : D3D2GLCubeFace)
+            glTextureImage2DEXT(mTexId, face, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
+                                mGLFormat->format, mGLFormat->type, nullptr);
+        // Force allocation of mipmap levels, if any
+        if(mSurfaces.size() > 1)
+            glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
+    }
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureImage, StreamTexImage{
+            mTexId, GL_TEXTURE_CUBE_MAP, GLint(mSurfaces.size()), mGLFormat->internalformat,
+            GLsizei(mDesc.Width), GLsizei(mDesc.Height), 1, mGLFormat->format, mGLFormat->type
+        });
+}
+class CubeTextureRestoreCmd : public Command {
+    D3DGLCubeTexture *mTarget;
+
+public:
+    CubeTextureRestoreCmd(D3DGLCubeTexture *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->allocGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+void D3DGLCubeTexture::evictGL()
+{
+    glDeleteTextures(1, &mTexId);
+    checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureDelete, StreamValue{mTexId});
+    mTexId = 0;
+}
+class CubeTextureEvictCmd : public Command {
+    D3DGLCubeTexture *mTarget;
+
+public:
+    CubeTextureEvictCmd(D3DGLCubeTexture *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->evictGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
 class CubeTextureDeinitCmd : public Command {
+    FramebufferCache &mFramebuffers;
     GLuint mTexId;
 
 public:
-    CubeTextureDeinitCmd(GLuint texid) : mTexId(texid) { }
+    CubeTextureDeinitCmd(FramebufferCache &framebuffers, GLuint texid)
+      : mFramebuffers(framebuffers), mTexId(texid)
+    { }
 
     virtual ULONG execute()
     {
+        mFramebuffers.forgetGL(false, mTexId);
         glDeleteTextures(1, &mTexId);
         checkGLError();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::TextureDelete, StreamValue{mTexId});
+    }
 };
 
 
@@ -108,6 +170,9 @@ void D3DGLCubeTexture::genMipmapGL()
 {
     glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
     checkGLError();
+
+    if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+        stream->write(StreamOp::TextureGenMip, StreamBindTexture{0, GL_TEXTURE_CUBE_MAP, mTexId});
 }
 class CubeTextureGenMipCmd : public Command {
     D3DGLCubeTexture *mTarget;
@@ -120,47 +185,64 @@ public:
         mTarget->genMipmapGL();
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter&) const { }
 };
 
 
-void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
+UINT D3DGLCubeTexture::calcUpdateRange(DWORD level, GLint facenum, const RECT &rect, UINT &length) const
+{
+    UINT w = std::max(1u, mDesc.Width>>level);
+
+    if(mIsCompressed)
+    {
+        int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        UINT offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
+        length = mSurfaces[level][facenum]->getDataLength() - offset;
+        return offset;
+    }
+
+    int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+    length = (rect.bottom-rect.top-1)*pitch + (rect.right-rect.left)*mGLFormat->bytesperpixel;
+    return (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
+}
+
+void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     /*UINT h = std::max(1u, mDesc.Height>>Level);*/
 
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
     if(mIsCompressed)
     {
-        D3DGLCubeSurface *surface = mSurfaces[level][facenum];
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
-            len = surface->getDataLength() - offset;
-            dataPtr += offset;
-        }
         glCompressedTextureSubImage2DEXT(mTexId, D3D2GLCubeFace[facenum], level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
-            mGLFormat->internalformat, len, dataPtr
+            mGLFormat->internalformat, length, dataPtr
         );
+
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, D3D2GLCubeFace[facenum], GLint(level), rect.left, rect.top, 0,
+                rect.right-rect.left, rect.bottom-rect.top, 1,
+                mGLFormat->internalformat, GL_NONE, 0, 0
+            }, dataPtr, length);
     }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
         glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
         glTextureSubImage2DEXT(mTexId, D3D2GLCubeFace[facenum], level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->format, mGLFormat->type, dataPtr
         );
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-    }
 
-    if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
+        if(CommandStreamWriter *stream = mParent->getQueue().getRecorder())
+            stream->write(StreamOp::TextureSubImage, StreamTexSubImage{
+                mTexId, D3D2GLCubeFace[facenum], GLint(level), rect.left, rect.top, 0,
+                rect.right-rect.left, rect.bottom-rect.top, 1,
+                mGLFormat->format, mGLFormat->type, GLint(w), 0
+            }, dataPtr, length);
+    }
+    if(pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     checkGLError();
 
     --mUpdateInProgress;
@@ -170,16 +252,36 @@ class CubeTextureLoadLevelCmd : public Command {
     DWORD mLevel;
     GLint mFaceNum;
     RECT mRect;
+    GLuint mPbo;
     const GLubyte *mDataPtr;
+    UINT mLength;
 
 public:
-    CubeTextureLoadLevelCmd(D3DGLCubeTexture *target, DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mFaceNum(facenum), mRect(rect), mDataPtr(dataPtr)
+    CubeTextureLoadLevelCmd(D3DGLCubeTexture *target, DWORD level, GLint facenum, const RECT &rect, GLuint pbo, const GLubyte *dataPtr, UINT length)
+      : mTarget(target), mLevel(level), mFaceNum(facenum), mRect(rect), mPbo(pbo), mDataPtr(dataPtr)
+      , mLength(length)
     { }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mFaceNum, mRect, mDataPtr);
+        mTarget->loadTexLevelGL(mLevel, mFaceNum, mRect, mPbo, mDataPtr, mLength);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class CubeTextureLoadConvertedCmd : public CubeTextureLoadLevelCmd {
+    GLubyte *mData;
+
+public:
+    CubeTextureLoadConvertedCmd(D3DGLCubeTexture *target, DWORD level, GLint facenum, const RECT &rect, GLubyte *data, UINT length)
+      : CubeTextureLoadLevelCmd(target, level, facenum, rect, 0, data, length), mData(data)
+    { }
+    ~CubeTextureLoadConvertedCmd() { PooledDataDeallocator<GLubyte>()(mData); }
+
+    virtual ULONG execute()
+    {
+        CubeTextureLoadLevelCmd::execute();
         return sizeof(*this);
     }
 };
@@ -192,6 +294,8 @@ D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
   , mGLFormat(nullptr)
   , mTexId(0)
   , mUpdateInProgress(0)
+  , mUpdateFence(0)
+  , mHasPendingRects(false)
   , mLodLevel(0)
 {
     for(RECT &rect : mDirtyRect)
@@ -201,11 +305,22 @@ D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
 
 D3DGLCubeTexture::~D3DGLCubeTexture()
 {
-    if(mTexId)
+    if(mHasPendingRects || isManaged())
     {
-        mParent->getQueue().send<CubeTextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        if(mHasPendingRects)
+            mParent->removePendingUpload(this);
+        if(isManaged())
+            mParent->getResidency().remove(this);
+        queue.unlock();
+    }
+
+    // An evicted texture already had its GL texture deleted.
+    if(mTexId && isResident())
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.waitFence(queue.send<CubeTextureDeinitCmd>(make_ref(mParent->getFramebuffers()), mTexId));
         mTexId = 0;
     }
 
@@ -227,13 +342,12 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         return false;
     }
 
-    auto fmtinfo = gFormatList.find(mDesc.Format);
-    if(fmtinfo == gFormatList.end())
+    mGLFormat = FindGLFormat(mDesc.Format);
+    if(!mGLFormat)
     {
         ERR("Failed to find info for format %s\n", d3dfmt_to_str(mDesc.Format));
         return false;
     }
-    mGLFormat = &fmtinfo->second;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -288,6 +402,7 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
             surfaces[j] = new D3DGLCubeSurface(this, i, j);
         mSurfaces.push_back(surfaces);
     }
+    mPendingRects.resize(levels);
 
     mIsCompressed = (mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
                      mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
@@ -302,18 +417,167 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         mParent->getQueue().sendSync<CubeTextureInitCmd>(this);
     }
 
+    if(isManaged())
+    {
+        UINT64 size = mSysMem.size();
+        if(const PixelConverter *conv = mGLFormat->converter)
+            size = size / mGLFormat->bytesperpixel * conv->dstbpp;
+
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        mParent->getResidency().add(this, size);
+        queue.unlock();
+    }
+
     return true;
 }
 
-void D3DGLCubeTexture::updateTexture(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
+void D3DGLCubeTexture::evict()
+{
+    mParent->getQueue().doSend<CubeTextureEvictCmd>(this);
+}
+
+void D3DGLCubeTexture::restore()
+{
+    mParent->getQueue().sendSync<CubeTextureRestoreCmd>(this);
+
+    // The new storage is empty, so everything gets reuploaded.
+    for(DWORD level = 0;level < mPendingRects.size();++level)
+    {
+        LONG w = std::max(1u, mDesc.Width>>level);
+        LONG h = std::max(1u, mDesc.Height>>level);
+        for(DirtyRects &rects : mPendingRects[level])
+        {
+            rects.clear();
+            rects.add(RECT{0, 0, w, h});
+        }
+    }
+    if(!mHasPendingRects)
+    {
+        mHasPendingRects = true;
+        mParent->addPendingUpload(this);
+    }
+    flushUpdates();
+}
+
+void D3DGLCubeTexture::stageUpdate(StagingBatch &batch, std::vector<StagedUpload> &staged, DWORD level,
+                                   GLint facenum, const RECT &rect)
+{
+    UINT length;
+    const GLubyte *dataPtr = &mSysMem[mSurfaces[level][facenum]->getDataOffset()];
+    dataPtr += calcUpdateRange(level, facenum, rect, length);
+
+    const PixelConverter *conv = mGLFormat->converter;
+    UINT srcpitch = 0, dstpitch = 0;
+    UINT width = rect.right - rect.left;
+    UINT height = rect.bottom - rect.top;
+    if(conv)
+    {
+        UINT w = std::max(1u, mDesc.Width>>level);
+        srcpitch = GLFormatInfo::calcPitch(w, mGLFormat->bytesperpixel);
+        dstpitch = GLFormatInfo::calcPitch(w, conv->dstbpp);
+        length = (height-1)*dstpitch + width*conv->dstbpp;
+    }
+
+    ++mUpdateInProgress;
+    if(!mParent->getUploadRing().canStage(length))
+    {
+        // Send what's batched first, to keep the uploads in order.
+        sendStaged(batch, staged);
+
+        CommandQueue &queue = mParent->getQueue();
+        if(conv)
+        {
+            GLubyte *dst = PooledDataAllocator<GLubyte>()(length);
+            conv->convertBox(dst, dstpitch, 0, dataPtr, srcpitch, 0, width, height, 1);
+            queue.doSend<CubeTextureLoadConvertedCmd>(this, level, facenum, rect, dst, length);
+        }
+        else
+            mUpdateFence = queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, 0, dataPtr, length);
+        return;
+    }
+
+    if(!batch.fits(length))
+        sendStaged(batch, staged);
+    UINT offset = batch.add(length);
+    if(conv)
+        batch.convert(offset, *conv, dstpitch, 0, dataPtr, srcpitch, 0, width, height, 1);
+    else
+        batch.copy(offset, dataPtr, length);
+    staged.push_back(StagedUpload{level, facenum, rect, offset, length});
+}
+
+void D3DGLCubeTexture::sendStaged(StagingBatch &batch, std::vector<StagedUpload> &staged)
+{
+    if(staged.empty())
+        return;
+
+    // The upload reads the staged copy, so the app can write the system
+    // memory again right away.
+    UINT base = batch.stage();
+    GLuint buffer = mParent->getUploadRing().getBufferId();
+    CommandQueue &queue = mParent->getQueue();
+    for(const StagedUpload &upload : staged)
+        queue.doSend<CubeTextureLoadLevelCmd>(this, upload.mLevel, upload.mFaceNum, upload.mRect, buffer,
+                                              ((GLubyte*)nullptr) + base + upload.mOffset, upload.mLength);
+    staged.clear();
+}
+
+void D3DGLCubeTexture::queueUpdate(DWORD level, GLint facenum, const RECT &rect)
 {
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, dataPtr);
+    mPendingRects[level][facenum].add(rect);
+    if(!mHasPendingRects)
+    {
+        mHasPendingRects = true;
+        mParent->addPendingUpload(this);
+    }
     queue.unlock();
 }
 
+void D3DGLCubeTexture::flushUpdates()
+{
+    if(!mHasPendingRects)
+        return;
+    mHasPendingRects = false;
+    mParent->removePendingUpload(this);
+
+    // System memory has it all, for when the texture gets restored.
+    if(!isResident())
+    {
+        for(auto &faces : mPendingRects)
+        {
+            for(DirtyRects &rects : faces)
+                rects.clear();
+        }
+        return;
+    }
+
+    // Every face gets staged before anything is sent, so their copies and
+    // conversions can be done together on the worker pool.
+    StagingBatch batch(mParent->getUploadRing(), mParent->getWorkerPool());
+    std::vector<StagedUpload> staged;
+    bool genmips = false;
+    for(DWORD level = 0;level < mPendingRects.size();++level)
+    {
+        for(GLint facenum = 0;facenum < 6;++facenum)
+        {
+            DirtyRects &rects = mPendingRects[level][facenum];
+            if(rects.empty())
+                continue;
+            for(const RECT &rect : rects)
+                stageUpdate(batch, staged, level, facenum, rect);
+            rects.clear();
+            if(level == 0) genmips = true;
+        }
+    }
+    sendStaged(batch, staged);
+
+    if(genmips && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
+        mParent->getQueue().doSend<CubeTextureGenMipCmd>(this);
+}
+
 void D3DGLCubeTexture::addIface()
 {
     ++mIfaceCount;
@@ -395,19 +659,44 @@ HRESULT D3DGLCubeTexture::FreePrivateData(REFGUID refguid)
 
 DWORD D3DGLCubeTexture::SetPriority(DWORD priority)
 {
-    FIXME("iface %p, priority %lu : stub!\n", this, priority);
-    return 0;
+    TRACE("iface %p, priority %lu\n", this, priority);
+
+    if(!isManaged())
+        return 0;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    priority = mParent->getResidency().setPriority(this, priority);
+    queue.unlock();
+    return priority;
 }
 
 DWORD D3DGLCubeTexture::GetPriority()
 {
-    FIXME("iface %p : stub!\n", this);
-    return 0;
+    TRACE("iface %p\n", this);
+
+    if(!isManaged())
+        return 0;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    DWORD priority = mParent->getResidency().getPriority(this);
+    queue.unlock();
+    return priority;
 }
 
 void D3DGLCubeTexture::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+
+    if(!isManaged())
+        return;
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    mParent->getResidency().use(this);
+    flushUpdates();
+    queue.unlock();
 }
 
 D3DRESOURCETYPE D3DGLCubeTexture::GetType()
@@ -460,7 +749,14 @@ void D3DGLCubeTexture::GenerateMipSubLevels()
 {
     TRACE("iface %p\n", this);
     if(mDesc.Format != D3DFMT_NULL)
-        mParent->getQueue().send<CubeTextureGenMipCmd>(this);
+    {
+        CommandQueue &queue = mParent->getQueue();
+        queue.lock();
+        flushUpdates();
+        if(isResident())
+            queue.doSend<CubeTextureGenMipCmd>(this);
+        queue.unlock();
+    }
 }
 
 
@@ -661,6 +957,7 @@ HRESULT D3DGLCubeSurface::GetDesc(D3DSURFACE_DESC *desc)
 HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect, DWORD flags)
 {
     TRACE("iface %p, lockedRect %p, rect %p, flags 0x%lx\n", this, lockedRect, rect, flags);
+    TIMELINE_SCOPE("CubeSurface::LockRect");
 
     if(mParent->mDesc.Format == D3DFMT_NULL)
     {
@@ -709,8 +1006,7 @@ HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect,
     // No need to wait if we're not writing over previous data.
     if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
     {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
+        mParent->mParent->getQueue().waitFence(mParent->mUpdateFence);
     }
 
     GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
@@ -742,6 +1038,7 @@ HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect,
 HRESULT D3DGLCubeSurface::UnlockRect()
 {
     TRACE("iface %p\n", this);
+    TIMELINE_SCOPE("CubeSurface::UnlockRect");
 
     if(mLock == LT_Unlocked)
     {
@@ -750,7 +1047,7 @@ HRESULT D3DGLCubeSurface::UnlockRect()
     }
 
     if(mLock != LT_ReadOnly)
-        mParent->updateTexture(mLevel, mFaceNum, mLockRegion, &mParent->mSysMem[mDataOffset]);
+        mParent->queueUpdate(mLevel, mFaceNum, mLockRegion);
 
     mLock = LT_Unlocked;
     return D3D_OK;
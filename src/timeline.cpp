@@ -0,0 +1,228 @@
+
+#include "timeline.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <cxxabi.h>
+
+#include "trace.hpp"
+#include "commandqueue.hpp"
+
+
+unsigned int TimelineFrames = 0;
+unsigned int TimelineStartFrame = 0;
+
+std::atomic<bool> Timeline::sActive(false);
+std::atomic<bool> Timeline::sActiveGL(false);
+
+
+namespace
+{
+
+struct TimelineEvent {
+    const char *mName;
+    const std::type_info *mType;
+    LONGLONG mStart;
+    LONGLONG mEnd;
+};
+
+struct TimelineBuffer {
+    static const ULONG sMaxEvents = 1<<15;
+
+    TimelineBuffer *mNext;
+    DWORD mThreadId;
+    const char *mThreadName;
+
+    // The capture the events belong to. The owning thread resets the buffer
+    // when it first records something for a new capture.
+    std::atomic<ULONG> mCapture;
+    std::atomic<ULONG> mCount;
+    TimelineEvent mEvents[sMaxEvents];
+};
+
+// Buffers are never freed, since the threads that own them may still be
+// around. There is one per thread that has ever recorded an event.
+std::atomic<TimelineBuffer*> BufferList(nullptr);
+thread_local TimelineBuffer *ThreadBuffer = nullptr;
+
+std::atomic<ULONG> CaptureId(0);
+std::atomic<bool> CaptureWriting(false);
+
+// Only used by the thread calling Present.
+LONGLONG CaptureStart = 0;
+ULONG FrameCount = 0;
+ULONG CapturedFrames = 0;
+bool HotkeyDown = false;
+
+
+TimelineBuffer *getBuffer()
+{
+    TimelineBuffer *buffer = ThreadBuffer;
+    if(!buffer)
+    {
+        buffer = new TimelineBuffer;
+        buffer->mThreadId = GetCurrentThreadId();
+        buffer->mThreadName = nullptr;
+        buffer->mCapture.store(0, std::memory_order_relaxed);
+        buffer->mCount.store(0, std::memory_order_relaxed);
+
+        buffer->mNext = BufferList.load();
+        while(!BufferList.compare_exchange_weak(buffer->mNext, buffer))
+        { }
+        ThreadBuffer = buffer;
+    }
+
+    ULONG capture = CaptureId.load(std::memory_order_acquire);
+    if(buffer->mCapture.load(std::memory_order_relaxed) != capture)
+    {
+        buffer->mCount.store(0, std::memory_order_relaxed);
+        buffer->mCapture.store(capture, std::memory_order_release);
+    }
+    return buffer;
+}
+
+void pushEvent(const char *name, const std::type_info *type, LONGLONG start, LONGLONG end)
+{
+    TimelineBuffer *buffer = getBuffer();
+    ULONG idx = buffer->mCount.load(std::memory_order_relaxed);
+    if(idx >= TimelineBuffer::sMaxEvents)
+        return;
+
+    buffer->mEvents[idx] = TimelineEvent{ name, type, start, end };
+    buffer->mCount.store(idx+1, std::memory_order_release);
+}
+
+
+void writeTimeline(ULONG capture, LONGLONG start)
+{
+    std::stringstream sstr;
+    sstr<< "d3dgl-"<<GetCurrentProcessId()<<"-"<<capture<<".json";
+    FILE *file = fopen(sstr.str().c_str(), "wb");
+    if(!file)
+    {
+        ERR("Failed to open %s for writing\n", sstr.str().c_str());
+        return;
+    }
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    const double scale = 1000000.0 / freq.QuadPart;
+    const DWORD pid = GetCurrentProcessId();
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    const char *sep = "";
+    for(TimelineBuffer *buffer = BufferList.load();buffer;buffer = buffer->mNext)
+    {
+        if(buffer->mThreadName)
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                    sep, pid, buffer->mThreadId, buffer->mThreadName);
+            sep = ",\n";
+        }
+        if(buffer->mCapture.load(std::memory_order_acquire) != capture)
+            continue;
+
+        ULONG count = buffer->mCount.load(std::memory_order_acquire);
+        for(ULONG i = 0;i < count;++i)
+        {
+            const TimelineEvent &evt = buffer->mEvents[i];
+            const char *name = evt.mName;
+            char *demangled = nullptr;
+            if(evt.mType)
+            {
+                if(*evt.mType == typeid(CommandNoOp) || *evt.mType == typeid(CommandSkip))
+                    continue;
+                int status = 0;
+                demangled = abi::__cxa_demangle(evt.mType->name(), nullptr, nullptr, &status);
+                name = demangled ? demangled : evt.mType->name();
+            }
+
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu}",
+                    sep, name, evt.mType ? "command" : "d3d", (evt.mStart-start)*scale,
+                    (evt.mEnd-evt.mStart)*scale, pid, buffer->mThreadId);
+            sep = ",\n";
+            free(demangled);
+        }
+        if(count >= TimelineBuffer::sMaxEvents)
+            WARN("Timeline events dropped for thread %04lx\n", buffer->mThreadId);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    log_printf(LogFile, "Wrote timeline capture to %s\n", sstr.str().c_str());
+}
+
+} // namespace
+
+class StartTimelineCmd : public Command {
+public:
+    virtual ULONG execute()
+    {
+        Timeline::sActiveGL.store(true);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class WriteTimelineCmd : public Command {
+    ULONG mCapture;
+    LONGLONG mStart;
+
+public:
+    WriteTimelineCmd(ULONG capture, LONGLONG start) : mCapture(capture), mStart(start) { }
+
+    virtual ULONG execute()
+    {
+        Timeline::sActiveGL.store(false);
+        writeTimeline(mCapture, mStart);
+        CaptureWriting.store(false);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+
+void Timeline::addEvent(const char *name, LONGLONG start, LONGLONG end)
+{ pushEvent(name, nullptr, start, end); }
+
+void Timeline::addEvent(const std::type_info &type, LONGLONG start, LONGLONG end)
+{ pushEvent(nullptr, &type, start, end); }
+
+void Timeline::setThreadName(const char *name)
+{ getBuffer()->mThreadName = name; }
+
+
+void Timeline::endFrame(CommandQueue &queue)
+{
+    if(!TimelineFrames)
+        return;
+    ++FrameCount;
+
+    if(!isActive())
+    {
+        bool hotkey = (GetAsyncKeyState(VK_CONTROL)&0x8000) && (GetAsyncKeyState(VK_F12)&0x8000);
+        bool trigger = (hotkey && !HotkeyDown) || FrameCount == TimelineStartFrame;
+        HotkeyDown = hotkey;
+        if(!trigger || CaptureWriting.load())
+            return;
+
+        log_printf(LogFile, "Starting %u frame timeline capture at frame %lu\n",
+                   TimelineFrames, FrameCount);
+        CaptureStart = now();
+        CapturedFrames = 0;
+        CaptureId.fetch_add(1);
+        sActive.store(true);
+        queue.send<StartTimelineCmd>();
+        return;
+    }
+
+    if(++CapturedFrames < TimelineFrames)
+        return;
+
+    // Commands for the captured frames are still in the queue, so have the
+    // command thread write the trace once it gets through them.
+    sActive.store(false);
+    CaptureWriting.store(true);
+    queue.send<WriteTimelineCmd>(CaptureId.load(), CaptureStart);
+}
@@ -0,0 +1,304 @@
+
+#include "uploadring.hpp"
+
+#include <cstring>
+
+#include "trace.hpp"
+#include "commandqueue.hpp"
+#include "commandstream.hpp"
+#include "allocators.hpp"
+#include "vertexarraycache.hpp"
+
+
+namespace
+{
+
+class InitUploadRingCmd : public Command {
+    UploadRing *mTarget;
+    UINT mSize;
+    bool mMapped;
+
+public:
+    InitUploadRingCmd(UploadRing *target, UINT size, bool mapped)
+      : mTarget(target), mSize(size), mMapped(mapped)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->initGL(mSize, mMapped);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class DeinitUploadRingCmd : public Command {
+    UploadRing *mTarget;
+
+public:
+    DeinitUploadRingCmd(UploadRing *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->deinitGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class RetireUploadRegionCmd : public Command {
+    UploadRing *mTarget;
+    UINT mRegion;
+
+public:
+    RetireUploadRegionCmd(UploadRing *target, UINT region) : mTarget(target), mRegion(region) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->retireRegionGL(mRegion);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+class WaitUploadRegionCmd : public Command {
+    UploadRing *mTarget;
+    UINT mRegion;
+
+public:
+    WaitUploadRegionCmd(UploadRing *target, UINT region) : mTarget(target), mRegion(region) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->waitRegionGL(mRegion);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+// Used when the ring isn't mapped.
+class UploadRingDataCmd : public Command {
+    GLuint mBufferId;
+    UINT mOffset;
+    UINT mLength;
+    GLubyte *mData;
+
+public:
+    UploadRingDataCmd(GLuint buffer, UINT offset, UINT length, GLubyte *data)
+      : mBufferId(buffer), mOffset(offset), mLength(length), mData(data)
+    { }
+    ~UploadRingDataCmd() { PooledDataDeallocator<GLubyte>()(mData); }
+
+    virtual ULONG execute()
+    {
+        glNamedBufferSubDataEXT(mBufferId, mOffset, mLength, mData);
+        checkGLError();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::BufferSubData, StreamBufferSubData{mBufferId, mOffset}, mData, mLength);
+    }
+};
+
+} // namespace
+
+
+UploadRing::UploadRing(CommandQueue &queue, VertexArrayCache &vertexarrays, UINT size)
+  : mQueue(queue), mVertexArrays(vertexarrays), mInitialSize(size), mBufferId(0), mData(nullptr), mSize(0)
+  , mMapped(false), mHead(0), mRegion(0), mRegionSerial(0)
+{
+    resetRegions();
+    mFences.fill(nullptr);
+}
+
+UploadRing::~UploadRing()
+{
+}
+
+void UploadRing::resetRegions()
+{
+    mHead = 0;
+    mRegion = 0;
+    ++mRegionSerial;
+    for(std::atomic<bool> &busy : mRegionBusy)
+        busy = false;
+}
+
+
+void UploadRing::initGL(UINT size, bool mapped)
+{
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+
+    GLubyte *ptr = nullptr;
+    if(mapped)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glNamedBufferStorageEXT(buffer, size, nullptr, flags);
+        ptr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(buffer, 0, size, flags));
+        if(!ptr)
+        {
+            ERR("Failed to map %u byte upload ring\n", size);
+            glDeleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+        }
+    }
+    if(!ptr)
+    {
+        glNamedBufferDataEXT(buffer, size, nullptr, GL_STREAM_DRAW);
+        if(CommandStreamWriter *stream = mQueue.getRecorder())
+            stream->write(StreamOp::BufferData, StreamBufferData{buffer, size, GL_STREAM_DRAW});
+    }
+    checkGLError();
+
+    // Commands already sent keep using the old buffer, which the GL holds on
+    // to until they're done with it.
+    deinitGL();
+
+    mBufferId = buffer;
+    mData = ptr;
+    mSize = size;
+}
+
+void UploadRing::deinitGL()
+{
+    for(GLsync &fence : mFences)
+    {
+        if(fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if(mBufferId)
+    {
+        // Cached vertex arrays may still have it bound, from user pointer
+        // draws.
+        mVertexArrays.forgetBufferGL(mBufferId);
+        glDeleteBuffers(1, &mBufferId);
+        checkGLError();
+
+        if(CommandStreamWriter *stream = mQueue.getRecorder())
+            stream->write(StreamOp::BufferDelete, StreamValue{mBufferId});
+    }
+    mBufferId = 0;
+    mData = nullptr;
+}
+
+void UploadRing::retireRegionGL(UINT region)
+{
+    GLsync &fence = mFences[region];
+    if(fence) glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    for(UINT i = 0;i < sNumRegions;++i)
+    {
+        GLsync &other = mFences[i];
+        if(i == region || !other)
+            continue;
+
+        GLint status = GL_UNSIGNALED;
+        glGetSynciv(other, GL_SYNC_STATUS, sizeof(status), nullptr, &status);
+        if(status == GL_SIGNALED)
+        {
+            glDeleteSync(other);
+            other = nullptr;
+            mRegionBusy[i] = false;
+        }
+    }
+    checkGLError();
+}
+
+void UploadRing::waitRegionGL(UINT region)
+{
+    GLsync &fence = mFences[region];
+    if(fence)
+    {
+        GLenum ret;
+        while((ret=glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED)
+            WARN("Timed out waiting for upload region %u\n", region);
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait for upload region %u\n", region);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    mRegionBusy[region] = false;
+}
+
+
+bool UploadRing::init()
+{
+    // The command stream can't see writes through the mapping.
+    mMapped = GLEW_ARB_buffer_storage && !CommandStreamFile;
+    mQueue.sendSync<InitUploadRingCmd>(this, mInitialSize, mMapped);
+    if(!mBufferId)
+    {
+        ERR("Failed to create upload ring\n");
+        return false;
+    }
+    mMapped = (mData != nullptr);
+    resetRegions();
+    return true;
+}
+
+void UploadRing::deinit()
+{
+    if(mQueue.isActive())
+        mQueue.waitFence(mQueue.send<DeinitUploadRingCmd>(this));
+}
+
+UINT UploadRing::reserve(UINT len, UINT align)
+{
+    len = (len+15) & ~15;
+    if(len > getRegionSize())
+    {
+        UINT size = mSize;
+        while(size/sNumRegions < len)
+            size *= 2;
+        TRACE("Growing upload ring to %u bytes\n", size);
+
+        // The new buffer starts with every region free.
+        mQueue.sendSync<InitUploadRingCmd>(this, size, mMapped);
+        resetRegions();
+    }
+
+    UINT offset = (mHead+align-1) & ~(align-1);
+    if(offset+len > (mRegion+1)*getRegionSize())
+    {
+        // Fence the region being left. Any commands using it were sent
+        // before this allocation.
+        mRegionBusy[mRegion] = true;
+        mQueue.doSend<RetireUploadRegionCmd>(this, mRegion);
+
+        mRegion = (mRegion+1) % sNumRegions;
+        ++mRegionSerial;
+        if(mRegionBusy[mRegion])
+            mQueue.sendSync<WaitUploadRegionCmd>(this, mRegion);
+        offset = mRegion * getRegionSize();
+    }
+    mHead = offset + len;
+
+    return offset;
+}
+
+void UploadRing::copy(UINT offset, const void *data, UINT len)
+{
+    GLubyte *ptr = map(offset, len);
+    memcpy(ptr, data, len);
+    commit(offset, len, ptr);
+}
+
+GLubyte *UploadRing::map(UINT offset, UINT len)
+{
+    if(mData)
+        return mData+offset;
+    return PooledDataAllocator<GLubyte>()(len);
+}
+
+void UploadRing::commit(UINT offset, UINT len, GLubyte *ptr)
+{
+    if(!mData)
+        mQueue.doSend<UploadRingDataCmd>(mBufferId, offset, len, ptr);
+}
+
+bool UploadRing::canStage(UINT len) const
+{
+    return len <= getRegionSize() && !CommandStreamFile;
+}
@@ -0,0 +1,314 @@
+
+#include "vertexarraycache.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+
+VertexArrayCache::VertexArrayCache()
+  : mSeparateFormat(false)
+  , mCurrent(nullptr)
+  , mScratch{0, 0, 0, {}, {}, 0}
+  , mElements(0)
+  , mClock(0)
+{
+}
+
+
+UINT64 VertexArrayCache::hash(UINT attribs, const GLVertexFormat *formats, UINT count,
+                              const GLVertexBinding *bindings, UINT numbindings) const
+{
+    // Structs can have padding, so hash the fields.
+    UINT64 hash = 0xcbf29ce484222325ull;
+    auto add = [&hash](UINT64 val) -> void
+    {
+        hash ^= val;
+        hash *= 0x100000001b3ull;
+    };
+    add(attribs);
+    for(UINT i = 0;i < count;++i)
+    {
+        add(formats[i].mTarget);
+        add(formats[i].mBinding);
+        add(formats[i].mGLType);
+        add(formats[i].mGLCount);
+        add(formats[i].mNormalize);
+        add(formats[i].mOffset);
+    }
+    if(!mSeparateFormat)
+    {
+        for(UINT i = 0;i < numbindings;++i)
+        {
+            add(bindings[i].mBufferId);
+            add(bindings[i].mOffset);
+            add(bindings[i].mStride);
+            add(bindings[i].mDivisor);
+        }
+    }
+    return hash;
+}
+
+bool VertexArrayCache::matches(const Entry &entry, UINT attribs, const GLVertexFormat *formats, UINT count,
+                               const GLVertexBinding *bindings, UINT numbindings) const
+{
+    if(entry.mAttribs != attribs || entry.mFormats.size() != count)
+        return false;
+    for(UINT i = 0;i < count;++i)
+    {
+        const GLVertexFormat &a = entry.mFormats[i];
+        const GLVertexFormat &b = formats[i];
+        if(a.mTarget != b.mTarget || a.mBinding != b.mBinding || a.mGLType != b.mGLType ||
+           a.mGLCount != b.mGLCount || a.mNormalize != b.mNormalize || a.mOffset != b.mOffset)
+            return false;
+    }
+    if(!mSeparateFormat)
+    {
+        if(entry.mBindings.size() != numbindings)
+            return false;
+        for(UINT i = 0;i < numbindings;++i)
+        {
+            const GLVertexBinding &a = entry.mBindings[i];
+            const GLVertexBinding &b = bindings[i];
+            if(a.mBufferId != b.mBufferId || a.mOffset != b.mOffset || a.mStride != b.mStride ||
+               a.mDivisor != b.mDivisor)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+void VertexArrayCache::setupGL(Entry &entry, UINT attribs, const GLVertexFormat *formats, UINT count,
+                               const GLVertexBinding *bindings, UINT numbindings)
+{
+    UINT old_attribs = entry.mAttribs;
+    UINT new_attribs = attribs;
+    for(UINT i = 0;old_attribs || new_attribs;++i)
+    {
+        if((new_attribs&1) && !(old_attribs&1))
+            glEnableVertexAttribArray(i);
+        else if(!(new_attribs&1) && (old_attribs&1))
+        {
+            glDisableVertexAttribArray(i);
+            glVertexAttrib4f(i, 0.0f, 0.0f, 0.0f, 1.0f);
+        }
+        old_attribs >>= 1;
+        new_attribs >>= 1;
+    }
+    entry.mAttribs = attribs;
+    entry.mFormats.assign(formats, formats+count);
+
+    if(mSeparateFormat)
+    {
+        for(UINT i = 0;i < count;++i)
+        {
+            glVertexAttribFormat(formats[i].mTarget, formats[i].mGLCount, formats[i].mGLType,
+                                 formats[i].mNormalize, formats[i].mOffset);
+            glVertexAttribBinding(formats[i].mTarget, formats[i].mBinding);
+        }
+        setBindingsGL(entry, bindings, numbindings);
+        return;
+    }
+
+    GLuint binding = 0;
+    for(UINT i = 0;i < count;++i)
+    {
+        const GLVertexBinding &stream = bindings[formats[i].mBinding];
+        if(binding != stream.mBufferId)
+        {
+            binding = stream.mBufferId;
+            glBindBuffer(GL_ARRAY_BUFFER, binding);
+        }
+        glVertexAttribPointer(formats[i].mTarget, formats[i].mGLCount,
+                              formats[i].mGLType, formats[i].mNormalize, stream.mStride,
+                              ((GLubyte*)nullptr) + stream.mOffset + formats[i].mOffset);
+        // Setting a high divisor will keep the vertex attribute from
+        // incrementing, just like D3D's stride==0 setting.
+        if(stream.mStride == 0)
+            glVertexAttribDivisor(formats[i].mTarget, 65535);
+        else
+            glVertexAttribDivisor(formats[i].mTarget, stream.mDivisor);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    checkGLError();
+
+    entry.mBindings.assign(bindings, bindings+numbindings);
+}
+
+void VertexArrayCache::setBindingsGL(Entry &entry, const GLVertexBinding *bindings, UINT numbindings)
+{
+    // Binding points that were never set get a buffer name no binding will
+    // have, so they're always updated.
+    if(entry.mBindings.size() < numbindings)
+        entry.mBindings.resize(numbindings, GLVertexBinding{~0u, 0, 0, 0});
+    for(UINT i = 0;i < numbindings;++i)
+    {
+        GLVertexBinding &cur = entry.mBindings[i];
+        const GLVertexBinding &stream = bindings[i];
+        // Unlike with glVertexAttribPointer, a stride of 0 is used as-is, so
+        // every vertex reads the same element.
+        if(cur.mBufferId != stream.mBufferId || cur.mOffset != stream.mOffset ||
+           cur.mStride != stream.mStride)
+            glBindVertexBuffer(i, stream.mBufferId, stream.mOffset, stream.mStride);
+        if(cur.mDivisor != stream.mDivisor)
+            glVertexBindingDivisor(i, stream.mDivisor);
+        cur = stream;
+    }
+    checkGLError();
+}
+
+void VertexArrayCache::bindEntryGL(Entry &entry)
+{
+    glBindVertexArray(entry.mArray);
+    if(entry.mElements != mElements)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mElements);
+        entry.mElements = mElements;
+    }
+    mCurrent = &entry;
+}
+
+void VertexArrayCache::evictGL()
+{
+    auto oldest = mArrays.end();
+    for(auto iter = mArrays.begin();iter != mArrays.end();++iter)
+    {
+        if(&iter->second != mCurrent && (oldest == mArrays.end() ||
+           iter->second.mLastUse < oldest->second.mLastUse))
+            oldest = iter;
+    }
+    if(oldest == mArrays.end())
+        return;
+    glDeleteVertexArrays(1, &oldest->second.mArray);
+    mArrays.erase(oldest);
+}
+
+
+void VertexArrayCache::initGL()
+{
+    mSeparateFormat = GLEW_ARB_vertex_attrib_binding;
+    if(mSeparateFormat)
+        TRACE("Using separate vertex formats and bindings\n");
+}
+
+void VertexArrayCache::deinitGL()
+{
+    glBindVertexArray(0);
+    for(auto &entry : mArrays)
+        glDeleteVertexArrays(1, &entry.second.mArray);
+    mArrays.clear();
+    if(mScratch.mArray)
+        glDeleteVertexArrays(1, &mScratch.mArray);
+    mScratch = Entry{0, 0, 0, {}, {}, 0};
+    mCurrent = nullptr;
+    mElements = 0;
+    checkGLError();
+}
+
+
+void VertexArrayCache::bindGL(UINT attribs, const GLVertexFormat *formats, UINT count,
+                              const GLVertexBinding *bindings, UINT numbindings, GLuint scratchbuffer)
+{
+    bool scratch = !mSeparateFormat && std::any_of(bindings, bindings+numbindings,
+        [scratchbuffer](const GLVertexBinding &stream) -> bool { return stream.mBufferId == scratchbuffer; }
+    );
+    if(scratch)
+    {
+        if(!mScratch.mArray)
+        {
+            glGenVertexArrays(1, &mScratch.mArray);
+            // A new array has no element array bound.
+            mScratch.mElements = 0;
+        }
+        if(mCurrent != &mScratch)
+            bindEntryGL(mScratch);
+        setupGL(mScratch, attribs, formats, count, bindings, numbindings);
+        return;
+    }
+
+    if(mCurrent && mCurrent != &mScratch && matches(*mCurrent, attribs, formats, count, bindings, numbindings))
+    {
+        if(mSeparateFormat)
+            setBindingsGL(*mCurrent, bindings, numbindings);
+        mCurrent->mLastUse = ++mClock;
+        return;
+    }
+
+    UINT64 key = hash(attribs, formats, count, bindings, numbindings);
+    auto range = mArrays.equal_range(key);
+    for(auto iter = range.first;iter != range.second;++iter)
+    {
+        if(matches(iter->second, attribs, formats, count, bindings, numbindings))
+        {
+            bindEntryGL(iter->second);
+            if(mSeparateFormat)
+                setBindingsGL(iter->second, bindings, numbindings);
+            iter->second.mLastUse = ++mClock;
+            return;
+        }
+    }
+
+    if(mArrays.size() >= sMaxArrays)
+        evictGL();
+
+    Entry &entry = mArrays.insert(std::make_pair(key, Entry{0, 0, 0, {}, {}, 0}))->second;
+    glGenVertexArrays(1, &entry.mArray);
+    bindEntryGL(entry);
+    setupGL(entry, attribs, formats, count, bindings, numbindings);
+    entry.mLastUse = ++mClock;
+}
+
+void VertexArrayCache::setElementsGL(GLuint buffer)
+{
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+    checkGLError();
+    mElements = buffer;
+    if(mCurrent)
+        mCurrent->mElements = buffer;
+}
+
+void VertexArrayCache::forgetBufferGL(GLuint buffer)
+{
+    auto iter = mArrays.begin();
+    while(iter != mArrays.end())
+    {
+        Entry &entry = iter->second;
+        // Arrays that aren't bound keep their element array when it's
+        // deleted, so make sure it gets replaced.
+        if(entry.mElements == buffer)
+            entry.mElements = ~0u;
+
+        if(mSeparateFormat)
+        {
+            // Same for the vertex buffers, which only need rebinding.
+            for(GLVertexBinding &binding : entry.mBindings)
+            {
+                if(binding.mBufferId == buffer)
+                    binding.mBufferId = ~0u;
+            }
+            ++iter;
+            continue;
+        }
+
+        bool uses = std::any_of(entry.mBindings.begin(), entry.mBindings.end(),
+            [buffer](const GLVertexBinding &stream) -> bool { return stream.mBufferId == buffer; }
+        );
+        if(!uses)
+        {
+            ++iter;
+            continue;
+        }
+
+        // Deleting the bound array reverts to the default one.
+        if(mCurrent == &entry)
+            mCurrent = nullptr;
+        glDeleteVertexArrays(1, &entry.mArray);
+        iter = mArrays.erase(iter);
+    }
+    if(mScratch.mElements == buffer)
+        mScratch.mElements = ~0u;
+    if(mElements == buffer)
+        mElements = 0;
+    checkGLError();
+}
@@ -2,27 +2,33 @@
 #include "vertexshader.hpp"
 
 #include <sstream>
+#include <algorithm>
+#include <bitset>
+#include <cstring>
 
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
+#include "vertexdeclaration.hpp"
 #include "trace.hpp"
+#include "timeline.hpp"
+#include "commandstream.hpp"
+#include "shadercompiler.hpp"
+#include "shaderarena.hpp"
 #include "private_iids.hpp"
 
 
-GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
+std::string VertexShaderCode::translate(const ShaderVariant &key) const
 {
-    const MOJOSHADER_parseData *shader = nullptr;
-    GLuint program = mProgram.exchange(0);
-    if(program)
-    {
-        glDeleteProgram(program);
-        program = 0;
-    }
+    MOJOSHADER_constants consts;
+    memcpy(consts.int4, key.mInts, sizeof(consts.int4));
+    consts.bools = key.mBools;
 
-    shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
+    ShaderArena &arena = ShaderArena::get();
+    const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
         reinterpret_cast<const unsigned char*>(mCode.data()),
         mCode.size() * sizeof(decltype(mCode)::value_type),
-        nullptr, 0, shadowsamplers
+        nullptr, 0, key.mShadowSamplers, key.mFolded ? &consts : nullptr,
+        ShaderArena::allocate, ShaderArena::deallocate, &arena
     );
     if(shader->error_count > 0)
     {
@@ -30,58 +36,33 @@ GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
         for(int i = 0;i < shader->error_count;++i)
             sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
         ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        goto done;
+        MOJOSHADER_freeParseData(shader);
+        arena.reset();
+        return std::string();
     }
     if(mCode.size() != (std::size_t)shader->token_count)
         ERR("Token count mismatch (previous: %u, now: %d)\n",
             mCode.size(), shader->token_count);
     TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
+    std::string source = shader->output;
+    MOJOSHADER_freeParseData(shader);
+    arena.reset();
+    return source;
+}
 
-    {
-        program = glCreateShaderProgramv(GL_VERTEX_SHADER, 1, &shader->output);
-        checkGLError();
-        if(!program)
-        {
-            FIXME("Failed to create shader program\n");
-            goto done;
-        }
-
-        GLint logLen = 0;
-        GLint status = GL_FALSE;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-        if(status == GL_FALSE)
-        {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                  log.data(), shader->output);
-
-            glDeleteProgram(program);
-            program = 0;
-            checkGLError();
-
-            goto done;
-        }
-
-        mProgram = program;
-        TRACE("Created vertex shader program 0x%x\n", program);
-
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-        if(logLen > 4)
-        {
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                 log.data(), shader->output);
-        }
-    }
-
+void VertexShaderCode::setupProgramGL(GLuint program, CommandStreamWriter *stream) const
+{
     {
         GLuint v4f_idx = glGetUniformBlockIndex(program, "vs_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, VSF_BINDING_IDX);
+        GLuint v4i_idx = glGetUniformBlockIndex(program, "vs_ivec4");
+        if(v4i_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, v4i_idx, VSI_BINDING_IDX);
+        GLuint b_idx = glGetUniformBlockIndex(program, "vs_bool");
+        if(b_idx != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, b_idx, VSB_BINDING_IDX);
         GLuint vtx_state_idx = glGetUniformBlockIndex(program, "vertex_state");
         if(vtx_state_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, vtx_state_idx, VTXSTATE_BINDING_IDX);
@@ -89,30 +70,147 @@ GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
         if(pos_fixup_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, pos_fixup_idx, POSFIXUP_BINDING_IDX);
     }
+    if(stream)
+    {
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, VSF_BINDING_IDX}, "vs_vec4", sizeof("vs_vec4"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, VSI_BINDING_IDX}, "vs_ivec4", sizeof("vs_ivec4"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, VSB_BINDING_IDX}, "vs_bool", sizeof("vs_bool"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, VTXSTATE_BINDING_IDX}, "vertex_state", sizeof("vertex_state"));
+        stream->write(StreamOp::ProgramBlock, StreamProgram{program, POSFIXUP_BINDING_IDX}, "pos_fixup", sizeof("pos_fixup"));
+    }
 
-    for(int i = 0;i < shader->attribute_count;++i)
+    for(const ShaderVariable &sampler : mReflection.mSamplers)
     {
-        GLint loc = glGetAttribLocation(program, shader->attributes[i].name);
-        TRACE("Got attribute %s at location %d\n", shader->attributes[i].name, loc);
-        mUsageMap[(shader->attributes[i].usage<<8) | shader->attributes[i].index] = loc;
+        GLint loc = glGetUniformLocation(program, sampler.mName.c_str());
+        TRACE("Got sampler %s:%u at location %d\n", sampler.mName.c_str(), sampler.mIndex, loc);
+        glProgramUniform1i(program, loc, sampler.mIndex+MAX_FRAGMENT_SAMPLERS);
+        if(stream)
+            stream->write(StreamOp::ProgramSampler, StreamProgram{program, GLenum(sampler.mIndex+MAX_FRAGMENT_SAMPLERS)},
+                          sampler.mName.c_str(), sampler.mName.length()+1);
     }
+}
 
-    for(int i = 0;i < shader->sampler_count;++i)
+GLuint VertexShaderCode::buildProgramGL(const ShaderVariant &key, std::string&& source,
+                                        CommandStreamWriter *stream)
+{
+    if(source.empty())
     {
-        GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
-        TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name, shader->samplers[i].index, loc);
-        glProgramUniform1i(program, loc, shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
+        source = translate(key);
+        if(source.empty())
+            return 0;
     }
 
+    GLuint program = ShaderCache::createProgramGL(GL_VERTEX_SHADER, source.c_str());
     checkGLError();
+    if(!program)
+    {
+        FIXME("Failed to create shader program\n");
+        return 0;
+    }
 
-done:
-    MOJOSHADER_freeParseData(shader);
+    GLint logLen = 0;
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE)
+    {
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+              log.data(), source.c_str());
+
+        glDeleteProgram(program);
+        checkGLError();
+        return 0;
+    }
 
-    --mPendingUpdates;
+    TRACE("Created vertex shader program 0x%x\n", program);
+    if(stream)
+        stream->write(StreamOp::ProgramCreate, StreamProgram{program, GL_VERTEX_SHADER},
+                      source.c_str(), source.length()+1);
+
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+    if(logLen > 4)
+    {
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+             log.data(), source.c_str());
+    }
+
+    return program;
+}
+
+GLuint VertexShaderCode::compileShaderGL(const ShaderVariant &key, Variant &variant, bool async)
+{
+    TIMELINE_SCOPE_GL("VertexShader::compileShaderGL");
+    CommandStreamWriter *stream = async ? nullptr : mParent->getQueue().getRecorder();
+
+    // Only the build without shadow samplers or folded constants uses the
+    // source from when the shader was created, so it's dropped once that's
+    // done.
+    std::string source;
+    if(!key.mShadowSamplers && !key.mFolded)
+        source.swap(mSource);
+
+    // Recordings need the GLSL source to recreate the program, which a cached
+    // one doesn't have.
+    GLuint program = 0;
+    if(!stream)
+    {
+        ShaderReflection cached;
+        program = ShaderCache::loadProgramGL(GL_VERTEX_SHADER, mCode, key, cached);
+    }
+    if(program)
+        TRACE("Loaded cached vertex shader program 0x%x\n", program);
+    else
+    {
+        program = buildProgramGL(key, std::move(source), stream);
+        if(!program)
+        {
+            if(!async) --variant.mPending;
+            return 0;
+        }
+        if(!stream)
+            ShaderCache::storeProgramGL(GL_VERTEX_SHADER, mCode, key, program, mReflection);
+    }
+    variant.mProgram = program;
+
+    setupProgramGL(program, stream);
+
+    for(const ShaderVariable &attr : mReflection.mAttributes)
+    {
+        GLint loc = glGetAttribLocation(program, attr.mName.c_str());
+        TRACE("Got attribute %s at location %d\n", attr.mName.c_str(), loc);
+        if(attr.mUsage < variant.mUsageMap.size() && attr.mIndex < variant.mUsageMap[attr.mUsage].size())
+            variant.mUsageMap[attr.mUsage][attr.mIndex] = loc;
+        else
+            ERR("Attribute %s out of range (usage %u, index %u)\n", attr.mName.c_str(), attr.mUsage, attr.mIndex);
+    }
+
+    checkGLError();
+
+    if(!async) --variant.mPending;
     return program;
 }
 
+class CompileVShaderCmd : public Command {
+    VertexShaderCode *mTarget;
+    VertexShaderCode::Variant *mVariant;
+    ShaderVariant mKey;
+
+public:
+    CompileVShaderCmd(VertexShaderCode *target, const ShaderVariant &key, VertexShaderCode::Variant *variant)
+      : mTarget(target), mVariant(variant), mKey(key) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->compileShaderGL(mKey, *mVariant, false);
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
 class DeinitVShaderCmd : public Command {
     GLuint mProgram;
 
@@ -124,28 +222,375 @@ public:
         glDeleteProgram(mProgram);
         return sizeof(*this);
     }
+    virtual void record(CommandStreamWriter &stream) const
+    {
+        stream.write(StreamOp::ProgramDelete, StreamValue{mProgram});
+    }
 };
 
 
+namespace
+{
+
+UINT GetDeclTypeSize(BYTE type)
+{
+    switch(type)
+    {
+    case D3DDECLTYPE_FLOAT1: return 4;
+    case D3DDECLTYPE_FLOAT2: return 8;
+    case D3DDECLTYPE_FLOAT3: return 12;
+    case D3DDECLTYPE_FLOAT4: return 16;
+    case D3DDECLTYPE_D3DCOLOR: return 4;
+    case D3DDECLTYPE_UBYTE4: return 4;
+    case D3DDECLTYPE_SHORT2: return 4;
+    case D3DDECLTYPE_SHORT4: return 8;
+    case D3DDECLTYPE_UBYTE4N: return 4;
+    case D3DDECLTYPE_SHORT2N: return 4;
+    case D3DDECLTYPE_SHORT4N: return 8;
+    case D3DDECLTYPE_USHORT2N: return 4;
+    case D3DDECLTYPE_USHORT4N: return 8;
+    case D3DDECLTYPE_UDEC3: return 4;
+    case D3DDECLTYPE_DEC3N: return 4;
+    case D3DDECLTYPE_FLOAT16_2: return 4;
+    case D3DDECLTYPE_FLOAT16_4: return 8;
+    }
+    return 0;
+}
+
+void AddFeedbackSkip(std::vector<std::string> &varyings, UINT bytes)
+{
+    static const char *const skips[4] = {
+        "gl_SkipComponents1", "gl_SkipComponents2", "gl_SkipComponents3", "gl_SkipComponents4"
+    };
+    for(UINT comps = bytes/4;comps > 0;)
+    {
+        UINT n = std::min(comps, 4u);
+        varyings.push_back(skips[n-1]);
+        comps -= n;
+    }
+}
+
+} // namespace
+
+HRESULT FeedbackLayout::init(const D3DGLVertexDeclaration *decl)
+{
+    std::vector<D3DGLVERTEXELEMENT> elems = decl->getVtxElements();
+    std::sort(elems.begin(), elems.end(),
+        [](const D3DGLVERTEXELEMENT &lhs, const D3DGLVERTEXELEMENT &rhs) -> bool
+        { return lhs.Offset < rhs.Offset; }
+    );
+
+    std::stringstream decls, body;
+    decls<< "uniform vec4 PV_VIEWPORT[2];\n"
+            "uint pv_color(vec4 c)\n"
+            "{\n"
+            "    uvec4 v = uvec4(clamp(c, 0.0, 1.0)*255.0 + 0.5);\n"
+            "    return (v.a<<24) | (v.r<<16) | (v.g<<8) | v.b;\n"
+            "}\n";
+    // Undo the GL clip space fixup, then go to D3D screen space.
+    body<< "void main()\n"
+           "{\n"
+           "    d3dgl_main();\n"
+           "    vec4 pv_pos = gl_Position;\n"
+           "    pv_pos.z = (pv_pos.z + pv_pos.w) * 0.5;\n"
+           "    pv_pos.xy = (pv_pos.xy - POS_FIXUP.xy*pv_pos.ww) * vec2(1.0, -1.0);\n"
+           "    pv_pos.w = 1.0 / pv_pos.w;\n"
+           "    pv_pos.xyz = pv_pos.xyz*pv_pos.w*PV_VIEWPORT[0].xyz + PV_VIEWPORT[1].xyz;\n";
+
+    mVaryings.clear();
+    UINT pos = 0;
+    for(const D3DGLVERTEXELEMENT &elem : elems)
+    {
+        if(elem.Stream != 0)
+        {
+            WARN("Output element in stream %u\n", elem.Stream);
+            return D3DERR_INVALIDCALL;
+        }
+        UINT size = GetDeclTypeSize(elem.Type);
+        if(elem.Offset < pos || (elem.Offset&3) || !size)
+        {
+            FIXME("Unhandled output element (offset %u, type 0x%x)\n", elem.Offset, elem.Type);
+            return E_NOTIMPL;
+        }
+        AddFeedbackSkip(mVaryings, elem.Offset-pos);
+        pos = elem.Offset + size;
+
+        std::stringstream src;
+        if((elem.Usage == D3DDECLUSAGE_POSITION || elem.Usage == D3DDECLUSAGE_POSITIONT) && elem.UsageIndex == 0)
+            src<< "pv_pos";
+        else if(elem.Usage == D3DDECLUSAGE_PSIZE && elem.UsageIndex == 0)
+            src<< "vec4(gl_PointSize)";
+        else if(elem.Usage == D3DDECLUSAGE_TEXCOORD && elem.UsageIndex < 8)
+            src<< "vs_output["<<UINT(elem.UsageIndex)<<"]";
+        else if(elem.Usage == D3DDECLUSAGE_COLOR && elem.UsageIndex < 2)
+            src<< "vs_output["<<UINT(elem.UsageIndex)+8<<"]";
+        else
+        {
+            // Left as it was in the buffer.
+            TRACE("Skipping output element (usage 0x%02x, index %u)\n", elem.Usage, elem.UsageIndex);
+            AddFeedbackSkip(mVaryings, size);
+            continue;
+        }
+
+        std::stringstream namestr;
+        namestr<< "pv_out"<<mVaryings.size();
+        std::string name = namestr.str();
+        switch(elem.Type)
+        {
+        case D3DDECLTYPE_FLOAT1:
+            decls<< "out float "<<name<<";\n";
+            body<< "    "<<name<<" = "<<src.str()<<".x;\n";
+            break;
+        case D3DDECLTYPE_FLOAT2:
+            decls<< "out vec2 "<<name<<";\n";
+            body<< "    "<<name<<" = "<<src.str()<<".xy;\n";
+            break;
+        case D3DDECLTYPE_FLOAT3:
+            decls<< "out vec3 "<<name<<";\n";
+            body<< "    "<<name<<" = "<<src.str()<<".xyz;\n";
+            break;
+        case D3DDECLTYPE_FLOAT4:
+            decls<< "out vec4 "<<name<<";\n";
+            body<< "    "<<name<<" = "<<src.str()<<";\n";
+            break;
+        case D3DDECLTYPE_D3DCOLOR:
+            decls<< "flat out uint "<<name<<";\n";
+            body<< "    "<<name<<" = pv_color("<<src.str()<<");\n";
+            break;
+        default:
+            FIXME("Unhandled output type 0x%x (usage 0x%02x, index %u)\n", elem.Type, elem.Usage,
+                  elem.UsageIndex);
+            AddFeedbackSkip(mVaryings, size);
+            continue;
+        }
+        mVaryings.push_back(name);
+    }
+    body<< "}\n";
+
+    mSource = decls.str() + body.str();
+    mStride = pos;
+    return D3D_OK;
+}
+
+
+GLuint VertexShaderCode::getFeedbackProgramGL(const Variant &variant, const FeedbackLayout &layout)
+{
+    auto key = std::make_pair(&variant, layout);
+    auto iter = mFeedbackPrograms.find(key);
+    if(iter != mFeedbackPrograms.end())
+        return iter->second;
+
+    // The shader's main() is renamed so the layout's can call it. Failures are
+    // kept too, so they're not tried again.
+    GLuint program = 0;
+    std::string source;
+    if(variant.mProgram)
+        source = translate(variant.mKey);
+    if(!source.empty())
+    {
+        source.insert(source.find('\n')+1, "#define main d3dgl_main\n");
+        source += "#undef main\n";
+        source += layout.mSource;
+
+        std::vector<const char*> varyings;
+        for(const std::string &name : layout.mVaryings)
+            varyings.push_back(name.c_str());
+
+        // Attributes need the same locations as the variant's, which the
+        // vertex arrays were set up for.
+        program = ShaderCache::createProgramGL(GL_VERTEX_SHADER, source.c_str(),
+            [this, &variant, &varyings](GLuint prog) -> void
+            {
+                for(const ShaderVariable &attr : mReflection.mAttributes)
+                {
+                    if(attr.mUsage >= variant.mUsageMap.size() || attr.mIndex >= variant.mUsageMap[0].size())
+                        continue;
+                    GLint loc = variant.mUsageMap[attr.mUsage][attr.mIndex];
+                    if(loc >= 0)
+                        glBindAttribLocation(prog, loc, attr.mName.c_str());
+                }
+                glTransformFeedbackVaryings(prog, varyings.size(), varyings.data(), GL_INTERLEAVED_ATTRIBS);
+            }
+        );
+    }
+    if(program)
+    {
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if(status == GL_FALSE)
+        {
+            GLint logLen = 0;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+            std::vector<char> log(logLen+1);
+            glGetProgramInfoLog(program, logLen, &logLen, log.data());
+            FIXME("Feedback shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+                  log.data(), source.c_str());
+            glDeleteProgram(program);
+            program = 0;
+        }
+        else
+        {
+            TRACE("Created vertex feedback program 0x%x\n", program);
+            setupProgramGL(program, nullptr);
+        }
+    }
+    checkGLError();
+
+    mFeedbackPrograms.insert(std::make_pair(key, program));
+    return program;
+}
+
+void VertexShaderCode::deinitFeedbackGL()
+{
+    for(auto &entry : mFeedbackPrograms)
+    {
+        if(entry.second)
+            glDeleteProgram(entry.second);
+    }
+    mFeedbackPrograms.clear();
+    checkGLError();
+}
+class DeinitFeedbackCmd : public Command {
+    VertexShaderCode *mTarget;
+
+public:
+    DeinitFeedbackCmd(VertexShaderCode *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->deinitFeedbackGL();
+        return sizeof(*this);
+    }
+    virtual void record(CommandStreamWriter&) const { }
+};
+
+
+VertexShaderCode::Variant::Variant()
+  : mPending(0)
+  , mUpdateFence(0)
+  , mProgram(0)
+  , mKey()
+{
+    for(auto &locs : mUsageMap)
+        locs.fill(-1);
+}
+
+
+VertexShaderCode::VertexShaderCode(D3DGLDevice *parent, std::vector<DWORD>&& code, ShaderCodeInfo&& info)
+  : mRefCount(0)
+  , mParent(parent)
+  , mSamplerMask(info.mSamplerMask)
+  , mConstFStart(info.mConstFStart)
+  , mConstFEnd(info.mConstFEnd)
+  , mConstIMask(info.mConstIMask)
+  , mConstBMask(info.mConstBMask)
+  , mSpecializations(0)
+  , mCurrent(nullptr)
+  , mCurrentKey()
+  , mReflection(std::move(info.mReflection))
+  , mSource(std::move(info.mSource))
+  , mCode(std::move(code))
+  , mFeedbackUsed(false)
+{
+}
+
+VertexShaderCode::~VertexShaderCode()
+{
+    CommandQueue &queue = mParent->getQueue();
+    ULONG fence = 0;
+    for(auto &variant : mVariants)
+    {
+        waitBuilt(variant.second);
+        if(GLuint program = variant.second.mProgram)
+            fence = queue.send<DeinitVShaderCmd>(program);
+    }
+    if(mFeedbackUsed)
+        fence = queue.send<DeinitFeedbackCmd>(this);
+    if(fence)
+        queue.waitFence(fence);
+}
+
+void VertexShaderCode::selectVariant(UINT shadowmask, const ShaderConstantsI &ints, UINT bools)
+{
+    ShaderVariant key = makeShaderVariant(shadowmask&mSamplerMask, mConstIMask, ints, mConstBMask, bools);
+    if(mCurrent && mCurrentKey == key)
+        return;
+
+    bool maskchanged = (key.mShadowSamplers != mCurrentKey.mShadowSamplers);
+    mCurrentKey = key;
+    auto iter = mVariants.find(key);
+    if(iter == mVariants.end() && key.mFolded && mSpecializations >= MaxShaderSpecializations)
+    {
+        TRACE("Vertex shader %p has too many constant sets, reading them from uniforms\n", this);
+        key = makeShaderVariant(key.mShadowSamplers, 0, ints, 0, 0);
+        iter = mVariants.find(key);
+    }
+    if(iter != mVariants.end())
+    {
+        mCurrent = &iter->second;
+        return;
+    }
+
+    bool first = mVariants.empty();
+    if(!first)
+        TRACE("Building vertex shader %p variant for shadow mask 0x%x, bools 0x%x\n", this,
+              key.mShadowSamplers, key.mBools);
+    if(key.mFolded)
+        ++mSpecializations;
+    mCurrent = &startCompile(key);
+    UINT mask = key.mShadowSamplers;
+
+    /* Once the mask changes, build the others in the background so later
+     * changes don't have to wait. Only done when there are few enough.
+     */
+    if(first || !maskchanged || !mParent->getShaderCompiler().isActive() ||
+       std::bitset<32>(mSamplerMask).count() > sMaxSpeculativeBits)
+        return;
+    ShaderVariant sub = key;
+    do {
+        sub.mShadowSamplers = (sub.mShadowSamplers-1) & mSamplerMask;
+        if(mVariants.find(sub) == mVariants.end())
+            startCompile(sub);
+    } while(sub.mShadowSamplers != mask);
+}
+
+VertexShaderCode::Variant &VertexShaderCode::startCompile(const ShaderVariant &key)
+{
+    ShaderCompiler &compiler = mParent->getShaderCompiler();
+    Variant &variant = mVariants[key];
+    variant.mKey = key;
+    ++variant.mPending;
+    if(compiler.isActive())
+        compiler.queue([this, key, &variant]() -> void { compileShaderGL(key, variant, true); },
+                       variant.mPending);
+    else
+        variant.mUpdateFence = mParent->getQueue().doSend<CompileVShaderCmd>(this, key, &variant);
+    return variant;
+}
+
+void VertexShaderCode::waitBuilt(Variant &variant)
+{
+    ShaderCompiler &compiler = mParent->getShaderCompiler();
+    if(compiler.isActive())
+        compiler.wait(variant.mPending);
+    else
+        mParent->getQueue().waitFence(variant.mUpdateFence);
+}
+
+
 D3DGLVertexShader::D3DGLVertexShader(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
-  , mPendingUpdates(0)
-  , mProgram(0)
-  , mSamplerMask(0)
-  , mShadowSamplers(0)
+  , mCode(nullptr)
 {
     mParent->AddRef();
 }
 
 D3DGLVertexShader::~D3DGLVertexShader()
 {
-    if(GLuint program = mProgram.exchange(0))
-    {
-        mParent->getQueue().send<DeinitVShaderCmd>(program);
-        if(mPendingUpdates > 0)
-            mParent->getQueue().wakeAndSleep();
-    }
+    if(mCode)
+        mParent->getVertexShaderCodes().release(mCode);
+    mCode = nullptr;
     mParent->Release();
 }
 
@@ -161,8 +606,10 @@ bool D3DGLVertexShader::init(const DWORD *data)
           (((*data>>16)==0xfffe) ? "vertex" : ((*data>>16)==0xffff) ? "pixel" : "unknown"),
           (*data>>8)&0xff, *data&0xff, MOJOSHADER_PROFILE_GLSL330);
 
+    ShaderArena &arena = ShaderArena::get();
     const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0
+        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0, nullptr,
+        ShaderArena::allocate, ShaderArena::deallocate, &arena
     );
     if(shader->error_count > 0)
     {
@@ -171,37 +618,58 @@ bool D3DGLVertexShader::init(const DWORD *data)
             sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
         ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
         MOJOSHADER_freeParseData(shader);
+        arena.reset();
         return false;
     }
     // Save the tokens used
-    mCode.insert(mCode.end(), data, data+shader->token_count);
+    std::vector<DWORD> code(data, data+shader->token_count);
 
     TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
+    // The output is the program without shadow samplers, which is usually
+    // the first one built, so it's kept instead of parsing again for it.
+    ShaderCodeInfo info{0, 256, 0, 0, 0, ShaderReflection(), shader->output};
+    for(int i = 0;i < shader->attribute_count;++i)
+        info.mReflection.mAttributes.push_back(ShaderVariable{
+            UINT(shader->attributes[i].usage), UINT(shader->attributes[i].index), shader->attributes[i].name
+        });
     for(int i = 0;i < shader->sampler_count;++i)
-        mSamplerMask |= 1<<(shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
+    {
+        info.mSamplerMask |= 1<<(shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
+        info.mReflection.mSamplers.push_back(ShaderVariable{
+            0, UINT(shader->samplers[i].index), shader->samplers[i].name
+        });
+    }
+    for(int i = 0;i < shader->uniform_count;++i)
+    {
+        const MOJOSHADER_uniform &uniform = shader->uniforms[i];
+        if(uniform.type == MOJOSHADER_UNIFORM_INT || uniform.type == MOJOSHADER_UNIFORM_BOOL)
+        {
+            UINT &mask = (uniform.type == MOJOSHADER_UNIFORM_INT) ? info.mConstIMask : info.mConstBMask;
+            if(uniform.index >= 0 && uniform.index < 16)
+                mask |= 1<<uniform.index;
+            continue;
+        }
+        if(uniform.type != MOJOSHADER_UNIFORM_FLOAT)
+            continue;
+        UINT count = std::max(uniform.array_count, 1);
+        info.mConstFStart = std::min<UINT>(info.mConstFStart, uniform.index);
+        info.mConstFEnd = std::min<UINT>(std::max<UINT>(info.mConstFEnd, uniform.index+count), 256);
+    }
+
+    // Bool and integer constants get folded into the programs, so the output
+    // would only be used if the shader falls back to reading them from
+    // uniforms.
+    if(info.mConstIMask || info.mConstBMask)
+        info.mSource = std::string();
 
     MOJOSHADER_freeParseData(shader);
+    arena.reset();
 
+    mCode = mParent->getVertexShaderCodes().get(mParent, std::move(code), std::move(info));
     return true;
 }
 
-void D3DGLVertexShader::checkShadowSamplers(UINT mask)
-{
-    if(mPendingUpdates > 0 || mProgram)
-    {
-        if(mShadowSamplers == (mask&mSamplerMask))
-            return;
-
-        WARN("Rebuilding vertex shader %p because of shadow mismatch: 0x%x / 0x%x\n",
-             this, mShadowSamplers, (mask&mSamplerMask));
-    }
-
-    mShadowSamplers = (mask&mSamplerMask);
-    ++mPendingUpdates;
-    mParent->getQueue().doSend<CompileAndSetVShaderCmd>(this, mParent->getShaderPipeline(), mShadowSamplers);
-}
-
 
 HRESULT D3DGLVertexShader::QueryInterface(REFIID riid, void **obj)
 {
@@ -245,8 +713,9 @@ HRESULT D3DGLVertexShader::GetFunction(void *data, UINT *size)
 {
     TRACE("iface %p, data %p, size %p\n", this, data, size);
 
-    *size = mCode.size() * sizeof(decltype(mCode)::value_type);
+    const std::vector<DWORD> &code = mCode->getCode();
+    *size = code.size() * sizeof(DWORD);
     if(data)
-        memcpy(data, mCode.data(), mCode.size() * sizeof(decltype(mCode)::value_type));
+        memcpy(data, code.data(), code.size() * sizeof(DWORD));
     return D3D_OK;
 }
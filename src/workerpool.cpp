@@ -0,0 +1,138 @@
+
+#include "workerpool.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+
+WorkerPool::WorkerPool()
+  : mGeneration(0), mBusy(0), mQuit(false), mJob(nullptr), mJobCount(0), mNextPart(0), mPartsDone(0)
+{
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mWakeCond);
+    InitializeConditionVariable(&mDoneCond);
+}
+
+WorkerPool::~WorkerPool()
+{
+    deinit();
+    DeleteCriticalSection(&mLock);
+}
+
+
+void WorkerPool::init()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    // Leave a core each for the app and command threads.
+    UINT count = std::max<DWORD>(info.dwNumberOfProcessors, 2) - 2;
+    if(count > sMaxThreads) count = sMaxThreads;
+    TRACE("Starting %u worker threads\n", count);
+
+    mQuit = false;
+    for(UINT i = 0;i < count;++i)
+    {
+        HANDLE thread = CreateThread(nullptr, 0, thread_func, this, 0, nullptr);
+        if(!thread)
+        {
+            ERR("Failed to create worker thread, error %lu\n", GetLastError());
+            break;
+        }
+        mThreads.push_back(thread);
+    }
+}
+
+void WorkerPool::deinit()
+{
+    if(mThreads.empty())
+        return;
+
+    EnterCriticalSection(&mLock);
+    mQuit = true;
+    WakeAllConditionVariable(&mWakeCond);
+    LeaveCriticalSection(&mLock);
+
+    WaitForMultipleObjects(mThreads.size(), mThreads.data(), TRUE, INFINITE);
+    for(HANDLE thread : mThreads)
+        CloseHandle(thread);
+    mThreads.clear();
+}
+
+
+void WorkerPool::doParts()
+{
+    // A worker may get here late, after the job it was woken for finished.
+    // Then there are no parts left and it goes straight back to sleep.
+    size_t part;
+    while((part=mNextPart++) < mJobCount.load())
+    {
+        (*mJob)(part);
+        if(++mPartsDone == mJobCount.load())
+        {
+            EnterCriticalSection(&mLock);
+            WakeAllConditionVariable(&mDoneCond);
+            LeaveCriticalSection(&mLock);
+        }
+    }
+}
+
+void WorkerPool::workerLoop()
+{
+    ULONG generation = 0;
+    EnterCriticalSection(&mLock);
+    while(!mQuit)
+    {
+        if(generation == mGeneration)
+        {
+            SleepConditionVariableCS(&mWakeCond, &mLock, INFINITE);
+            continue;
+        }
+        generation = mGeneration;
+        ++mBusy;
+        LeaveCriticalSection(&mLock);
+        doParts();
+        EnterCriticalSection(&mLock);
+        if(--mBusy == 0)
+            WakeAllConditionVariable(&mDoneCond);
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+DWORD CALLBACK WorkerPool::thread_func(void *arg)
+{
+    static_cast<WorkerPool*>(arg)->workerLoop();
+    return 0;
+}
+
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)> &func)
+{
+    if(mThreads.empty() || count < 2)
+    {
+        for(size_t i = 0;i < count;++i)
+            func(i);
+        return;
+    }
+
+    EnterCriticalSection(&mLock);
+    while(mBusy > 0)
+        SleepConditionVariableCS(&mDoneCond, &mLock, INFINITE);
+    mJob = &func;
+    mPartsDone = 0;
+    mJobCount = count;
+    mNextPart = 0;
+    ++mGeneration;
+    WakeAllConditionVariable(&mWakeCond);
+    LeaveCriticalSection(&mLock);
+
+    doParts();
+
+    EnterCriticalSection(&mLock);
+    // func is only valid until this returns, so wait for the workers to be
+    // out of doParts too.
+    while(mPartsDone.load() < count || mBusy > 0)
+        SleepConditionVariableCS(&mDoneCond, &mLock, INFINITE);
+    mJobCount = 0;
+    LeaveCriticalSection(&mLock);
+}